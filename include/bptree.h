@@ -15,6 +15,22 @@
  *   #define BPTREE_IMPLEMENTATION
  *   #include "bptree.h"
  *
+ * Compile-time options (define before including the implementation):
+ *   BPTREE_NODE_HANDLES     Link nodes through 32-bit handles into tree-owned slabs
+ *                           instead of pointers, which halves the child arrays of
+ *                           internal nodes on 64-bit targets.
+ *   BPTREE_NODE_HASHES      Give every node a hash of its subtree, which
+ *                           bptree_set_hash and bptree_diff need. Without it nodes
+ *                           are 8 bytes smaller on 64-bit targets.
+ *   BPTREE_SEPARATOR_BYTES  Longest truncated separator key that internal nodes store
+ *                           inline when the tree has a key bytes function (default 15).
+ *   BPTREE_THREADS          Let bptree_free_async, bptree_free_parallel, and
+ *                           bptree_clone_parallel use C11 threads (<threads.h>; link
+ *                           with -pthread on older systems).
+ *   BPTREE_HUGE_PAGES       Let bptree_set_huge_pages place nodes in 2 MiB huge pages
+ *                           mapped with mmap. Linux only; the POSIX declarations must be
+ *                           visible, for example by defining _DEFAULT_SOURCE.
+ *
  * @note Thread-safety: This library is not explicitly thread-safe.
  *       The caller must handle synchronization if used in a multi-threaded environment.
  */
@@ -93,6 +109,15 @@ typedef enum {
     BPTREE_ERROR             /**< Generic error code. */
 } bptree_status;
 
+/**
+ * @brief Strategies for making room when an item is inserted into a full leaf.
+ */
+typedef enum {
+    BPTREE_OVERFLOW_SPLIT,       /**< Split the full leaf into two half-full leaves (default). */
+    BPTREE_OVERFLOW_REDISTRIBUTE /**< Share items with a sibling that has room, or split two
+                                      full siblings into three (B*-tree style). */
+} bptree_overflow_policy;
+
 /**
  * @brief Opaque structure representing a B+Tree.
  */
@@ -114,6 +139,27 @@ bptree *bptree_new(int max_keys,
                    void *user_data, bptree_malloc_t malloc_fn, bptree_free_t free_fn,
                    bool debug_enabled);
 
+/**
+ * @brief Creates a new B+Tree with separate capacities for leaf and internal nodes.
+ *
+ * Large leaves make range scans cheaper, while small internal nodes keep the
+ * path from the root to a leaf within a few cache lines.
+ *
+ * @param leaf_max_keys Maximum number of keys in a leaf node.
+ * @param internal_max_keys Maximum number of keys in an internal node.
+ * @param compare Comparison function to order keys.
+ * @param user_data User-provided data for the comparison function.
+ * @param malloc_fn Custom memory allocation function.
+ * @param free_fn Custom memory free function.
+ * @param debug_enabled Enable or disable debug logging.
+ * @return Pointer to the newly created B+Tree, or NULL on failure.
+ */
+bptree *bptree_new_with_fanout(int leaf_max_keys, int internal_max_keys,
+                               int (*compare)(const void *first, const void *second,
+                                              const void *user_data),
+                               void *user_data, bptree_malloc_t malloc_fn, bptree_free_t free_fn,
+                               bool debug_enabled);
+
 /**
  * @brief Frees the memory allocated for the B+Tree.
  *
@@ -121,6 +167,41 @@ bptree *bptree_new(int max_keys,
  */
 void bptree_free(bptree *tree);
 
+/**
+ * @brief Frees the B+Tree on a background thread.
+ *
+ * The calling thread only starts the thread, which then frees the nodes a
+ * bounded chunk at a time, yielding between chunks so that it does not hold
+ * the processor or the allocator for long stretches. The tree must not be used
+ * once this returns BPTREE_OK, and the free function must be safe to call from
+ * another thread. Items are not freed, as with bptree_free.
+ *
+ * @param tree Pointer to the B+Tree to free.
+ * @return BPTREE_OK if the tree is being freed in the background, or
+ *         BPTREE_ERROR if tree is NULL, the library was built without
+ *         BPTREE_THREADS, or no thread could be started. On error the tree
+ *         is left as it was, for the caller to free with bptree_free.
+ */
+bptree_status bptree_free_async(bptree *tree);
+
+/**
+ * @brief Frees the B+Tree with several threads working on separate subtrees.
+ *
+ * The top of the tree is split into subtrees, which the calling thread and
+ * n_threads - 1 helper threads free side by side; the call returns once the
+ * whole tree is freed. Nodes in slabs are freed with their slabs, so the gain
+ * is largest for trees whose nodes were allocated one at a time. The free
+ * function must be safe to call from several threads at once. Without
+ * BPTREE_THREADS, or if no helper thread can be started, the tree is freed by
+ * the calling thread alone.
+ *
+ * @param tree Pointer to the B+Tree to free.
+ * @param n_threads Number of threads to use, including the calling thread.
+ * @return BPTREE_OK once the tree is freed, or BPTREE_ERROR if n_threads is
+ *         less than 1, in which case the tree is left as it was.
+ */
+bptree_status bptree_free_parallel(bptree *tree, int n_threads);
+
 /**
  * @brief Inserts an item into the B+Tree.
  *
@@ -140,946 +221,6278 @@ bptree_status bptree_put(bptree *tree, void *item);
 bptree_status bptree_remove(bptree *tree, const void *key);
 
 /**
- * @brief Retrieves an item from the B+Tree.
+ * @brief Sets how empty a node may become before it is rebalanced on removal.
+ *
+ * A node underflows once it holds fewer keys than the given percentage of its
+ * capacity; it then borrows from a sibling or is merged with one. The default
+ * is 50, the classic B+tree bound. Lower values widen the gap between the split
+ * and merge points, so workloads that alternate insertions and removals near a
+ * node boundary stop splitting and merging the same nodes over and over. A
+ * value of 0 merges nodes only when they become empty.
  *
  * @param tree Pointer to the B+Tree.
- * @param key Pointer to the key of the item to retrieve.
- * @return Pointer to the item if found, or NULL if not found.
+ * @param min_fill_percent Minimum node fill in percent, between 0 and 50.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if the value is out of range.
  */
-void *bptree_get(const bptree *tree, const void *key);
+bptree_status bptree_set_min_fill(bptree *tree, int min_fill_percent);
 
 /**
- * @brief Retrieves a range of items from the B+Tree.
- *
- * The range is inclusive of both start_key and end_key.
+ * @brief Sets the minimum occupancy of leaf and internal nodes independently.
  *
  * @param tree Pointer to the B+Tree.
- * @param start_key Pointer to the starting key of the range.
- * @param end_key Pointer to the ending key of the range.
- * @param count Pointer to an integer that will hold the number of items returned.
- * @return Array of pointers to the items in the specified range.
+ * @param leaf_min_keys Minimum keys in a non-root leaf, between 1 and (leaf_max_keys + 1) / 2.
+ * @param internal_min_keys Minimum keys in a non-root internal node, between 1 and
+ *        internal_max_keys / 2.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if a value is out of range.
  */
-void **bptree_get_range(const bptree *tree, const void *start_key, const void *end_key, int *count);
+bptree_status bptree_set_min_keys(bptree *tree, int leaf_min_keys, int internal_min_keys);
 
 /**
- * @brief Bulk loads a sorted array of items into a B+Tree.
+ * @brief Sets how full leaves make room for new items.
  *
- * @param max_keys Maximum number of keys in a node.
- * @param compare Comparison function to order keys.
- * @param user_data User-provided data for the comparison function.
- * @param malloc_fn Custom memory allocation function.
- * @param free_fn Custom memory free function.
- * @param debug_enabled Enable or disable debug logging.
- * @param sorted_items Array of sorted items to load.
- * @param n_items Number of items in the array.
- * @return Pointer to the newly created B+Tree, or NULL on failure.
+ * With BPTREE_OVERFLOW_REDISTRIBUTE, inserting into a full leaf first spreads
+ * its items over an adjacent sibling that has room; only when both are full are
+ * the two split into three leaves. Trees built by random insertion then end up
+ * with fewer, fuller leaves at the cost of touching a sibling on overflow.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param policy Overflow policy to use for subsequent insertions.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if the policy is unknown.
  */
-bptree *bptree_bulk_load(int max_keys,
-                         int (*compare)(const void *first, const void *second,
-                                        const void *user_data),
-                         void *user_data, bptree_malloc_t malloc_fn, bptree_free_t free_fn,
-                         bool debug_enabled, void **sorted_items, int n_items);
+bptree_status bptree_set_overflow_policy(bptree *tree, bptree_overflow_policy policy);
 
 /**
- * @brief Structure representing an iterator for traversing the B+Tree.
+ * @brief Places leaves created by splits next to their left neighbor in memory.
+ *
+ * Leaves are carved out of chunks of `chunk_slots` slots. A new leaf goes into
+ * the chunk of the leaf it was split from when that chunk has a spare slot, or
+ * into a fresh chunk otherwise, so walking the leaf chain mostly stays within
+ * a few nearby pages. A chunk is freed once all its leaves have been freed.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param chunk_slots Number of leaves per chunk, or 0 to allocate each leaf on its own.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if chunk_slots is negative.
  */
-typedef struct bptree_iterator {
-    struct bptree_node *current_leaf; /**< Current leaf node in the iteration. */
-    int index;                        /**< Current index within the leaf node. */
-} bptree_iterator;
+bptree_status bptree_set_leaf_clustering(bptree *tree, int chunk_slots);
 
 /**
- * @brief Creates a new iterator for the B+Tree.
+ * @brief Enables or disables gapped leaves.
  *
- * The iterator traverses items in sorted order.
+ * Gapped leaves keep empty slots spread between their items, like a packed
+ * memory array, so an insertion only shifts the items between its position
+ * and the nearest gap instead of everything after it. Leaves are spread out
+ * whenever they are split, merged, or rebalanced, and removals leave gaps
+ * behind instead of closing them. Lookups and scans step over the gaps.
+ *
+ * Disabling gapped leaves packs every leaf of the tree.
  *
  * @param tree Pointer to the B+Tree.
- * @return Pointer to the newly created iterator, or NULL on failure.
+ * @param enabled Whether leaves should keep gaps.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if tree is NULL or uses dense leaves.
  */
-bptree_iterator *bptree_iterator_new(const bptree *tree);
+bptree_status bptree_set_gapped_leaves(bptree *tree, bool enabled);
 
 /**
- * @brief Advances the iterator to the next item.
+ * @brief Maps an item to the integer it is ordered by.
  *
- * @param iter Pointer to the B+Tree iterator.
- * @return Pointer to the next item, or NULL if the end is reached.
+ * @param item Item stored in the tree.
+ * @param user_data User-provided data given to the tree.
+ * @return Integer key of the item.
  */
-void *bptree_iterator_next(bptree_iterator *iter);
+typedef long long (*bptree_int_key_t)(const void *item, const void *user_data);
 
 /**
- * @brief Frees the memory allocated for the iterator.
+ * @brief Enables dense leaves for trees ordered by integer keys.
  *
- * @param iter Pointer to the iterator.
- * @param free_fn Custom memory free function.
+ * A full-size leaf whose keys fall within a range of at least four times
+ * leaf_max_keys replaces its key array with a bitmap over that range plus
+ * per-word rank counts (Roaring style), and its items double as keys. The bitmap is much
+ * smaller than the key array, so the leaf uses the freed memory for items
+ * and holds nearly twice leaf_max_keys of them before it splits. Looking up a
+ * key in such a leaf is a bit test and a popcount instead of a binary search.
+ * A leaf returns to the sorted-array layout when a key outside its range
+ * arrives, or is split if it holds too many items for that layout, and is
+ * re-evaluated whenever it is split, merged, or rebalanced.
+ *
+ * `int_key` must agree with the tree's comparison function: first orders
+ * before second exactly when int_key(first) < int_key(second). Dense leaves
+ * cannot be combined with gapped leaves. Passing NULL converts every leaf
+ * back to the sorted-array layout; if some leaves hold more items than that
+ * layout allows, the tree is rebuilt as bptree_compact(tree, 100) would.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param int_key Function returning the integer key of an item, or NULL to disable.
+ * @return BPTREE_OK on success, BPTREE_ERROR if tree is NULL or uses gapped
+ *         leaves, or BPTREE_ALLOCATION_ERROR if the tree had to be rebuilt
+ *         and could not be; the tree is then left unchanged.
  */
-void bptree_iterator_free(bptree_iterator *iter, bptree_free_t free_fn);
+bptree_status bptree_set_int_keys(bptree *tree, bptree_int_key_t int_key);
 
 /**
- * @brief Structure containing statistics about the B+Tree.
+ * @brief Enables or disables compressed leaves for trees ordered by integer keys.
+ *
+ * A leaf that is not dense but whose keys span less than 2^32 replaces its
+ * key array with a frame-of-reference encoding: the smallest key, followed by
+ * the offset of every key from it as a 1, 2, or 4-byte integer, whichever is
+ * the narrowest that fits the leaf. Lookups count the offsets below the
+ * searched one in a branch-free loop the compiler can vectorize, and never
+ * dereference items. The offsets take less memory than the key array, so
+ * the leaf uses the rest for items: up to about 1.8, 1.6, or 1.3 times
+ * leaf_max_keys of them before it splits, for 1, 2, and 4-byte offsets. A
+ * leaf is re-encoded when a key outside its range arrives, or split if it
+ * holds too many items for the sorted-array layout, and is re-encoded
+ * whenever it is split, merged, or rebalanced.
+ *
+ * Compressed leaves only take effect while the tree has an integer key
+ * function (see bptree_set_int_keys). Disabling them converts every
+ * compressed leaf back to the sorted-array layout; if some hold more items
+ * than that layout allows, the tree is rebuilt as bptree_compact(tree, 100)
+ * would.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param enabled Whether leaves should use the compressed layout.
+ * @return BPTREE_OK on success, BPTREE_ERROR if tree is NULL, or
+ *         BPTREE_ALLOCATION_ERROR if the tree had to be rebuilt and could
+ *         not be; the tree is then left unchanged.
  */
-typedef struct bptree_stats {
-    int count;      /**< Total number of items stored in the tree. */
-    int height;     /**< Height of the tree. */
-    int node_count; /**< Total number of nodes in the tree. */
-} bptree_stats;
+bptree_status bptree_set_compressed_leaves(bptree *tree, bool enabled);
 
 /**
- * @brief Retrieves statistics about the B+Tree.
+ * @brief Maps an item to the bytes it is ordered by.
  *
- * @param tree Pointer to the B+Tree.
- * @return A structure containing the tree statistics.
+ * @param item Item stored in the tree.
+ * @param length Receives the number of key bytes.
+ * @param user_data User-provided data given to the tree.
+ * @return Pointer to the key bytes of the item.
  */
-bptree_stats bptree_get_stats(const bptree *tree);
-
-#ifdef __cplusplus
-}
-#endif
-
-#ifdef BPTREE_IMPLEMENTATION
-
-#include <assert.h>
-#include <stdlib.h>
-#include <string.h>
+typedef const void *(*bptree_key_bytes_t)(const void *item, size_t *length,
+                                          const void *user_data);
 
-#define BPTREE_LOG_DEBUG(tree, ...)     \
-    do {                                \
-        if ((tree)->debug_enabled) {    \
-            bptree_logger(__VA_ARGS__); \
-        }                               \
-    } while (0)
+/**
+ * @brief Stores truncated separator keys inside internal nodes.
+ *
+ * By default an internal node separates its children with pointers to items,
+ * so every comparison on the way down dereferences an item somewhere else in
+ * memory. With a key bytes function, a split instead separates the two nodes
+ * by the shortest prefix of the right node's first key that still sorts after
+ * the left node's last key, and copies that prefix into the internal node when
+ * it is at most BPTREE_SEPARATOR_BYTES long. Descents compare the bytes of the
+ * search key with these prefixes and only look at an item for a separator too
+ * long to store inline.
+ *
+ * The tree's comparison function must order items the way memcmp orders their
+ * key bytes, with a key sorting before every longer key it is a prefix of (as
+ * strcmp does for strings). The key bytes function can only be changed while
+ * the tree has no internal nodes.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param key_bytes Function returning the key bytes of an item, or NULL to disable.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if tree is NULL or has internal nodes.
+ */
+bptree_status bptree_set_key_bytes(bptree *tree, bptree_key_bytes_t key_bytes);
 
-/* Internal default allocation functions */
+/**
+ * @brief Enables or disables variable node capacities.
+ *
+ * With variable capacities, nodes created by insertions get the smallest
+ * capacity class (8, 16, 32, ... keys, capped at the node maximum) that holds
+ * their keys, and the retained half of a split node is trimmed the same way.
+ * A node that fills up moves into the next class instead of splitting, and one
+ * that drops to a quarter of its capacity moves into a smaller class, so
+ * memory follows how full the nodes actually are. The arrays of such nodes are
+ * allocated apart from the node itself, which stays in place when it is resized.
+ * Nodes allocated by bulk loading, compaction, or leaf clustering keep their
+ * full capacity.
+ *
+ * Not available with BPTREE_NODE_HANDLES, whose nodes live in fixed-size slab slots.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param enabled Whether new nodes should get variable capacities.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if tree is NULL or nodes use handles.
+ */
+bptree_status bptree_set_variable_capacity(bptree *tree, bool enabled);
 
 /**
- * @brief Default memory allocation function.
+ * @brief Trims every node of the B+Tree to the smallest capacity class that holds its keys.
  *
- * @param size Number of bytes to allocate.
- * @return Pointer to the allocated memory.
+ * Nodes with more room than they need, including full-size nodes from bulk
+ * loading or compaction, are moved into nodes with variable capacities. The
+ * trimmed nodes grow again as items are inserted, whether or not variable
+ * capacities are enabled. Does nothing with BPTREE_NODE_HANDLES. Existing
+ * iterators are invalidated.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @return BPTREE_OK on success, BPTREE_ERROR if tree is NULL, or
+ *         BPTREE_ALLOCATION_ERROR if some nodes could not be trimmed (the tree stays valid).
  */
-static void *default_malloc(const size_t size) { return malloc(size); }
+bptree_status bptree_shrink_to_fit(bptree *tree);
 
 /**
- * @brief Default memory free function.
+ * @brief Preallocates the nodes that inserting a number of items will need.
  *
- * @param ptr Pointer to the memory to free.
+ * Allocates, in one slab per node kind, as many leaves and internal nodes as
+ * inserting n_items more items can create, assuming each new node ends up no
+ * less than half full as it does after a split, and touches their memory so
+ * the system commits it right away. The buffer used to split nodes is
+ * allocated as well. Later insertions take their nodes from this reserve
+ * and only call the allocation function once it runs out, which moves the
+ * allocation cost of an ingest out of its insertions. Nodes freed by removals
+ * go back to the reserve, which is kept until it is replaced or the tree is freed.
+ *
+ * A new reservation replaces an unused one. Not available with variable
+ * capacities, whose nodes are allocated at the size they need.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param n_items Number of items about to be inserted.
+ * @return BPTREE_OK on success, BPTREE_ERROR if tree is NULL, n_items is
+ *         negative, or variable capacities are enabled, or
+ *         BPTREE_ALLOCATION_ERROR if the reserve could not be allocated.
  */
-static void default_free(void *ptr) { free(ptr); }
+bptree_status bptree_reserve(bptree *tree, int n_items);
 
-/* Internal structure representing a node in the B+Tree */
-typedef struct bptree_node {
-    int is_leaf;  /**< Flag indicating whether the node is a leaf (non-zero) or internal (zero). */
-    int num_keys; /**< Number of keys currently stored in the node. */
-    void **keys;  /**< Array of keys stored in the node. */
-    union {
-        struct {
-            void **items;             /**< Array of item pointers (for leaf nodes). */
-            struct bptree_node *next; /**< Pointer to the next leaf node. */
-        } leaf;
-        struct {
-            struct bptree_node *
-                *children; /**< Array of child node pointers (for internal nodes). */
-        } internal;
-    } ptr;
-} bptree_node;
+/**
+ * @brief Places new nodes in huge pages to cut TLB misses on large trees.
+ *
+ * Nodes allocated one at a time are taken from an arena of 2 MiB pages
+ * instead of the allocation function. A page comes from the system's reserved
+ * huge pages when there are any, and is otherwise marked for transparent huge
+ * pages. A page is unmapped once all of its nodes are freed. Nodes already in
+ * the tree stay where they are, and nodes the allocation function is asked
+ * for directly (bulk loading, compaction, clustered leaves, reserves and
+ * variable capacities) are unaffected. If a page cannot be mapped, nodes are
+ * allocated as usual.
+ *
+ * Internal nodes are the ones every search goes through, so they gain the
+ * most; leaves are worth adding when the whole tree is accessed at random.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param internal_nodes Whether internal nodes come from the arena.
+ * @param leaves Whether leaves come from the arena.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if tree is NULL or huge pages
+ *         are requested without BPTREE_HUGE_PAGES.
+ */
+bptree_status bptree_set_huge_pages(bptree *tree, bool internal_nodes, bool leaves);
 
-/* Definition of the main B+Tree structure */
-struct bptree {
-    int max_keys; /**< Maximum number of keys in a node. */
-    int min_keys; /**< Minimum number of keys required in a node (except root). */
-    int height;   /**< Current height of the tree. */
-    int count;    /**< Total number of items stored in the tree. */
-    int (*compare)(const void *first, const void *second,
-                   const void *user_data); /**< Comparison function for keys. */
-    void *udata;                           /**< User-provided data for the comparison function. */
-    bptree_node *root;                     /**< Pointer to the root node of the tree. */
-    bptree_malloc_t malloc_fn;             /**< Memory allocation function. */
-    bptree_free_t free_fn;                 /**< Memory free function. */
-    bool debug_enabled;                    /**< Debug logging flag. */
-};
+/**
+ * @brief Retrieves an item from the B+Tree.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param key Pointer to the key of the item to retrieve.
+ * @return Pointer to the item if found, or NULL if not found.
+ */
+void *bptree_get(const bptree *tree, const void *key);
 
-/* Internal helper functions documented below */
+/**
+ * @brief Remembers the leaf of a recent operation for the hinted operations.
+ *
+ * The hint records a leaf together with its fence keys, the separators in
+ * its ancestors that bound the keys it may hold, and the tree version at the
+ * time. A hinted operation on a key between the fences goes straight to the
+ * leaf. The hint is checked before use, so a stale hint, one from another
+ * tree, or a zero-initialized one only costs a regular descent. A hint must
+ * not be used after its tree is freed.
+ */
+typedef struct bptree_hint {
+    const struct bptree *tree;    /**< Tree the hint was recorded in. */
+    struct bptree_node *leaf;     /**< Leaf of the last hinted operation, or NULL. */
+    struct bptree_node *low_node; /**< Internal node holding the lower fence key, or NULL. */
+    struct bptree_node *high_node; /**< Internal node holding the upper fence key, or NULL. */
+    int low_index;                /**< Index of the lower fence key in low_node. */
+    int high_index;               /**< Index of the upper fence key in high_node. */
+    unsigned long version;        /**< Tree version when the hint was recorded. */
+} bptree_hint;
 
 /**
- * @brief Performs a binary search on an array of keys.
+ * @brief Retrieves an item, starting from the leaf remembered by a hint.
  *
  * @param tree Pointer to the B+Tree.
- * @param array Array of key pointers.
- * @param count Number of keys in the array.
- * @param key Key to search for.
- * @return Index of the found key or insertion index if not found.
+ * @param key Pointer to the key of the item to retrieve.
+ * @param hint Caller-owned hint, updated to the leaf of the key.
+ * @return Pointer to the item if found, or NULL if not found.
  */
-static int binary_search(const bptree *tree, void *const *array, const int count, const void *key) {
-    int low = 0, high = count - 1;
-    while (low <= high) {
-        const int mid = (low + high) / 2;
-        const int cmp = tree->compare(key, array[mid], tree->udata);
-        if (cmp == 0) {
-            return mid;
-        }
-        if (cmp < 0) {
-            high = mid - 1;
-        } else {
-            low = mid + 1;
-        }
-    }
-    return low;
-}
+void *bptree_get_hinted(const bptree *tree, const void *key, bptree_hint *hint);
 
 /**
- * @brief Searches for a key in a leaf node.
+ * @brief Inserts an item, starting from the leaf remembered by a hint.
+ *
+ * An item that fits into the hinted leaf is inserted there without a
+ * descent; otherwise the insertion proceeds as in bptree_put.
  *
  * @param tree Pointer to the B+Tree.
- * @param keys Array of keys in the leaf node.
- * @param count Number of keys in the leaf node.
- * @param key Key to search for.
- * @return Index of the found key or insertion index if not found.
+ * @param item Pointer to the item to insert.
+ * @param hint Caller-owned hint, updated to the leaf of the item.
+ * @return Status code indicating the result of the operation.
  */
-static int leaf_node_search(const bptree *tree, void *const *keys, const int count,
-                            const void *key) {
-    return binary_search(tree, keys, count, key);
-}
+bptree_status bptree_put_hinted(bptree *tree, void *item, bptree_hint *hint);
 
 /**
- * @brief Searches for a key in an internal node.
+ * @brief Removes an item, starting from the leaf remembered by a hint.
+ *
+ * An item whose removal leaves the hinted leaf above its minimum occupancy is
+ * removed without a descent; otherwise the removal proceeds as in bptree_remove.
  *
  * @param tree Pointer to the B+Tree.
- * @param keys Array of keys in the internal node.
- * @param count Number of keys in the internal node.
- * @param key Key to search for.
- * @return Index of the child pointer to follow.
+ * @param key Pointer to the key of the item to remove.
+ * @param hint Caller-owned hint, updated to the leaf of the key.
+ * @return Status code indicating the result of the operation.
  */
-static int internal_node_search(const bptree *tree, void *const *keys, const int count,
-                                const void *key) {
-    int low = 0, high = count;
-    while (low < high) {
-        const int mid = (low + high) / 2;
-        if (tree->compare(key, keys[mid], tree->udata) < 0) {
-            high = mid;
-        } else {
-            low = mid + 1;
-        }
-    }
-    return low;
-}
+bptree_status bptree_remove_hinted(bptree *tree, const void *key, bptree_hint *hint);
 
 /**
- * @brief Creates a new leaf node.
+ * @brief Returns the item with the smallest key.
+ *
+ * The tree caches its leftmost and rightmost leaves until nodes are next
+ * created, freed, or rebalanced, so this only looks at the leftmost leaf.
+ * The tree is otherwise unchanged, but refreshing that cache writes to it,
+ * so concurrent calls on one tree need the same exclusion as updates.
  *
  * @param tree Pointer to the B+Tree.
- * @return Pointer to the new leaf node, or NULL on failure.
+ * @return Pointer to the smallest item, or NULL if the tree is empty.
  */
-static bptree_node *create_leaf(const bptree *tree) {
-    bptree_node *node = tree->malloc_fn(sizeof(bptree_node));
-    if (!node) {
-        BPTREE_LOG_DEBUG(tree, "Allocation failure (leaf node)");
-        return NULL;
-    }
-    node->is_leaf = 1;
-    node->num_keys = 0;
-    node->keys = (void **)tree->malloc_fn(tree->max_keys * sizeof(void *));
-    if (!node->keys) {
-        tree->free_fn(node);
-        BPTREE_LOG_DEBUG(tree, "Allocation failure (leaf keys)");
-        return NULL;
-    }
-    node->ptr.leaf.items = (void **)tree->malloc_fn(tree->max_keys * sizeof(void *));
-    if (!node->ptr.leaf.items) {
-        tree->free_fn(node->keys);
-        tree->free_fn(node);
-        BPTREE_LOG_DEBUG(tree, "Allocation failure (leaf items)");
-        return NULL;
-    }
-    node->ptr.leaf.next = NULL;
-    return node;
-}
+void *bptree_min(const bptree *tree);
 
 /**
- * @brief Creates a new internal node.
+ * @brief Returns the item with the largest key.
  *
  * @param tree Pointer to the B+Tree.
- * @return Pointer to the new internal node, or NULL on failure.
+ * @return Pointer to the largest item, or NULL if the tree is empty.
+ * @see bptree_min
  */
-static bptree_node *create_internal(const bptree *tree) {
-    bptree_node *node = tree->malloc_fn(sizeof(bptree_node));
-    if (!node) {
-        BPTREE_LOG_DEBUG(tree, "Allocation failure (internal node)");
-        return NULL;
-    }
-    node->is_leaf = 0;
-    node->num_keys = 0;
-    node->keys = (void **)tree->malloc_fn(tree->max_keys * sizeof(void *));
-    if (!node->keys) {
-        tree->free_fn(node);
-        BPTREE_LOG_DEBUG(tree, "Allocation failure (internal keys)");
-        return NULL;
-    }
-    node->ptr.internal.children =
-        (bptree_node **)tree->malloc_fn((tree->max_keys + 1) * sizeof(bptree_node *));
-    if (!node->ptr.internal.children) {
-        tree->free_fn(node->keys);
-        tree->free_fn(node);
-        BPTREE_LOG_DEBUG(tree, "Allocation failure (internal children)");
-        return NULL;
-    }
-    return node;
-}
+void *bptree_max(const bptree *tree);
 
 /**
- * @brief Recursively frees a node and its descendants.
+ * @brief Removes and returns the item with the smallest key.
+ *
+ * The item is removed from the cached leftmost leaf directly; only when that
+ * leaf underflows is the path to it walked to rebalance. Any change to the
+ * tree's nodes, including a rebalance caused by a pop itself, makes the next
+ * call descend both edges again, so the cost is O(1) amortized over the pops
+ * between rebalances rather than on every call.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param item Receives the removed item.
+ * @return BPTREE_OK on success, BPTREE_NOT_FOUND if the tree is empty,
+ *         BPTREE_ERROR for invalid arguments, or BPTREE_ALLOCATION_ERROR if
+ *         the path for rebalancing could not be allocated.
+ */
+bptree_status bptree_pop_min(bptree *tree, void **item);
+
+/**
+ * @brief Removes and returns the item with the largest key.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param item Receives the removed item.
+ * @return Status code as for bptree_pop_min.
+ * @see bptree_pop_min
+ */
+bptree_status bptree_pop_max(bptree *tree, void **item);
+
+/**
+ * @brief Retrieves a range of items from the B+Tree.
+ *
+ * The range is inclusive of both start_key and end_key.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param start_key Pointer to the starting key of the range.
+ * @param end_key Pointer to the ending key of the range.
+ * @param count Pointer to an integer that will hold the number of items returned.
+ * @return Array of pointers to the items in the specified range.
+ */
+void **bptree_get_range(const bptree *tree, const void *start_key, const void *end_key, int *count);
+
+/**
+ * @brief Continuation token for reading a range one page at a time.
+ *
+ * Zero-initialize the token before reading the first page and pass it back
+ * unchanged for the following pages. It records the last item returned, which
+ * must stay valid until the next page is read, and the leaf holding it. If the
+ * tree has not been restructured since, the next page resumes in that leaf;
+ * otherwise it starts with one descent to the recorded item. Items inserted
+ * before the recorded item in the meantime are not returned. A token must not
+ * be used after its tree is freed.
+ */
+typedef struct bptree_range_token {
+    const struct bptree *tree; /**< Tree the token was recorded in. */
+    const void *key;           /**< Last item returned, or NULL before the first page. */
+    struct bptree_node *leaf;  /**< Leaf that held the last item returned. */
+    int index;                 /**< Slot of the last item returned in leaf. */
+    unsigned long version;     /**< Tree version when the token was recorded. */
+    bool done;                 /**< Set once no items of the range are left. */
+} bptree_range_token;
+
+/**
+ * @brief Retrieves the next page of a range of items from the B+Tree.
+ *
+ * The range is inclusive of both start_key and end_key. At most limit items
+ * following the position recorded in the token are copied to out, and the
+ * token is advanced past them.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param start_key Pointer to the starting key of the range.
+ * @param end_key Pointer to the ending key of the range.
+ * @param limit Maximum number of items to return.
+ * @param out Caller-provided array with room for limit items.
+ * @param token Caller-owned continuation token.
+ * @return Number of items copied to out; 0 for invalid arguments or once the token is done.
+ */
+int bptree_get_range_limit(const bptree *tree, const void *start_key, const void *end_key,
+                           int limit, void **out, bptree_range_token *token);
+
+/**
+ * @brief Key range for bptree_get_ranges, inclusive of both keys.
+ */
+typedef struct bptree_range {
+    const void *start_key; /**< Pointer to the starting key of the range. */
+    const void *end_key;   /**< Pointer to the ending key of the range. */
+} bptree_range;
+
+/**
+ * @brief Function called by bptree_get_ranges for each item found.
+ *
+ * @param item Pointer to the item.
+ * @param range Range the item was found in.
+ * @param user_data User-provided data passed to bptree_get_ranges.
+ * @return true to continue, or false to stop the query.
+ */
+typedef bool (*bptree_range_visitor_t)(void *item, const bptree_range *range, void *user_data);
+
+/**
+ * @brief Visits the items of many ranges in a single pass over the B+Tree.
+ *
+ * The ranges are sorted in place by their starting keys, and the items are
+ * visited in key order. Within a leaf, or from one leaf to the next, the
+ * query keeps sweeping forward; to reach a range further away it climbs only
+ * to the lowest internal node covering the range's start and descends from
+ * there. An item in several overlapping ranges is visited once, with the
+ * first of them in sorted order. Ranges whose start sorts after their end
+ * are empty.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param ranges Array of ranges, sorted in place.
+ * @param n Number of ranges.
+ * @param visit Function called for each item found.
+ * @param user_data User-provided data passed to visit.
+ * @return BPTREE_OK on success, BPTREE_ERROR for invalid arguments, or
+ *         BPTREE_ALLOCATION_ERROR if the traversal state could not be allocated.
+ */
+bptree_status bptree_get_ranges(const bptree *tree, bptree_range *ranges, int n,
+                                bptree_range_visitor_t visit, void *user_data);
+
+/**
+ * @brief Function called by bptree_scan_prefix for each item found.
+ *
+ * @param item Pointer to the item.
+ * @param user_data User-provided data passed to bptree_scan_prefix.
+ * @return true to continue, or false to stop the scan.
+ */
+typedef bool (*bptree_visitor_t)(void *item, void *user_data);
+
+/**
+ * @brief Visits, in key order, the items whose key bytes start with a prefix.
+ *
+ * The tree needs a key bytes function (see bptree_set_key_bytes), whose
+ * contract that items are ordered by their key bytes puts all keys with a
+ * prefix next to each other. The scan descends with the prefix itself,
+ * comparing it with the separators stored inline in the internal nodes, and
+ * stops at the first key that does not start with the prefix. Only the
+ * prefix bytes of each key are compared.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param prefix Prefix bytes; may be NULL if length is 0, which visits every item.
+ * @param length Number of prefix bytes.
+ * @param visit Function called for each item found.
+ * @param user_data User-provided data passed to visit.
+ * @return BPTREE_OK on success, or BPTREE_ERROR for invalid arguments or a
+ *         tree without a key bytes function.
+ */
+bptree_status bptree_scan_prefix(const bptree *tree, const void *prefix, size_t length,
+                                 bptree_visitor_t visit, void *user_data);
+
+/**
+ * @brief Bulk loads a sorted array of items into a B+Tree.
+ *
+ * @param max_keys Maximum number of keys in a node.
+ * @param compare Comparison function to order keys.
+ * @param user_data User-provided data for the comparison function.
+ * @param malloc_fn Custom memory allocation function.
+ * @param free_fn Custom memory free function.
+ * @param debug_enabled Enable or disable debug logging.
+ * @param sorted_items Array of sorted items to load.
+ * @param n_items Number of items in the array.
+ * @return Pointer to the newly created B+Tree, or NULL on failure.
+ */
+bptree *bptree_bulk_load(int max_keys,
+                         int (*compare)(const void *first, const void *second,
+                                        const void *user_data),
+                         void *user_data, bptree_malloc_t malloc_fn, bptree_free_t free_fn,
+                         bool debug_enabled, void **sorted_items, int n_items);
+
+/**
+ * @brief Bulk loads a sorted array of items into a B+Tree with separate node capacities.
+ *
+ * @param leaf_max_keys Maximum number of keys in a leaf node.
+ * @param internal_max_keys Maximum number of keys in an internal node.
+ * @param compare Comparison function to order keys.
+ * @param user_data User-provided data for the comparison function.
+ * @param malloc_fn Custom memory allocation function.
+ * @param free_fn Custom memory free function.
+ * @param debug_enabled Enable or disable debug logging.
+ * @param sorted_items Array of sorted items to load.
+ * @param n_items Number of items in the array.
+ * @return Pointer to the newly created B+Tree, or NULL on failure.
+ */
+bptree *bptree_bulk_load_with_fanout(int leaf_max_keys, int internal_max_keys,
+                                     int (*compare)(const void *first, const void *second,
+                                                    const void *user_data),
+                                     void *user_data, bptree_malloc_t malloc_fn,
+                                     bptree_free_t free_fn, bool debug_enabled,
+                                     void **sorted_items, int n_items);
+
+/**
+ * @brief Rebuilds the B+Tree in place into densely packed, contiguous nodes.
+ *
+ * The leaves are read in key order and the tree is rebuilt bottom-up, as in
+ * bptree_bulk_load, with each level allocated contiguously and every node
+ * filled to about the given percentage of its capacity (never below the
+ * minimum occupancy). This undoes the scattered, half-empty nodes left behind
+ * by long periods of churn. A fill below 100 leaves room for later insertions
+ * without immediate splits. Existing iterators are invalidated.
+ *
+ * The old nodes are freed only after the new ones are built, so the tree is
+ * unchanged if an allocation fails. Until then both sets of nodes are held,
+ * so at its peak compaction needs the memory of the old nodes plus that of
+ * the new ones: about twice the tree's node memory at 100 percent fill, and
+ * more at lower fills. On a large tree that memory may not be available, in
+ * which case BPTREE_ALLOCATION_ERROR is returned. Items are copied from the
+ * old leaves straight into the new ones, without an array of all items.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param fill_percent Target node fill in percent, between 1 and 100.
+ * @return BPTREE_OK on success, BPTREE_ERROR for invalid arguments, or
+ *         BPTREE_ALLOCATION_ERROR if the new nodes could not be allocated.
+ */
+bptree_status bptree_compact(bptree *tree, int fill_percent);
+
+/**
+ * @brief Copies the node structure of a B+Tree into a new tree.
+ *
+ * The copy is made level by level from the root down. The nodes of each level
+ * are allocated contiguously, and the leaves are linked as they are copied.
+ * Node layouts and settings carry over, so the cost is close to copying the
+ * memory of the nodes. Every node of the copy gets the full capacity of its
+ * kind, even if the source uses variable capacities. The items are not copied
+ * but shared: both trees point to the same items, which must stay valid while
+ * either tree holds them.
+ *
+ * @param tree Pointer to the B+Tree to copy.
+ * @return Pointer to the new B+Tree, or NULL if tree is NULL or allocation failed.
+ */
+bptree *bptree_clone(const bptree *tree);
+
+/**
+ * @brief Copies a B+Tree as bptree_clone does, with several threads copying nodes.
+ *
+ * Each level is allocated and linked by the calling thread, and its nodes are
+ * copied in n_threads equal shares by the calling thread and n_threads - 1
+ * helper threads. Levels too small to be worth the threads are copied by the
+ * calling thread alone, as is everything without BPTREE_THREADS or if no
+ * helper thread can be started.
+ *
+ * @param tree Pointer to the B+Tree to copy.
+ * @param n_threads Number of threads to use, including the calling thread.
+ * @return Pointer to the new B+Tree, or NULL if tree is NULL, n_threads is
+ *         less than 1, or allocation failed.
+ */
+bptree *bptree_clone_parallel(const bptree *tree, int n_threads);
+
+/**
+ * @brief Maps an item to a hash of its key and value.
+ *
+ * @param item Item stored in the tree.
+ * @param user_data User-provided data given to the tree.
+ * @return Hash of the item.
+ */
+typedef unsigned long long (*bptree_hash_t)(const void *item, const void *user_data);
+
+/**
+ * @brief Enables or disables a hash per node summarizing its subtree (Merkle tree).
+ *
+ * The hash of a leaf combines the hashes of its items, and the hash of an
+ * internal node combines the hashes of its children. Every modification marks
+ * the nodes on its path as stale, and stale hashes are recomputed on demand,
+ * so a batch of modifications is hashed once. The combination is a sum of
+ * mixed item hashes, so two subtrees holding the same items have the same
+ * hash whatever their shape. Hinted modifications and pops take the full
+ * path from the root while hashes are enabled. Nodes only have room for a
+ * hash with BPTREE_NODE_HASHES.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param hash Function returning the hash of an item, or NULL to disable.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if tree is NULL or a hash
+ *         function is given without BPTREE_NODE_HASHES.
+ */
+bptree_status bptree_set_hash(bptree *tree, bptree_hash_t hash);
+
+/**
+ * @brief Function called by bptree_diff for each key whose items differ.
+ *
+ * @param a_item Item of the first tree, or NULL if only the second tree has the key.
+ * @param b_item Item of the second tree, or NULL if only the first tree has the key.
+ * @param user_data User-provided data passed to bptree_diff.
+ * @return true to continue, or false to stop the diff.
+ */
+typedef bool (*bptree_diff_visitor_t)(void *a_item, void *b_item, void *user_data);
+
+/**
+ * @brief Visits, in key order, the keys whose items differ between two trees.
+ *
+ * Both trees need the same hash function (see bptree_set_hash), the same key
+ * order, and the same key bytes function. The trees are walked side by side,
+ * and two subtrees covering the same key range with the same hash are
+ * skipped without being read. Items with equal keys differ when they are
+ * different pointers with different hashes. The diff is fastest when the
+ * trees share most of their shape, as a tree and a modified clone of it do;
+ * regions where the shapes differ are compared item by item.
+ *
+ * @param a Pointer to the first B+Tree.
+ * @param b Pointer to the second B+Tree.
+ * @param visit Function called for each differing key.
+ * @param user_data User-provided data passed to visit.
+ * @return BPTREE_OK on success, BPTREE_ERROR for invalid arguments or trees
+ *         without the same hash function, or BPTREE_ALLOCATION_ERROR if the
+ *         traversal state could not be allocated.
+ */
+bptree_status bptree_diff(bptree *a, bptree *b, bptree_diff_visitor_t visit, void *user_data);
+
+/**
+ * @brief Visits, in key order, the items whose keys are in both trees.
+ *
+ * The leaf chains of both trees are merged with a cursor on each. When one
+ * side falls behind for more than a couple of items, its cursor skips ahead
+ * to the other side's key through the separators of its path, climbing only
+ * as high as the skip needs, so keys missing from the other tree cost little
+ * more than their count would suggest. Both trees must order items the same
+ * way; the first tree's comparison function is used. For keys in both trees,
+ * the item of the first tree is kept.
+ *
+ * With out, the kept items are also bulk-loaded into a new tree with the
+ * settings and fanout of the first tree, sharing the items with both inputs.
+ * If the visitor stops the operation, the new tree holds the items visited
+ * until then.
+ *
+ * @param a Pointer to the first B+Tree.
+ * @param b Pointer to the second B+Tree.
+ * @param visit Function called for each item kept, or NULL.
+ * @param user_data User-provided data passed to visit.
+ * @param out Receives the new tree, or NULL if no tree is wanted.
+ * @return BPTREE_OK on success, BPTREE_ERROR if a tree is NULL or both visit
+ *         and out are NULL, or BPTREE_ALLOCATION_ERROR if the traversal state
+ *         or the new tree could not be allocated.
+ */
+bptree_status bptree_intersect(const bptree *a, const bptree *b, bptree_visitor_t visit,
+                               void *user_data, bptree **out);
+
+/**
+ * @brief Visits, in key order, the items whose keys are in either tree.
+ *
+ * Works as bptree_intersect does, keeping every item; for keys in both
+ * trees, the item of the first tree is kept.
+ *
+ * @param a Pointer to the first B+Tree.
+ * @param b Pointer to the second B+Tree.
+ * @param visit Function called for each item kept, or NULL.
+ * @param user_data User-provided data passed to visit.
+ * @param out Receives the new tree, or NULL if no tree is wanted.
+ * @return Status code as for bptree_intersect.
+ */
+bptree_status bptree_union(const bptree *a, const bptree *b, bptree_visitor_t visit,
+                           void *user_data, bptree **out);
+
+/**
+ * @brief Visits, in key order, the items of the first tree whose keys are not in the second.
+ *
+ * Works as bptree_intersect does, skipping ahead in the second tree.
+ *
+ * @param a Pointer to the first B+Tree.
+ * @param b Pointer to the second B+Tree.
+ * @param visit Function called for each item kept, or NULL.
+ * @param user_data User-provided data passed to visit.
+ * @param out Receives the new tree, or NULL if no tree is wanted.
+ * @return Status code as for bptree_intersect.
+ */
+bptree_status bptree_difference(const bptree *a, const bptree *b, bptree_visitor_t visit,
+                                void *user_data, bptree **out);
+
+/**
+ * @brief Structure representing an iterator for traversing the B+Tree.
+ */
+typedef struct bptree_iterator {
+    const struct bptree *tree;        /**< Tree being traversed. */
+    struct bptree_node *current_leaf; /**< Current leaf node in the iteration. */
+    int index;                        /**< Current index within the leaf node. */
+} bptree_iterator;
+
+/**
+ * @brief Creates a new iterator for the B+Tree.
+ *
+ * The iterator traverses items in sorted order.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @return Pointer to the newly created iterator, or NULL on failure.
+ */
+bptree_iterator *bptree_iterator_new(const bptree *tree);
+
+/**
+ * @brief Advances the iterator to the next item.
+ *
+ * @param iter Pointer to the B+Tree iterator.
+ * @return Pointer to the next item, or NULL if the end is reached.
+ */
+void *bptree_iterator_next(bptree_iterator *iter);
+
+/**
+ * @brief Frees the memory allocated for the iterator.
+ *
+ * @param iter Pointer to the iterator.
+ * @param free_fn Custom memory free function.
+ */
+void bptree_iterator_free(bptree_iterator *iter, bptree_free_t free_fn);
+
+/**
+ * @brief Opaque iterator visiting the items of several trees in one key order.
+ *
+ * The trees are merged with a loser tree (tournament tree): the source of
+ * the last item returned replays only its path to the root, so each item
+ * costs about log2(k) comparisons for k trees. When one source wins twice in
+ * a row, the iterator also finds the runner-up of the other sources and
+ * returns that source's items while they come before it, with one comparison
+ * per item, or none for the rest of a leaf whose last item does. Each source
+ * reads the items of its current leaf in place, a leaf-sized batch at a
+ * time, and fetches its next leaf ahead. The trees must not be modified
+ * while the iterator is in use.
+ */
+typedef struct bptree_merge_iterator bptree_merge_iterator;
+
+/**
+ * @brief Creates an iterator merging several trees, from the first item not less than a key.
+ *
+ * All trees must order items the same way; the first tree's comparison
+ * function is used. With de-duplication, only one item is returned for a
+ * key found in several trees: the one from the tree listed last, taken to
+ * be the newest.
+ *
+ * @param trees Array of trees to merge; empty trees are allowed.
+ * @param k Number of trees.
+ * @param start_key Key to start at, or NULL for the first item.
+ * @param dedup Whether to return only the newest item of each key.
+ * @return Pointer to the new iterator, or NULL if trees is NULL, k is less
+ *         than 1, a tree is NULL, or allocation failed.
+ */
+bptree_merge_iterator *bptree_merge_iterator_new(const bptree *const *trees, int k,
+                                                 const void *start_key, bool dedup);
+
+/**
+ * @brief Advances a merged iterator to the next item.
+ *
+ * @param iter Pointer to the merged iterator.
+ * @param source Receives the index of the tree the item came from, or may be NULL.
+ * @return Pointer to the next item, or NULL if the end is reached.
+ */
+void *bptree_merge_iterator_next(bptree_merge_iterator *iter, int *source);
+
+/**
+ * @brief Frees a merged iterator.
+ *
+ * @param iter Pointer to the merged iterator.
+ */
+void bptree_merge_iterator_free(bptree_merge_iterator *iter);
+
+/**
+ * @brief Opaque cursor that can modify the B+Tree at its position.
+ *
+ * A cursor keeps its leaf and the path of internal nodes above it, so moving
+ * to the next leaf and rebalancing after a removal do not descend from the
+ * root. It stays valid across its own modifications. After other
+ * modifications of the tree it finds its item again by key, so the item must
+ * remain valid while the cursor is in use.
+ */
+typedef struct bptree_cursor bptree_cursor;
+
+/**
+ * @brief Creates a cursor positioned at the first item not less than a key.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param key Key to position the cursor at, or NULL for the first item.
+ * @return Pointer to the new cursor, or NULL on failure.
+ */
+bptree_cursor *bptree_cursor_new(bptree *tree, const void *key);
+
+/**
+ * @brief Returns the item at the cursor.
+ *
+ * @param cursor Pointer to the cursor.
+ * @return Pointer to the item, or NULL if the cursor is past the last item.
+ */
+void *bptree_cursor_get(bptree_cursor *cursor);
+
+/**
+ * @brief Moves the cursor to the next item.
+ *
+ * @param cursor Pointer to the cursor.
+ * @return Pointer to the new item at the cursor, or NULL if the cursor moved
+ *         past the last item.
+ */
+void *bptree_cursor_next(bptree_cursor *cursor);
+
+/**
+ * @brief Removes the item at the cursor and moves the cursor to the next item.
+ *
+ * A leaf that drops below its minimum occupancy is rebalanced along the
+ * cursor's path.
+ *
+ * @param cursor Pointer to the cursor.
+ * @return BPTREE_OK on success, BPTREE_ERROR if the cursor is past the last
+ *         item, or BPTREE_ALLOCATION_ERROR if the cursor could not be repositioned.
+ */
+bptree_status bptree_cursor_remove(bptree_cursor *cursor);
+
+/**
+ * @brief Replaces the item at the cursor with another item that has the same key.
+ *
+ * The tree stops referring to the old item, which may then be freed.
+ *
+ * @param cursor Pointer to the cursor.
+ * @param item Pointer to the new item.
+ * @return BPTREE_OK on success, or BPTREE_ERROR if the cursor is past the
+ *         last item or the keys differ.
+ */
+bptree_status bptree_cursor_replace(bptree_cursor *cursor, void *item);
+
+/**
+ * @brief Inserts an item that sorts before the item at the cursor.
+ *
+ * The cursor stays on its item, so a forward pass does not visit the new
+ * item. An item that belongs in the cursor's leaf is inserted there directly
+ * when the leaf has room; otherwise it is inserted as by bptree_put.
+ *
+ * @param cursor Pointer to the cursor.
+ * @param item Pointer to the item to insert.
+ * @return BPTREE_OK on success, BPTREE_DUPLICATE if the key is already in
+ *         the tree, BPTREE_ERROR if the item does not sort before the item at
+ *         the cursor, or BPTREE_ALLOCATION_ERROR on allocation failure.
+ */
+bptree_status bptree_cursor_insert_before(bptree_cursor *cursor, void *item);
+
+/**
+ * @brief Frees the cursor.
+ *
+ * @param cursor Pointer to the cursor.
+ */
+void bptree_cursor_free(bptree_cursor *cursor);
+
+/**
+ * @brief Structure containing statistics about the B+Tree.
+ */
+typedef struct bptree_stats {
+    int count;                  /**< Total number of items stored in the tree. */
+    int height;                 /**< Height of the tree. */
+    int node_count;             /**< Total number of nodes in the tree. */
+    int leaf_count;             /**< Number of leaf nodes in the tree. */
+    int dense_leaf_count;       /**< Number of leaves using the dense integer layout. */
+    int compressed_leaf_count;  /**< Number of leaves using the compressed integer layout. */
+    int reserved_nodes;         /**< Number of preallocated nodes left by bptree_reserve. */
+    size_t node_bytes;          /**< Memory held by the nodes and their arrays, in bytes. */
+    size_t arena_bytes;         /**< Memory mapped for the huge page arena, in bytes. */
+    size_t arena_hugetlb_bytes; /**< Part of arena_bytes taken from reserved huge pages. */
+} bptree_stats;
+
+/**
+ * @brief Retrieves statistics about the B+Tree.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @return A structure containing the tree statistics.
+ */
+bptree_stats bptree_get_stats(const bptree *tree);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef BPTREE_IMPLEMENTATION
+
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef BPTREE_THREADS
+#include <threads.h>
+#endif
+
+#ifdef BPTREE_HUGE_PAGES
+#ifndef __linux__
+#error "BPTREE_HUGE_PAGES is only supported on Linux"
+#endif
+#include <sys/mman.h>
+#define BPTREE_HUGE_PAGE_SIZE ((size_t)2 << 20)
+// How an arena slab was mapped
+#define BPTREE_ARENA_TRANSPARENT 1
+#define BPTREE_ARENA_HUGETLB 2
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BPTREE_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BPTREE_PREFETCH(addr) ((void)(addr))
+#endif
+
+#define BPTREE_LOG_DEBUG(tree, ...)     \
+    do {                                \
+        if ((tree)->debug_enabled) {    \
+            bptree_logger(__VA_ARGS__); \
+        }                               \
+    } while (0)
+
+/* Internal default allocation functions */
+
+/**
+ * @brief Default memory allocation function.
+ *
+ * @param size Number of bytes to allocate.
+ * @return Pointer to the allocated memory.
+ */
+static void *default_malloc(const size_t size) { return malloc(size); }
+
+/**
+ * @brief Default memory free function.
+ *
+ * @param ptr Pointer to the memory to free.
+ */
+static void default_free(void *ptr) { free(ptr); }
+
+#ifdef BPTREE_NODE_HANDLES
+/* Nodes refer to each other by 32-bit handles into the tree's slabs; 0 is the null handle */
+typedef uint32_t bptree_ref;
+// Handles are given out to slabs in blocks of 2^BPTREE_HANDLE_BLOCK_BITS slots.
+#define BPTREE_HANDLE_BLOCK_BITS 6
+#define BPTREE_HANDLE_BLOCK (1u << BPTREE_HANDLE_BLOCK_BITS)
+#define BPTREE_HANDLE_MAX_BLOCKS (1u << (32 - BPTREE_HANDLE_BLOCK_BITS))
+#else
+/* Nodes refer to each other by plain pointers */
+typedef struct bptree_node *bptree_ref;
+#endif
+
+#ifndef BPTREE_SEPARATOR_BYTES
+#define BPTREE_SEPARATOR_BYTES 15
+#endif
+#if BPTREE_SEPARATOR_BYTES < 1 || BPTREE_SEPARATOR_BYTES > 254
+#error "BPTREE_SEPARATOR_BYTES must be between 1 and 254"
+#endif
+// With a key bytes function, an internal node key slot holds a length byte followed by
+// the separator bytes, or BPTREE_SEPARATOR_ITEM followed (at pointer alignment) by the
+// item whose key is the separator when it is too long to store inline.
+#define BPTREE_SEPARATOR_ITEM 0xFF
+#define BPTREE_SEPARATOR_SLOT_BYTES \
+    ((BPTREE_SEPARATOR_BYTES + sizeof(void *)) / sizeof(void *) * sizeof(void *))
+#define BPTREE_SEPARATOR_SLOT                                          \
+    (BPTREE_SEPARATOR_SLOT_BYTES > 2 * sizeof(void *) ? BPTREE_SEPARATOR_SLOT_BYTES \
+                                                      : 2 * sizeof(void *))
+
+// Smallest capacity class of nodes with variable capacities; larger classes double
+// in size up to the maximum number of keys of the node kind.
+#define BPTREE_MIN_CAPACITY_CLASS 8
+
+// Capacity of the root leaf stored inside the tree structure, enough for trees of
+// fewer than ten items. Larger root leaves are allocated separately and double
+// in capacity until they reach leaf_max_keys.
+#define BPTREE_INLINE_ROOT_KEYS 10
+
+/* Block of contiguous node slots owned by the tree */
+typedef struct bptree_slab {
+    struct bptree_slab *prev; /**< Previous slab in the tree's slab list. */
+    struct bptree_slab *next; /**< Next slab in the tree's slab list. */
+    unsigned char *slots;     /**< Storage for the node slots. */
+    size_t slot_size;         /**< Size of one slot in bytes. */
+    int capacity;             /**< Number of slots in the slab. */
+    int used;                 /**< Number of slots handed out by bump allocation so far. */
+    int live;                 /**< Number of slots currently holding a node. */
+    void *free_slots;         /**< List of released slots available for reuse. */
+#ifdef BPTREE_NODE_HANDLES
+    uint32_t first_handle; /**< Handle of the first slot. */
+    int is_leaf;           /**< Non-zero if the slab holds leaf nodes. */
+#endif
+#ifdef BPTREE_HUGE_PAGES
+    unsigned char mapped; /**< How a huge page arena slab was mapped, or 0 if allocated. */
+#endif
+} bptree_slab;
+
+/* Internal structure representing a node in the B+Tree */
+typedef struct bptree_node {
+    unsigned char is_leaf;  /**< Non-zero for a leaf node, zero for an internal node. */
+    unsigned char detached; /**< Non-zero if the arrays are allocated apart from the node. */
+#ifdef BPTREE_NODE_HASHES
+    unsigned char hashed;   /**< Non-zero if hash is up to date with the subtree. */
+#endif
+    int num_keys;           /**< Number of keys currently stored in the node. */
+    void **keys;  /**< Array of keys stored in the node. */
+    union {
+        struct {
+            void **items;    /**< Array of item pointers (for leaf nodes). */
+            bptree_ref next; /**< Reference to the next leaf node. */
+            int capacity;    /**< Slots of the keys and items arrays in the sorted layout. */
+            int gaps;        /**< Number of empty slots among the first num_keys slots. */
+            int dense;       /**< Non-zero if the key array holds a dense bitmap index. */
+            int delta_width; /**< Width of the key offsets of a compressed leaf, or 0. */
+        } leaf;
+        struct {
+            bptree_ref *children; /**< Array of child node references (for internal nodes). */
+        } internal;
+    } ptr;
+    bptree_slab *slab; /**< Slab the node was carved out of, or NULL if allocated on its own. */
+#ifdef BPTREE_NODE_HASHES
+    unsigned long long hash; /**< Hash of the items of the subtree, valid if hashed is set. */
+#endif
+} bptree_node;
+
+/* Definition of the main B+Tree structure */
+struct bptree {
+    int leaf_max_keys;     /**< Maximum number of keys in a leaf node. */
+    int internal_max_keys; /**< Maximum number of keys in an internal node. */
+    int leaf_min_keys;     /**< Minimum number of keys in a leaf node (except root). */
+    int internal_min_keys; /**< Minimum number of keys in an internal node (except root). */
+    bptree_overflow_policy overflow_policy; /**< How full leaves make room for new items. */
+    int height;            /**< Current height of the tree. */
+    int count;             /**< Total number of items stored in the tree. */
+    unsigned long version; /**< Changed whenever nodes are created, freed, or rebalanced. */
+    bptree_node *edge_leaves[2]; /**< Leftmost [0] and rightmost [1] leaves, or NULL. */
+    unsigned long edge_version;  /**< Tree version edge_leaves were found at. */
+    int (*compare)(const void *first, const void *second,
+                   const void *user_data); /**< Comparison function for keys. */
+    void *udata;                           /**< User-provided data for the comparison function. */
+    bptree_node *root;                     /**< Pointer to the root node of the tree. */
+    bptree_slab *slabs;                    /**< Slabs holding contiguously allocated nodes. */
+    int leaf_chunk_slots;                  /**< Slots per leaf chunk, or 0 to disable clustering. */
+    bool gapped_leaves;                    /**< Leave empty slots spread through leaves. */
+    bptree_int_key_t int_key;              /**< Integer key of an item, or NULL. */
+    int dense_words;                       /**< Bitmap words that fit in a dense leaf. */
+    bool compressed_leaves;                /**< Encode integer keys of leaves as offsets. */
+    bool variable_capacity;                /**< Give new nodes the smallest fitting capacity. */
+    bptree_key_bytes_t key_bytes;          /**< Key bytes of an item, or NULL. */
+    size_t key_slot_size;                  /**< Size of a key slot in an internal node. */
+    bptree_hash_t hash;                    /**< Hash of an item for node hashes, or NULL. */
+    bptree_slab *reserve[2];               /**< Reserved internal [0] and leaf [1] nodes. */
+    void *scratch;                         /**< Buffer for the temporary arrays of splits. */
+    size_t scratch_size;                   /**< Size of the scratch buffer in bytes. */
+#ifdef BPTREE_NODE_HANDLES
+    bptree_slab **handle_slabs; /**< Slab owning each block of handles, indexed by block. */
+    uint32_t *free_blocks;      /**< Stack of handle blocks released by freed slabs. */
+    uint32_t handle_blocks;     /**< Number of handle blocks handed out, including null block 0. */
+    uint32_t free_block_count;  /**< Number of entries in free_blocks. */
+    uint32_t handle_capacity;   /**< Capacity of handle_slabs and free_blocks. */
+    bptree_slab *open_slabs[2]; /**< Slabs new internal [0] and leaf [1] nodes come from. */
+#endif
+#ifdef BPTREE_HUGE_PAGES
+    bool huge_pages[2];         /**< Take new internal [0] and leaf [1] nodes from the arena. */
+    bptree_slab *arena[2];      /**< Arena slabs new internal [0] and leaf [1] nodes come from. */
+#endif
+    bptree_malloc_t malloc_fn;             /**< Memory allocation function. */
+    bptree_free_t free_fn;                 /**< Memory free function. */
+    bool debug_enabled;                    /**< Debug logging flag. */
+    bptree_node root_leaf;                 /**< Root leaf stored inline while the tree is small. */
+    void *root_slots[2 * BPTREE_INLINE_ROOT_KEYS]; /**< Keys and items of root_leaf. */
+};
+
+/* Internal helper functions documented below */
+
+/**
+ * @brief Performs a binary search on an array of keys.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param array Array of key pointers.
+ * @param count Number of keys in the array.
+ * @param key Key to search for.
+ * @return Index of the found key or insertion index if not found.
+ */
+static int binary_search(const bptree *tree, void *const *array, const int count, const void *key) {
+    int low = 0, high = count - 1;
+    while (low <= high) {
+        const int mid = (low + high) / 2;
+        const int cmp = tree->compare(key, array[mid], tree->udata);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            high = mid - 1;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Searches for a key in a leaf node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param keys Array of keys in the leaf node.
+ * @param count Number of keys in the leaf node.
+ * @param key Key to search for.
+ * @return Index of the found key or insertion index if not found.
+ */
+static int leaf_node_search(const bptree *tree, void *const *keys, const int count,
+                            const void *key) {
+    return binary_search(tree, keys, count, key);
+}
+
+/**
+ * @brief Returns the address of a key slot in an internal node.
+ *
+ * Key slots hold an item pointer, or a separator record when the tree has a
+ * key bytes function.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Internal node.
+ * @param index Index of the key.
+ * @return Pointer to the key slot.
+ */
+static unsigned char *key_slot(const bptree *tree, const bptree_node *node, const int index) {
+    return (unsigned char *)node->keys + (size_t)index * tree->key_slot_size;
+}
+
+/**
+ * @brief Copies key slots between internal nodes, or within one node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param dst Destination node.
+ * @param dst_index Index of the first destination slot.
+ * @param src Source node.
+ * @param src_index Index of the first source slot.
+ * @param count Number of slots to copy.
+ */
+static void copy_keys(const bptree *tree, bptree_node *dst, const int dst_index,
+                      const bptree_node *src, const int src_index, const int count) {
+    memmove(key_slot(tree, dst, dst_index), key_slot(tree, src, src_index),
+            (size_t)count * tree->key_slot_size);
+}
+
+/**
+ * @brief Compares two byte strings like memcmp, ordering a prefix before longer strings.
+ *
+ * @param a First byte string.
+ * @param a_length Length of the first byte string.
+ * @param b Second byte string.
+ * @param b_length Length of the second byte string.
+ * @return Negative, zero, or positive as a sorts before, equal to, or after b.
+ */
+static int compare_bytes(const unsigned char *a, const size_t a_length, const unsigned char *b,
+                         const size_t b_length) {
+    const size_t common = a_length < b_length ? a_length : b_length;
+    // Empty byte strings may be NULL, which memcmp must not be passed even for no bytes.
+    const int cmp = common > 0 ? memcmp(a, b, common) : 0;
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (a_length > b_length) - (a_length < b_length);
+}
+
+/**
+ * @brief Returns the bytes of a separator stored in a key slot.
+ *
+ * @param tree Pointer to the B+Tree, which has a key bytes function.
+ * @param slot Key slot holding a separator record.
+ * @param length Receives the length of the separator.
+ * @return Pointer to the separator bytes.
+ */
+static const unsigned char *separator_bytes(const bptree *tree, const unsigned char *slot,
+                                            size_t *length) {
+    if (slot[0] != BPTREE_SEPARATOR_ITEM) {
+        *length = slot[0];
+        return slot + 1;
+    }
+    const void *item;
+    memcpy(&item, slot + sizeof(void *), sizeof(item));
+    return tree->key_bytes(item, length, tree->udata);
+}
+
+/**
+ * @brief Searches for key bytes among the separators of an internal node.
+ *
+ * @param tree Pointer to the B+Tree, which has a key bytes function.
+ * @param node Internal node to search.
+ * @param bytes Key bytes to search for.
+ * @param length Number of key bytes.
+ * @return Index of the child pointer to follow.
+ */
+static int internal_node_search_bytes(const bptree *tree, const bptree_node *node,
+                                      const unsigned char *bytes, const size_t length) {
+    int low = 0, high = node->num_keys;
+    while (low < high) {
+        const int mid = (low + high) / 2;
+        size_t separator_length;
+        const unsigned char *separator =
+            separator_bytes(tree, key_slot(tree, node, mid), &separator_length);
+        if (compare_bytes(bytes, length, separator, separator_length) < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Searches for a key in an internal node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Internal node to search.
+ * @param key Key to search for.
+ * @return Index of the child pointer to follow.
+ */
+static int internal_node_search(const bptree *tree, const bptree_node *node, const void *key) {
+    if (!tree->key_bytes) {
+        int low = 0, high = node->num_keys;
+        void *const *keys = node->keys;
+        while (low < high) {
+            const int mid = (low + high) / 2;
+            if (tree->compare(key, keys[mid], tree->udata) < 0) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        return low;
+    }
+    size_t length;
+    const unsigned char *bytes = tree->key_bytes(key, &length, tree->udata);
+    return internal_node_search_bytes(tree, node, bytes, length);
+}
+
+/**
+ * @brief Compares a key with the separator in a key slot.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param key Key to compare.
+ * @param slot Key slot of an internal node of the tree.
+ * @return Negative, zero, or positive as the key sorts before, equal to, or after the slot.
+ */
+static int compare_to_slot(const bptree *tree, const void *key, const unsigned char *slot) {
+    if (!tree->key_bytes) {
+        const void *separator;
+        memcpy(&separator, slot, sizeof(separator));
+        return tree->compare(key, separator, tree->udata);
+    }
+    size_t length, separator_length;
+    const unsigned char *bytes = tree->key_bytes(key, &length, tree->udata);
+    const unsigned char *separator = separator_bytes(tree, slot, &separator_length);
+    return compare_bytes(bytes, length, separator, separator_length);
+}
+
+/**
+ * @brief Compares a key with a key slot of an internal node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param key Key to compare.
+ * @param node Internal node.
+ * @param index Index of the key slot.
+ * @return Negative, zero, or positive as the key sorts before, equal to, or after the slot.
+ */
+static int compare_to_key(const bptree *tree, const void *key, const bptree_node *node,
+                          const int index) {
+    if (!tree->key_bytes) {
+        return tree->compare(key, node->keys[index], tree->udata);
+    }
+    return compare_to_slot(tree, key, key_slot(tree, node, index));
+}
+
+/**
+ * @brief Returns the size of the arrays of a node with the given capacity.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param is_leaf Non-zero for a leaf node, zero for an internal node.
+ * @param capacity Maximum number of keys the node can hold.
+ * @return Size of the keys plus the items or child references, in bytes.
+ */
+static size_t arrays_size(const bptree *tree, const int is_leaf, const int capacity) {
+    if (is_leaf) {
+        return 2 * (size_t)capacity * sizeof(void *);
+    }
+    return (size_t)capacity * tree->key_slot_size + ((size_t)capacity + 1) * sizeof(bptree_ref);
+}
+
+/**
+ * @brief Returns the size of the single allocation holding a full-size node and its arrays.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param is_leaf Non-zero for a leaf node, zero for an internal node.
+ * @return Size of the node block in bytes.
+ */
+static size_t node_size(const bptree *tree, const int is_leaf) {
+    const int capacity = is_leaf ? tree->leaf_max_keys : tree->internal_max_keys;
+    const size_t size = sizeof(bptree_node) + arrays_size(tree, is_leaf, capacity);
+    // Round up so nodes packed into a slab stay pointer-aligned.
+    return (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+}
+
+/**
+ * @brief Returns the smallest capacity class that holds a number of keys.
+ *
+ * @param max_keys Maximum number of keys of the node kind.
+ * @param count Number of keys to hold.
+ * @return Capacity class, at most max_keys.
+ */
+static int capacity_class(const int max_keys, const int count) {
+    int capacity = BPTREE_MIN_CAPACITY_CLASS;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    return capacity < max_keys ? capacity : max_keys;
+}
+
+#ifdef BPTREE_NODE_HANDLES
+/**
+ * @brief Assigns a contiguous range of handles to a slab.
+ *
+ * Slabs that fit in a single block reuse blocks released by freed slabs;
+ * larger slabs take fresh blocks from the end of the handle space.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param slab Slab whose capacity is already set.
+ * @return Handle of the slab's first slot, or 0 if the handles are exhausted.
+ */
+static uint32_t reserve_handles(bptree *tree, bptree_slab *slab) {
+    const uint32_t blocks =
+        ((uint32_t)slab->capacity + BPTREE_HANDLE_BLOCK - 1) >> BPTREE_HANDLE_BLOCK_BITS;
+    uint32_t first;
+    if (blocks == 1 && tree->free_block_count > 0) {
+        first = tree->free_blocks[--tree->free_block_count];
+    } else {
+        if (blocks > BPTREE_HANDLE_MAX_BLOCKS - tree->handle_blocks) {
+            return 0;
+        }
+        if (tree->handle_blocks + blocks > tree->handle_capacity) {
+            uint32_t capacity = tree->handle_capacity ? tree->handle_capacity : 64;
+            while (capacity < tree->handle_blocks + blocks) {
+                capacity *= 2;
+            }
+            bptree_slab **slabs = tree->malloc_fn(capacity * sizeof(bptree_slab *));
+            uint32_t *free_blocks = tree->malloc_fn(capacity * sizeof(uint32_t));
+            if (!slabs || !free_blocks) {
+                if (slabs) {
+                    tree->free_fn(slabs);
+                }
+                if (free_blocks) {
+                    tree->free_fn(free_blocks);
+                }
+                return 0;
+            }
+            if (tree->handle_slabs) {
+                memcpy(slabs, tree->handle_slabs, tree->handle_blocks * sizeof(bptree_slab *));
+                memcpy(free_blocks, tree->free_blocks, tree->free_block_count * sizeof(uint32_t));
+                tree->free_fn(tree->handle_slabs);
+                tree->free_fn(tree->free_blocks);
+            }
+            tree->handle_slabs = slabs;
+            tree->free_blocks = free_blocks;
+            tree->handle_capacity = capacity;
+        }
+        first = tree->handle_blocks;
+        tree->handle_blocks += blocks;
+    }
+    for (uint32_t b = 0; b < blocks; b++) {
+        tree->handle_slabs[first + b] = slab;
+    }
+    return first << BPTREE_HANDLE_BLOCK_BITS;
+}
+
+/**
+ * @brief Returns the handle blocks of a slab that is about to be freed.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param slab Slab being freed.
+ */
+static void release_handles(bptree *tree, const bptree_slab *slab) {
+    const uint32_t blocks =
+        ((uint32_t)slab->capacity + BPTREE_HANDLE_BLOCK - 1) >> BPTREE_HANDLE_BLOCK_BITS;
+    const uint32_t first = slab->first_handle >> BPTREE_HANDLE_BLOCK_BITS;
+    for (uint32_t b = 0; b < blocks; b++) {
+        tree->handle_slabs[first + b] = NULL;
+        tree->free_blocks[tree->free_block_count++] = first + b;
+    }
+}
+#endif
+
+/**
+ * @brief Resolves a node reference to the node it refers to.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param ref Node reference.
+ * @return Pointer to the node, or NULL for a null reference.
+ */
+static bptree_node *ref_node(const bptree *tree, const bptree_ref ref) {
+#ifdef BPTREE_NODE_HANDLES
+    if (!ref) {
+        return NULL;
+    }
+    const bptree_slab *slab = tree->handle_slabs[ref >> BPTREE_HANDLE_BLOCK_BITS];
+    return (bptree_node *)(slab->slots + slab->slot_size * (size_t)(ref - slab->first_handle));
+#else
+    (void)tree;
+    return ref;
+#endif
+}
+
+/**
+ * @brief Returns the reference through which other nodes refer to a node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node, or NULL.
+ * @return Reference to the node.
+ */
+static bptree_ref node_ref(const bptree *tree, bptree_node *node) {
+    (void)tree;
+#ifdef BPTREE_NODE_HANDLES
+    if (!node) {
+        return 0;
+    }
+    const bptree_slab *slab = node->slab;
+    return slab->first_handle +
+           (uint32_t)(((unsigned char *)node - slab->slots) / slab->slot_size);
+#else
+    return node;
+#endif
+}
+
+/**
+ * @brief Returns a child of an internal node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Internal node.
+ * @param index Index of the child.
+ * @return Pointer to the child node.
+ */
+static bptree_node *child_at(const bptree *tree, const bptree_node *node, const int index) {
+    return ref_node(tree, node->ptr.internal.children[index]);
+}
+
+/**
+ * @brief Stores a child in an internal node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Internal node.
+ * @param index Index of the child.
+ * @param child Child node to store.
+ */
+static void set_child_at(const bptree *tree, bptree_node *node, const int index,
+                         bptree_node *child) {
+    node->ptr.internal.children[index] = node_ref(tree, child);
+}
+
+/**
+ * @brief Returns the leaf that follows a leaf in key order.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Leaf node.
+ * @return Pointer to the next leaf, or NULL for the last leaf.
+ */
+static bptree_node *next_leaf(const bptree *tree, const bptree_node *leaf) {
+    return ref_node(tree, leaf->ptr.leaf.next);
+}
+
+/**
+ * @brief Links a leaf to the leaf that follows it in key order.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Leaf node.
+ * @param next Next leaf, or NULL.
+ */
+static void set_next_leaf(const bptree *tree, bptree_node *leaf, bptree_node *next) {
+    leaf->ptr.leaf.next = node_ref(tree, next);
+}
+
+/**
+ * @brief Sets up a slab at the start of a block of memory and links it into the tree.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param slab Memory for the slab header followed by its slots.
+ * @param is_leaf Non-zero if the slab holds leaf nodes.
+ * @param capacity Number of node slots in the slab.
+ * @return true on success, or false if the slab could not get node handles.
+ */
+static bool init_slab(bptree *tree, bptree_slab *slab, const int is_leaf, const int capacity) {
+    slab->slots = (unsigned char *)(slab + 1);
+    slab->slot_size = node_size(tree, is_leaf);
+    slab->capacity = capacity;
+    slab->used = 0;
+    slab->live = 0;
+    slab->free_slots = NULL;
+#ifdef BPTREE_HUGE_PAGES
+    slab->mapped = 0;
+#endif
+#ifdef BPTREE_NODE_HANDLES
+    slab->is_leaf = is_leaf;
+    slab->first_handle = reserve_handles(tree, slab);
+    if (!slab->first_handle) {
+        BPTREE_LOG_DEBUG(tree, "Out of node handles (slab of %d nodes)", capacity);
+        return false;
+    }
+#else
+    (void)is_leaf;
+#endif
+    slab->prev = NULL;
+    slab->next = tree->slabs;
+    if (tree->slabs) {
+        tree->slabs->prev = slab;
+    }
+    tree->slabs = slab;
+    return true;
+}
+
+/**
+ * @brief Creates a slab that holds nodes of one kind in contiguous memory.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param is_leaf Non-zero if the slab holds leaf nodes.
+ * @param capacity Number of node slots in the slab.
+ * @return Pointer to the new slab, or NULL on failure.
+ */
+static bptree_slab *create_slab(bptree *tree, const int is_leaf, const int capacity) {
+    bptree_slab *slab =
+        tree->malloc_fn(sizeof(bptree_slab) + node_size(tree, is_leaf) * (size_t)capacity);
+    if (!slab) {
+        BPTREE_LOG_DEBUG(tree, "Allocation failure (slab of %d nodes)", capacity);
+        return NULL;
+    }
+    if (!init_slab(tree, slab, is_leaf, capacity)) {
+        tree->free_fn(slab);
+        return NULL;
+    }
+    return slab;
+}
+
+#ifdef BPTREE_HUGE_PAGES
+/**
+ * @brief Creates a slab that fills one 2 MiB huge page.
+ *
+ * The page comes from the system's reserved huge pages (MAP_HUGETLB) when
+ * there are any. Otherwise a 2 MiB aligned range of ordinary memory is mapped
+ * and marked for transparent huge pages, which the kernel backs with a huge
+ * page when it can.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param is_leaf Non-zero if the slab holds leaf nodes.
+ * @return Pointer to the new slab, or NULL on failure.
+ */
+static bptree_slab *create_arena_slab(bptree *tree, const int is_leaf) {
+    const size_t size = BPTREE_HUGE_PAGE_SIZE;
+    const size_t capacity = (size - sizeof(bptree_slab)) / node_size(tree, is_leaf);
+    if (capacity == 0) {
+        return NULL;
+    }
+    unsigned char mapped = BPTREE_ARENA_HUGETLB;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory == MAP_FAILED) {
+        // Over-map by a page so that an aligned range can be cut out of it.
+        unsigned char *range = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (range == MAP_FAILED) {
+            BPTREE_LOG_DEBUG(tree, "Mapping failure (huge page arena)");
+            return NULL;
+        }
+        const size_t head = (size - (uintptr_t)range % size) % size;
+        if (head > 0) {
+            munmap(range, head);
+        }
+        munmap(range + head + size, size - head);
+        memory = range + head;
+        (void)madvise(memory, size, MADV_HUGEPAGE);
+        mapped = BPTREE_ARENA_TRANSPARENT;
+    }
+    bptree_slab *slab = memory;
+    if (!init_slab(tree, slab, is_leaf, (int)capacity)) {
+        munmap(memory, size);
+        return NULL;
+    }
+    slab->mapped = mapped;
+    return slab;
+}
+#endif
+
+/**
+ * @brief Unlinks a slab from the tree and frees it.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param slab Slab to free.
+ */
+static void destroy_slab(bptree *tree, bptree_slab *slab) {
+    for (int i = 0; i < 2; i++) {
+        if (tree->reserve[i] == slab) {
+            tree->reserve[i] = NULL;
+        }
+    }
+#ifdef BPTREE_NODE_HANDLES
+    release_handles(tree, slab);
+    for (int i = 0; i < 2; i++) {
+        if (tree->open_slabs[i] == slab) {
+            tree->open_slabs[i] = NULL;
+        }
+    }
+#endif
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        tree->slabs = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+#ifdef BPTREE_HUGE_PAGES
+    for (int i = 0; i < 2; i++) {
+        if (tree->arena[i] == slab) {
+            tree->arena[i] = NULL;
+        }
+    }
+    if (slab->mapped) {
+        munmap(slab, BPTREE_HUGE_PAGE_SIZE);
+        return;
+    }
+#endif
+    tree->free_fn(slab);
+}
+
+/**
+ * @brief Marks the subtree hash of a node as stale, if nodes have hashes.
+ *
+ * @param node Node whose subtree changed.
+ */
+static void mark_stale(bptree_node *node) {
+#ifdef BPTREE_NODE_HASHES
+    node->hashed = 0;
+#else
+    (void)node;
+#endif
+}
+
+/**
+ * @brief Initializes an empty node whose arrays live at the given address.
+ *
+ * The keys come first, followed by the items (leaf) or child references
+ * (internal node), each with room for `capacity` entries (plus one child).
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node to initialize.
+ * @param is_leaf Non-zero for a leaf node, zero for an internal node.
+ * @param arrays Storage for the node's arrays.
+ * @param capacity Maximum number of keys the node can hold.
+ */
+static void init_node(const bptree *tree, bptree_node *node, const int is_leaf, void **arrays,
+                      const int capacity) {
+    node->is_leaf = (unsigned char)is_leaf;
+    node->detached = 0;
+    mark_stale(node);
+    node->num_keys = 0;
+    node->keys = arrays;
+    if (is_leaf) {
+        node->ptr.leaf.items = node->keys + capacity;
+        node->ptr.leaf.next = node_ref(tree, NULL);
+        node->ptr.leaf.capacity = capacity;
+        node->ptr.leaf.gaps = 0;
+        node->ptr.leaf.dense = 0;
+        node->ptr.leaf.delta_width = 0;
+    } else {
+        const size_t keys_size = (size_t)capacity * tree->key_slot_size;
+        node->ptr.internal.children = (bptree_ref *)(void *)((unsigned char *)arrays + keys_size);
+    }
+}
+
+/**
+ * @brief Returns how many items a leaf has room for in the sorted-array layout.
+ *
+ * A small root leaf or a leaf with a variable capacity holds fewer than
+ * leaf_max_keys items. Dense and compressed leaves move their items array
+ * down next to their index and may hold more; see leaf_room.
+ *
+ * @param leaf Leaf node.
+ * @return Capacity of the leaf.
+ */
+static int leaf_capacity(const bptree_node *leaf) { return leaf->ptr.leaf.capacity; }
+
+/**
+ * @brief Returns how many keys a node has room for.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node to check.
+ * @return Capacity of the node.
+ */
+static int node_capacity(const bptree *tree, const bptree_node *node) {
+    if (node->is_leaf) {
+        return leaf_capacity(node);
+    }
+    return (int)(((unsigned char *)node->ptr.internal.children - (unsigned char *)node->keys) /
+                 tree->key_slot_size);
+}
+
+/**
+ * @brief Returns the maximum number of keys of a node's kind.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node to check.
+ * @return leaf_max_keys for leaves, internal_max_keys for internal nodes.
+ */
+static int node_max_keys(const bptree *tree, const bptree_node *node) {
+    return node->is_leaf ? tree->leaf_max_keys : tree->internal_max_keys;
+}
+
+/**
+ * @brief Tells whether a slab has a slot for another node.
+ *
+ * @param slab Slab to check, or NULL.
+ * @return true if the slab exists and has a free or unused slot.
+ */
+static bool slab_has_room(const bptree_slab *slab) {
+    return slab && (slab->free_slots || slab->used < slab->capacity);
+}
+
+/**
+ * @brief Returns the number of nodes a slab can still hand out.
+ *
+ * @param slab Slab to check, or NULL.
+ * @return Number of free and unused slots in the slab.
+ */
+static int slab_room(const bptree_slab *slab) {
+    if (!slab) {
+        return 0;
+    }
+    int room = slab->capacity - slab->used;
+    for (const void *slot = slab->free_slots; slot; slot = *(void *const *)slot) {
+        room++;
+    }
+    return room;
+}
+
+/**
+ * @brief Allocates a node, carving it out of a slab when one with room is given.
+ *
+ * The node and its arrays live in a single block: the keys follow the node
+ * header, then the items (leaf) or child pointers (internal node).
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param is_leaf Non-zero for a leaf node, zero for an internal node.
+ * @param slab Slab to allocate from, or NULL to take the node from the reserve
+ *        or allocate it on its own.
+ * @return Pointer to the new node, or NULL on failure.
+ */
+static bptree_node *alloc_node(bptree *tree, const int is_leaf, bptree_slab *slab) {
+    bptree_node *node = NULL;
+    tree->version++;
+    if (!slab && slab_has_room(tree->reserve[is_leaf])) {
+        slab = tree->reserve[is_leaf];
+    }
+#ifdef BPTREE_HUGE_PAGES
+    if (!slab && tree->huge_pages[is_leaf]) {
+        if (!slab_has_room(tree->arena[is_leaf])) {
+            tree->arena[is_leaf] = create_arena_slab(tree, is_leaf);
+        }
+        slab = tree->arena[is_leaf];
+    }
+#endif
+#ifdef BPTREE_NODE_HANDLES
+    // Every node needs a handle, so nodes allocated on their own come from an open slab.
+    if (!slab) {
+        slab = tree->open_slabs[is_leaf];
+        if (!slab_has_room(slab)) {
+            slab = create_slab(tree, is_leaf, BPTREE_HANDLE_BLOCK);
+            if (!slab) {
+                return NULL;
+            }
+            tree->open_slabs[is_leaf] = slab;
+        }
+    }
+#endif
+    if (slab && slab->free_slots) {
+        node = slab->free_slots;
+        slab->free_slots = *(void **)node;
+    } else if (slab && slab->used < slab->capacity) {
+        node = (bptree_node *)(slab->slots + slab->slot_size * (size_t)slab->used++);
+    } else {
+        slab = NULL;
+        node = tree->malloc_fn(node_size(tree, is_leaf));
+        if (!node) {
+            BPTREE_LOG_DEBUG(tree, "Allocation failure (%s node)", is_leaf ? "leaf" : "internal");
+            return NULL;
+        }
+    }
+    if (slab) {
+        slab->live++;
+    }
+    node->slab = slab;
+    init_node(tree, node, is_leaf, (void **)(node + 1),
+              is_leaf ? tree->leaf_max_keys : tree->internal_max_keys);
+    return node;
+}
+
+/**
+ * @brief Allocates a node whose arrays are allocated apart from it.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param is_leaf Non-zero for a leaf node, zero for an internal node.
+ * @param capacity Maximum number of keys the node can hold.
+ * @return Pointer to the new node, or NULL on failure.
+ */
+static bptree_node *alloc_detached_node(bptree *tree, const int is_leaf, const int capacity) {
+    tree->version++;
+    bptree_node *node = tree->malloc_fn(sizeof(bptree_node));
+    void **arrays = node ? tree->malloc_fn(arrays_size(tree, is_leaf, capacity)) : NULL;
+    if (!arrays) {
+        if (node) {
+            tree->free_fn(node);
+        }
+        BPTREE_LOG_DEBUG(tree, "Allocation failure (%s node of capacity %d)",
+                         is_leaf ? "leaf" : "internal", capacity);
+        return NULL;
+    }
+    node->slab = NULL;
+    init_node(tree, node, is_leaf, arrays, capacity);
+    node->detached = 1;
+    return node;
+}
+
+/**
+ * @brief Moves the arrays of a node into newly allocated arrays of another capacity.
+ *
+ * The node itself stays in place, so its parent and the previous leaf need
+ * no update. A leaf must be packed and in the sorted-array layout.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node to resize.
+ * @param capacity New capacity, at least the node's number of keys.
+ * @return BPTREE_OK on success, or BPTREE_ALLOCATION_ERROR on failure.
+ */
+static bptree_status resize_node(bptree *tree, bptree_node *node, const int capacity) {
+    assert(capacity >= node->num_keys);
+    const size_t key_size = node->is_leaf ? sizeof(void *) : tree->key_slot_size;
+    unsigned char *arrays = tree->malloc_fn(arrays_size(tree, node->is_leaf, capacity));
+    if (!arrays) {
+        BPTREE_LOG_DEBUG(tree, "Allocation failure while resizing a node to %d keys", capacity);
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    unsigned char *values = arrays + (size_t)capacity * key_size;
+    memcpy(arrays, node->keys, node->num_keys * key_size);
+    if (node->is_leaf) {
+        memcpy(values, node->ptr.leaf.items, node->num_keys * sizeof(void *));
+    } else {
+        memcpy(values, node->ptr.internal.children, (node->num_keys + 1) * sizeof(bptree_ref));
+    }
+    if (node->detached) {
+        tree->free_fn(node->keys);
+    }
+    node->keys = (void **)(void *)arrays;
+    if (node->is_leaf) {
+        node->ptr.leaf.items = (void **)(void *)values;
+        node->ptr.leaf.capacity = capacity;
+    } else {
+        node->ptr.internal.children = (bptree_ref *)(void *)values;
+    }
+    node->detached = 1;
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Makes sure a node has room for a number of keys, moving it into a larger class.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node to check; a leaf must be packed and in the sorted-array layout.
+ * @param count Number of keys the node must be able to hold.
+ * @return BPTREE_OK on success, or BPTREE_ALLOCATION_ERROR on failure.
+ */
+static bptree_status reserve_node(bptree *tree, bptree_node *node, const int count) {
+    if (count <= node_capacity(tree, node)) {
+        return BPTREE_OK;
+    }
+    return resize_node(tree, node, capacity_class(node_max_keys(tree, node), count));
+}
+
+/**
+ * @brief Moves a detached node into the smallest capacity class that holds its keys.
+ *
+ * Allocation failures are ignored, since the node stays valid at its old capacity.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node to trim; a leaf must be packed and in the sorted-array layout.
+ */
+static void trim_node(bptree *tree, bptree_node *node) {
+    const int capacity = capacity_class(node_max_keys(tree, node), node->num_keys);
+    if (node->detached && capacity < node_capacity(tree, node)) {
+        (void)resize_node(tree, node, capacity);
+    }
+}
+
+/**
+ * @brief Creates a new leaf node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param count Number of items the leaf is about to receive, which picks its
+ *        capacity class when variable capacities are enabled.
+ * @return Pointer to the new leaf node, or NULL on failure.
+ */
+static bptree_node *create_leaf(bptree *tree, const int count) {
+    if (tree->variable_capacity) {
+        return alloc_detached_node(tree, 1, capacity_class(tree->leaf_max_keys, count));
+    }
+    return alloc_node(tree, 1, NULL);
+}
+
+/**
+ * @brief Creates a new internal node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param count Number of keys the node is about to receive, which picks its
+ *        capacity class when variable capacities are enabled.
+ * @return Pointer to the new internal node, or NULL on failure.
+ */
+static bptree_node *create_internal(bptree *tree, const int count) {
+    if (tree->variable_capacity) {
+        return alloc_detached_node(tree, 0, capacity_class(tree->internal_max_keys, count));
+    }
+    return alloc_node(tree, 0, NULL);
+}
+
+/**
+ * @brief Frees a single node without touching its descendants.
+ *
+ * Nodes carved out of a slab go back to the slab, and the slab is freed once
+ * its last node is released, unless it holds the tree's reserve.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Pointer to the node to free.
+ */
+static void release_node(bptree *tree, bptree_node *node) {
+    tree->version++;
+    if (node == &tree->root_leaf) {
+        return;
+    }
+    if (node->detached) {
+        tree->free_fn(node->keys);
+    }
+    bptree_slab *slab = node->slab;
+    if (!slab) {
+        tree->free_fn(node);
+        return;
+    }
+    *(void **)node = slab->free_slots;
+    slab->free_slots = node;
+    // Reserved slabs stay around empty until the reservation is replaced or the tree is freed.
+    if (--slab->live == 0 && slab != tree->reserve[0] && slab != tree->reserve[1]) {
+        destroy_slab(tree, slab);
+        return;
+    }
+#ifdef BPTREE_NODE_HANDLES
+    // Refill partially used slabs before opening new ones.
+    bptree_slab *open = tree->open_slabs[slab->is_leaf];
+    if (!slab_has_room(open)) {
+        tree->open_slabs[slab->is_leaf] = slab;
+    }
+#endif
+}
+
+/**
+ * @brief Creates a leaf that will follow the given leaf in key order.
+ *
+ * With leaf clustering enabled, the new leaf is placed in the same chunk as
+ * its left neighbor when the chunk has a spare slot, and otherwise in a fresh
+ * chunk, so leaves that are adjacent in key order tend to be close in memory.
+ * Leaves reserved by bptree_reserve are used first, and clustering is skipped
+ * while leaves come from the huge page arena.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param left Leaf that will precede the new leaf.
+ * @param count Number of items the leaf is about to receive.
+ * @return Pointer to the new leaf node, or NULL on failure.
+ */
+static bptree_node *create_leaf_after(bptree *tree, const bptree_node *left, const int count) {
+    bool clustered = tree->leaf_chunk_slots > 0 && !slab_has_room(tree->reserve[1]);
+#ifdef BPTREE_HUGE_PAGES
+    clustered = clustered && !tree->huge_pages[1];
+#endif
+    if (clustered) {
+        bptree_slab *slab = left->slab;
+        if (!slab_has_room(slab)) {
+            slab = create_slab(tree, 1, tree->leaf_chunk_slots);
+        }
+        if (slab) {
+            return alloc_node(tree, 1, slab);
+        }
+    }
+    return create_leaf(tree, count);
+}
+
+/**
+ * @brief Frees the memory of a node that is being torn down with the whole tree.
+ *
+ * Nodes in slabs are left alone, since the slabs are destroyed as a whole
+ * afterwards, so only the allocation function's memory is touched.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Pointer to the node to drop.
+ */
+static void drop_node(const bptree *tree, bptree_node *node) {
+    if (node == &tree->root_leaf) {
+        return;
+    }
+    if (node->detached) {
+        tree->free_fn(node->keys);
+    }
+    if (!node->slab) {
+        tree->free_fn(node);
+    }
+}
+
+/**
+ * @brief Starts freeing the subtree under a node with free_nodes.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Root of the subtree.
+ */
+static void begin_free(const bptree *tree, bptree_node *node) {
+    if (node && !node->is_leaf) {
+        const bptree_node *parent = NULL;
+        memcpy(key_slot(tree, node, 0), &parent, sizeof(parent));
+    }
+}
+
+/**
+ * @brief Frees a subtree in post-order, a bounded number of nodes at a time.
+ *
+ * The walk needs neither recursion nor a stack. The keys of a subtree are dead
+ * once it is being freed, so every internal node on the current path keeps
+ * its parent in its first key slot and counts down its key count as the index
+ * of the next child to free. Starting from the node returned by the previous
+ * call resumes the walk.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node to continue from; the subtree root after begin_free.
+ * @param teardown Whether the whole tree is going away, in which case nodes
+ *        are dropped with drop_node instead of released to their slabs.
+ * @param budget Maximum number of nodes to free.
+ * @return Node to continue from, or NULL once the subtree is freed.
+ */
+static bptree_node *free_nodes(bptree *tree, bptree_node *node, const bool teardown,
+                               long budget) {
+    while (node && budget-- > 0) {
+        bptree_node *next = NULL;
+        if (!node->is_leaf && node->num_keys >= 0) {
+            bptree_node *child = child_at(tree, node, node->num_keys--);
+            if (!child->is_leaf) {
+                memcpy(key_slot(tree, child, 0), &node, sizeof(node));
+                node = child;
+                continue;
+            }
+            next = node;
+            node = child;
+        } else if (!node->is_leaf) {
+            memcpy(&next, key_slot(tree, node, 0), sizeof(next));
+        }
+        if (teardown) {
+            drop_node(tree, node);
+        } else {
+            release_node(tree, node);
+        }
+        node = next;
+    }
+    return node;
+}
+
+/**
+ * @brief Frees a node and its descendants.
  *
  * @param tree Pointer to the B+Tree.
  * @param node Pointer to the node to free.
  */
-static void free_node(bptree *tree, bptree_node *node) {
-    if (node == NULL) {
+static void free_node(bptree *tree, bptree_node *node) {
+    if (node == NULL) {
+        return;
+    }
+    begin_free(tree, node);
+    free_nodes(tree, node, false, LONG_MAX);
+}
+
+/* Contents of one internal node key slot, kept outside of any node */
+typedef union {
+    void *item;                                 /**< Item whose key separates the children. */
+    unsigned char bytes[BPTREE_SEPARATOR_SLOT]; /**< Separator record (key bytes mode). */
+} bptree_separator;
+
+/**
+ * @brief Builds the separator between two adjacent nodes.
+ *
+ * Without a key bytes function the separator is the right node's first item.
+ * Otherwise it is the shortest prefix of that item's key that sorts after the
+ * left node's last key, stored inline if it fits.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param separator Receives the separator.
+ * @param left Last item of the left node.
+ * @param right First item of the right node.
+ */
+static void make_separator(const bptree *tree, bptree_separator *separator, const void *left,
+                           void *right) {
+    if (!tree->key_bytes) {
+        separator->item = right;
+        return;
+    }
+    size_t left_length, right_length;
+    const unsigned char *left_bytes = tree->key_bytes(left, &left_length, tree->udata);
+    const unsigned char *right_bytes = tree->key_bytes(right, &right_length, tree->udata);
+    size_t length = 0;
+    while (length < left_length && length < right_length &&
+           left_bytes[length] == right_bytes[length]) {
+        length++;
+    }
+    // Keep the first differing byte; the right key cannot be a prefix of the smaller left key.
+    length++;
+    assert(length <= right_length);
+    if (length <= BPTREE_SEPARATOR_BYTES) {
+        separator->bytes[0] = (unsigned char)length;
+        memcpy(separator->bytes + 1, right_bytes, length);
+    } else {
+        separator->bytes[0] = BPTREE_SEPARATOR_ITEM;
+        memcpy(separator->bytes + sizeof(void *), &right, sizeof(right));
+    }
+}
+
+/**
+ * @brief Stores a separator in a key slot of an internal node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Internal node.
+ * @param index Index of the key slot.
+ * @param separator Separator to store.
+ */
+static void set_key(const bptree *tree, bptree_node *node, const int index,
+                    const bptree_separator *separator) {
+    memcpy(key_slot(tree, node, index), separator, tree->key_slot_size);
+}
+
+/**
+ * @brief Stores the separator between two adjacent nodes in a key slot of their parent.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Internal node.
+ * @param index Index of the key slot.
+ * @param left Last item of the left node.
+ * @param right First item of the right node.
+ */
+static void set_separator(const bptree *tree, bptree_node *node, const int index,
+                          const void *left, void *right) {
+    bptree_separator separator;
+    make_separator(tree, &separator, left, right);
+    set_key(tree, node, index, &separator);
+}
+
+/* Structure for internal result handling during insertion. */
+typedef struct {
+    bptree_separator promoted; /**< Key to be promoted to the parent node along with new_child. */
+    bptree_node *new_child;    /**< Pointer to the new node created after split, or NULL. */
+    bptree_status status;      /**< Status of the insertion operation. */
+} insert_result;
+
+/**
+ * @brief Returns the tree's buffer for the temporary arrays of a split.
+ *
+ * The buffer is large enough for any split or redistribution of the tree's
+ * nodes and is allocated on first use, so splits do not allocate memory of
+ * their own. Only one split at a time may use it.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @return Pointer to the buffer, or NULL on allocation failure.
+ */
+static void *scratch_buffer(bptree *tree) {
+    const size_t leaf_size = 2 * ((size_t)tree->leaf_max_keys + 1) * sizeof(void *);
+    const size_t internal_size = ((size_t)tree->internal_max_keys + 1) * tree->key_slot_size +
+                                 ((size_t)tree->internal_max_keys + 2) * sizeof(bptree_ref);
+    const size_t size = leaf_size > internal_size ? leaf_size : internal_size;
+    if (size > tree->scratch_size) {
+        void *buffer = tree->malloc_fn(size);
+        if (!buffer) {
+            BPTREE_LOG_DEBUG(tree, "Allocation failure (split buffer of %zu bytes)", size);
+            return NULL;
+        }
+        if (tree->scratch) {
+            tree->free_fn(tree->scratch);
+        }
+        tree->scratch = buffer;
+        tree->scratch_size = size;
+    }
+    return tree->scratch;
+}
+
+/**
+ * @brief Splits an internal node and promotes a key.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Internal node to split.
+ * @param new_key Separator to insert.
+ * @param new_child Child pointer corresponding to new_key.
+ * @param pos Position to insert the new key.
+ * @return Structure containing the promoted key, new child, and status.
+ */
+static insert_result split_internal(bptree *tree, bptree_node *node,
+                                    const bptree_separator *new_key, bptree_node *new_child,
+                                    const int pos) {
+    insert_result res = {{NULL}, NULL, BPTREE_ERROR};
+    const int total = node->num_keys + 1;
+    const int split = total / 2;
+    const size_t slot = tree->key_slot_size;
+    unsigned char *all_keys = scratch_buffer(tree);
+    if (!all_keys) {
+        return res;
+    }
+    // Key slots are multiples of the pointer size, so the children stay aligned.
+    bptree_ref *all_children = (bptree_ref *)(void *)(all_keys + total * slot);
+    memcpy(all_keys, node->keys, node->num_keys * slot);
+    memcpy(all_children, node->ptr.internal.children, (node->num_keys + 1) * sizeof(bptree_ref));
+    memmove(all_keys + (pos + 1) * slot, all_keys + pos * slot, (node->num_keys - pos) * slot);
+    memcpy(all_keys + pos * slot, new_key, slot);
+    memmove(&all_children[pos + 2], &all_children[pos + 1],
+            (node->num_keys - pos) * sizeof(bptree_ref));
+    all_children[pos + 1] = node_ref(tree, new_child);
+    node->num_keys = split;
+    memcpy(node->keys, all_keys, split * slot);
+    memcpy(node->ptr.internal.children, all_children, (split + 1) * sizeof(bptree_ref));
+    bptree_node *new_internal = create_internal(tree, total - split - 1);
+    if (!new_internal) {
+        return res;
+    }
+    if (tree->variable_capacity) {
+        trim_node(tree, node);
+    }
+    new_internal->num_keys = total - split - 1;
+    memcpy(new_internal->keys, all_keys + (split + 1) * slot, (total - split - 1) * slot);
+    memcpy(new_internal->ptr.internal.children, &all_children[split + 1],
+           (total - split) * sizeof(bptree_ref));
+    memcpy(&res.promoted, all_keys + split * slot, slot);
+    res.new_child = new_internal;
+    res.status = BPTREE_OK;
+    return res;
+}
+
+/**
+ * @brief Returns the number of keys a node holds, not counting the gaps of a leaf.
+ *
+ * @param node Node to check.
+ * @return Number of live keys in the node.
+ */
+static int live_keys(const bptree_node *node) {
+    return node->is_leaf ? node->num_keys - node->ptr.leaf.gaps : node->num_keys;
+}
+
+/**
+ * @brief Removes the gaps from a leaf, moving its items to the front.
+ *
+ * @param leaf Leaf node to pack.
+ */
+static void pack_leaf(bptree_node *leaf) {
+    if (leaf->ptr.leaf.gaps == 0) {
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < leaf->num_keys; i++) {
+        if (leaf->ptr.leaf.items[i]) {
+            leaf->keys[n] = leaf->keys[i];
+            leaf->ptr.leaf.items[n] = leaf->ptr.leaf.items[i];
+            n++;
+        }
+    }
+    leaf->num_keys = n;
+    leaf->ptr.leaf.gaps = 0;
+}
+
+/**
+ * @brief Spreads the items of a packed leaf evenly over all of its slots.
+ *
+ * Does nothing unless the tree uses gapped leaves. A gap has a NULL item and
+ * a copy of the next item's key, so the keys stay sorted for binary search.
+ * The last slot always holds an item.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Packed leaf node to spread out.
+ */
+static void spread_leaf(const bptree *tree, bptree_node *leaf) {
+    const int n = leaf->num_keys;
+    const int capacity = leaf_capacity(leaf);
+    if (!tree->gapped_leaves || n == 0 || n == capacity) {
+        return;
+    }
+    void **keys = leaf->keys;
+    void **items = leaf->ptr.leaf.items;
+    int next = capacity;
+    // Walk backwards so every item moves into a slot that has already been vacated.
+    for (int j = n - 1; j >= 0; j--) {
+        const int dst = (int)((long long)(j + 1) * capacity / n) - 1;
+        keys[dst] = keys[j];
+        items[dst] = items[j];
+        for (int g = dst + 1; g < next; g++) {
+            keys[g] = keys[next];
+            items[g] = NULL;
+        }
+        next = dst;
+    }
+    for (int g = 0; g < next; g++) {
+        keys[g] = keys[next];
+        items[g] = NULL;
+    }
+    leaf->num_keys = capacity;
+    leaf->ptr.leaf.gaps = capacity - n;
+}
+
+/**
+ * @brief Inserts an item into a gapped leaf that has at least one free slot.
+ *
+ * The item goes into the nearest gap, or the nearest free slot past the end,
+ * and only the items between that slot and the insertion point are shifted.
+ *
+ * @param leaf Leaf node with fewer items than its capacity.
+ * @param pos Insertion index returned by leaf_node_search.
+ * @param item Pointer to the item to insert.
+ */
+static void gapped_leaf_insert(bptree_node *leaf, const int pos, void *item) {
+    void **keys = leaf->keys;
+    void **items = leaf->ptr.leaf.items;
+    int at = pos;
+    for (int d = 0;; d++) {
+        const int right = pos + d;
+        if (right < leaf->num_keys ? items[right] == NULL : right < leaf_capacity(leaf)) {
+            memmove(&keys[pos + 1], &keys[pos], d * sizeof(void *));
+            memmove(&items[pos + 1], &items[pos], d * sizeof(void *));
+            if (right == leaf->num_keys) {
+                leaf->num_keys++;
+            } else {
+                leaf->ptr.leaf.gaps--;
+            }
+            at = pos;
+            break;
+        }
+        const int left = pos - 1 - d;
+        if (left >= 0 && items[left] == NULL) {
+            memmove(&keys[left], &keys[left + 1], d * sizeof(void *));
+            memmove(&items[left], &items[left + 1], d * sizeof(void *));
+            leaf->ptr.leaf.gaps--;
+            at = pos - 1;
+            break;
+        }
+    }
+    keys[at] = item;
+    items[at] = item;
+    for (int g = at - 1; g >= 0 && items[g] == NULL; g--) {
+        keys[g] = item;
+    }
+}
+
+/**
+ * @brief Removes the item in a slot of a gapped leaf, leaving a gap behind.
+ *
+ * @param leaf Leaf node.
+ * @param pos Slot holding the item to remove.
+ */
+static void gapped_leaf_remove(bptree_node *leaf, const int pos) {
+    void **keys = leaf->keys;
+    void **items = leaf->ptr.leaf.items;
+    items[pos] = NULL;
+    if (pos == leaf->num_keys - 1) {
+        // Trailing gaps have no next key to copy, so drop them.
+        leaf->num_keys--;
+        while (leaf->num_keys > 0 && items[leaf->num_keys - 1] == NULL) {
+            leaf->num_keys--;
+            leaf->ptr.leaf.gaps--;
+        }
+        return;
+    }
+    leaf->ptr.leaf.gaps++;
+    for (int g = pos; g >= 0 && items[g] == NULL; g--) {
+        keys[g] = keys[pos + 1];
+    }
+}
+
+/**
+ * @brief Counts the set bits in a 64-bit word.
+ *
+ * @param x Word to count.
+ * @return Number of set bits.
+ */
+static int popcount64(unsigned long long x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+/*
+ * A dense leaf stores an index at the start of its arrays: the smallest key
+ * the index can hold, then one bitmap word per 64 keys, then for every word
+ * the number of bits set in the words before it. Item i of the leaf is the
+ * one whose key has rank i in the bitmap. The items array moves down to
+ * follow the index, so the memory a sorted leaf spends on its key array
+ * holds nearly as many items again.
+ */
+
+/**
+ * @brief Returns the number of pointer-sized slots taken by the index of a dense leaf.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @return Size of the index in slots.
+ */
+static int dense_slots(const bptree *tree) {
+    const size_t word_bytes = sizeof(unsigned long long) + sizeof(unsigned int);
+    const size_t bytes = sizeof(long long) + (size_t)tree->dense_words * word_bytes;
+    return (int)((bytes + sizeof(void *) - 1) / sizeof(void *));
+}
+
+/**
+ * @brief Returns how many items a dense leaf has room for.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Dense leaf node.
+ * @return Number of items that fit after the index.
+ */
+static int dense_capacity(const bptree *tree, const bptree_node *leaf) {
+    return 2 * leaf_capacity(leaf) - dense_slots(tree);
+}
+
+/**
+ * @brief Returns the smallest key a dense leaf can hold.
+ *
+ * @param leaf Dense leaf node.
+ * @return Pointer to the base key.
+ */
+static long long *dense_base(const bptree_node *leaf) { return (long long *)(void *)leaf->keys; }
+
+/**
+ * @brief Returns the bitmap of a dense leaf.
+ *
+ * @param leaf Dense leaf node.
+ * @return Pointer to the first bitmap word.
+ */
+static unsigned long long *dense_bits(const bptree_node *leaf) {
+    return (unsigned long long *)(void *)((unsigned char *)leaf->keys + sizeof(long long));
+}
+
+/**
+ * @brief Returns the rank counts of a dense leaf.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Dense leaf node.
+ * @return Pointer to the rank count of the first bitmap word.
+ */
+static unsigned int *dense_ranks(const bptree *tree, const bptree_node *leaf) {
+    return (unsigned int *)(void *)(dense_bits(leaf) + tree->dense_words);
+}
+
+/**
+ * @brief Returns the bitmap position of a key in a dense leaf.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Dense leaf node.
+ * @param key Key to locate.
+ * @return Offset of the key from the leaf's base key (wraps around below the base).
+ */
+static unsigned long long dense_offset(const bptree *tree, const bptree_node *leaf,
+                                       const void *key) {
+    return (unsigned long long)tree->int_key(key, tree->udata) -
+           (unsigned long long)*dense_base(leaf);
+}
+
+/**
+ * @brief Looks up a key in a dense leaf.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Dense leaf node.
+ * @param key Key to look up.
+ * @param slot Receives the index of the item with the key, or where it would be inserted.
+ * @return 1 if the key is present, 0 if it is absent but within the leaf's
+ *         range, or -1 if it lies outside the range.
+ */
+static int dense_find(const bptree *tree, const bptree_node *leaf, const void *key, int *slot) {
+    const unsigned long long offset = dense_offset(tree, leaf, key);
+    if (offset >= (unsigned long long)tree->dense_words * 64) {
+        return -1;
+    }
+    const unsigned long long word = dense_bits(leaf)[offset / 64];
+    const unsigned long long bit = 1ULL << (offset % 64);
+    *slot = (int)dense_ranks(tree, leaf)[offset / 64] + popcount64(word & (bit - 1));
+    return (word & bit) != 0;
+}
+
+/**
+ * @brief Inserts an item into a dense leaf that has room and covers its key.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Dense leaf node.
+ * @param slot Insertion index returned by dense_find.
+ * @param item Pointer to the item to insert.
+ */
+static void dense_insert(const bptree *tree, bptree_node *leaf, const int slot, void *item) {
+    const unsigned long long offset = dense_offset(tree, leaf, item);
+    void **items = leaf->ptr.leaf.items;
+    memmove(&items[slot + 1], &items[slot], (leaf->num_keys - slot) * sizeof(void *));
+    items[slot] = item;
+    leaf->num_keys++;
+    dense_bits(leaf)[offset / 64] |= 1ULL << (offset % 64);
+    unsigned int *ranks = dense_ranks(tree, leaf);
+    for (int w = (int)(offset / 64) + 1; w < tree->dense_words; w++) {
+        ranks[w]++;
+    }
+}
+
+/**
+ * @brief Removes the item in a slot of a dense leaf.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Dense leaf node.
+ * @param slot Index of the item to remove.
+ */
+static void dense_remove(const bptree *tree, bptree_node *leaf, const int slot) {
+    void **items = leaf->ptr.leaf.items;
+    const unsigned long long offset = dense_offset(tree, leaf, items[slot]);
+    memmove(&items[slot], &items[slot + 1], (leaf->num_keys - slot - 1) * sizeof(void *));
+    leaf->num_keys--;
+    dense_bits(leaf)[offset / 64] &= ~(1ULL << (offset % 64));
+    unsigned int *ranks = dense_ranks(tree, leaf);
+    for (int w = (int)(offset / 64) + 1; w < tree->dense_words; w++) {
+        ranks[w]--;
+    }
+}
+
+/**
+ * @brief Rebuilds the bitmap and rank counts of a dense leaf from its items.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Dense leaf node whose base key covers all of its items.
+ */
+static void dense_index(const bptree *tree, bptree_node *leaf) {
+    void **items = leaf->ptr.leaf.items;
+    unsigned long long *bits = dense_bits(leaf);
+    memset(bits, 0, tree->dense_words * sizeof(unsigned long long));
+    for (int i = 0; i < leaf->num_keys; i++) {
+        const unsigned long long offset = dense_offset(tree, leaf, items[i]);
+        bits[offset / 64] |= 1ULL << (offset % 64);
+    }
+    unsigned int *ranks = dense_ranks(tree, leaf);
+    unsigned int rank = 0;
+    for (int w = 0; w < tree->dense_words; w++) {
+        ranks[w] = rank;
+        rank += popcount64(bits[w]);
+    }
+}
+
+/**
+ * @brief Switches a packed leaf to the dense layout if its keys span a narrow enough range.
+ *
+ * Does nothing unless the tree has an integer key function and the leaf has
+ * full capacity. The bitmap range is centered on the leaf's keys, leaving
+ * room for new keys on both sides.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Packed leaf node in the sorted-array layout.
+ */
+static void densify_leaf(const bptree *tree, bptree_node *leaf) {
+    const int n = leaf->num_keys;
+    if (!tree->int_key || n == 0 || leaf_capacity(leaf) < tree->leaf_max_keys) {
+        return;
+    }
+    void **items = leaf->ptr.leaf.items;
+    const long long low = tree->int_key(items[0], tree->udata);
+    const unsigned long long span =
+        (unsigned long long)tree->int_key(items[n - 1], tree->udata) - (unsigned long long)low;
+    const unsigned long long capacity = (unsigned long long)tree->dense_words * 64;
+    if (span >= capacity) {
+        return;
+    }
+    leaf->ptr.leaf.items = memmove(leaf->keys + dense_slots(tree), items, n * sizeof(void *));
+    const long long slack = (long long)((capacity - 1 - span) / 2);
+    *dense_base(leaf) = low >= LLONG_MIN + slack ? low - slack : LLONG_MIN;
+    leaf->ptr.leaf.dense = 1;
+    dense_index(tree, leaf);
+}
+
+/*
+ * A compressed leaf stores its index at the start of its arrays too: the
+ * smallest key of the leaf, then the offset of each key from it as an
+ * unsigned integer of delta_width bytes. Item i of the leaf is the one whose
+ * key has offset i. The items move down behind the offsets, so narrower
+ * offsets leave room for more items.
+ */
+
+/**
+ * @brief Returns the key the offsets of a compressed leaf are relative to.
+ *
+ * @param leaf Compressed leaf node.
+ * @return Pointer to the base key.
+ */
+static long long *delta_base(const bptree_node *leaf) { return (long long *)(void *)leaf->keys; }
+
+/**
+ * @brief Returns the key offsets of a compressed leaf.
+ *
+ * @param leaf Compressed leaf node.
+ * @return Pointer to the first offset.
+ */
+static unsigned char *delta_offsets(const bptree_node *leaf) {
+    return (unsigned char *)leaf->keys + sizeof(long long);
+}
+
+/**
+ * @brief Returns how many offsets of the given width fit in front of the items of a leaf.
+ *
+ * @param leaf Leaf node.
+ * @param width Width of an offset in bytes.
+ * @return Number of offsets that fit.
+ */
+static int delta_capacity(const bptree_node *leaf, const int width) {
+    const size_t bytes = (size_t)(leaf->ptr.leaf.items - leaf->keys) * sizeof(void *);
+    return bytes > sizeof(long long) ? (int)((bytes - sizeof(long long)) / width) : 0;
+}
+
+/**
+ * @brief Stores a key offset in a compressed leaf.
+ *
+ * @param leaf Compressed leaf node.
+ * @param slot Index of the offset.
+ * @param offset Offset to store; must fit the leaf's offset width.
+ */
+static void delta_store(bptree_node *leaf, const int slot, const unsigned long long offset) {
+    unsigned char *offsets = delta_offsets(leaf);
+    switch (leaf->ptr.leaf.delta_width) {
+    case 1:
+        offsets[slot] = (uint8_t)offset;
+        break;
+    case 2:
+        ((uint16_t *)(void *)offsets)[slot] = (uint16_t)offset;
+        break;
+    default:
+        ((uint32_t *)(void *)offsets)[slot] = (uint32_t)offset;
+        break;
+    }
+}
+
+/**
+ * @brief Looks up a key in a compressed leaf.
+ *
+ * The position of the key is the number of offsets below its own, which is
+ * counted over all offsets without branching so the loop vectorizes.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Compressed leaf node.
+ * @param key Key to look up.
+ * @param slot Receives the index of the item with the key, or where it would be inserted.
+ * @return 1 if the key is present, 0 if it is absent but its offset fits the
+ *         leaf, or -1 if it lies below the base key or too far above it.
+ */
+static int delta_find(const bptree *tree, const bptree_node *leaf, const void *key, int *slot) {
+    const long long k = tree->int_key(key, tree->udata);
+    const long long base = *delta_base(leaf);
+    const int width = leaf->ptr.leaf.delta_width;
+    const unsigned long long offset = (unsigned long long)k - (unsigned long long)base;
+    if (k < base || offset >> (8 * width) != 0) {
+        return -1;
+    }
+    const unsigned char *offsets = delta_offsets(leaf);
+    const int n = leaf->num_keys;
+    int below = 0, found = 0;
+    if (width == 1) {
+        const uint8_t *d = offsets;
+        const uint8_t target = (uint8_t)offset;
+        for (int i = 0; i < n; i++) {
+            below += d[i] < target;
+        }
+        found = below < n && d[below] == target;
+    } else if (width == 2) {
+        const uint16_t *d = (const uint16_t *)(const void *)offsets;
+        const uint16_t target = (uint16_t)offset;
+        for (int i = 0; i < n; i++) {
+            below += d[i] < target;
+        }
+        found = below < n && d[below] == target;
+    } else {
+        const uint32_t *d = (const uint32_t *)(const void *)offsets;
+        const uint32_t target = (uint32_t)offset;
+        for (int i = 0; i < n; i++) {
+            below += d[i] < target;
+        }
+        found = below < n && d[below] == target;
+    }
+    *slot = below;
+    return found;
+}
+
+/**
+ * @brief Inserts an item into a compressed leaf that has room and covers its key.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Compressed leaf node.
+ * @param slot Insertion index returned by delta_find.
+ * @param item Pointer to the item to insert.
+ */
+static void delta_insert(const bptree *tree, bptree_node *leaf, const int slot, void *item) {
+    const int width = leaf->ptr.leaf.delta_width;
+    unsigned char *offsets = delta_offsets(leaf);
+    void **items = leaf->ptr.leaf.items;
+    memmove(&items[slot + 1], &items[slot], (leaf->num_keys - slot) * sizeof(void *));
+    memmove(offsets + (size_t)(slot + 1) * width, offsets + (size_t)slot * width,
+            (size_t)(leaf->num_keys - slot) * width);
+    items[slot] = item;
+    delta_store(leaf, slot,
+                (unsigned long long)tree->int_key(item, tree->udata) -
+                    (unsigned long long)*delta_base(leaf));
+    leaf->num_keys++;
+}
+
+/**
+ * @brief Removes the item in a slot of a compressed leaf.
+ *
+ * The base key stays put, so it may end up below the smallest remaining key.
+ *
+ * @param leaf Compressed leaf node.
+ * @param slot Index of the item to remove.
+ */
+static void delta_remove(bptree_node *leaf, const int slot) {
+    const int width = leaf->ptr.leaf.delta_width;
+    unsigned char *offsets = delta_offsets(leaf);
+    void **items = leaf->ptr.leaf.items;
+    memmove(&items[slot], &items[slot + 1], (leaf->num_keys - slot - 1) * sizeof(void *));
+    memmove(offsets + (size_t)slot * width, offsets + (size_t)(slot + 1) * width,
+            (size_t)(leaf->num_keys - slot - 1) * width);
+    leaf->num_keys--;
+}
+
+/**
+ * @brief Tells whether a dense or compressed leaf may hold more items than its sorted capacity.
+ *
+ * Only a full-size leaf that can be split grows past it; the inline root leaf
+ * and smaller capacity classes move into a larger class through the sorted
+ * layout instead.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Leaf node.
+ * @return true if the leaf may become overfull.
+ */
+static bool leaf_can_grow(const bptree *tree, const bptree_node *leaf) {
+    return leaf_capacity(leaf) >= tree->leaf_max_keys && leaf != &tree->root_leaf;
+}
+
+/**
+ * @brief Switches a packed leaf to the compressed layout if its keys span less than 2^32.
+ *
+ * Does nothing unless the tree has an integer key function and compressed
+ * leaves enabled, or if the leaf is already dense or compressed. The leaf
+ * keeps room for as many offsets as items: with w-byte offsets, a full-size
+ * leaf of capacity c holds (16c - 8) / (8 + w) items on 64-bit targets.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Packed leaf node.
+ */
+static void compress_leaf(const bptree *tree, bptree_node *leaf) {
+    const int n = leaf->num_keys;
+    if (!tree->compressed_leaves || !tree->int_key || n == 0 || leaf->ptr.leaf.dense ||
+        leaf->ptr.leaf.delta_width) {
+        return;
+    }
+    void **items = leaf->ptr.leaf.items;
+    const long long low = tree->int_key(items[0], tree->udata);
+    const unsigned long long span =
+        (unsigned long long)tree->int_key(items[n - 1], tree->udata) - (unsigned long long)low;
+    const int width = span <= UINT8_MAX ? 1 : span <= UINT16_MAX ? 2 : span <= UINT32_MAX ? 4 : 0;
+    if (width == 0) {
+        return;
+    }
+    // The largest room whose base and offsets fit in the slots the items leave free.
+    const size_t slots = 2 * (size_t)leaf_capacity(leaf);
+    int room = (int)((slots * sizeof(void *) - sizeof(long long)) / (sizeof(void *) + width));
+    if (!leaf_can_grow(tree, leaf) && room > leaf_capacity(leaf)) {
+        room = leaf_capacity(leaf);
+    }
+    if (n > room) {
+        return;
+    }
+    const size_t index_bytes = sizeof(long long) + (size_t)room * width;
+    leaf->ptr.leaf.items = memmove(leaf->keys + (index_bytes + sizeof(void *) - 1) / sizeof(void *),
+                                   items, n * sizeof(void *));
+    items = leaf->ptr.leaf.items;
+    *delta_base(leaf) = low;
+    leaf->ptr.leaf.delta_width = width;
+    for (int i = 0; i < n; i++) {
+        delta_store(leaf, i,
+                    (unsigned long long)tree->int_key(items[i], tree->udata) -
+                        (unsigned long long)low);
+    }
+}
+
+/**
+ * @brief Returns how many items a leaf of any layout has room for.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Leaf node.
+ * @return Capacity of the leaf in its current layout.
+ */
+static int leaf_room(const bptree *tree, const bptree_node *leaf) {
+    const int capacity = leaf_capacity(leaf);
+    int room = capacity;
+    if (leaf->ptr.leaf.dense) {
+        room = dense_capacity(tree, leaf);
+    } else if (leaf->ptr.leaf.delta_width) {
+        const int offsets = delta_capacity(leaf, leaf->ptr.leaf.delta_width);
+        room = 2 * capacity - (int)(leaf->ptr.leaf.items - leaf->keys);
+        room = offsets < room ? offsets : room;
+    }
+    if (room > capacity && !leaf_can_grow(tree, leaf)) {
+        room = capacity;
+    }
+    return room;
+}
+
+/**
+ * @brief Rebuilds the index of a dense or compressed leaf after items left it.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Dense or compressed leaf whose base key is still at most its smallest key.
+ */
+static void reindex_leaf(const bptree *tree, bptree_node *leaf) {
+    if (leaf->ptr.leaf.dense) {
+        dense_index(tree, leaf);
+        return;
+    }
+    const unsigned long long base = (unsigned long long)*delta_base(leaf);
+    for (int i = 0; i < leaf->num_keys; i++) {
+        delta_store(leaf, i,
+                    (unsigned long long)tree->int_key(leaf->ptr.leaf.items[i], tree->udata) - base);
+    }
+}
+
+/**
+ * @brief Tells whether a leaf holds more items than the sorted-array layout has room for.
+ *
+ * Only a dense or compressed leaf can; it has to be split before its items
+ * can move to other leaves through the sorted layout.
+ *
+ * @param leaf Leaf node.
+ * @return true if the leaf cannot be switched back to the sorted layout.
+ */
+static bool leaf_overfull(const bptree_node *leaf) {
+    return leaf->num_keys > leaf_capacity(leaf);
+}
+
+/**
+ * @brief Switches a dense or compressed leaf back to the sorted-array layout.
+ *
+ * @param leaf Leaf node holding no more items than its sorted capacity.
+ */
+static void sparsify_leaf(bptree_node *leaf) {
+    if (!leaf->ptr.leaf.dense && !leaf->ptr.leaf.delta_width) {
+        return;
+    }
+    assert(!leaf_overfull(leaf));
+    void **items = leaf->keys + leaf_capacity(leaf);
+    memmove(items, leaf->ptr.leaf.items, leaf->num_keys * sizeof(void *));
+    leaf->ptr.leaf.items = items;
+    memcpy(leaf->keys, items, leaf->num_keys * sizeof(void *));
+    leaf->ptr.leaf.dense = 0;
+    leaf->ptr.leaf.delta_width = 0;
+}
+
+/**
+ * @brief Brings a leaf into the packed sorted-array layout before moving items between leaves.
+ *
+ * @param leaf Leaf node.
+ */
+static void open_leaf(bptree_node *leaf) {
+    pack_leaf(leaf);
+    sparsify_leaf(leaf);
+}
+
+/**
+ * @brief Applies the tree's leaf layout to a packed leaf after its items changed.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Packed leaf node in the sorted-array layout.
+ */
+static void settle_leaf(const bptree *tree, bptree_node *leaf) {
+    spread_leaf(tree, leaf);
+    densify_leaf(tree, leaf);
+    compress_leaf(tree, leaf);
+}
+
+/**
+ * @brief Finds the slot holding a key in a leaf of any layout.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Leaf node to search.
+ * @param key Key to search for.
+ * @param slot Receives the index of the item with the key.
+ * @return true if the key is present in the leaf.
+ */
+static bool leaf_find(const bptree *tree, const bptree_node *leaf, const void *key, int *slot) {
+    if (leaf->ptr.leaf.dense) {
+        return dense_find(tree, leaf, key, slot) > 0;
+    }
+    if (leaf->ptr.leaf.delta_width) {
+        return delta_find(tree, leaf, key, slot) > 0;
+    }
+    int pos = leaf_node_search(tree, leaf->keys, leaf->num_keys, key);
+    if (pos >= leaf->num_keys || tree->compare(key, leaf->keys[pos], tree->udata) != 0) {
+        return false;
+    }
+    // Gaps copy the key of the next item, so the item ends the run of equal keys.
+    while (!leaf->ptr.leaf.items[pos]) {
+        pos++;
+    }
+    *slot = pos;
+    return true;
+}
+
+/**
+ * @brief Returns the first slot of a leaf whose key is not less than a key.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Leaf node of any layout.
+ * @param key Key to search for.
+ * @return Slot index, which may hold a gap or be the leaf's key count.
+ */
+static int leaf_lower_bound(const bptree *tree, const bptree_node *leaf, const void *key) {
+    // Dense and compressed leaves encode their keys, but their items are packed in order.
+    void *const *keys =
+        leaf->ptr.leaf.dense || leaf->ptr.leaf.delta_width ? leaf->ptr.leaf.items : leaf->keys;
+    return binary_search(tree, keys, leaf->num_keys, key);
+}
+
+/**
+ * @brief Replaces the contents of a leaf with a run of sorted items.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Leaf node to fill.
+ * @param items Sorted items to copy into the leaf; may already be the leaf's item slots.
+ * @param count Number of items to copy.
+ */
+static void fill_leaf(const bptree *tree, bptree_node *leaf, void *const *items, const int count) {
+    leaf->ptr.leaf.items = leaf->keys + leaf_capacity(leaf);
+    memmove(leaf->ptr.leaf.items, items, count * sizeof(void *));
+    memcpy(leaf->keys, leaf->ptr.leaf.items, count * sizeof(void *));
+    leaf->num_keys = count;
+    leaf->ptr.leaf.gaps = 0;
+    leaf->ptr.leaf.dense = 0;
+    leaf->ptr.leaf.delta_width = 0;
+    settle_leaf(tree, leaf);
+}
+
+/**
+ * @brief Tells whether a full leaf can share its items with a sibling.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param parent Internal node holding the leaf.
+ * @param pos Index of the leaf in the parent.
+ * @return true if the leaf is in the sorted-array layout and neither sibling
+ *         holds more items than the sorted layout has room for.
+ */
+static bool can_share_leaf(const bptree *tree, const bptree_node *parent, const int pos) {
+    const bptree_node *child = child_at(tree, parent, pos);
+    return !child->ptr.leaf.dense && !child->ptr.leaf.delta_width &&
+           (pos == 0 || !leaf_overfull(child_at(tree, parent, pos - 1))) &&
+           (pos == parent->num_keys || !leaf_overfull(child_at(tree, parent, pos + 1)));
+}
+
+/**
+ * @brief Inserts an item into a full leaf by sharing keys with a sibling (B*-tree style).
+ *
+ * If an adjacent sibling has room, the items of both leaves plus the new item
+ * are spread evenly over the two and the separator between them is updated.
+ * Otherwise the leaf and a full sibling are split into three leaves, each
+ * about two thirds full, and the third leaf is returned for promotion.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param parent Internal node holding the full leaf; must have at least two children.
+ * @param pos Index of the full leaf in the parent; see can_share_leaf.
+ * @param item Pointer to the item to insert.
+ * @param key_pos Receives the parent key index at which a promoted key must be inserted.
+ * @return Structure containing information about a potential key promotion and status.
+ */
+static insert_result insert_full_leaf(bptree *tree, bptree_node *parent, const int pos,
+                                      void *item, int *key_pos) {
+    insert_result result = {{NULL}, NULL, BPTREE_ERROR};
+    tree->version++;
+    bptree_node *child = child_at(tree, parent, pos);
+    const int slot = leaf_node_search(tree, child->keys, child->num_keys, item);
+    if (slot < child->num_keys && tree->compare(item, child->keys[slot], tree->udata) == 0) {
+        result.status = BPTREE_DUPLICATE;
+        return result;
+    }
+    const int max_keys = tree->leaf_max_keys;
+    const bptree_node *left = pos > 0 ? child_at(tree, parent, pos - 1) : NULL;
+    const bptree_node *right = pos < parent->num_keys ? child_at(tree, parent, pos + 1) : NULL;
+    int first;
+    if (left && live_keys(left) < max_keys && (!right || live_keys(left) <= live_keys(right))) {
+        first = pos - 1;
+    } else if (right) {
+        first = pos;
+    } else {
+        first = pos - 1;
+    }
+    bptree_node *a = child_at(tree, parent, first);
+    bptree_node *b = child_at(tree, parent, first + 1);
+    open_leaf(a);
+    open_leaf(b);
+    mark_stale(a);
+    mark_stale(b);
+    const int total = a->num_keys + b->num_keys + 1;
+    void **temp = scratch_buffer(tree);
+    if (!temp) {
+        return result;
+    }
+    const int at = (child == a ? 0 : a->num_keys) + slot;
+    memcpy(temp, a->ptr.leaf.items, a->num_keys * sizeof(void *));
+    memcpy(&temp[a->num_keys], b->ptr.leaf.items, b->num_keys * sizeof(void *));
+    memmove(&temp[at + 1], &temp[at], (total - 1 - at) * sizeof(void *));
+    temp[at] = item;
+    if (a->num_keys < max_keys || b->num_keys < max_keys) {
+        const int n_a = total / 2;
+        if (reserve_node(tree, a, n_a) != BPTREE_OK ||
+            reserve_node(tree, b, total - n_a) != BPTREE_OK) {
+            settle_leaf(tree, a);
+            settle_leaf(tree, b);
+            result.status = BPTREE_ALLOCATION_ERROR;
+            return result;
+        }
+        fill_leaf(tree, a, temp, n_a);
+        fill_leaf(tree, b, &temp[n_a], total - n_a);
+        set_separator(tree, parent, first, temp[n_a - 1], temp[n_a]);
+    } else {
+        const int n_a = total / 3;
+        const int n_b = (total - n_a) / 2;
+        bptree_node *c = create_leaf_after(tree, b, total - n_a - n_b);
+        if (!c) {
+            return result;
+        }
+        fill_leaf(tree, a, temp, n_a);
+        fill_leaf(tree, b, &temp[n_a], n_b);
+        fill_leaf(tree, c, &temp[n_a + n_b], total - n_a - n_b);
+        c->ptr.leaf.next = b->ptr.leaf.next;
+        set_next_leaf(tree, b, c);
+        set_separator(tree, parent, first, temp[n_a - 1], temp[n_a]);
+        make_separator(tree, &result.promoted, temp[n_a + n_b - 1], temp[n_a + n_b]);
+        result.new_child = c;
+        *key_pos = first + 1;
+    }
+    result.status = BPTREE_OK;
+    return result;
+}
+
+/**
+ * @brief Moves a full root leaf into a separately allocated leaf with more room.
+ *
+ * A small root leaf doubles in capacity, up to leaf_max_keys. A root leaf that
+ * is stored inside the tree structure is moved out before it can be split,
+ * since it cannot become a child of another node. A root leaf with detached
+ * arrays is resized in place.
+ *
+ * @param tree Pointer to the B+Tree whose root is a leaf.
+ * @return BPTREE_OK on success, or BPTREE_ALLOCATION_ERROR on failure.
+ */
+static bptree_status grow_root_leaf(bptree *tree) {
+    bptree_node *old = tree->root;
+    int capacity = leaf_capacity(old) * 2;
+#ifdef BPTREE_NODE_HANDLES
+    // Slab slots are sized for full leaves, so a smaller capacity would not save memory.
+    capacity = tree->leaf_max_keys;
+#endif
+    if (old->detached) {
+        return resize_node(tree, old, capacity_class(tree->leaf_max_keys, capacity));
+    }
+    bptree_node *leaf;
+    if (capacity >= tree->leaf_max_keys || tree->variable_capacity ||
+        slab_has_room(tree->reserve[1])) {
+        leaf = create_leaf(tree, capacity);
+    } else {
+        leaf = tree->malloc_fn(sizeof(bptree_node) + 2 * (size_t)capacity * sizeof(void *));
+        if (leaf) {
+            leaf->slab = NULL;
+            init_node(tree, leaf, 1, (void **)(leaf + 1), capacity);
+        }
+    }
+    if (!leaf) {
+        BPTREE_LOG_DEBUG(tree, "Allocation failure while growing the root leaf");
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    open_leaf(old);
+    memcpy(leaf->keys, old->keys, old->num_keys * sizeof(void *));
+    memcpy(leaf->ptr.leaf.items, old->ptr.leaf.items, old->num_keys * sizeof(void *));
+    leaf->num_keys = old->num_keys;
+    release_node(tree, old);
+    tree->root = leaf;
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Splits a full leaf in two around a new item.
+ *
+ * A full leaf has no gaps, so its items double as its keys. This also holds
+ * for a dense or compressed leaf with more items than its sorted layout has
+ * room for; both halves fit the sorted layout again.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Full leaf node.
+ * @param pos Index at which the item goes among the leaf's items.
+ * @param item Pointer to the item to insert.
+ * @return Structure containing the promoted key, the new leaf, and status.
+ */
+static insert_result split_leaf(bptree *tree, bptree_node *node, const int pos, void *item) {
+    insert_result result = {{NULL}, NULL, BPTREE_ERROR};
+    const int total = node->num_keys + 1;
+    const int split = total / 2;
+    void **temp = scratch_buffer(tree);
+    if (!temp) {
+        return result;
+    }
+    memcpy(temp, node->ptr.leaf.items, pos * sizeof(void *));
+    temp[pos] = item;
+    memcpy(&temp[pos + 1], &node->ptr.leaf.items[pos], (node->num_keys - pos) * sizeof(void *));
+    bptree_node *new_leaf = create_leaf_after(tree, node, total - split);
+    if (!new_leaf) {
+        return result;
+    }
+    node->ptr.leaf.items = node->keys + leaf_capacity(node);
+    node->ptr.leaf.dense = 0;
+    node->ptr.leaf.delta_width = 0;
+    node->num_keys = split;
+    memcpy(node->keys, temp, split * sizeof(void *));
+    memcpy(node->ptr.leaf.items, temp, split * sizeof(void *));
+    if (tree->variable_capacity) {
+        trim_node(tree, node);
+    }
+    new_leaf->num_keys = total - split;
+    memcpy(new_leaf->keys, &temp[split], (total - split) * sizeof(void *));
+    memcpy(new_leaf->ptr.leaf.items, &temp[split], (total - split) * sizeof(void *));
+    new_leaf->ptr.leaf.next = node->ptr.leaf.next;
+    set_next_leaf(tree, node, new_leaf);
+    make_separator(tree, &result.promoted, temp[split - 1], temp[split]);
+    result.new_child = new_leaf;
+    result.status = BPTREE_OK;
+    settle_leaf(tree, node);
+    settle_leaf(tree, new_leaf);
+    return result;
+}
+
+/**
+ * @brief Recursively inserts an item into the B+Tree.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Current node in the recursion.
+ * @param item Pointer to the item to insert.
+ * @return Structure containing information about a potential key promotion and status.
+ */
+static insert_result insert_recursive(bptree *tree, bptree_node *node, void *item) {
+    insert_result result = {{NULL}, NULL, BPTREE_ERROR};
+    mark_stale(node);
+    if (node->is_leaf) {
+        if (node->ptr.leaf.dense || node->ptr.leaf.delta_width) {
+            int slot;
+            const int found = node->ptr.leaf.dense ? dense_find(tree, node, item, &slot)
+                                                   : delta_find(tree, node, item, &slot);
+            if (found > 0) {
+                result.status = BPTREE_DUPLICATE;
+                return result;
+            }
+            if (found == 0 && node->num_keys < leaf_room(tree, node)) {
+                if (node->ptr.leaf.dense) {
+                    dense_insert(tree, node, slot, item);
+                } else {
+                    delta_insert(tree, node, slot, item);
+                }
+                result.status = BPTREE_OK;
+                return result;
+            }
+            if (leaf_overfull(node)) {
+                return split_leaf(tree, node, leaf_lower_bound(tree, node, item), item);
+            }
+            sparsify_leaf(node);
+        }
+        const int pos = leaf_node_search(tree, node->keys, node->num_keys, item);
+        if (pos < node->num_keys && tree->compare(item, node->keys[pos], tree->udata) == 0) {
+            result.status = BPTREE_DUPLICATE;
+            return result;
+        }
+        if (tree->gapped_leaves && live_keys(node) < leaf_capacity(node)) {
+            gapped_leaf_insert(node, pos, item);
+            result.status = BPTREE_OK;
+            return result;
+        }
+        if (node->num_keys < leaf_capacity(node)) {
+            memmove(&node->keys[pos + 1], &node->keys[pos],
+                    (node->num_keys - pos) * sizeof(void *));
+            memmove(&node->ptr.leaf.items[pos + 1], &node->ptr.leaf.items[pos],
+                    (node->num_keys - pos) * sizeof(void *));
+            node->keys[pos] = item;
+            node->ptr.leaf.items[pos] = item;
+            node->num_keys++;
+            // Re-encode a leaf that left the compressed layout for a key out of its range.
+            compress_leaf(tree, node);
+            result.status = BPTREE_OK;
+            return result;
+        }
+        if (node == &tree->root_leaf || leaf_capacity(node) < tree->leaf_max_keys) {
+            // A leaf below full capacity moves into a larger class instead of splitting.
+            if (node == tree->root) {
+                result.status = grow_root_leaf(tree);
+                node = tree->root;
+            } else {
+                result.status = resize_node(
+                    tree, node, capacity_class(tree->leaf_max_keys, leaf_capacity(node) + 1));
+            }
+            return result.status == BPTREE_OK ? insert_recursive(tree, node, item) : result;
+        }
+        return split_leaf(tree, node, pos, item);
+    }
+    const int pos = internal_node_search(tree, node, item);
+    const bptree_node *child = child_at(tree, node, pos);
+    int key_pos = pos;
+    const insert_result child_result =
+        tree->overflow_policy == BPTREE_OVERFLOW_REDISTRIBUTE && child->is_leaf &&
+                live_keys(child) == tree->leaf_max_keys && node->num_keys > 0 &&
+                can_share_leaf(tree, node, pos)
+            ? insert_full_leaf(tree, node, pos, item, &key_pos)
+            : insert_recursive(tree, child_at(tree, node, pos), item);
+    if (child_result.status == BPTREE_DUPLICATE) {
+        return child_result;
+    }
+    if (child_result.status != BPTREE_OK) {
+        return child_result;
+    }
+    if (child_result.new_child == NULL) {
+        return child_result;
+    }
+    if (node->num_keys < tree->internal_max_keys) {
+        result.status = reserve_node(tree, node, node->num_keys + 1);
+        if (result.status != BPTREE_OK) {
+            return result;
+        }
+        copy_keys(tree, node, key_pos + 1, node, key_pos, node->num_keys - key_pos);
+        memmove(&node->ptr.internal.children[key_pos + 2],
+                &node->ptr.internal.children[key_pos + 1],
+                (node->num_keys - key_pos) * sizeof(bptree_ref));
+        set_key(tree, node, key_pos, &child_result.promoted);
+        set_child_at(tree, node, key_pos + 1, child_result.new_child);
+        node->num_keys++;
+        result.status = BPTREE_OK;
+        return result;
+    }
+    return split_internal(tree, node, &child_result.promoted, child_result.new_child, key_pos);
+}
+
+inline bptree_status bptree_put(bptree *tree, void *item) {
+    const insert_result result = insert_recursive(tree, tree->root, item);
+    if (result.status == BPTREE_DUPLICATE) {
+        return BPTREE_DUPLICATE;
+    }
+    if (result.status != BPTREE_OK) {
+        return result.status;
+    }
+    if (result.new_child == NULL) {
+        tree->count++;
+        return BPTREE_OK;
+    }
+    bptree_node *new_root = create_internal(tree, 1);
+    if (!new_root) {
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    new_root->num_keys = 1;
+    set_key(tree, new_root, 0, &result.promoted);
+    set_child_at(tree, new_root, 0, tree->root);
+    set_child_at(tree, new_root, 1, result.new_child);
+    tree->root = new_root;
+    tree->height++;
+    tree->count++;
+    return BPTREE_OK;
+}
+
+inline void *bptree_get(const bptree *tree, const void *key) {
+    const bptree_node *node = tree->root;
+    while (!node->is_leaf) {
+        const int pos = internal_node_search(tree, node, key);
+        node = child_at(tree, node, pos);
+    }
+    int pos;
+    return leaf_find(tree, node, key, &pos) ? node->ptr.leaf.items[pos] : NULL;
+}
+
+/* Structure used during deletion and by cursors to track traversal */
+typedef struct {
+    bptree_node *node; /**< Current node in deletion stack. */
+    int pos;           /**< Position of the child pointer in the parent node. */
+} delete_stack_item;
+
+/**
+ * @brief Returns the minimum number of keys a non-root node must hold.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node to check.
+ * @return Minimum key count for the node kind.
+ */
+static int node_min_keys(const bptree *tree, const bptree_node *node) {
+    return node->is_leaf ? tree->leaf_min_keys : tree->internal_min_keys;
+}
+
+/**
+ * @brief Moves items from a leaf holding more than its sorted layout allows into its sibling.
+ *
+ * The overfull leaf keeps its dense or compressed layout and gives up the
+ * items next to the sibling, at most as many as a full sorted leaf holds.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param parent Parent of both leaves.
+ * @param index Index of the separator between the leaves in the parent.
+ * @param left Left leaf of the pair.
+ * @param right Right leaf of the pair; exactly one of the two is overfull.
+ * @return BPTREE_OK on success, or BPTREE_ALLOCATION_ERROR if the sibling could not grow.
+ */
+static bptree_status borrow_from_overfull(bptree *tree, bptree_node *parent, const int index,
+                                          bptree_node *left, bptree_node *right) {
+    const bool from_left = leaf_overfull(left);
+    bptree_node *giver = from_left ? left : right;
+    bptree_node *taker = from_left ? right : left;
+    open_leaf(taker);
+    int k = (giver->num_keys - taker->num_keys) / 2;
+    if (taker->num_keys + k > tree->leaf_max_keys) {
+        k = tree->leaf_max_keys - taker->num_keys;
+    }
+    if (reserve_node(tree, taker, taker->num_keys + k) != BPTREE_OK) {
+        settle_leaf(tree, taker);
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    void **items = giver->ptr.leaf.items;
+    const int n = taker->num_keys;
+    if (from_left) {
+        memmove(&taker->keys[k], taker->keys, n * sizeof(void *));
+        memmove(&taker->ptr.leaf.items[k], taker->ptr.leaf.items, n * sizeof(void *));
+        memcpy(taker->keys, &items[giver->num_keys - k], k * sizeof(void *));
+        memcpy(taker->ptr.leaf.items, &items[giver->num_keys - k], k * sizeof(void *));
+    } else {
+        memcpy(&taker->keys[n], items, k * sizeof(void *));
+        memcpy(&taker->ptr.leaf.items[n], items, k * sizeof(void *));
+        memmove(items, &items[k], (giver->num_keys - k) * sizeof(void *));
+    }
+    giver->num_keys -= k;
+    taker->num_keys += k;
+    reindex_leaf(tree, giver);
+    set_separator(tree, parent, index, left->ptr.leaf.items[left->num_keys - 1],
+                  right->ptr.leaf.items[0]);
+    settle_leaf(tree, taker);
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Moves keys from the left sibling into an underflowing child.
+ *
+ * Half of the surplus is moved, so both nodes end up roughly equally full and
+ * the next few removals from the child do not trigger another rebalance.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param parent Parent of both nodes.
+ * @param index Index of the child in the parent.
+ * @param left Left sibling of the child.
+ * @param child Underflowing child.
+ * @return BPTREE_OK on success, or BPTREE_ALLOCATION_ERROR if the child could not grow.
+ */
+static bptree_status redistribute_from_left(bptree *tree, bptree_node *parent, const int index,
+                                            bptree_node *left, bptree_node *child) {
+    tree->version++;
+    mark_stale(left);
+    if (child->is_leaf && leaf_overfull(left)) {
+        return borrow_from_overfull(tree, parent, index - 1, left, child);
+    }
+    if (child->is_leaf) {
+        open_leaf(left);
+        open_leaf(child);
+    }
+    const int k = (left->num_keys - child->num_keys) / 2;
+    if (reserve_node(tree, child, child->num_keys + k) != BPTREE_OK) {
+        if (child->is_leaf) {
+            settle_leaf(tree, left);
+            settle_leaf(tree, child);
+        }
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    if (child->is_leaf) {
+        memmove(&child->keys[k], child->keys, child->num_keys * sizeof(void *));
+        memmove(&child->ptr.leaf.items[k], child->ptr.leaf.items,
+                child->num_keys * sizeof(void *));
+        memcpy(child->keys, &left->keys[left->num_keys - k], k * sizeof(void *));
+        memcpy(child->ptr.leaf.items, &left->ptr.leaf.items[left->num_keys - k],
+               k * sizeof(void *));
+        set_separator(tree, parent, index - 1, left->ptr.leaf.items[left->num_keys - k - 1],
+                      child->ptr.leaf.items[0]);
+    } else {
+        copy_keys(tree, child, k, child, 0, child->num_keys);
+        memmove(&child->ptr.internal.children[k], child->ptr.internal.children,
+                (child->num_keys + 1) * sizeof(bptree_ref));
+        copy_keys(tree, child, k - 1, parent, index - 1, 1);
+        copy_keys(tree, child, 0, left, left->num_keys - k + 1, k - 1);
+        memcpy(child->ptr.internal.children, &left->ptr.internal.children[left->num_keys - k + 1],
+               k * sizeof(bptree_ref));
+        copy_keys(tree, parent, index - 1, left, left->num_keys - k, 1);
+    }
+    left->num_keys -= k;
+    child->num_keys += k;
+    if (child->is_leaf) {
+        settle_leaf(tree, left);
+        settle_leaf(tree, child);
+    }
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Moves keys from the right sibling into an underflowing child.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param parent Parent of both nodes.
+ * @param index Index of the child in the parent.
+ * @param child Underflowing child.
+ * @param right Right sibling of the child.
+ * @return BPTREE_OK on success, or BPTREE_ALLOCATION_ERROR if the child could not grow.
+ */
+static bptree_status redistribute_from_right(bptree *tree, bptree_node *parent, const int index,
+                                             bptree_node *child, bptree_node *right) {
+    tree->version++;
+    mark_stale(right);
+    if (child->is_leaf && leaf_overfull(right)) {
+        return borrow_from_overfull(tree, parent, index, child, right);
+    }
+    if (child->is_leaf) {
+        open_leaf(child);
+        open_leaf(right);
+    }
+    const int k = (right->num_keys - child->num_keys) / 2;
+    if (reserve_node(tree, child, child->num_keys + k) != BPTREE_OK) {
+        if (child->is_leaf) {
+            settle_leaf(tree, child);
+            settle_leaf(tree, right);
+        }
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    if (child->is_leaf) {
+        memcpy(&child->keys[child->num_keys], right->keys, k * sizeof(void *));
+        memcpy(&child->ptr.leaf.items[child->num_keys], right->ptr.leaf.items,
+               k * sizeof(void *));
+        memmove(right->keys, &right->keys[k], (right->num_keys - k) * sizeof(void *));
+        memmove(right->ptr.leaf.items, &right->ptr.leaf.items[k],
+                (right->num_keys - k) * sizeof(void *));
+        set_separator(tree, parent, index, child->ptr.leaf.items[child->num_keys + k - 1],
+                      right->ptr.leaf.items[0]);
+    } else {
+        copy_keys(tree, child, child->num_keys, parent, index, 1);
+        copy_keys(tree, child, child->num_keys + 1, right, 0, k - 1);
+        memcpy(&child->ptr.internal.children[child->num_keys + 1], right->ptr.internal.children,
+               k * sizeof(bptree_ref));
+        copy_keys(tree, parent, index, right, k - 1, 1);
+        copy_keys(tree, right, 0, right, k, right->num_keys - k);
+        memmove(right->ptr.internal.children, &right->ptr.internal.children[k],
+                (right->num_keys - k + 1) * sizeof(bptree_ref));
+    }
+    right->num_keys -= k;
+    child->num_keys += k;
+    if (child->is_leaf) {
+        settle_leaf(tree, child);
+        settle_leaf(tree, right);
+    }
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Merges a child with its right sibling and removes the separator from the parent.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param parent Parent of both nodes.
+ * @param index Index of the left node of the pair in the parent.
+ * @return BPTREE_OK on success, or BPTREE_ALLOCATION_ERROR if the left node could not grow.
+ */
+static bptree_status merge_children(bptree *tree, bptree_node *parent, const int index) {
+    bptree_node *left = child_at(tree, parent, index);
+    bptree_node *right = child_at(tree, parent, index + 1);
+    mark_stale(left);
+    if (left->is_leaf) {
+        open_leaf(left);
+        open_leaf(right);
+    }
+    if (reserve_node(tree, left, left->num_keys + right->num_keys + !left->is_leaf) !=
+        BPTREE_OK) {
+        if (left->is_leaf) {
+            settle_leaf(tree, left);
+            settle_leaf(tree, right);
+        }
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    if (left->is_leaf) {
+        memcpy(&left->keys[left->num_keys], right->keys, right->num_keys * sizeof(void *));
+        memcpy(&left->ptr.leaf.items[left->num_keys], right->ptr.leaf.items,
+               right->num_keys * sizeof(void *));
+        left->num_keys += right->num_keys;
+        left->ptr.leaf.next = right->ptr.leaf.next;
+        settle_leaf(tree, left);
+    } else {
+        copy_keys(tree, left, left->num_keys, parent, index, 1);
+        left->num_keys++;
+        copy_keys(tree, left, left->num_keys, right, 0, right->num_keys);
+        memcpy(&left->ptr.internal.children[left->num_keys], right->ptr.internal.children,
+               (right->num_keys + 1) * sizeof(bptree_ref));
+        left->num_keys += right->num_keys;
+    }
+    copy_keys(tree, parent, index, parent, index + 1, parent->num_keys - index - 1);
+    memmove(&parent->ptr.internal.children[index + 1], &parent->ptr.internal.children[index + 2],
+            (parent->num_keys - index - 1) * sizeof(bptree_ref));
+    parent->num_keys--;
+    release_node(tree, right);
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Moves a detached node that dropped to a quarter of its capacity into a smaller class.
+ *
+ * The capacity is halved rather than trimmed to fit, so a few insertions do
+ * not immediately move the node back up.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Node to check.
+ */
+static void shrink_node(bptree *tree, bptree_node *node) {
+    const int capacity = node_capacity(tree, node);
+    if (!node->detached || capacity <= BPTREE_MIN_CAPACITY_CLASS ||
+        live_keys(node) > capacity / 4) {
+        return;
+    }
+    if (node->is_leaf) {
+        open_leaf(node);
+    }
+    (void)resize_node(tree, node, capacity_class(node_max_keys(tree, node), capacity / 2));
+    if (node->is_leaf) {
+        settle_leaf(tree, node);
+    }
+}
+
+/**
+ * @brief Marks the hashes of the nodes on a path from the root to a leaf as stale.
+ *
+ * @param path Internal nodes from the root down to the leaf's parent.
+ * @param depth Number of entries in the path.
+ * @param leaf Leaf at the end of the path.
+ */
+static void mark_path_stale(const delete_stack_item *path, const int depth, bptree_node *leaf) {
+    for (int d = 0; d < depth; d++) {
+        mark_stale(path[d].node);
+    }
+    mark_stale(leaf);
+}
+
+/**
+ * @brief Rebalances the nodes on a path after an item was removed from its leaf.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param stack Internal nodes from the root down to the leaf's parent, with
+ *        the index of the child taken in each.
+ * @param depth Number of entries in the stack.
+ * @param leaf Leaf the item was removed from.
+ */
+static void rebalance_path(bptree *tree, const delete_stack_item *stack, int depth,
+                           bptree_node *leaf) {
+    mark_path_stale(stack, depth, leaf);
+    bptree_node *child = leaf;
+    while (depth > 0 && live_keys(child) < node_min_keys(tree, child)) {
+        depth--;
+        bptree_node *parent = stack[depth].node;
+        const int child_index = stack[depth].pos;
+        bptree_node *left = child_index > 0 ? child_at(tree, parent, child_index - 1) : NULL;
+        bptree_node *right =
+            child_index < parent->num_keys ? child_at(tree, parent, child_index + 1) : NULL;
+        BPTREE_LOG_DEBUG(tree,
+                         "Iterative deletion at depth %d: parent num_keys=%d, child index=%d "
+                         "(is_leaf=%d, num_keys=%d)",
+                         depth, parent->num_keys, child_index, child->is_leaf, live_keys(child));
+        const int min_keys = node_min_keys(tree, child);
+        // If a node cannot grow to take the keys, the child is left underfull but valid.
+        if (left && live_keys(left) > min_keys) {
+            redistribute_from_left(tree, parent, child_index, left, child);
+            break;
+        }
+        if (right && live_keys(right) > min_keys) {
+            redistribute_from_right(tree, parent, child_index, child, right);
+            break;
+        }
+        bptree_status merged = BPTREE_ERROR;
+        if (left) {
+            BPTREE_LOG_DEBUG(tree, "Merging child index %d with left sibling", child_index);
+            merged = merge_children(tree, parent, child_index - 1);
+        } else if (right) {
+            BPTREE_LOG_DEBUG(tree, "Merging child index %d with right sibling", child_index);
+            merged = merge_children(tree, parent, child_index);
+        }
+        if (merged != BPTREE_OK) {
+            break;
+        }
+        child = parent;
+    }
+    shrink_node(tree, child);
+    while (tree->root->num_keys == 0 && !tree->root->is_leaf) {
+        bptree_node *old_root = tree->root;
+        tree->root = child_at(tree, tree->root, 0);
+        release_node(tree, old_root);
+        tree->height--;
+    }
+}
+
+/**
+ * @brief Removes the item in a slot of a leaf of any layout, without rebalancing.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param leaf Leaf node.
+ * @param pos Slot of the item, as found by leaf_find.
+ */
+static void leaf_remove(const bptree *tree, bptree_node *leaf, const int pos) {
+    if (leaf->ptr.leaf.dense) {
+        dense_remove(tree, leaf, pos);
+    } else if (leaf->ptr.leaf.delta_width) {
+        delta_remove(leaf, pos);
+    } else if (tree->gapped_leaves) {
+        gapped_leaf_remove(leaf, pos);
+    } else {
+        memmove(&leaf->ptr.leaf.items[pos], &leaf->ptr.leaf.items[pos + 1],
+                (leaf->num_keys - pos - 1) * sizeof(void *));
+        memmove(&leaf->keys[pos], &leaf->keys[pos + 1],
+                (leaf->num_keys - pos - 1) * sizeof(void *));
+        leaf->num_keys--;
+    }
+}
+
+inline bptree_status bptree_remove(bptree *tree, const void *key) {
+    if (tree == NULL || tree->root == NULL) {
+        return BPTREE_ERROR;
+    }
+    const int INITIAL_STACK_CAPACITY = 16;
+    int stack_capacity = INITIAL_STACK_CAPACITY;
+    int depth = 0;
+    delete_stack_item *stack = tree->malloc_fn(stack_capacity * sizeof(delete_stack_item));
+    if (stack == NULL) {
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    bptree_node *node = tree->root;
+    while (!node->is_leaf) {
+        const int pos = internal_node_search(tree, node, key);
+        if (depth >= stack_capacity) {
+            const int new_capacity = stack_capacity * 2;
+            delete_stack_item *new_stack =
+                tree->malloc_fn(new_capacity * sizeof(delete_stack_item));
+            if (new_stack == NULL) {
+                tree->free_fn(stack);
+                return BPTREE_ALLOCATION_ERROR;
+            }
+            memcpy(new_stack, stack, depth * sizeof(delete_stack_item));
+            tree->free_fn(stack);
+            stack = new_stack;
+            stack_capacity = new_capacity;
+        }
+        stack[depth].node = node;
+        stack[depth].pos = pos;
+        depth++;
+        node = child_at(tree, node, pos);
+    }
+    int pos;
+    if (!leaf_find(tree, node, key, &pos)) {
+        tree->free_fn(stack);
+        return BPTREE_NOT_FOUND;
+    }
+    leaf_remove(tree, node, pos);
+    rebalance_path(tree, stack, depth, node);
+    tree->count--;
+    tree->free_fn(stack);
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Finds the leaf for a key, directly if a hint covers it, and updates the hint.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param key Key to locate.
+ * @param hint Caller-owned hint.
+ * @return Leaf whose key range holds the key.
+ */
+static bptree_node *hinted_leaf(const bptree *tree, const void *key, bptree_hint *hint) {
+    if (hint->leaf && hint->tree == tree && hint->version == tree->version &&
+        (!hint->low_node || compare_to_key(tree, key, hint->low_node, hint->low_index) >= 0) &&
+        (!hint->high_node || compare_to_key(tree, key, hint->high_node, hint->high_index) < 0)) {
+        return hint->leaf;
+    }
+    // The deepest separators passed on either side of the key are the leaf's fences.
+    hint->low_node = NULL;
+    hint->high_node = NULL;
+    bptree_node *node = tree->root;
+    while (!node->is_leaf) {
+        const int pos = internal_node_search(tree, node, key);
+        if (pos > 0) {
+            hint->low_node = node;
+            hint->low_index = pos - 1;
+        }
+        if (pos < node->num_keys) {
+            hint->high_node = node;
+            hint->high_index = pos;
+        }
+        node = child_at(tree, node, pos);
+    }
+    hint->tree = tree;
+    hint->leaf = node;
+    hint->version = tree->version;
+    return node;
+}
+
+inline void *bptree_get_hinted(const bptree *tree, const void *key, bptree_hint *hint) {
+    if (tree == NULL || hint == NULL) {
+        return tree ? bptree_get(tree, key) : NULL;
+    }
+    const bptree_node *leaf = hinted_leaf(tree, key, hint);
+    int pos;
+    return leaf_find(tree, leaf, key, &pos) ? leaf->ptr.leaf.items[pos] : NULL;
+}
+
+inline bptree_status bptree_put_hinted(bptree *tree, void *item, bptree_hint *hint) {
+    if (tree == NULL || hint == NULL) {
+        return tree ? bptree_put(tree, item) : BPTREE_ERROR;
+    }
+    bptree_node *leaf = hinted_leaf(tree, item, hint);
+    // With a free slot the leaf takes the item in place, so no ancestor changes unless
+    // the ancestors' hashes have to be marked stale.
+    const int capacity = leaf_capacity(leaf);
+    if (!tree->hash && live_keys(leaf) < capacity &&
+        (tree->gapped_leaves || leaf->num_keys < capacity)) {
+        const insert_result result = insert_recursive(tree, leaf, item);
+        if (result.status == BPTREE_OK) {
+            tree->count++;
+        }
+        return result.status;
+    }
+    return bptree_put(tree, item);
+}
+
+inline bptree_status bptree_remove_hinted(bptree *tree, const void *key, bptree_hint *hint) {
+    if (tree == NULL || hint == NULL) {
+        return tree ? bptree_remove(tree, key) : BPTREE_ERROR;
+    }
+    bptree_node *leaf = hinted_leaf(tree, key, hint);
+    int pos;
+    if (!leaf_find(tree, leaf, key, &pos)) {
+        return BPTREE_NOT_FOUND;
+    }
+    if (tree->hash || (leaf != tree->root && live_keys(leaf) <= tree->leaf_min_keys)) {
+        return bptree_remove(tree, key);
+    }
+    leaf_remove(tree, leaf, pos);
+    shrink_node(tree, leaf);
+    tree->count--;
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Returns the leftmost or rightmost leaf, descending only if nodes changed since last time.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param side 0 for the leftmost leaf, 1 for the rightmost leaf.
+ * @return Pointer to the leaf.
+ */
+static bptree_node *edge_leaf(bptree *tree, const int side) {
+    if (!tree->edge_leaves[0] || tree->edge_version != tree->version) {
+        for (int s = 0; s < 2; s++) {
+            bptree_node *node = tree->root;
+            while (!node->is_leaf) {
+                node = child_at(tree, node, s ? node->num_keys : 0);
+            }
+            tree->edge_leaves[s] = node;
+        }
+        tree->edge_version = tree->version;
+    }
+    return tree->edge_leaves[side];
+}
+
+/**
+ * @brief Finds the slot of the first or last item of a leaf.
+ *
+ * @param leaf Leaf node of any layout.
+ * @param side 0 for the first item, 1 for the last item.
+ * @return Slot index, or -1 if the leaf is empty.
+ */
+static int edge_slot(const bptree_node *leaf, const int side) {
+    void *const *items = leaf->ptr.leaf.items;
+    if (side) {
+        int i = leaf->num_keys - 1;
+        while (i >= 0 && !items[i]) {
+            i--;
+        }
+        return i;
+    }
+    for (int i = 0; i < leaf->num_keys; i++) {
+        if (items[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Removes the first or last item of the tree.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param side 0 for the smallest item, 1 for the largest item.
+ * @param item Receives the removed item.
+ * @return Status code indicating the result of the operation.
+ */
+static bptree_status pop_edge(bptree *tree, const int side, void **item) {
+    bptree_node *leaf = edge_leaf(tree, side);
+    const int pos = edge_slot(leaf, side);
+    if (pos < 0) {
+        return BPTREE_NOT_FOUND;
+    }
+    *item = leaf->ptr.leaf.items[pos];
+    // The path is needed to mark the hashes of the ancestors stale, if any.
+    if (!tree->hash && (leaf == tree->root || live_keys(leaf) > tree->leaf_min_keys)) {
+        leaf_remove(tree, leaf, pos);
+        shrink_node(tree, leaf);
+        tree->count--;
+        return BPTREE_OK;
+    }
+    delete_stack_item *stack = tree->malloc_fn((size_t)tree->height * sizeof(delete_stack_item));
+    if (stack == NULL) {
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    int depth = 0;
+    for (bptree_node *node = tree->root; !node->is_leaf; depth++) {
+        stack[depth].node = node;
+        stack[depth].pos = side ? node->num_keys : 0;
+        node = child_at(tree, node, stack[depth].pos);
+    }
+    leaf_remove(tree, leaf, pos);
+    rebalance_path(tree, stack, depth, leaf);
+    tree->count--;
+    tree->free_fn(stack);
+    return BPTREE_OK;
+}
+
+inline void *bptree_min(const bptree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    // Only the edge leaf cache is written, never the items or nodes.
+    const bptree_node *leaf = edge_leaf((bptree *)tree, 0);
+    const int pos = edge_slot(leaf, 0);
+    return pos < 0 ? NULL : leaf->ptr.leaf.items[pos];
+}
+
+inline void *bptree_max(const bptree *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    // Only the edge leaf cache is written, never the items or nodes.
+    const bptree_node *leaf = edge_leaf((bptree *)tree, 1);
+    const int pos = edge_slot(leaf, 1);
+    return pos < 0 ? NULL : leaf->ptr.leaf.items[pos];
+}
+
+inline bptree_status bptree_pop_min(bptree *tree, void **item) {
+    if (tree == NULL || item == NULL) {
+        return BPTREE_ERROR;
+    }
+    return pop_edge(tree, 0, item);
+}
+
+inline bptree_status bptree_pop_max(bptree *tree, void **item) {
+    if (tree == NULL || item == NULL) {
+        return BPTREE_ERROR;
+    }
+    return pop_edge(tree, 1, item);
+}
+
+inline bptree_status bptree_set_min_fill(bptree *tree, const int min_fill_percent) {
+    if (tree == NULL || min_fill_percent < 0 || min_fill_percent > 50) {
+        return BPTREE_ERROR;
+    }
+    const int leaf_min = (tree->leaf_max_keys * min_fill_percent + 99) / 100;
+    const int internal_min = tree->internal_max_keys * min_fill_percent / 100;
+    tree->leaf_min_keys = leaf_min > 1 ? leaf_min : 1;
+    tree->internal_min_keys = internal_min > 1 ? internal_min : 1;
+    BPTREE_LOG_DEBUG(tree, "Min fill set to %d%% (leaf_min_keys=%d, internal_min_keys=%d)",
+                     min_fill_percent, tree->leaf_min_keys, tree->internal_min_keys);
+    return BPTREE_OK;
+}
+
+inline bptree_status bptree_set_min_keys(bptree *tree, const int leaf_min_keys,
+                                         const int internal_min_keys) {
+    if (tree == NULL || leaf_min_keys < 1 || leaf_min_keys > (tree->leaf_max_keys + 1) / 2 ||
+        internal_min_keys < 1 || internal_min_keys > tree->internal_max_keys / 2) {
+        return BPTREE_ERROR;
+    }
+    tree->leaf_min_keys = leaf_min_keys;
+    tree->internal_min_keys = internal_min_keys;
+    return BPTREE_OK;
+}
+
+inline bptree_status bptree_set_leaf_clustering(bptree *tree, const int chunk_slots) {
+    if (tree == NULL || chunk_slots < 0) {
+        return BPTREE_ERROR;
+    }
+    tree->leaf_chunk_slots = chunk_slots;
+    return BPTREE_OK;
+}
+
+inline bptree_status bptree_set_gapped_leaves(bptree *tree, const bool enabled) {
+    if (tree == NULL || (enabled && tree->int_key)) {
+        return BPTREE_ERROR;
+    }
+    if (tree->gapped_leaves && !enabled) {
+        bptree_node *leaf = tree->root;
+        while (!leaf->is_leaf) {
+            leaf = child_at(tree, leaf, 0);
+        }
+        for (; leaf; leaf = next_leaf(tree, leaf)) {
+            pack_leaf(leaf);
+        }
+    }
+    tree->gapped_leaves = enabled;
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Tells whether any leaf of the tree holds more items than its sorted layout allows.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param compressed_only Whether to consider only compressed leaves.
+ * @return true if some such leaf is overfull.
+ */
+static bool has_overfull_leaf(const bptree *tree, const bool compressed_only) {
+    const bptree_node *leaf = tree->root;
+    while (!leaf->is_leaf) {
+        leaf = child_at(tree, leaf, 0);
+    }
+    for (; leaf; leaf = next_leaf(tree, leaf)) {
+        if (leaf_overfull(leaf) && (!compressed_only || leaf->ptr.leaf.delta_width)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bptree_status bptree_set_int_keys(bptree *tree, const bptree_int_key_t int_key) {
+    if (tree == NULL || (int_key && tree->gapped_leaves)) {
+        return BPTREE_ERROR;
+    }
+    if (has_overfull_leaf(tree, false)) {
+        // Overfull leaves cannot go back to the sorted layout, so the tree is rebuilt instead.
+        const bptree_int_key_t old = tree->int_key;
+        tree->int_key = int_key;
+        const bptree_status status = bptree_compact(tree, 100);
+        if (status != BPTREE_OK) {
+            tree->int_key = old;
+        }
+        return status;
+    }
+    tree->int_key = int_key;
+    bptree_node *leaf = tree->root;
+    while (!leaf->is_leaf) {
+        leaf = child_at(tree, leaf, 0);
+    }
+    for (; leaf; leaf = next_leaf(tree, leaf)) {
+        sparsify_leaf(leaf);
+        densify_leaf(tree, leaf);
+        compress_leaf(tree, leaf);
+    }
+    return BPTREE_OK;
+}
+
+inline bptree_status bptree_set_compressed_leaves(bptree *tree, const bool enabled) {
+    if (tree == NULL) {
+        return BPTREE_ERROR;
+    }
+    if (!enabled && has_overfull_leaf(tree, true)) {
+        // As in bptree_set_int_keys, overfull leaves are rebuilt rather than converted.
+        const bool old = tree->compressed_leaves;
+        tree->compressed_leaves = false;
+        const bptree_status status = bptree_compact(tree, 100);
+        if (status != BPTREE_OK) {
+            tree->compressed_leaves = old;
+        }
+        return status;
+    }
+    tree->compressed_leaves = enabled;
+    bptree_node *leaf = tree->root;
+    while (!leaf->is_leaf) {
+        leaf = child_at(tree, leaf, 0);
+    }
+    for (; leaf; leaf = next_leaf(tree, leaf)) {
+        if (enabled) {
+            compress_leaf(tree, leaf);
+        } else if (leaf->ptr.leaf.delta_width) {
+            sparsify_leaf(leaf);
+        }
+    }
+    return BPTREE_OK;
+}
+
+inline bptree_status bptree_set_key_bytes(bptree *tree, const bptree_key_bytes_t key_bytes) {
+    // Reserved and arena internal nodes are sized for the current key slots too.
+    if (tree == NULL || tree->height > 1 || tree->reserve[0]) {
+        return BPTREE_ERROR;
+    }
+#ifdef BPTREE_HUGE_PAGES
+    if (tree->arena[0]) {
+        return BPTREE_ERROR;
+    }
+#endif
+    tree->key_bytes = key_bytes;
+    tree->key_slot_size = key_bytes ? BPTREE_SEPARATOR_SLOT : sizeof(void *);
+    return BPTREE_OK;
+}
+
+inline bptree_status bptree_set_variable_capacity(bptree *tree, const bool enabled) {
+    if (tree == NULL) {
+        return BPTREE_ERROR;
+    }
+#ifdef BPTREE_NODE_HANDLES
+    if (enabled) {
+        return BPTREE_ERROR;
+    }
+#endif
+    tree->variable_capacity = enabled;
+    return BPTREE_OK;
+}
+
+inline bptree_status bptree_set_overflow_policy(bptree *tree,
+                                                const bptree_overflow_policy policy) {
+    if (tree == NULL ||
+        (policy != BPTREE_OVERFLOW_SPLIT && policy != BPTREE_OVERFLOW_REDISTRIBUTE)) {
+        return BPTREE_ERROR;
+    }
+    tree->overflow_policy = policy;
+    return BPTREE_OK;
+}
+
+inline bptree *bptree_new_with_fanout(int leaf_max_keys, int internal_max_keys,
+                                      int (*compare)(const void *first, const void *second,
+                                                     const void *user_data),
+                                      void *user_data, bptree_malloc_t malloc_fn,
+                                      bptree_free_t free_fn, const bool debug_enabled) {
+    if (leaf_max_keys < 3) {
+        leaf_max_keys = 3;
+    }
+    if (internal_max_keys < 3) {
+        internal_max_keys = 3;
+    }
+    if (!malloc_fn) {
+        malloc_fn = default_malloc;
+    }
+    if (!free_fn) {
+        free_fn = default_free;
+    }
+    // The tree and its initial root leaf share a single allocation.
+    bptree *tree = malloc_fn(sizeof(bptree));
+    if (!tree) {
+        return NULL;
+    }
+    tree->leaf_max_keys = leaf_max_keys;
+    tree->internal_max_keys = internal_max_keys;
+    tree->leaf_min_keys = (leaf_max_keys + 1) / 2;
+    tree->internal_min_keys = internal_max_keys / 2;
+    tree->overflow_policy = BPTREE_OVERFLOW_SPLIT;
+    tree->height = 1;
+    tree->count = 0;
+    tree->version = 0;
+    tree->edge_leaves[0] = NULL;
+    tree->edge_leaves[1] = NULL;
+    tree->compare = compare;
+    tree->udata = user_data;
+    tree->malloc_fn = malloc_fn;
+    tree->free_fn = free_fn;
+    tree->debug_enabled = debug_enabled;
+    tree->slabs = NULL;
+    tree->leaf_chunk_slots = 0;
+    tree->gapped_leaves = false;
+    tree->int_key = NULL;
+    tree->compressed_leaves = false;
+    tree->variable_capacity = false;
+    tree->key_bytes = NULL;
+    tree->key_slot_size = sizeof(void *);
+    tree->hash = NULL;
+    tree->reserve[0] = NULL;
+    tree->reserve[1] = NULL;
+    tree->scratch = NULL;
+    tree->scratch_size = 0;
+    // A dense index is a base key, then a bitmap word and a rank count per 64 keys. The
+    // bitmap covers at least four times leaf_max_keys, so a leaf stays dense with holes.
+    tree->dense_words = (leaf_max_keys * 4 + 63) / 64;
+#ifdef BPTREE_NODE_HANDLES
+    tree->handle_slabs = NULL;
+    tree->free_blocks = NULL;
+    tree->handle_blocks = 1;
+    tree->free_block_count = 0;
+    tree->handle_capacity = 0;
+    tree->open_slabs[0] = NULL;
+    tree->open_slabs[1] = NULL;
+#endif
+#ifdef BPTREE_HUGE_PAGES
+    tree->huge_pages[0] = false;
+    tree->huge_pages[1] = false;
+    tree->arena[0] = NULL;
+    tree->arena[1] = NULL;
+#endif
+    BPTREE_LOG_DEBUG(tree, "B+tree created (leaf_max_keys=%d, internal_max_keys=%d)",
+                     tree->leaf_max_keys, tree->internal_max_keys);
+    tree->root_leaf.slab = NULL;
+    init_node(tree, &tree->root_leaf, 1, tree->root_slots,
+              leaf_max_keys < BPTREE_INLINE_ROOT_KEYS ? leaf_max_keys : BPTREE_INLINE_ROOT_KEYS);
+    tree->root = &tree->root_leaf;
+    return tree;
+}
+
+inline bptree *bptree_new(
+    int max_keys, int (*compare)(const void *first, const void *second, const void *user_data),
+    void *user_data, bptree_malloc_t malloc_fn, bptree_free_t free_fn, const bool debug_enabled) {
+    return bptree_new_with_fanout(max_keys, max_keys, compare, user_data, malloc_fn, free_fn,
+                                  debug_enabled);
+}
+
+/**
+ * @brief Frees the slabs and buffers of a tree whose nodes have been dropped, and the tree.
+ *
+ * @param tree Pointer to the B+Tree.
+ */
+static void free_tree(bptree *tree) {
+    while (tree->slabs) {
+        destroy_slab(tree, tree->slabs);
+    }
+    if (tree->scratch) {
+        tree->free_fn(tree->scratch);
+    }
+#ifdef BPTREE_NODE_HANDLES
+    tree->free_fn(tree->handle_slabs);
+    tree->free_fn(tree->free_blocks);
+#endif
+    tree->free_fn(tree);
+}
+
+inline void bptree_free(bptree *tree) {
+    if (tree == NULL) {
+        return;
+    }
+    begin_free(tree, tree->root);
+    free_nodes(tree, tree->root, true, LONG_MAX);
+    free_tree(tree);
+}
+
+#ifdef BPTREE_THREADS
+// Number of nodes the background thread of bptree_free_async frees between yields.
+#define BPTREE_FREE_CHUNK 4096
+
+/**
+ * @brief Entry point of the background thread of bptree_free_async.
+ *
+ * @param arg Pointer to the B+Tree to free.
+ * @return Always 0.
+ */
+static int free_async_main(void *arg) {
+    bptree *tree = arg;
+    bptree_node *node = tree->root;
+    begin_free(tree, node);
+    while ((node = free_nodes(tree, node, true, BPTREE_FREE_CHUNK))) {
+        thrd_yield();
+    }
+    while (tree->slabs) {
+        destroy_slab(tree, tree->slabs);
+        thrd_yield();
+    }
+    free_tree(tree);
+    return 0;
+}
+
+/* Share of the subtrees freed by one thread of bptree_free_parallel */
+typedef struct {
+    bptree *tree;         /**< Tree being freed. */
+    bptree_node **roots;  /**< Roots of all the subtrees. */
+    int count;            /**< Number of subtrees. */
+    int first;            /**< Index of the first subtree of this thread. */
+    int step;             /**< Distance between the subtrees of this thread. */
+    bool started;         /**< Whether a helper thread took on the task. */
+} bptree_free_task;
+
+/**
+ * @brief Frees every step-th subtree of a bptree_free_parallel split.
+ *
+ * @param arg Pointer to the bptree_free_task.
+ * @return Always 0.
+ */
+static int free_subtrees_main(void *arg) {
+    const bptree_free_task *task = arg;
+    for (int i = task->first; i < task->count; i += task->step) {
+        begin_free(task->tree, task->roots[i]);
+        free_nodes(task->tree, task->roots[i], true, LONG_MAX);
+    }
+    return 0;
+}
+
+/**
+ * @brief Splits the top of a tree into subtrees for bptree_free_parallel.
+ *
+ * Levels are expanded from the root down until there are enough subtrees to
+ * keep every thread busy, or the next level is the leaves. The internal nodes
+ * above the subtrees are dropped on the way.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param n_threads Number of threads that will free the subtrees.
+ * @param count Receives the number of subtrees.
+ * @return Array of subtree roots, or NULL on allocation failure.
+ */
+static bptree_node **split_subtrees(bptree *tree, const int n_threads, int *count) {
+    bptree_node **roots = tree->malloc_fn(sizeof(bptree_node *));
+    if (!roots) {
+        return NULL;
+    }
+    roots[0] = tree->root;
+    *count = 1;
+    // A few subtrees per thread even out their sizes.
+    while (*count < 4 * n_threads && !child_at(tree, roots[0], 0)->is_leaf) {
+        long children = 0;
+        for (int i = 0; i < *count; i++) {
+            children += roots[i]->num_keys + 1;
+        }
+        if (children > INT_MAX) {
+            break;
+        }
+        bptree_node **next = tree->malloc_fn((size_t)children * sizeof(bptree_node *));
+        if (!next) {
+            break;
+        }
+        int n = 0;
+        for (int i = 0; i < *count; i++) {
+            for (int j = 0; j <= roots[i]->num_keys; j++) {
+                next[n++] = child_at(tree, roots[i], j);
+            }
+            drop_node(tree, roots[i]);
+        }
+        tree->free_fn(roots);
+        roots = next;
+        *count = n;
+    }
+    return roots;
+}
+#endif
+
+inline bptree_status bptree_free_async(bptree *tree) {
+    if (tree == NULL) {
+        return BPTREE_ERROR;
+    }
+#ifdef BPTREE_THREADS
+    thrd_t thread;
+    if (thrd_create(&thread, free_async_main, tree) != thrd_success) {
+        BPTREE_LOG_DEBUG(tree, "Could not start a thread to free the tree");
+        return BPTREE_ERROR;
+    }
+    thrd_detach(thread);
+    return BPTREE_OK;
+#else
+    return BPTREE_ERROR;
+#endif
+}
+
+inline bptree_status bptree_free_parallel(bptree *tree, const int n_threads) {
+    if (n_threads < 1) {
+        return BPTREE_ERROR;
+    }
+    if (tree == NULL) {
+        return BPTREE_OK;
+    }
+#ifdef BPTREE_THREADS
+    bptree_free_task *tasks = NULL;
+    thrd_t *threads = NULL;
+    int count;
+    bptree_node **roots = NULL;
+    if (n_threads > 1 && !tree->root->is_leaf) {
+        tasks = tree->malloc_fn((size_t)n_threads * sizeof(bptree_free_task));
+        threads = tree->malloc_fn((size_t)n_threads * sizeof(thrd_t));
+        if (tasks && threads) {
+            roots = split_subtrees(tree, n_threads, &count);
+        }
+    }
+    if (roots) {
+        for (int t = 0; t < n_threads; t++) {
+            tasks[t] = (bptree_free_task){tree, roots, count, t, n_threads, false};
+        }
+        for (int t = 1; t < n_threads; t++) {
+            tasks[t].started =
+                thrd_create(&threads[t], free_subtrees_main, &tasks[t]) == thrd_success;
+        }
+        free_subtrees_main(&tasks[0]);
+        // A helper that could not be started leaves its share to the calling thread.
+        for (int t = 1; t < n_threads; t++) {
+            if (tasks[t].started) {
+                thrd_join(threads[t], NULL);
+            } else {
+                free_subtrees_main(&tasks[t]);
+            }
+        }
+        tree->free_fn(roots);
+        tree->free_fn(threads);
+        tree->free_fn(tasks);
+        free_tree(tree);
+        return BPTREE_OK;
+    }
+    if (threads) {
+        tree->free_fn(threads);
+    }
+    if (tasks) {
+        tree->free_fn(tasks);
+    }
+#endif
+    bptree_free(tree);
+    return BPTREE_OK;
+}
+
+inline void **bptree_get_range(const bptree *tree, const void *start_key, const void *end_key,
+                               int *count) {
+    *count = 0;
+    if (tree == NULL || tree->root == NULL) {
+        return NULL;
+    }
+    const bptree_node *node = tree->root;
+    while (!node->is_leaf) {
+        const int pos = internal_node_search(tree, node, start_key);
+        node = child_at(tree, node, pos);
+    }
+    int capacity = 16;
+    void **results = tree->malloc_fn(capacity * sizeof(void *));
+    if (results == NULL) {
+        return NULL;
+    }
+    while (node) {
+        BPTREE_PREFETCH(next_leaf(tree, node));
+        for (int i = 0; i < node->num_keys; i++) {
+            if (!node->ptr.leaf.items[i]) {
+                continue;
+            }
+            void *item = node->ptr.leaf.items[i];
+            if (tree->compare(item, start_key, tree->udata) >= 0 &&
+                tree->compare(item, end_key, tree->udata) <= 0) {
+                if (*count >= capacity) {
+                    capacity *= 2;
+                    void **temp = tree->malloc_fn(capacity * sizeof(void *));
+                    if (temp == NULL) {
+                        tree->free_fn(results);
+                        return NULL;
+                    }
+                    memcpy(temp, results, *count * sizeof(void *));
+                    tree->free_fn(results);
+                    results = temp;
+                }
+                results[(*count)++] = item;
+            } else if (tree->compare(item, end_key, tree->udata) > 0) {
+                return results;
+            }
+        }
+        node = next_leaf(tree, node);
+    }
+    return results;
+}
+
+/**
+ * @brief Descends to the leaf that would hold a key.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param key Key to search for.
+ * @return Pointer to the leaf node.
+ */
+static bptree_node *find_leaf(const bptree *tree, const void *key) {
+    bptree_node *node = tree->root;
+    while (!node->is_leaf) {
+        node = child_at(tree, node, internal_node_search(tree, node, key));
+    }
+    return node;
+}
+
+inline int bptree_get_range_limit(const bptree *tree, const void *start_key, const void *end_key,
+                                  const int limit, void **out, bptree_range_token *token) {
+    if (tree == NULL || out == NULL || token == NULL || limit < 1 || token->done) {
+        return 0;
+    }
+    const void *after = token->key;
+    bptree_node *node;
+    int i;
+    if (after == NULL) {
+        node = find_leaf(tree, start_key);
+        i = leaf_lower_bound(tree, node, start_key);
+    } else if (token->tree == tree && token->version == tree->version &&
+               token->index < token->leaf->num_keys &&
+               token->leaf->ptr.leaf.items[token->index] == after) {
+        // No node was allocated or freed since, so the leaf is still part of the tree.
+        node = token->leaf;
+        i = token->index + 1;
+        after = NULL;
+    } else {
+        node = find_leaf(tree, after);
+        i = leaf_lower_bound(tree, node, after);
+    }
+    int count = 0;
+    for (; node; node = next_leaf(tree, node), i = 0) {
+        BPTREE_PREFETCH(next_leaf(tree, node));
+        for (; i < node->num_keys; i++) {
+            void *item = node->ptr.leaf.items[i];
+            if (!item) {
+                continue;
+            }
+            // Only the item recorded in the token can sort before the first slot found.
+            if (after) {
+                if (tree->compare(item, after, tree->udata) <= 0) {
+                    continue;
+                }
+                after = NULL;
+            }
+            if (tree->compare(item, end_key, tree->udata) > 0) {
+                token->done = true;
+                return count;
+            }
+            // The item past a full page is only looked at to tell whether the range goes on.
+            if (count == limit) {
+                return count;
+            }
+            out[count++] = item;
+            *token = (bptree_range_token){tree, item, node, i, tree->version, false};
+        }
+    }
+    token->done = true;
+    return count;
+}
+
+/**
+ * @brief Computes over how many nodes a level of entries is spread.
+ *
+ * Aims for `target` entries per node while keeping every node between the
+ * minimum and maximum number of entries whenever the level has more than one node.
+ *
+ * @param count Number of entries on the level (items for leaves, children for internal nodes).
+ * @param max_entries Maximum number of entries per node.
+ * @param min_entries Minimum number of entries per non-root node.
+ * @param target Desired number of entries per node.
+ * @return Number of nodes on the level.
+ */
+static int level_node_count(const int count, const int max_entries, const int min_entries,
+                            const int target) {
+    int nodes = (count + target - 1) / target;
+    if (nodes > count / min_entries) {
+        nodes = count / min_entries;
+    }
+    const int lower = (count + max_entries - 1) / max_entries;
+    return nodes > lower ? nodes : lower;
+}
+
+/**
+ * @brief Frees the nodes of a partially built level together with their subtrees.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param nodes Array of nodes on the level.
+ * @param count Number of nodes in the array.
+ */
+static void free_level(bptree *tree, bptree_node **nodes, const int count) {
+    for (int i = 0; i < count; i++) {
+        free_node(tree, nodes[i]);
+    }
+    tree->free_fn(nodes);
+}
+
+/* Sorted, distinct items to build a tree from: an array, or the leaf chain of a tree */
+typedef struct {
+    void *const *array;      /**< Items not read yet, or NULL to read the leaf chain. */
+    const bptree *tree;      /**< Tree whose leaves are read. */
+    const bptree_node *leaf; /**< Leaf being read. */
+    int index;               /**< Slot of the next item in the leaf. */
+} sorted_source;
+
+/**
+ * @brief Reads the next run of items from a sorted source.
+ *
+ * An array source hands out its own items; a leaf chain is copied into the buffer.
+ *
+ * @param source Pointer to the source, holding at least count more items.
+ * @param buffer Room for count items.
+ * @param count Number of items to read.
+ * @return Pointer to the items read.
+ */
+static void *const *read_sorted(sorted_source *source, void **buffer, const int count) {
+    if (source->array) {
+        void *const *run = source->array;
+        source->array += count;
+        return run;
+    }
+    for (int n = 0; n < count;) {
+        if (source->index == source->leaf->num_keys) {
+            source->leaf = next_leaf(source->tree, source->leaf);
+            source->index = 0;
+            continue;
+        }
+        void *item = source->leaf->ptr.leaf.items[source->index++];
+        if (item) {
+            buffer[n++] = item;
+        }
+    }
+    return buffer;
+}
+
+/**
+ * @brief Builds a tree bottom-up from a sorted source of items.
+ *
+ * Each level is allocated from a single slab, so nodes sit contiguously in key
+ * order, and nodes are filled to roughly the given percentage of their capacity.
+ * Items read from a leaf chain go straight into the new leaves.
+ *
+ * @param tree Pointer to the B+Tree that will own the nodes.
+ * @param source Source of the items.
+ * @param n_items Number of items in the source.
+ * @param fill_percent Target node fill in percent, between 1 and 100.
+ * @param height Receives the height of the built tree.
+ * @return Pointer to the root of the built tree, or NULL on failure.
+ */
+static bptree_node *build_from_sorted(bptree *tree, sorted_source *source, const int n_items,
+                                      const int fill_percent, int *height) {
+    const int leaf_target = (tree->leaf_max_keys * fill_percent + 99) / 100;
+    int count = n_items > 0 ? level_node_count(n_items, tree->leaf_max_keys, tree->leaf_min_keys,
+                                               leaf_target > 0 ? leaf_target : 1)
+                            : 1;
+    bptree_node **level = tree->malloc_fn(count * sizeof(bptree_node *));
+    void **lows = tree->malloc_fn(count * sizeof(void *));
+    void **highs = tree->malloc_fn(count * sizeof(void *));
+    bptree_slab *slab = level && lows && highs ? create_slab(tree, 1, count) : NULL;
+    if (!slab) {
+        tree->free_fn(level);
+        tree->free_fn(lows);
+        tree->free_fn(highs);
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        bptree_node *leaf = alloc_node(tree, 1, slab);
+        const int n = n_items / count + (i < n_items % count);
+        void *const *items = read_sorted(source, leaf->keys + leaf_capacity(leaf), n);
+        lows[i] = n > 0 ? items[0] : NULL;
+        highs[i] = n > 0 ? items[n - 1] : NULL;
+        fill_leaf(tree, leaf, items, n);
+        if (i > 0) {
+            set_next_leaf(tree, level[i - 1], leaf);
+        }
+        level[i] = leaf;
+    }
+    *height = 1;
+    const int internal_target = (tree->internal_max_keys * fill_percent + 99) / 100 + 1;
+    while (count > 1) {
+        const int parent_count =
+            level_node_count(count, tree->internal_max_keys + 1, tree->internal_min_keys + 1,
+                             internal_target > 2 ? internal_target : 2);
+        bptree_node **parents = tree->malloc_fn(parent_count * sizeof(bptree_node *));
+        void **parent_lows = tree->malloc_fn(parent_count * sizeof(void *));
+        void **parent_highs = tree->malloc_fn(parent_count * sizeof(void *));
+        slab = parents && parent_lows && parent_highs ? create_slab(tree, 0, parent_count) : NULL;
+        if (!slab) {
+            tree->free_fn(parents);
+            tree->free_fn(parent_lows);
+            tree->free_fn(parent_highs);
+            tree->free_fn(lows);
+            tree->free_fn(highs);
+            free_level(tree, level, count);
+            return NULL;
+        }
+        int child_index = 0;
+        for (int i = 0; i < parent_count; i++) {
+            bptree_node *parent = alloc_node(tree, 0, slab);
+            const int n = count / parent_count + (i < count % parent_count);
+            for (int j = 0; j < n; j++) {
+                set_child_at(tree, parent, j, level[child_index + j]);
+                if (j > 0) {
+                    set_separator(tree, parent, j - 1, highs[child_index + j - 1],
+                                  lows[child_index + j]);
+                }
+            }
+            parent->num_keys = n - 1;
+            parent_lows[i] = lows[child_index];
+            parent_highs[i] = highs[child_index + n - 1];
+            child_index += n;
+            parents[i] = parent;
+        }
+        tree->free_fn(level);
+        tree->free_fn(lows);
+        tree->free_fn(highs);
+        level = parents;
+        lows = parent_lows;
+        highs = parent_highs;
+        count = parent_count;
+        (*height)++;
+    }
+    bptree_node *root = level[0];
+    tree->free_fn(level);
+    tree->free_fn(lows);
+    tree->free_fn(highs);
+    return root;
+}
+
+bptree *bptree_bulk_load_with_fanout(int leaf_max_keys, int internal_max_keys,
+                                     int (*compare)(const void *first, const void *second,
+                                                    const void *user_data),
+                                     void *user_data, bptree_malloc_t malloc_fn,
+                                     bptree_free_t free_fn, bool debug_enabled,
+                                     void **sorted_items, int n_items) {
+    if (n_items <= 0 || !sorted_items) {
+        return NULL;
+    }
+    bptree *tree = bptree_new_with_fanout(leaf_max_keys, internal_max_keys, compare, user_data,
+                                          malloc_fn, free_fn, debug_enabled);
+    if (!tree) {
+        return NULL;
+    }
+    int height;
+    sorted_source source = {sorted_items, NULL, NULL, 0};
+    bptree_node *root = build_from_sorted(tree, &source, n_items, 100, &height);
+    if (!root) {
+        bptree_free(tree);
+        return NULL;
+    }
+    // Release the initial root leaf; it lives inside the tree structure, so nothing is freed.
+    free_node(tree, tree->root);
+    tree->root = root;
+    tree->height = height;
+    tree->count = n_items;
+    return tree;
+}
+
+inline bptree_status bptree_compact(bptree *tree, const int fill_percent) {
+    if (tree == NULL || fill_percent < 1 || fill_percent > 100) {
+        return BPTREE_ERROR;
+    }
+    // The new leaves are filled straight from the old ones, which stay intact until the end.
+    const bptree_node *leaf = tree->root;
+    while (!leaf->is_leaf) {
+        leaf = child_at(tree, leaf, 0);
+    }
+    sorted_source source = {NULL, tree, leaf, 0};
+    const int n = tree->count;
+    int height;
+    bptree_node *root = build_from_sorted(tree, &source, n, fill_percent, &height);
+    if (!root) {
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    free_node(tree, tree->root);
+    tree->root = root;
+    tree->height = height;
+    BPTREE_LOG_DEBUG(tree, "Compacted %d items at %d%% fill (height=%d)", n, fill_percent,
+                     height);
+    return BPTREE_OK;
+}
+
+#ifndef BPTREE_NODE_HANDLES
+/**
+ * @brief Trims the nodes of a subtree to the smallest capacity classes that hold their keys.
+ *
+ * Nodes whose arrays share a block with the node are moved into new nodes with
+ * detached arrays, so the parent and the previous leaf are relinked; leaves
+ * are visited in key order to make the latter possible.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Root of the subtree.
+ * @param prev_leaf Last leaf visited so far, or NULL; updated as leaves are visited.
+ * @param status Set to BPTREE_ALLOCATION_ERROR if a node could not be trimmed.
+ * @return Pointer to the node now holding the root of the subtree.
+ */
+static bptree_node *fit_subtree(bptree *tree, bptree_node *node, bptree_node **prev_leaf,
+                                bptree_status *status) {
+    // An overfull leaf already has full capacity and keeps its layout.
+    const bool overfull = node->is_leaf && leaf_overfull(node);
+    if (node->is_leaf && !overfull) {
+        open_leaf(node);
+    } else if (!node->is_leaf) {
+        for (int i = 0; i <= node->num_keys; i++) {
+            bptree_node *child = fit_subtree(tree, child_at(tree, node, i), prev_leaf, status);
+            set_child_at(tree, node, i, child);
+        }
+    }
+    bptree_node *result = node;
+    const int capacity = capacity_class(node_max_keys(tree, node), node->num_keys);
+    if (capacity < node_capacity(tree, node) && node != &tree->root_leaf) {
+        if (node->detached) {
+            if (resize_node(tree, node, capacity) != BPTREE_OK) {
+                *status = BPTREE_ALLOCATION_ERROR;
+            }
+        } else {
+            // Copy the node, then give the copy its own arrays while the old ones are still valid.
+            bptree_node *moved = tree->malloc_fn(sizeof(bptree_node));
+            if (moved) {
+                *moved = *node;
+                moved->slab = NULL;
+                if (resize_node(tree, moved, capacity) == BPTREE_OK) {
+                    release_node(tree, node);
+                    result = moved;
+                } else {
+                    tree->free_fn(moved);
+                }
+            }
+            if (result == node) {
+                *status = BPTREE_ALLOCATION_ERROR;
+            }
+        }
+    }
+    if (result->is_leaf) {
+        if (!overfull) {
+            settle_leaf(tree, result);
+        }
+        if (*prev_leaf) {
+            set_next_leaf(tree, *prev_leaf, result);
+        }
+        *prev_leaf = result;
+    }
+    return result;
+}
+#endif
+
+inline bptree_status bptree_shrink_to_fit(bptree *tree) {
+    if (tree == NULL) {
+        return BPTREE_ERROR;
+    }
+    bptree_status status = BPTREE_OK;
+#ifndef BPTREE_NODE_HANDLES
+    bptree_node *prev_leaf = NULL;
+    tree->root = fit_subtree(tree, tree->root, &prev_leaf, &status);
+#endif
+    return status;
+}
+
+inline bptree_status bptree_reserve(bptree *tree, const int n_items) {
+    if (tree == NULL || n_items < 0 || tree->variable_capacity) {
+        return BPTREE_ERROR;
+    }
+    if (!scratch_buffer(tree)) {
+        return BPTREE_ALLOCATION_ERROR;
+    }
+    // Both halves of a split are at least half full, and insertions never shrink a node.
+    const int leaf_fill = (tree->leaf_max_keys + 1) / 2;
+    const int fanout = tree->internal_max_keys / 2 + 1;
+    int counts[2] = {0, (int)(((long long)n_items + leaf_fill - 1) / leaf_fill)};
+    for (int level = counts[1]; level > 1;) {
+        level = (level + fanout - 1) / fanout;
+        counts[0] += level;
+    }
+    for (int is_leaf = 0; is_leaf < 2; is_leaf++) {
+        bptree_slab *old = tree->reserve[is_leaf];
+        if (counts[is_leaf] <= slab_room(old)) {
+            continue;
+        }
+        bptree_slab *slab = create_slab(tree, is_leaf, counts[is_leaf]);
+        if (!slab) {
+            return BPTREE_ALLOCATION_ERROR;
+        }
+        // Touch the slots now so their pages are not faulted in by later insertions.
+        memset(slab->slots, 0, slab->slot_size * (size_t)slab->capacity);
+        if (old && old->live == 0) {
+            destroy_slab(tree, old);
+        }
+        tree->reserve[is_leaf] = slab;
+    }
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Copies the keys and items or separators of a node into an empty node.
+ *
+ * Child references and leaf links are left to the caller.
+ *
+ * @param tree Pointer to the B+Tree the copy belongs to, with the source's key slots.
+ * @param node Node to copy.
+ * @param copy Empty node of the same kind with at least the capacity of node.
+ */
+static void copy_node(const bptree *tree, const bptree_node *node, bptree_node *copy) {
+    const int n = node->num_keys;
+    copy->num_keys = n;
+#ifdef BPTREE_NODE_HASHES
+    copy->hashed = node->hashed;
+    copy->hash = node->hash;
+#endif
+    if (!node->is_leaf) {
+        memcpy(copy->keys, node->keys, (size_t)n * tree->key_slot_size);
+        return;
+    }
+    if (node->ptr.leaf.dense || node->ptr.leaf.delta_width) {
+        // Dense and compressed leaves keep their index anywhere in front of their items.
+        const size_t index_slots = (size_t)(node->ptr.leaf.items - node->keys);
+        memcpy(copy->keys, node->keys, index_slots * sizeof(void *));
+        copy->ptr.leaf.items = copy->keys + index_slots;
+    } else {
+        memcpy(copy->keys, node->keys, (size_t)n * sizeof(void *));
+    }
+    memcpy(copy->ptr.leaf.items, node->ptr.leaf.items, (size_t)n * sizeof(void *));
+    copy->ptr.leaf.gaps = node->ptr.leaf.gaps;
+    copy->ptr.leaf.dense = node->ptr.leaf.dense;
+    copy->ptr.leaf.delta_width = node->ptr.leaf.delta_width;
+}
+
+/* Share of the nodes of a level copied by one thread of bptree_clone_parallel */
+typedef struct {
+    const bptree *tree;         /**< Tree the copies belong to. */
+    bptree_node *const *nodes;  /**< Nodes of the level in the source tree. */
+    bptree_node *const *copies; /**< Nodes of the level in the copy. */
+    int count;                  /**< Number of nodes on the level. */
+    int begin;                  /**< Index of the first node of this share. */
+    int end;                    /**< Index past the last node of this share. */
+    bool started;               /**< Whether a helper thread took on the task. */
+} bptree_clone_task;
+
+/**
+ * @brief Copies a share of the nodes of a level and links the copied leaves.
+ *
+ * @param arg Pointer to the bptree_clone_task.
+ * @return Always 0.
+ */
+static int clone_nodes_main(void *arg) {
+    const bptree_clone_task *task = arg;
+    for (int i = task->begin; i < task->end; i++) {
+        copy_node(task->tree, task->nodes[i], task->copies[i]);
+        if (task->copies[i]->is_leaf && i + 1 < task->count) {
+            set_next_leaf(task->tree, task->copies[i], task->copies[i + 1]);
+        }
+    }
+    return 0;
+}
+
+// Smallest number of nodes per thread for which bptree_clone_parallel starts helper threads.
+#define BPTREE_CLONE_SHARE 1024
+
+/**
+ * @brief Copies the nodes of a level, with helper threads when the level is large enough.
+ *
+ * @param tree Pointer to the B+Tree the copies belong to.
+ * @param nodes Nodes of the level in the source tree.
+ * @param copies Allocated, empty nodes of the level in the copy.
+ * @param count Number of nodes on the level.
+ * @param n_threads Number of threads to use, including the calling thread.
+ */
+static void clone_level(const bptree *tree, bptree_node *const *nodes, bptree_node *const *copies,
+                        const int count, int n_threads) {
+    bptree_clone_task task = {tree, nodes, copies, count, 0, count, false};
+#ifdef BPTREE_THREADS
+    if (n_threads > count / BPTREE_CLONE_SHARE) {
+        n_threads = count / BPTREE_CLONE_SHARE;
+    }
+    bptree_clone_task *tasks = NULL;
+    thrd_t *threads = NULL;
+    if (n_threads > 1) {
+        tasks = tree->malloc_fn((size_t)n_threads * sizeof(bptree_clone_task));
+        threads = tree->malloc_fn((size_t)n_threads * sizeof(thrd_t));
+    }
+    if (tasks && threads) {
+        for (int t = 0; t < n_threads; t++) {
+            tasks[t] = task;
+            tasks[t].begin = (int)((long long)count * t / n_threads);
+            tasks[t].end = (int)((long long)count * (t + 1) / n_threads);
+        }
+        for (int t = 1; t < n_threads; t++) {
+            tasks[t].started =
+                thrd_create(&threads[t], clone_nodes_main, &tasks[t]) == thrd_success;
+        }
+        clone_nodes_main(&tasks[0]);
+        // A helper that could not be started leaves its share to the calling thread.
+        for (int t = 1; t < n_threads; t++) {
+            if (tasks[t].started) {
+                thrd_join(threads[t], NULL);
+            } else {
+                clone_nodes_main(&tasks[t]);
+            }
+        }
+    } else {
+        clone_nodes_main(&task);
+    }
+    if (threads) {
+        tree->free_fn(threads);
+    }
+    if (tasks) {
+        tree->free_fn(tasks);
+    }
+#else
+    (void)n_threads;
+    clone_nodes_main(&task);
+#endif
+}
+
+/**
+ * @brief Gives a new, empty tree the settings of another tree.
+ *
+ * @param tree Tree to take the settings from.
+ * @param copy Empty tree with the same fanout.
+ */
+static void copy_settings(const bptree *tree, bptree *copy) {
+    copy->leaf_min_keys = tree->leaf_min_keys;
+    copy->internal_min_keys = tree->internal_min_keys;
+    copy->overflow_policy = tree->overflow_policy;
+    copy->leaf_chunk_slots = tree->leaf_chunk_slots;
+    copy->gapped_leaves = tree->gapped_leaves;
+    copy->int_key = tree->int_key;
+    copy->compressed_leaves = tree->compressed_leaves;
+    copy->variable_capacity = tree->variable_capacity;
+    copy->key_bytes = tree->key_bytes;
+    copy->key_slot_size = tree->key_slot_size;
+    copy->hash = tree->hash;
+#ifdef BPTREE_HUGE_PAGES
+    copy->huge_pages[0] = tree->huge_pages[0];
+    copy->huge_pages[1] = tree->huge_pages[1];
+#endif
+}
+
+inline bptree *bptree_clone_parallel(const bptree *tree, const int n_threads) {
+    if (tree == NULL || n_threads < 1) {
+        return NULL;
+    }
+    bptree *clone =
+        bptree_new_with_fanout(tree->leaf_max_keys, tree->internal_max_keys, tree->compare,
+                               tree->udata, tree->malloc_fn, tree->free_fn, tree->debug_enabled);
+    if (!clone) {
+        return NULL;
+    }
+    copy_settings(tree, clone);
+    if (tree->root == &tree->root_leaf) {
+        copy_node(clone, tree->root, clone->root);
+        clone->count = tree->count;
+        return clone;
+    }
+    // Levels are copied from the root down; each array holds the nodes of one level.
+    bptree_node **nodes = tree->malloc_fn(sizeof(bptree_node *));
+    bptree_node **copies = tree->malloc_fn(sizeof(bptree_node *));
+    bptree_slab *slab = nodes && copies ? create_slab(clone, tree->root->is_leaf, 1) : NULL;
+    int count = 1;
+    if (slab) {
+        nodes[0] = tree->root;
+        copies[0] = alloc_node(clone, tree->root->is_leaf, slab);
+        clone->root = copies[0];
+        clone->height = tree->height;
+        clone->count = tree->count;
+    }
+    while (slab) {
+        clone_level(clone, nodes, copies, count, n_threads);
+        if (nodes[0]->is_leaf) {
+            break;
+        }
+        int child_count = 0;
+        for (int i = 0; i < count; i++) {
+            child_count += nodes[i]->num_keys + 1;
+        }
+        const int is_leaf = child_at(tree, nodes[0], 0)->is_leaf;
+        bptree_node **children = tree->malloc_fn((size_t)child_count * sizeof(bptree_node *));
+        bptree_node **child_copies =
+            tree->malloc_fn((size_t)child_count * sizeof(bptree_node *));
+        slab = children && child_copies ? create_slab(clone, is_leaf, child_count) : NULL;
+        if (slab) {
+            int c = 0;
+            for (int i = 0; i < count; i++) {
+                for (int j = 0; j <= nodes[i]->num_keys; j++, c++) {
+                    children[c] = child_at(tree, nodes[i], j);
+                    child_copies[c] = alloc_node(clone, is_leaf, slab);
+                    set_child_at(clone, copies[i], j, child_copies[c]);
+                }
+            }
+        }
+        tree->free_fn(nodes);
+        tree->free_fn(copies);
+        nodes = children;
+        copies = child_copies;
+        count = child_count;
+    }
+    if (nodes) {
+        tree->free_fn(nodes);
+    }
+    if (copies) {
+        tree->free_fn(copies);
+    }
+    if (!slab) {
+        // Every copied node lives in a slab of the clone, so freeing the slabs frees them all.
+        BPTREE_LOG_DEBUG(clone, "Allocation failure while cloning the tree");
+        clone->root = &clone->root_leaf;
+        bptree_free(clone);
+        return NULL;
+    }
+    return clone;
+}
+
+inline bptree *bptree_clone(const bptree *tree) {
+    return bptree_clone_parallel(tree, 1);
+}
+
+#ifdef BPTREE_NODE_HASHES
+/**
+ * @brief Returns the hash of an item, mixed so that sums of similar hashes do not collide.
+ *
+ * @param tree Pointer to the B+Tree, which has a hash function.
+ * @param item Item to hash.
+ * @return Mixed hash of the item.
+ */
+static unsigned long long item_hash(const bptree *tree, const void *item) {
+    // Finalizer of splitmix64.
+    unsigned long long hash = tree->hash(item, tree->udata);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * @brief Returns the hash of a subtree, recomputing the stale hashes within it.
+ *
+ * @param tree Pointer to the B+Tree, which has a hash function.
+ * @param node Root of the subtree.
+ * @return Sum of the mixed hashes of the items of the subtree.
+ */
+static unsigned long long node_hash(const bptree *tree, bptree_node *node) {
+    if (!node->hashed) {
+        unsigned long long hash = 0;
+        if (node->is_leaf) {
+            for (int i = 0; i < node->num_keys; i++) {
+                if (node->ptr.leaf.items[i]) {
+                    hash += item_hash(tree, node->ptr.leaf.items[i]);
+                }
+            }
+        } else {
+            for (int i = 0; i <= node->num_keys; i++) {
+                hash += node_hash(tree, child_at(tree, node, i));
+            }
+        }
+        node->hash = hash;
+        node->hashed = 1;
+    }
+    return node->hash;
+}
+
+/**
+ * @brief Marks the hashes of every node of a subtree as stale.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Root of the subtree.
+ */
+static void mark_subtree_stale(const bptree *tree, bptree_node *node) {
+    mark_stale(node);
+    if (!node->is_leaf) {
+        for (int i = 0; i <= node->num_keys; i++) {
+            mark_subtree_stale(tree, child_at(tree, node, i));
+        }
+    }
+}
+#endif
+
+inline bptree_status bptree_set_hash(bptree *tree, const bptree_hash_t hash) {
+    if (tree == NULL) {
+        return BPTREE_ERROR;
+    }
+#ifdef BPTREE_NODE_HASHES
+    // Shortcuts that skip the path do not mark hashes stale while hashing is disabled.
+    if (hash != tree->hash) {
+        mark_subtree_stale(tree, tree->root);
+    }
+    tree->hash = hash;
+    return BPTREE_OK;
+#else
+    return hash ? BPTREE_ERROR : BPTREE_OK;
+#endif
+}
+
+#ifdef BPTREE_NODE_HASHES
+
+/* Subtree or item on the walk of one tree in bptree_diff */
+typedef struct {
+    bptree_node *node;         /**< Root of the subtree, or NULL for an item. */
+    void *item;                /**< Item, if node is NULL. */
+    const unsigned char *low;  /**< Key slot of the lowest key of the subtree, or NULL. */
+    const unsigned char *high; /**< Key slot of the key past the subtree, or NULL. */
+    int level;                 /**< Height of the subtree above the leaves. */
+} diff_entry;
+
+/* Walk of one tree in bptree_diff: a stack of entries, the next in key order on top */
+typedef struct {
+    bptree *tree;      /**< Tree being walked. */
+    diff_entry *stack; /**< Entries still to visit. */
+    int depth;         /**< Number of entries on the stack. */
+} diff_walk;
+
+/**
+ * @brief Pushes an entry onto the stack of a walk.
+ *
+ * @param walk Walk of one tree.
+ * @param node Root of a subtree, or NULL for an item.
+ * @param item Item, if node is NULL.
+ * @param low Key slot of the low fence of the subtree, or NULL.
+ * @param high Key slot of the high fence of the subtree, or NULL.
+ * @param level Height of the subtree above the leaves.
+ */
+static void diff_push(diff_walk *walk, bptree_node *node, void *item, const unsigned char *low,
+                      const unsigned char *high, const int level) {
+    diff_entry *entry = &walk->stack[walk->depth++];
+    entry->node = node;
+    entry->item = item;
+    entry->low = low;
+    entry->high = high;
+    entry->level = level;
+}
+
+/**
+ * @brief Replaces the subtree on top of a walk's stack with its children or items.
+ *
+ * @param walk Walk of one tree.
+ */
+static void diff_expand(diff_walk *walk) {
+    const diff_entry entry = walk->stack[--walk->depth];
+    const bptree *tree = walk->tree;
+    const bptree_node *node = entry.node;
+    if (node->is_leaf) {
+        for (int i = node->num_keys - 1; i >= 0; i--) {
+            if (node->ptr.leaf.items[i]) {
+                diff_push(walk, NULL, node->ptr.leaf.items[i], NULL, NULL, -1);
+            }
+        }
         return;
     }
-    if (node->is_leaf) {
-        tree->free_fn(node->keys);
-        tree->free_fn(node->ptr.leaf.items);
-    } else {
-        for (int i = 0; i <= node->num_keys; i++) {
-            free_node(tree, node->ptr.internal.children[i]);
+    for (int i = node->num_keys; i >= 0; i--) {
+        diff_push(walk, child_at(tree, node, i), NULL,
+                  i > 0 ? key_slot(tree, node, i - 1) : entry.low,
+                  i < node->num_keys ? key_slot(tree, node, i) : entry.high, entry.level - 1);
+    }
+}
+
+/**
+ * @brief Checks whether fences of subtrees of two trees are the same key.
+ *
+ * @param a First tree.
+ * @param a_slot Key slot of the fence in the first tree, or NULL if unbounded.
+ * @param b Second tree, with the same key bytes function.
+ * @param b_slot Key slot of the fence in the second tree, or NULL if unbounded.
+ * @return true if the fences are equal.
+ */
+static bool fences_equal(const bptree *a, const unsigned char *a_slot, const bptree *b,
+                         const unsigned char *b_slot) {
+    if (!a_slot || !b_slot) {
+        return a_slot == b_slot;
+    }
+    if (!a->key_bytes) {
+        const void *a_key, *b_key;
+        memcpy(&a_key, a_slot, sizeof(a_key));
+        memcpy(&b_key, b_slot, sizeof(b_key));
+        return a_key == b_key || a->compare(a_key, b_key, a->udata) == 0;
+    }
+    size_t a_length, b_length;
+    const unsigned char *a_bytes = separator_bytes(a, a_slot, &a_length);
+    const unsigned char *b_bytes = separator_bytes(b, b_slot, &b_length);
+    return compare_bytes(a_bytes, a_length, b_bytes, b_length) == 0;
+}
+
+/**
+ * @brief Walks two trees side by side and visits the keys whose items differ.
+ *
+ * @param walks Walks of the first [0] and second [1] tree, each starting at the root.
+ * @param visit Function called for each differing key.
+ * @param user_data User-provided data passed to visit.
+ */
+static void diff_trees(diff_walk *walks, const bptree_diff_visitor_t visit, void *user_data) {
+    diff_walk *wa = &walks[0], *wb = &walks[1];
+    const bptree *a = wa->tree, *b = wb->tree;
+    while (wa->depth > 0 && wb->depth > 0) {
+        const diff_entry *ea = &wa->stack[wa->depth - 1];
+        const diff_entry *eb = &wb->stack[wb->depth - 1];
+        if (ea->node && eb->node) {
+            if (fences_equal(a, ea->low, b, eb->low) && fences_equal(a, ea->high, b, eb->high) &&
+                node_hash(a, ea->node) == node_hash(b, eb->node)) {
+                wa->depth--;
+                wb->depth--;
+                continue;
+            }
+            // Open the taller subtree, or both, until the boundaries of the trees line up.
+            const int level_a = ea->level, level_b = eb->level;
+            if (level_a >= level_b) {
+                diff_expand(wa);
+            }
+            if (level_b >= level_a) {
+                diff_expand(wb);
+            }
+            continue;
+        }
+        if (ea->node || eb->node) {
+            // An item before the other tree's next subtree is missing from it.
+            diff_walk *nodes = ea->node ? wa : wb;
+            diff_walk *items = ea->node ? wb : wa;
+            const diff_entry *entry = ea->node ? ea : eb;
+            void *item = items->stack[items->depth - 1].item;
+            if (!entry->low || compare_to_slot(nodes->tree, item, entry->low) >= 0) {
+                diff_expand(nodes);
+                continue;
+            }
+            items->depth--;
+            if (!(items == wa ? visit(item, NULL, user_data) : visit(NULL, item, user_data))) {
+                return;
+            }
+            continue;
+        }
+        void *a_item = ea->item, *b_item = eb->item;
+        const int cmp = a->compare(a_item, b_item, a->udata);
+        bool more = true;
+        if (cmp < 0) {
+            more = visit(a_item, NULL, user_data);
+        } else if (cmp > 0) {
+            more = visit(NULL, b_item, user_data);
+        } else if (a_item != b_item && item_hash(a, a_item) != item_hash(b, b_item)) {
+            more = visit(a_item, b_item, user_data);
+        }
+        if (!more) {
+            return;
+        }
+        if (cmp <= 0) {
+            wa->depth--;
+        }
+        if (cmp >= 0) {
+            wb->depth--;
+        }
+    }
+    for (int t = 0; t < 2; t++) {
+        diff_walk *walk = &walks[t];
+        while (walk->depth > 0) {
+            if (walk->stack[walk->depth - 1].node) {
+                diff_expand(walk);
+                continue;
+            }
+            void *item = walk->stack[--walk->depth].item;
+            if (!(t ? visit(NULL, item, user_data) : visit(item, NULL, user_data))) {
+                return;
+            }
+        }
+    }
+}
+
+#endif
+
+inline bptree_status bptree_diff(bptree *a, bptree *b, const bptree_diff_visitor_t visit,
+                                 void *user_data) {
+    if (a == NULL || b == NULL || visit == NULL || !a->hash || a->hash != b->hash ||
+        a->key_bytes != b->key_bytes) {
+        return BPTREE_ERROR;
+    }
+#ifdef BPTREE_NODE_HASHES
+    diff_walk walks[2] = {{a, NULL, 0}, {b, NULL, 0}};
+    bptree_status status = BPTREE_OK;
+    for (int t = 0; t < 2; t++) {
+        bptree *tree = walks[t].tree;
+        // Only the subtrees beside one path, and the items of one leaf, are pending at once.
+        const size_t capacity =
+            (size_t)tree->height * (tree->internal_max_keys + 1) + tree->leaf_max_keys + 1;
+        walks[t].stack = tree->malloc_fn(capacity * sizeof(diff_entry));
+        if (!walks[t].stack) {
+            status = BPTREE_ALLOCATION_ERROR;
+            break;
+        }
+        diff_push(&walks[t], tree->root, NULL, NULL, NULL, tree->height - 1);
+    }
+    if (status == BPTREE_OK) {
+        diff_trees(walks, visit, user_data);
+    }
+    for (int t = 0; t < 2; t++) {
+        if (walks[t].stack) {
+            walks[t].tree->free_fn(walks[t].stack);
+        }
+    }
+    return status;
+#else
+    // No tree has a hash function without node hashes, so this is never reached.
+    (void)user_data;
+    return BPTREE_ERROR;
+#endif
+}
+
+inline bptree_status bptree_set_huge_pages(bptree *tree, const bool internal_nodes,
+                                           const bool leaves) {
+    if (tree == NULL) {
+        return BPTREE_ERROR;
+    }
+#ifdef BPTREE_HUGE_PAGES
+    tree->huge_pages[0] = internal_nodes;
+    tree->huge_pages[1] = leaves;
+    return BPTREE_OK;
+#else
+    return internal_nodes || leaves ? BPTREE_ERROR : BPTREE_OK;
+#endif
+}
+
+bptree *bptree_bulk_load(const int max_keys,
+                         int (*compare)(const void *first, const void *second,
+                                        const void *user_data),
+                         void *user_data, bptree_malloc_t malloc_fn, bptree_free_t free_fn,
+                         const bool debug_enabled, void **sorted_items, const int n_items) {
+    return bptree_bulk_load_with_fanout(max_keys, max_keys, compare, user_data, malloc_fn,
+                                        free_fn, debug_enabled, sorted_items, n_items);
+}
+
+bptree_iterator *bptree_iterator_new(const bptree *tree) {
+    if (!tree || !tree->root) {
+        return NULL;
+    }
+    bptree_iterator *iter = tree->malloc_fn(sizeof(bptree_iterator));
+    if (!iter) {
+        return NULL;
+    }
+    bptree_node *node = tree->root;
+    while (!node->is_leaf) {
+        node = child_at(tree, node, 0);
+    }
+    iter->tree = tree;
+    iter->current_leaf = node;
+    iter->index = 0;
+    return iter;
+}
+
+void *bptree_iterator_next(bptree_iterator *iter) {
+    if (!iter || !iter->current_leaf) {
+        return NULL;
+    }
+    while (iter->current_leaf) {
+        while (iter->index < iter->current_leaf->num_keys) {
+            void *item = iter->current_leaf->ptr.leaf.items[iter->index++];
+            if (item) {
+                return item;
+            }
         }
-        tree->free_fn(node->keys);
-        tree->free_fn(node->ptr.internal.children);
+        iter->current_leaf = next_leaf(iter->tree, iter->current_leaf);
+        iter->index = 0;
+        if (iter->current_leaf) {
+            // Fetch the following leaf while this one is being consumed.
+            BPTREE_PREFETCH(next_leaf(iter->tree, iter->current_leaf));
+        }
+    }
+    return NULL;
+}
+
+void bptree_iterator_free(bptree_iterator *iter, bptree_free_t free_fn) {
+    if (iter && free_fn) {
+        free_fn(iter);
     }
-    tree->free_fn(node);
 }
 
-/* Structure for internal result handling during insertion. */
+/* Input of a merged iterator: a position in the leaf chain of one tree */
 typedef struct {
-    void *promoted_key;     /**< Key to be promoted to parent node. */
-    bptree_node *new_child; /**< Pointer to the new node created after split. */
-    bptree_status status;   /**< Status of the insertion operation. */
-} insert_result;
+    const bptree *tree;      /**< Tree the items come from. */
+    const bptree_node *leaf; /**< Leaf being read, or NULL once the tree is exhausted. */
+    int index;               /**< Slot of the next item in the leaf. */
+} bptree_merge_source;
+
+/* Next item of a source, as held by the nodes of a loser tree */
+typedef struct {
+    void *item; /**< Next item of the source, or NULL once it is exhausted. */
+    int source; /**< Index of the source. */
+} bptree_merge_head;
+
+/* Iterator merging several trees with a loser tree */
+struct bptree_merge_iterator {
+    const bptree *tree;           /**< First tree, whose functions order and allocate. */
+    int k;                        /**< Number of sources. */
+    bool dedup;                   /**< Whether to return only the newest item of each key. */
+    bptree_merge_head winner;     /**< Smallest next item of all sources. */
+    bptree_merge_source *sources; /**< Sources, one per tree. */
+    bptree_merge_head *losers;    /**< Loser of the match at each internal node 1 to k - 1. */
+    bptree_merge_head runner_up;  /**< Smallest next item of the other sources during a run. */
+    const bptree_node *run_leaf;  /**< Leaf of the winner during a run, or NULL outside one. */
+    int run_end; /**< Slot of run_leaf before which all items come before the runner-up. */
+};
 
 /**
- * @brief Splits an internal node and promotes a key.
+ * @brief Returns the next item of a merge source, moving it to the first item at or after its slot.
  *
- * @param tree Pointer to the B+Tree.
- * @param node Internal node to split.
- * @param new_key Key to insert.
- * @param new_child Child pointer corresponding to new_key.
- * @param pos Position to insert the new key.
- * @return Structure containing the promoted key, new child, and status.
+ * @param source Pointer to the source.
+ * @return Next item of the source, or NULL if it is exhausted.
  */
-static insert_result split_internal(const bptree *tree, bptree_node *node, void *new_key,
-                                    bptree_node *new_child, const int pos) {
-    insert_result res = {NULL, NULL, BPTREE_ERROR};
-    const int total = node->num_keys + 1;
-    const int split = total / 2;
-    void **all_keys = tree->malloc_fn(total * sizeof(void *));
-    bptree_node **all_children = tree->malloc_fn((total + 1) * sizeof(bptree_node *));
-    if (!all_keys || !all_children) {
-        if (all_keys) {
-            tree->free_fn(all_keys);
+static void *merge_source_settle(bptree_merge_source *source) {
+    while (source->leaf) {
+        void *const *items = source->leaf->ptr.leaf.items;
+        for (; source->index < source->leaf->num_keys; source->index++) {
+            if (items[source->index]) {
+                return items[source->index];
+            }
         }
-        if (all_children) {
-            tree->free_fn(all_children);
+        source->leaf = next_leaf(source->tree, source->leaf);
+        source->index = 0;
+        if (source->leaf) {
+            BPTREE_PREFETCH(next_leaf(source->tree, source->leaf));
         }
-        BPTREE_LOG_DEBUG(tree, "Allocation failure during split_internal");
-        return res;
     }
-    memcpy(all_keys, node->keys, node->num_keys * sizeof(void *));
-    memcpy(all_children, node->ptr.internal.children, (node->num_keys + 1) * sizeof(bptree_node *));
-    memmove(&all_keys[pos + 1], &all_keys[pos], (node->num_keys - pos) * sizeof(void *));
-    all_keys[pos] = new_key;
-    memmove(&all_children[pos + 2], &all_children[pos + 1],
-            (node->num_keys - pos) * sizeof(bptree_node *));
-    all_children[pos + 1] = new_child;
-    node->num_keys = split;
-    memcpy(node->keys, all_keys, split * sizeof(void *));
-    memcpy(node->ptr.internal.children, all_children, (split + 1) * sizeof(bptree_node *));
-    bptree_node *new_internal = create_internal(tree);
-    if (!new_internal) {
-        tree->free_fn(all_keys);
-        tree->free_fn(all_children);
-        return res;
+    return NULL;
+}
+
+/**
+ * @brief Checks whether one source's next item comes before another's.
+ *
+ * An exhausted source loses to every other, and of two equal keys the one
+ * from the later tree comes first, so de-duplication keeps the newest.
+ *
+ * @param tree Tree whose comparison function orders the items.
+ * @param a First head.
+ * @param b Second head.
+ * @return true if a's item is returned before b's.
+ */
+static bool merge_beats(const bptree *tree, const bptree_merge_head a, const bptree_merge_head b) {
+    if (!a.item || !b.item) {
+        return a.item != NULL;
     }
-    new_internal->num_keys = total - split - 1;
-    memcpy(new_internal->keys, &all_keys[split + 1], (total - split - 1) * sizeof(void *));
-    memcpy(new_internal->ptr.internal.children, &all_children[split + 1],
-           (total - split) * sizeof(bptree_node *));
-    res.promoted_key = all_keys[split];
-    assert(res.promoted_key != NULL);
-    res.new_child = new_internal;
-    res.status = BPTREE_OK;
-    tree->free_fn(all_keys);
-    tree->free_fn(all_children);
-    return res;
+    const int cmp = tree->compare(a.item, b.item, tree->udata);
+    // Matches between interleaved trees are unpredictable, so avoid branching on the result.
+    return (cmp < 0) | ((cmp == 0) & (a.source > b.source));
 }
 
 /**
- * @brief Recursively inserts an item into the B+Tree.
+ * @brief Plays the matches of a subtree of the loser tree and records the losers.
  *
- * @param tree Pointer to the B+Tree.
- * @param node Current node in the recursion.
- * @param item Pointer to the item to insert.
- * @return Structure containing information about a potential key promotion and status.
+ * @param iter Pointer to the merged iterator.
+ * @param node Node of the loser tree; nodes k to 2k - 1 are the sources.
+ * @return Head of the source winning the subtree.
  */
-static insert_result insert_recursive(bptree *tree, bptree_node *node, void *item) {
-    insert_result result = {NULL, NULL, BPTREE_ERROR};
-    if (node->is_leaf) {
-        const int pos = leaf_node_search(tree, node->keys, node->num_keys, item);
-        if (pos < node->num_keys && tree->compare(item, node->keys[pos], tree->udata) == 0) {
-            result.status = BPTREE_DUPLICATE;
-            return result;
+static bptree_merge_head merge_play(bptree_merge_iterator *iter, const int node) {
+    if (node >= iter->k) {
+        bptree_merge_head head = {merge_source_settle(&iter->sources[node - iter->k]),
+                                  node - iter->k};
+        return head;
+    }
+    const bptree_merge_head left = merge_play(iter, 2 * node);
+    const bptree_merge_head right = merge_play(iter, 2 * node + 1);
+    const bool left_wins = merge_beats(iter->tree, left, right);
+    iter->losers[node] = left_wins ? right : left;
+    return left_wins ? left : right;
+}
+
+/**
+ * @brief Continues the run of the winning source if its next item comes before the runner-up.
+ *
+ * If the last item of a leaf the run enters comes before the runner-up too,
+ * so does everything in between, and the run covers the rest of the leaf.
+ *
+ * @param iter Pointer to the merged iterator with a valid runner-up.
+ * @param head Next item of the winning source, at the slot of its source.
+ * @return true if the head continues the run.
+ */
+static bool merge_run_extend(bptree_merge_iterator *iter, const bptree_merge_head head) {
+    if (!merge_beats(iter->tree, head, iter->runner_up)) {
+        return false;
+    }
+    const bptree_merge_source *source = &iter->sources[head.source];
+    const bptree_node *leaf = source->leaf;
+    const bptree_merge_head last = {leaf->ptr.leaf.items[leaf->num_keys - 1], head.source};
+    const bool entered = leaf != iter->run_leaf;
+    iter->run_leaf = leaf;
+    iter->run_end = source->index + 1;
+    if (entered && last.item && merge_beats(iter->tree, last, iter->runner_up)) {
+        iter->run_end = leaf->num_keys;
+    }
+    return true;
+}
+
+/**
+ * @brief Starts a run of the winning source.
+ *
+ * The runner-up lost to the winner in one of the matches on the winner's
+ * path, so it is the best of the losers recorded there.
+ *
+ * @param iter Pointer to the merged iterator.
+ */
+static void merge_run_start(bptree_merge_iterator *iter) {
+    const bptree_merge_head winner = iter->winner;
+    bptree_merge_head runner_up = {NULL, winner.source};
+    for (int node = (winner.source + iter->k) / 2; node > 0; node /= 2) {
+        if (merge_beats(iter->tree, iter->losers[node], runner_up)) {
+            runner_up = iter->losers[node];
         }
-        if (node->num_keys < tree->max_keys) {
-            memmove(&node->keys[pos + 1], &node->keys[pos],
-                    (node->num_keys - pos) * sizeof(void *));
-            memmove(&node->ptr.leaf.items[pos + 1], &node->ptr.leaf.items[pos],
-                    (node->num_keys - pos) * sizeof(void *));
-            node->keys[pos] = item;
-            node->ptr.leaf.items[pos] = item;
-            node->num_keys++;
-            result.status = BPTREE_OK;
-            return result;
+    }
+    iter->runner_up = runner_up;
+    merge_run_extend(iter, winner);
+}
+
+/**
+ * @brief Advances the winning source and replays its matches up to the root.
+ *
+ * The item moving up is carried along and the losers keep their items at the
+ * nodes, so each match reads only its node. During a run the winner's next
+ * item only has to come before the runner-up, and the losers stay as they
+ * are; the replay happens when the run ends.
+ *
+ * @param iter Pointer to the merged iterator.
+ */
+static void merge_advance(bptree_merge_iterator *iter) {
+    bptree_merge_head winner = iter->winner;
+    bptree_merge_source *source = &iter->sources[winner.source];
+    source->index++;
+    winner.item = merge_source_settle(source);
+    if (iter->run_leaf) {
+        if (winner.item && ((source->leaf == iter->run_leaf && source->index < iter->run_end) ||
+                            merge_run_extend(iter, winner))) {
+            iter->winner = winner;
+            return;
+        }
+        iter->run_leaf = NULL;
+    }
+    for (int node = (winner.source + iter->k) / 2; node > 0; node /= 2) {
+        const bptree_merge_head other = iter->losers[node];
+        if (merge_beats(iter->tree, other, winner)) {
+            iter->losers[node] = winner;
+            winner = other;
+        }
+    }
+    // Interleaved sources rarely win twice in a row, so they never pay for the runner-up.
+    const bool again = winner.item && winner.source == iter->winner.source;
+    iter->winner = winner;
+    if (again) {
+        merge_run_start(iter);
+    }
+}
+
+bptree_merge_iterator *bptree_merge_iterator_new(const bptree *const *trees, const int k,
+                                                 const void *start_key, const bool dedup) {
+    if (!trees || k < 1) {
+        return NULL;
+    }
+    for (int i = 0; i < k; i++) {
+        if (!trees[i]) {
+            return NULL;
+        }
+    }
+    const bptree *tree = trees[0];
+    bptree_merge_iterator *iter = tree->malloc_fn(sizeof(bptree_merge_iterator));
+    bptree_merge_source *sources =
+        iter ? tree->malloc_fn((size_t)k * sizeof(bptree_merge_source)) : NULL;
+    bptree_merge_head *losers =
+        sources ? tree->malloc_fn((size_t)k * sizeof(bptree_merge_head)) : NULL;
+    if (!losers) {
+        if (sources) {
+            tree->free_fn(sources);
         }
-        const int total = node->num_keys + 1;
-        const int split = total / 2;
-        void **temp_keys = tree->malloc_fn(total * sizeof(void *));
-        void **temp_items = tree->malloc_fn(total * sizeof(void *));
-        if (!temp_keys || !temp_items) {
-            if (temp_keys) {
-                tree->free_fn(temp_keys);
+        if (iter) {
+            tree->free_fn(iter);
+        }
+        return NULL;
+    }
+    for (int i = 0; i < k; i++) {
+        bptree_merge_source *source = &sources[i];
+        source->tree = trees[i];
+        if (start_key) {
+            source->leaf = find_leaf(trees[i], start_key);
+            source->index = leaf_lower_bound(trees[i], source->leaf, start_key);
+        } else {
+            const bptree_node *node = trees[i]->root;
+            while (!node->is_leaf) {
+                node = child_at(trees[i], node, 0);
             }
-            if (temp_items) {
-                tree->free_fn(temp_items);
+            source->leaf = node;
+            source->index = 0;
+        }
+    }
+    iter->tree = tree;
+    iter->k = k;
+    iter->dedup = dedup;
+    iter->sources = sources;
+    iter->losers = losers;
+    iter->run_leaf = NULL;
+    iter->winner = merge_play(iter, 1);
+    return iter;
+}
+
+void *bptree_merge_iterator_next(bptree_merge_iterator *iter, int *source) {
+    if (!iter || !iter->winner.item) {
+        return NULL;
+    }
+    void *item = iter->winner.item;
+    if (source) {
+        *source = iter->winner.source;
+    }
+    merge_advance(iter);
+    // Older items with the same key come right after the newest one.
+    while (iter->dedup && iter->winner.item &&
+           iter->tree->compare(iter->winner.item, item, iter->tree->udata) == 0) {
+        merge_advance(iter);
+    }
+    return item;
+}
+
+void bptree_merge_iterator_free(bptree_merge_iterator *iter) {
+    if (iter) {
+        const bptree *tree = iter->tree;
+        tree->free_fn(iter->losers);
+        tree->free_fn(iter->sources);
+        tree->free_fn(iter);
+    }
+}
+
+/* Cursor that can modify the tree at its position */
+struct bptree_cursor {
+    bptree *tree;            /**< Tree the cursor moves through. */
+    delete_stack_item *path; /**< Internal nodes above the leaf, from the root down. */
+    int depth;               /**< Number of entries in path. */
+    int capacity;            /**< Capacity of path. */
+    bptree_node *leaf;       /**< Leaf holding the item, or the last leaf past the end. */
+    int index;               /**< Slot of the item, or the leaf's key count past the end. */
+    void *item;              /**< Item at the cursor, or NULL past the end. */
+    unsigned long version;   /**< Tree version the path was recorded at. */
+};
+
+/**
+ * @brief Moves a cursor to the first leaf after its own, following its path.
+ *
+ * @param cursor Pointer to the cursor.
+ * @return true if there is a next leaf, or false if the cursor is at the last leaf.
+ */
+static bool cursor_next_leaf(bptree_cursor *cursor) {
+    const bptree *tree = cursor->tree;
+    for (int d = cursor->depth - 1; d >= 0; d--) {
+        delete_stack_item *step = &cursor->path[d];
+        if (step->pos < step->node->num_keys) {
+            bptree_node *node = child_at(tree, step->node, ++step->pos);
+            for (d++; d < cursor->depth; d++) {
+                cursor->path[d].node = node;
+                cursor->path[d].pos = 0;
+                node = child_at(tree, node, 0);
             }
-            BPTREE_LOG_DEBUG(tree, "Allocation failure during leaf split");
-            return result;
+            cursor->leaf = node;
+            cursor->index = 0;
+            return true;
         }
-        memcpy(temp_keys, node->keys, pos * sizeof(void *));
-        memcpy(temp_items, node->ptr.leaf.items, pos * sizeof(void *));
-        temp_keys[pos] = item;
-        temp_items[pos] = item;
-        memcpy(&temp_keys[pos + 1], &node->keys[pos], (node->num_keys - pos) * sizeof(void *));
-        memcpy(&temp_items[pos + 1], &node->ptr.leaf.items[pos],
-               (node->num_keys - pos) * sizeof(void *));
-        node->num_keys = split;
-        memcpy(node->keys, temp_keys, split * sizeof(void *));
-        memcpy(node->ptr.leaf.items, temp_items, split * sizeof(void *));
-        bptree_node *new_leaf = create_leaf(tree);
-        if (!new_leaf) {
-            tree->free_fn(temp_keys);
-            tree->free_fn(temp_items);
-            return result;
+    }
+    return false;
+}
+
+/**
+ * @brief Moves a cursor forward from its slot to the first slot holding an item.
+ *
+ * @param cursor Pointer to the cursor.
+ */
+static void cursor_settle(bptree_cursor *cursor) {
+    for (;;) {
+        void **items = cursor->leaf->ptr.leaf.items;
+        for (; cursor->index < cursor->leaf->num_keys; cursor->index++) {
+            if (items[cursor->index]) {
+                cursor->item = items[cursor->index];
+                return;
+            }
+        }
+        if (!cursor_next_leaf(cursor)) {
+            cursor->item = NULL;
+            return;
         }
-        new_leaf->num_keys = total - split;
-        memcpy(new_leaf->keys, &temp_keys[split], (total - split) * sizeof(void *));
-        memcpy(new_leaf->ptr.leaf.items, &temp_items[split], (total - split) * sizeof(void *));
-        new_leaf->ptr.leaf.next = node->ptr.leaf.next;
-        node->ptr.leaf.next = new_leaf;
-        result.promoted_key = new_leaf->keys[0];
-        result.new_child = new_leaf;
-        result.status = BPTREE_OK;
-        tree->free_fn(temp_keys);
-        tree->free_fn(temp_items);
-        return result;
     }
-    const int pos = internal_node_search(tree, node->keys, node->num_keys, item);
-    const insert_result child_result =
-        insert_recursive(tree, node->ptr.internal.children[pos], item);
-    if (child_result.status == BPTREE_DUPLICATE) {
-        return child_result;
+}
+
+/**
+ * @brief Initializes a cursor without a path or position.
+ *
+ * Queries that only read a tree use a cursor on the stack, which never
+ * modifies the tree even though the cursor type holds it as non-const.
+ *
+ * @param cursor Pointer to the cursor.
+ * @param tree Tree the cursor moves through.
+ */
+static void cursor_init(bptree_cursor *cursor, const bptree *tree) {
+    cursor->tree = (bptree *)tree;
+    cursor->path = NULL;
+    cursor->depth = 0;
+    cursor->capacity = 0;
+    cursor->leaf = NULL;
+    cursor->index = 0;
+    cursor->item = NULL;
+    cursor->version = 0;
+}
+
+/**
+ * @brief Positions a cursor by descending from the root.
+ *
+ * @param cursor Pointer to the cursor.
+ * @param key Key to position the cursor at, or NULL for the first item.
+ * @param to_end Whether to position the cursor past the last item instead.
+ * @return BPTREE_OK on success, or BPTREE_ALLOCATION_ERROR if the path could not grow.
+ */
+static bptree_status cursor_seek(bptree_cursor *cursor, const void *key, const bool to_end) {
+    bptree *tree = cursor->tree;
+    if (cursor->capacity < tree->height) {
+        delete_stack_item *path = tree->malloc_fn((size_t)tree->height * sizeof(*path));
+        if (!path) {
+            return BPTREE_ALLOCATION_ERROR;
+        }
+        if (cursor->path) {
+            tree->free_fn(cursor->path);
+        }
+        cursor->path = path;
+        cursor->capacity = tree->height;
     }
-    if (child_result.status != BPTREE_OK) {
-        return child_result;
+    cursor->depth = 0;
+    bptree_node *node = tree->root;
+    while (!node->is_leaf) {
+        const int pos = to_end ? node->num_keys : key ? internal_node_search(tree, node, key) : 0;
+        cursor->path[cursor->depth].node = node;
+        cursor->path[cursor->depth].pos = pos;
+        cursor->depth++;
+        node = child_at(tree, node, pos);
     }
-    if (child_result.promoted_key == NULL) {
-        return child_result;
+    cursor->leaf = node;
+    cursor->index = to_end ? node->num_keys : key ? leaf_lower_bound(tree, node, key) : 0;
+    cursor->version = tree->version;
+    cursor_settle(cursor);
+    return BPTREE_OK;
+}
+
+/**
+ * @brief Brings a cursor up to date with changes made to the tree by others.
+ *
+ * While no node was created, freed, or rebalanced, the cursor's leaf and
+ * path are intact and at most its slot moved. Otherwise the cursor descends
+ * again to its item, or to the next item if its item was removed.
+ *
+ * @param cursor Pointer to the cursor.
+ * @return BPTREE_OK on success, or BPTREE_ALLOCATION_ERROR if the path could not grow.
+ */
+static bptree_status cursor_sync(bptree_cursor *cursor) {
+    const bptree *tree = cursor->tree;
+    if (cursor->version != tree->version) {
+        return cursor_seek(cursor, cursor->item, cursor->item == NULL);
     }
-    if (node->num_keys < tree->max_keys) {
-        memmove(&node->keys[pos + 1], &node->keys[pos], (node->num_keys - pos) * sizeof(void *));
-        memmove(&node->ptr.internal.children[pos + 2], &node->ptr.internal.children[pos + 1],
-                (node->num_keys - pos) * sizeof(bptree_node *));
-        node->keys[pos] = child_result.promoted_key;
-        node->ptr.internal.children[pos + 1] = child_result.new_child;
-        node->num_keys++;
-        result.status = BPTREE_OK;
-        return result;
+    const bptree_node *leaf = cursor->leaf;
+    if (!cursor->item) {
+        cursor->index = leaf->num_keys;
+    } else if (cursor->index >= leaf->num_keys ||
+               leaf->ptr.leaf.items[cursor->index] != cursor->item) {
+        if (!leaf_find(tree, leaf, cursor->item, &cursor->index) ||
+            leaf->ptr.leaf.items[cursor->index] != cursor->item) {
+            return cursor_seek(cursor, cursor->item, false);
+        }
     }
-    return split_internal(tree, node, child_result.promoted_key, child_result.new_child, pos);
+    return BPTREE_OK;
 }
 
-inline bptree_status bptree_put(bptree *tree, void *item) {
-    const insert_result result = insert_recursive(tree, tree->root, item);
-    if (result.status == BPTREE_DUPLICATE) {
-        return BPTREE_DUPLICATE;
+/**
+ * @brief Returns the index of the deepest path entry that holds the low fence of the leaf.
+ *
+ * @param cursor Pointer to the cursor.
+ * @return Index into the path, or -1 if the leaf is the first one.
+ */
+static int cursor_low_fence(const bptree_cursor *cursor) {
+    int d = cursor->depth - 1;
+    while (d >= 0 && cursor->path[d].pos == 0) {
+        d--;
     }
-    if (result.status != BPTREE_OK) {
-        return result.status;
+    return d;
+}
+
+bptree_cursor *bptree_cursor_new(bptree *tree, const void *key) {
+    if (!tree) {
+        return NULL;
     }
-    if (result.promoted_key == NULL) {
-        tree->count++;
-        return BPTREE_OK;
+    bptree_cursor *cursor = tree->malloc_fn(sizeof(bptree_cursor));
+    if (!cursor) {
+        return NULL;
     }
-    bptree_node *new_root = create_internal(tree);
-    if (!new_root) {
-        return BPTREE_ALLOCATION_ERROR;
+    cursor_init(cursor, tree);
+    if (cursor_seek(cursor, key, false) != BPTREE_OK) {
+        tree->free_fn(cursor);
+        return NULL;
     }
-    new_root->num_keys = 1;
-    new_root->keys[0] = result.promoted_key;
-    new_root->ptr.internal.children[0] = tree->root;
-    new_root->ptr.internal.children[1] = result.new_child;
-    tree->root = new_root;
-    tree->height++;
-    tree->count++;
+    return cursor;
+}
+
+void *bptree_cursor_get(bptree_cursor *cursor) {
+    if (!cursor || cursor_sync(cursor) != BPTREE_OK) {
+        return NULL;
+    }
+    return cursor->item;
+}
+
+void *bptree_cursor_next(bptree_cursor *cursor) {
+    if (!cursor || cursor_sync(cursor) != BPTREE_OK || !cursor->item) {
+        return NULL;
+    }
+    cursor->index++;
+    cursor_settle(cursor);
+    return cursor->item;
+}
+
+bptree_status bptree_cursor_remove(bptree_cursor *cursor) {
+    if (!cursor) {
+        return BPTREE_ERROR;
+    }
+    bptree_status status = cursor_sync(cursor);
+    if (status != BPTREE_OK) {
+        return status;
+    }
+    if (!cursor->item) {
+        return BPTREE_ERROR;
+    }
+    bptree *tree = cursor->tree;
+    bptree_node *leaf = cursor->leaf;
+    // Note the following item first; removal may repack the leaf.
+    void *next = NULL;
+    for (int i = cursor->index + 1; i < leaf->num_keys && !next; i++) {
+        next = leaf->ptr.leaf.items[i];
+    }
+    const bool in_leaf = next != NULL;
+    for (const bptree_node *n = next_leaf(tree, leaf); n && !next; n = next_leaf(tree, n)) {
+        for (int i = 0; i < n->num_keys && !next; i++) {
+            next = n->ptr.leaf.items[i];
+        }
+    }
+    leaf_remove(tree, leaf, cursor->index);
+    tree->count--;
+    mark_path_stale(cursor->path, cursor->depth, leaf);
+    if (leaf != tree->root && live_keys(leaf) < tree->leaf_min_keys) {
+        rebalance_path(tree, cursor->path, cursor->depth, leaf);
+        cursor->item = next;
+        return cursor_seek(cursor, next, next == NULL);
+    }
+    shrink_node(tree, leaf);
+    if (in_leaf) {
+        leaf_find(tree, leaf, next, &cursor->index);
+    } else {
+        cursor->index = leaf->num_keys;
+    }
+    cursor->version = tree->version;
+    cursor_settle(cursor);
+    return BPTREE_OK;
+}
+
+bptree_status bptree_cursor_replace(bptree_cursor *cursor, void *item) {
+    if (!cursor) {
+        return BPTREE_ERROR;
+    }
+    const bptree_status status = cursor_sync(cursor);
+    if (status != BPTREE_OK) {
+        return status;
+    }
+    const bptree *tree = cursor->tree;
+    void *old = cursor->item;
+    if (!old || tree->compare(item, old, tree->udata) != 0) {
+        return BPTREE_ERROR;
+    }
+    bptree_node *leaf = cursor->leaf;
+    leaf->ptr.leaf.items[cursor->index] = item;
+    mark_path_stale(cursor->path, cursor->depth, leaf);
+    if (!leaf->ptr.leaf.dense && !leaf->ptr.leaf.delta_width) {
+        // Gaps before the item copy its key.
+        for (int i = cursor->index; i >= 0 && leaf->keys[i] == old; i--) {
+            leaf->keys[i] = item;
+        }
+    }
+    // Only the first item of a subtree becomes a separator, the leaf's low fence.
+    const int d = cursor_low_fence(cursor);
+    if (d >= 0) {
+        const bptree_node *node = cursor->path[d].node;
+        unsigned char *slot = key_slot(tree, node, cursor->path[d].pos - 1);
+        const size_t offset = tree->key_bytes ? sizeof(void *) : 0;
+        void *separator_item;
+        memcpy(&separator_item, slot + offset, sizeof(separator_item));
+        if ((!tree->key_bytes || slot[0] == BPTREE_SEPARATOR_ITEM) && separator_item == old) {
+            memcpy(slot + offset, &item, sizeof(item));
+        }
+    }
+    cursor->item = item;
     return BPTREE_OK;
 }
 
-inline void *bptree_get(const bptree *tree, const void *key) {
-    const bptree_node *node = tree->root;
-    while (!node->is_leaf) {
-        const int pos = internal_node_search(tree, node->keys, node->num_keys, key);
-        node = node->ptr.internal.children[pos];
+bptree_status bptree_cursor_insert_before(bptree_cursor *cursor, void *item) {
+    if (!cursor) {
+        return BPTREE_ERROR;
     }
-    const int pos = leaf_node_search(tree, node->keys, node->num_keys, key);
-    if (pos < node->num_keys && tree->compare(key, node->keys[pos], tree->udata) == 0) {
-        return node->ptr.leaf.items[pos];
+    bptree_status status = cursor_sync(cursor);
+    if (status != BPTREE_OK) {
+        return status;
     }
-    return NULL;
+    bptree *tree = cursor->tree;
+    if (cursor->item) {
+        const int cmp = tree->compare(item, cursor->item, tree->udata);
+        if (cmp >= 0) {
+            return cmp == 0 ? BPTREE_DUPLICATE : BPTREE_ERROR;
+        }
+    }
+    bptree_node *leaf = cursor->leaf;
+    const int capacity = leaf_capacity(leaf);
+    const int d = cursor_low_fence(cursor);
+    if (live_keys(leaf) < capacity && (tree->gapped_leaves || leaf->num_keys < capacity) &&
+        (d < 0 || compare_to_key(tree, item, cursor->path[d].node, cursor->path[d].pos - 1) >= 0)) {
+        // The item belongs in this leaf, which takes it in place.
+        mark_path_stale(cursor->path, cursor->depth, leaf);
+        status = insert_recursive(tree, leaf, item).status;
+        if (status == BPTREE_OK) {
+            tree->count++;
+        }
+    } else {
+        status = bptree_put(tree, item);
+    }
+    if (status != BPTREE_OK) {
+        return status;
+    }
+    return cursor_sync(cursor);
 }
 
-/* Structure used during deletion to track traversal */
-typedef struct {
-    bptree_node *node; /**< Current node in deletion stack. */
-    int pos;           /**< Position of the child pointer in the parent node. */
-} delete_stack_item;
+void bptree_cursor_free(bptree_cursor *cursor) {
+    if (cursor) {
+        if (cursor->path) {
+            cursor->tree->free_fn(cursor->path);
+        }
+        cursor->tree->free_fn(cursor);
+    }
+}
 
-inline bptree_status bptree_remove(bptree *tree, const void *key) {
-    if (tree == NULL || tree->root == NULL) {
-        return BPTREE_ERROR;
+/**
+ * @brief Moves a cursor forward to the first item not less than a key.
+ *
+ * The cursor climbs its path only to the lowest internal node whose subtree
+ * covers the key and descends again from there, so nearby keys cost a search
+ * in one or two nodes instead of a descent from the root.
+ *
+ * @param cursor Pointer to a cursor positioned at an item that sorts before the key.
+ * @param key Key to move to.
+ */
+static void cursor_skip_to(bptree_cursor *cursor, const void *key) {
+    const bptree *tree = cursor->tree;
+    // The key is past the cursor, so only the upper fences decide whether a subtree covers it.
+    int d = cursor->depth - 1;
+    while (d >= 0 && (cursor->path[d].pos == cursor->path[d].node->num_keys ||
+                      compare_to_key(tree, key, cursor->path[d].node, cursor->path[d].pos) >= 0)) {
+        d--;
     }
-    const int INITIAL_STACK_CAPACITY = 16;
-    int stack_capacity = INITIAL_STACK_CAPACITY;
-    int depth = 0;
-    delete_stack_item *stack = tree->malloc_fn(stack_capacity * sizeof(delete_stack_item));
-    if (stack == NULL) {
-        return BPTREE_ALLOCATION_ERROR;
+    if (d + 1 < cursor->depth) {
+        bptree_node *node = cursor->path[d + 1].node;
+        for (d++; d < cursor->depth; d++) {
+            const int pos = internal_node_search(tree, node, key);
+            cursor->path[d].node = node;
+            cursor->path[d].pos = pos;
+            node = child_at(tree, node, pos);
+        }
+        cursor->leaf = node;
     }
-    bptree_node *node = tree->root;
-    while (!node->is_leaf) {
-        const int pos = internal_node_search(tree, node->keys, node->num_keys, key);
-        if (depth >= stack_capacity) {
-            const int new_capacity = stack_capacity * 2;
-            delete_stack_item *new_stack =
-                tree->malloc_fn(new_capacity * sizeof(delete_stack_item));
-            if (new_stack == NULL) {
-                tree->free_fn(stack);
-                return BPTREE_ALLOCATION_ERROR;
-            }
-            memcpy(new_stack, stack, depth * sizeof(delete_stack_item));
-            tree->free_fn(stack);
-            stack = new_stack;
-            stack_capacity = new_capacity;
+    cursor->index = leaf_lower_bound(tree, cursor->leaf, key);
+    cursor_settle(cursor);
+}
+
+/**
+ * @brief Sorts ranges by their starting keys with an in-place heapsort.
+ *
+ * @param tree Pointer to the B+Tree whose comparison function orders the keys.
+ * @param ranges Array of ranges.
+ * @param n Number of ranges.
+ */
+static void sort_ranges(const bptree *tree, bptree_range *ranges, const int n) {
+    // Query plans often produce their ranges in order already.
+    int sorted = 1;
+    while (sorted < n) {
+        const void *previous = ranges[sorted - 1].start_key;
+        if (tree->compare(previous, ranges[sorted].start_key, tree->udata) > 0) {
+            break;
         }
-        stack[depth].node = node;
-        stack[depth].pos = pos;
-        depth++;
-        node = node->ptr.internal.children[pos];
+        sorted++;
     }
-    const int pos = leaf_node_search(tree, node->keys, node->num_keys, key);
-    if (pos >= node->num_keys || tree->compare(key, node->keys[pos], tree->udata) != 0) {
-        tree->free_fn(stack);
-        return BPTREE_NOT_FOUND;
+    if (sorted == n) {
+        return;
     }
-    memmove(&node->ptr.leaf.items[pos], &node->ptr.leaf.items[pos + 1],
-            (node->num_keys - pos - 1) * sizeof(void *));
-    memmove(&node->keys[pos], &node->keys[pos + 1], (node->num_keys - pos - 1) * sizeof(void *));
-    node->num_keys--;
-    bool underflow = node != tree->root && node->num_keys < tree->min_keys;
-    while (underflow && depth > 0) {
-        depth--;
-        bptree_node *parent = stack[depth].node;
-        const int child_index = stack[depth].pos;
-        bptree_node *child = parent->ptr.internal.children[child_index];
-        bptree_node *left = child_index > 0 ? parent->ptr.internal.children[child_index - 1] : NULL;
-        bptree_node *right =
-            child_index < parent->num_keys ? parent->ptr.internal.children[child_index + 1] : NULL;
-        BPTREE_LOG_DEBUG(tree,
-                         "Iterative deletion at depth %d: parent num_keys=%d, child index=%d "
-                         "(is_leaf=%d, num_keys=%d)",
-                         depth, parent->num_keys, child_index, child->is_leaf, child->num_keys);
-        bool merged = false;
-        if (left && left->num_keys > tree->min_keys) {
-            if (child->is_leaf) {
-                memmove(&child->ptr.leaf.items[1], child->ptr.leaf.items,
-                        child->num_keys * sizeof(void *));
-                memmove(&child->keys[1], child->keys, child->num_keys * sizeof(void *));
-                child->ptr.leaf.items[0] = left->ptr.leaf.items[left->num_keys - 1];
-                child->keys[0] = left->keys[left->num_keys - 1];
-                left->num_keys--;
-                child->num_keys++;
-                parent->keys[child_index - 1] = child->keys[0];
-            } else {
-                memmove(&child->keys[1], child->keys, child->num_keys * sizeof(void *));
-                memmove(&child->ptr.internal.children[1], child->ptr.internal.children,
-                        (child->num_keys + 1) * sizeof(bptree_node *));
-                child->keys[0] = parent->keys[child_index - 1];
-                parent->keys[child_index - 1] = left->keys[left->num_keys - 1];
-                child->ptr.internal.children[0] = left->ptr.internal.children[left->num_keys];
-                left->num_keys--;
-                child->num_keys++;
-            }
-            merged = true;
-        } else if (right && right->num_keys > tree->min_keys) {
-            if (child->is_leaf) {
-                child->ptr.leaf.items[child->num_keys] = right->ptr.leaf.items[0];
-                child->keys[child->num_keys] = right->keys[0];
-                memmove(&right->ptr.leaf.items[0], &right->ptr.leaf.items[1],
-                        (right->num_keys - 1) * sizeof(void *));
-                memmove(&right->keys[0], &right->keys[1], (right->num_keys - 1) * sizeof(void *));
-                right->num_keys--;
-                parent->keys[child_index] = right->keys[0];
-                child->num_keys++;
-            } else {
-                child->keys[child->num_keys] = parent->keys[child_index];
-                child->ptr.internal.children[child->num_keys + 1] = right->ptr.internal.children[0];
-                parent->keys[child_index] = right->keys[0];
-                memmove(&right->keys[0], &right->keys[1], (right->num_keys - 1) * sizeof(void *));
-                memmove(&right->ptr.internal.children[0], &right->ptr.internal.children[1],
-                        (right->num_keys - 1) * sizeof(bptree_node *));
-                right->num_keys--;
-                child->num_keys++;
-            }
-            merged = true;
+    for (int end = n, start = n / 2; end > 1;) {
+        if (start > 0) {
+            start--;
         } else {
-            if (left) {
-                BPTREE_LOG_DEBUG(tree, "Merging child index %d with left sibling", child_index);
-                if (child->is_leaf) {
-                    memcpy(&left->ptr.leaf.items[left->num_keys], child->ptr.leaf.items,
-                           child->num_keys * sizeof(void *));
-                    memcpy(&left->keys[left->num_keys], child->keys,
-                           child->num_keys * sizeof(void *));
-                    left->num_keys += child->num_keys;
-                    left->ptr.leaf.next = child->ptr.leaf.next;
-                } else {
-                    left->keys[left->num_keys] = parent->keys[child_index - 1];
-                    left->num_keys++;
-                    memcpy(&left->keys[left->num_keys], child->keys,
-                           child->num_keys * sizeof(void *));
-                    memcpy(&left->ptr.internal.children[left->num_keys],
-                           child->ptr.internal.children,
-                           (child->num_keys + 1) * sizeof(bptree_node *));
-                    left->num_keys += child->num_keys;
-                }
-                {
-                    const int old_children = parent->num_keys + 1;
-                    memmove(&parent->ptr.internal.children[child_index],
-                            &parent->ptr.internal.children[child_index + 1],
-                            (old_children - child_index - 1) * sizeof(bptree_node *));
-                    parent->ptr.internal.children[old_children - 1] = NULL;
-                }
-                {
-                    const int old_keys = parent->num_keys;
-                    memmove(&parent->keys[child_index - 1], &parent->keys[child_index],
-                            (old_keys - child_index) * sizeof(void *));
-                    parent->num_keys = old_keys - 1;
-                }
-                free_node(tree, child);
-                merged = true;
-                break;
+            end--;
+            const bptree_range top = ranges[0];
+            ranges[0] = ranges[end];
+            ranges[end] = top;
+        }
+        // Sift the range at start down the heap of the first end ranges.
+        for (int parent = start, child; (child = 2 * parent + 1) < end; parent = child) {
+            const void *child_key = ranges[child].start_key;
+            if (child + 1 < end &&
+                tree->compare(child_key, ranges[child + 1].start_key, tree->udata) < 0) {
+                child_key = ranges[++child].start_key;
             }
-            if (right) {
-                BPTREE_LOG_DEBUG(tree, "Merging child index %d with right sibling", child_index);
-                if (child->is_leaf) {
-                    memcpy(&child->ptr.leaf.items[child->num_keys], right->ptr.leaf.items,
-                           right->num_keys * sizeof(void *));
-                    memcpy(&child->keys[child->num_keys], right->keys,
-                           right->num_keys * sizeof(void *));
-                    child->num_keys += right->num_keys;
-                    child->ptr.leaf.next = right->ptr.leaf.next;
-                } else {
-                    child->keys[child->num_keys] = parent->keys[child_index];
-                    child->num_keys++;
-                    memcpy(&child->keys[child->num_keys], right->keys,
-                           right->num_keys * sizeof(void *));
-                    memcpy(&child->ptr.internal.children[child->num_keys],
-                           right->ptr.internal.children,
-                           (right->num_keys + 1) * sizeof(bptree_node *));
-                    child->num_keys += right->num_keys;
-                }
-                {
-                    const int old_children = parent->num_keys + 1;
-                    memmove(&parent->ptr.internal.children[child_index + 1],
-                            &parent->ptr.internal.children[child_index + 2],
-                            (old_children - child_index - 2) * sizeof(bptree_node *));
-                    parent->ptr.internal.children[old_children - 1] = NULL;
-                }
-                {
-                    const int old_keys = parent->num_keys;
-                    memmove(&parent->keys[child_index], &parent->keys[child_index + 1],
-                            (old_keys - child_index - 1) * sizeof(void *));
-                    parent->num_keys = old_keys - 1;
-                }
-                free_node(tree, right);
-                merged = true;
+            if (tree->compare(ranges[parent].start_key, child_key, tree->udata) >= 0) {
                 break;
             }
+            const bptree_range swap = ranges[parent];
+            ranges[parent] = ranges[child];
+            ranges[child] = swap;
         }
-        if (merged) {
-            child = parent->ptr.internal.children[child_index];
-            underflow = child != tree->root && child->num_keys < tree->min_keys;
-        } else {
-            underflow = false;
-        }
-    }
-    if (tree->root->num_keys == 0 && !tree->root->is_leaf) {
-        bptree_node *old_root = tree->root;
-        tree->root = tree->root->ptr.internal.children[0];
-        tree->free_fn(old_root->keys);
-        tree->free_fn(old_root->ptr.internal.children);
-        tree->free_fn(old_root);
-        tree->height--;
     }
-    tree->count--;
-    tree->free_fn(stack);
-    return BPTREE_OK;
 }
 
-inline bptree *bptree_new(
-    int max_keys, int (*compare)(const void *first, const void *second, const void *user_data),
-    void *user_data, bptree_malloc_t malloc_fn, bptree_free_t free_fn, const bool debug_enabled) {
-    if (max_keys < 3) {
-        max_keys = 3;
-    }
-    if (!malloc_fn) {
-        malloc_fn = default_malloc;
-    }
-    if (!free_fn) {
-        free_fn = default_free;
+inline bptree_status bptree_get_ranges(const bptree *tree, bptree_range *ranges, const int n,
+                                       const bptree_range_visitor_t visit, void *user_data) {
+    if (tree == NULL || n < 0 || (ranges == NULL && n > 0) || visit == NULL) {
+        return BPTREE_ERROR;
     }
-    bptree *tree = malloc_fn(sizeof(bptree));
-    if (!tree) {
-        return NULL;
+    if (n == 0) {
+        return BPTREE_OK;
     }
-    tree->max_keys = max_keys;
-    tree->min_keys = (max_keys + 1) / 2;
-    tree->height = 1;
-    tree->count = 0;
-    tree->compare = compare;
-    tree->udata = user_data;
-    tree->malloc_fn = malloc_fn;
-    tree->free_fn = free_fn;
-    tree->debug_enabled = debug_enabled;
-    BPTREE_LOG_DEBUG(tree, "B+tree created (max_keys=%d)", tree->max_keys);
-    tree->root = create_leaf(tree);
-    if (!tree->root) {
-        tree->free_fn(tree);
-        return NULL;
+    sort_ranges(tree, ranges, n);
+    bptree_cursor cursor;
+    cursor_init(&cursor, tree);
+    const bptree_status status = cursor_seek(&cursor, ranges[0].start_key, false);
+    bool visiting = status == BPTREE_OK;
+    for (int r = 0; r < n && visiting && cursor.item; r++) {
+        const bptree_range *range = &ranges[r];
+        if (tree->compare(cursor.item, range->start_key, tree->udata) < 0) {
+            cursor_skip_to(&cursor, range->start_key);
+        }
+        while (cursor.item && tree->compare(cursor.item, range->end_key, tree->udata) <= 0) {
+            if (!visit(cursor.item, range, user_data)) {
+                visiting = false;
+                break;
+            }
+            cursor.index++;
+            cursor_settle(&cursor);
+        }
     }
-    return tree;
-}
-
-inline void bptree_free(bptree *tree) {
-    if (tree == NULL) {
-        return;
+    if (cursor.path) {
+        tree->free_fn(cursor.path);
     }
-    free_node(tree, tree->root);
-    tree->free_fn(tree);
+    return status;
 }
 
-inline void **bptree_get_range(const bptree *tree, const void *start_key, const void *end_key,
-                               int *count) {
-    *count = 0;
-    if (tree == NULL || tree->root == NULL) {
-        return NULL;
+inline bptree_status bptree_scan_prefix(const bptree *tree, const void *prefix,
+                                        const size_t length, const bptree_visitor_t visit,
+                                        void *user_data) {
+    if (tree == NULL || tree->key_bytes == NULL || (prefix == NULL && length > 0) ||
+        visit == NULL) {
+        return BPTREE_ERROR;
     }
+    // The prefix sorts before every key it starts, so it leads to the first of them. An
+    // empty prefix starts every key, so the scan begins at the first leaf.
     const bptree_node *node = tree->root;
     while (!node->is_leaf) {
-        const int pos = internal_node_search(tree, node->keys, node->num_keys, start_key);
-        node = node->ptr.internal.children[pos];
+        const int pos = length > 0 ? internal_node_search_bytes(tree, node, prefix, length) : 0;
+        node = child_at(tree, node, pos);
     }
-    int capacity = 16;
-    void **results = tree->malloc_fn(capacity * sizeof(void *));
-    if (results == NULL) {
-        return NULL;
+    void *const *keys =
+        node->ptr.leaf.dense || node->ptr.leaf.delta_width ? node->ptr.leaf.items : node->keys;
+    int low = 0, high = length > 0 ? node->num_keys : 0;
+    while (low < high) {
+        const int mid = (low + high) / 2;
+        size_t key_length;
+        const unsigned char *bytes = tree->key_bytes(keys[mid], &key_length, tree->udata);
+        if (compare_bytes(bytes, key_length, prefix, length) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
-    while (node) {
-        for (int i = 0; i < node->num_keys; i++) {
-            if (tree->compare(node->keys[i], start_key, tree->udata) >= 0 &&
-                tree->compare(node->keys[i], end_key, tree->udata) <= 0) {
-                if (*count >= capacity) {
-                    capacity *= 2;
-                    void **temp = tree->malloc_fn(capacity * sizeof(void *));
-                    if (temp == NULL) {
-                        tree->free_fn(results);
-                        return NULL;
-                    }
-                    memcpy(temp, results, *count * sizeof(void *));
-                    tree->free_fn(results);
-                    results = temp;
-                }
-                results[(*count)++] = node->ptr.leaf.items[i];
-            } else if (tree->compare(node->keys[i], end_key, tree->udata) > 0) {
-                return results;
+    for (int i = low; node; node = next_leaf(tree, node), i = 0) {
+        BPTREE_PREFETCH(next_leaf(tree, node));
+        for (; i < node->num_keys; i++) {
+            void *item = node->ptr.leaf.items[i];
+            if (!item) {
+                continue;
+            }
+            size_t key_length;
+            const unsigned char *bytes = tree->key_bytes(item, &key_length, tree->udata);
+            if (key_length < length || (length > 0 && memcmp(bytes, prefix, length) != 0)) {
+                return BPTREE_OK;
+            }
+            if (!visit(item, user_data)) {
+                return BPTREE_OK;
             }
         }
-        node = node->ptr.leaf.next;
     }
-    return results;
+    return BPTREE_OK;
 }
 
-bptree *bptree_bulk_load(int max_keys,
-                         int (*compare)(const void *first, const void *second,
-                                        const void *user_data),
-                         void *user_data, bptree_malloc_t malloc_fn, bptree_free_t free_fn,
-                         bool debug_enabled, void **sorted_items, int n_items) {
-    if (n_items <= 0 || !sorted_items) {
-        return NULL;
-    }
-    bptree *tree = bptree_new(max_keys, compare, user_data, malloc_fn, free_fn, debug_enabled);
-    if (!tree) {
-        return NULL;
-    }
-    int items_per_leaf = tree->max_keys;
-    int n_leaves = (n_items + items_per_leaf - 1) / items_per_leaf;
-    bptree_node **leaves = tree->malloc_fn(n_leaves * sizeof(bptree_node *));
-    if (!leaves) {
-        bptree_free(tree);
-        return NULL;
+// Which items a set operation keeps: keys only in the first tree, only in the second, or in both.
+#define BPTREE_SET_ONLY_A 1
+#define BPTREE_SET_ONLY_B 2
+#define BPTREE_SET_BOTH 4
+
+/* Destination of the items kept by a set operation */
+typedef struct {
+    bptree_visitor_t visit; /**< Function called for each item kept, or NULL. */
+    void *user_data;        /**< User-provided data passed to visit. */
+    void **items;           /**< Array collecting the items for a new tree, or NULL. */
+    int count;              /**< Number of items collected. */
+} set_output;
+
+/**
+ * @brief Passes an item kept by a set operation to its destinations.
+ *
+ * @param output Destination of the items.
+ * @param item Item kept.
+ * @return false if the visitor asked to stop.
+ */
+static bool set_emit(set_output *output, void *item) {
+    if (output->items) {
+        output->items[output->count++] = item;
     }
-    int item_index = 0;
-    for (int i = 0; i < n_leaves; i++) {
-        bptree_node *leaf = create_leaf(tree);
-        if (!leaf) {
-            for (int j = 0; j < i; j++) {
-                free_node(tree, leaves[j]);
-            }
-            tree->free_fn(leaves);
-            bptree_free(tree);
-            return NULL;
-        }
-        int count = 0;
-        while (count < items_per_leaf && item_index < n_items) {
-            leaf->keys[count] = sorted_items[item_index];
-            leaf->ptr.leaf.items[count] = sorted_items[item_index];
-            count++;
-            item_index++;
-        }
-        leaf->num_keys = count;
-        leaves[i] = leaf;
-    }
-    for (int i = 0; i < n_leaves - 1; i++) {
-        leaves[i]->ptr.leaf.next = leaves[i + 1];
-    }
-    int level_count = n_leaves;
-    bptree_node **current_level = leaves;
-    // Build internal levels using a fixed group size equal to max_keys.
-    while (level_count > 1) {
-        int group_size = tree->max_keys;
-        int parent_count = (level_count + group_size - 1) / group_size;
-        bptree_node **parent_level = tree->malloc_fn(parent_count * sizeof(bptree_node *));
-        if (!parent_level) {
-            for (int j = 0; j < level_count; j++) {
-                free_node(tree, current_level[j]);
-            }
-            if (current_level != leaves) {
-                tree->free_fn(current_level);
-            }
-            bptree_free(tree);
-            return NULL;
-        }
-        int parent_index = 0;
-        int i = 0;
-        while (i < level_count) {
-            bptree_node *parent = create_internal(tree);
-            if (!parent) {
-                for (int j = 0; j < level_count; j++) {
-                    free_node(tree, current_level[j]);
-                }
-                for (int j = 0; j < parent_index; j++) {
-                    free_node(tree, parent_level[j]);
-                }
-                tree->free_fn(parent_level);
-                if (current_level != leaves) {
-                    tree->free_fn(current_level);
+    return !output->visit || output->visit(item, output->user_data);
+}
+
+/**
+ * @brief Moves a cursor to the next item.
+ *
+ * @param cursor Pointer to the cursor.
+ */
+static void cursor_step(bptree_cursor *cursor) {
+    cursor->index++;
+    cursor_settle(cursor);
+}
+
+/**
+ * @brief Merges the items of two trees from cursors at their first items.
+ *
+ * @param ca Cursor on the first tree.
+ * @param cb Cursor on the second tree.
+ * @param keep Combination of BPTREE_SET_ONLY_A, BPTREE_SET_ONLY_B, and BPTREE_SET_BOTH.
+ * @param output Destination of the items kept.
+ */
+static void merge_sets(bptree_cursor *ca, bptree_cursor *cb, const int keep, set_output *output) {
+    const bptree *tree = ca->tree;
+    // Consecutive items a side stepped over without keeping them.
+    int run_a = 0, run_b = 0;
+    while (ca->item && cb->item) {
+        const int cmp = tree->compare(ca->item, cb->item, tree->udata);
+        if (cmp < 0) {
+            if (keep & BPTREE_SET_ONLY_A) {
+                if (!set_emit(output, ca->item)) {
+                    return;
                 }
-                bptree_free(tree);
-                return NULL;
+                cursor_step(ca);
+            } else if (++run_a > 2) {
+                // Gallop: after a few single steps, let the separators skip the rest of the gap.
+                cursor_skip_to(ca, cb->item);
+                run_a = 0;
+            } else {
+                cursor_step(ca);
             }
-            int child_count = 0;
-            for (int j = 0; j < group_size && i < level_count; j++, i++) {
-                parent->ptr.internal.children[child_count] = current_level[i];
-                if (child_count > 0) {
-                    bptree_node *child = current_level[i];
-                    while (!child->is_leaf) {
-                        child = child->ptr.internal.children[0];
-                    }
-                    parent->keys[child_count - 1] = child->keys[0];
+        } else if (cmp > 0) {
+            if (keep & BPTREE_SET_ONLY_B) {
+                if (!set_emit(output, cb->item)) {
+                    return;
                 }
-                child_count++;
+                cursor_step(cb);
+            } else if (++run_b > 2) {
+                cursor_skip_to(cb, ca->item);
+                run_b = 0;
+            } else {
+                cursor_step(cb);
             }
-            parent->num_keys = child_count - 1;
-            parent_level[parent_index++] = parent;
-        }
-        tree->height++;
-        if (current_level != leaves) {
-            tree->free_fn(current_level);
-        }
-        current_level = parent_level;
-        level_count = parent_count;
-    }
-    // Save and free the initial root allocated by bptree_new.
-    bptree_node *old_root = tree->root;
-    tree->root = current_level[0];
-    free_node(tree, old_root);
-    if (current_level != leaves) {
-        tree->free_fn(current_level);
-    }
-    tree->free_fn(leaves);
-    if (!tree->root->is_leaf && tree->root->num_keys == 0) {
-        bptree_node *temp = tree->root;
-        tree->root = temp->ptr.internal.children[0];
-        tree->free_fn(temp->keys);
-        tree->free_fn(temp->ptr.internal.children);
-        tree->free_fn(temp);
-        tree->height--;
+        } else {
+            if ((keep & BPTREE_SET_BOTH) && !set_emit(output, ca->item)) {
+                return;
+            }
+            cursor_step(ca);
+            cursor_step(cb);
+            run_a = 0;
+            run_b = 0;
+        }
+    }
+    for (; ca->item && (keep & BPTREE_SET_ONLY_A); cursor_step(ca)) {
+        if (!set_emit(output, ca->item)) {
+            return;
+        }
+    }
+    for (; cb->item && (keep & BPTREE_SET_ONLY_B); cursor_step(cb)) {
+        if (!set_emit(output, cb->item)) {
+            return;
+        }
     }
-    tree->count = n_items;
-    return tree;
 }
 
-bptree_iterator *bptree_iterator_new(const bptree *tree) {
-    if (!tree || !tree->root) {
-        return NULL;
+/**
+ * @brief Runs a set operation between two trees.
+ *
+ * @param a Pointer to the first B+Tree.
+ * @param b Pointer to the second B+Tree.
+ * @param keep Combination of BPTREE_SET_ONLY_A, BPTREE_SET_ONLY_B, and BPTREE_SET_BOTH.
+ * @param visit Function called for each item kept, or NULL.
+ * @param user_data User-provided data passed to visit.
+ * @param out Receives the new tree, or NULL if no tree is wanted.
+ * @return Status code indicating the result of the operation.
+ */
+static bptree_status set_operation(const bptree *a, const bptree *b, const int keep,
+                                   const bptree_visitor_t visit, void *user_data, bptree **out) {
+    if (a == NULL || b == NULL || (visit == NULL && out == NULL)) {
+        return BPTREE_ERROR;
     }
-    bptree_iterator *iter = tree->malloc_fn(sizeof(bptree_iterator));
-    if (!iter) {
-        return NULL;
+    set_output output = {visit, user_data, NULL, 0};
+    bptree *result = NULL;
+    if (out) {
+        *out = NULL;
+        size_t capacity = 0;
+        if (keep & BPTREE_SET_ONLY_A) {
+            capacity += (size_t)a->count;
+        }
+        if (keep & BPTREE_SET_ONLY_B) {
+            capacity += (size_t)b->count;
+        }
+        if (keep == BPTREE_SET_BOTH) {
+            capacity = (size_t)(a->count < b->count ? a->count : b->count);
+        }
+        result = bptree_new_with_fanout(a->leaf_max_keys, a->internal_max_keys, a->compare,
+                                        a->udata, a->malloc_fn, a->free_fn, a->debug_enabled);
+        output.items = result ? a->malloc_fn((capacity > 0 ? capacity : 1) * sizeof(void *)) : NULL;
+        if (!output.items) {
+            if (result) {
+                bptree_free(result);
+            }
+            return BPTREE_ALLOCATION_ERROR;
+        }
+        copy_settings(a, result);
     }
-    bptree_node *node = tree->root;
-    while (!node->is_leaf) {
-        node = node->ptr.internal.children[0];
+    bptree_cursor ca, cb;
+    cursor_init(&ca, a);
+    cursor_init(&cb, b);
+    bptree_status status = cursor_seek(&ca, NULL, false);
+    if (status == BPTREE_OK) {
+        status = cursor_seek(&cb, NULL, false);
     }
-    iter->current_leaf = node;
-    iter->index = 0;
-    return iter;
-}
-
-void *bptree_iterator_next(bptree_iterator *iter) {
-    if (!iter || !iter->current_leaf) {
-        return NULL;
+    if (status == BPTREE_OK) {
+        merge_sets(&ca, &cb, keep, &output);
     }
-    if (iter->index < iter->current_leaf->num_keys) {
-        return iter->current_leaf->ptr.leaf.items[iter->index++];
-    } else {
-        iter->current_leaf = iter->current_leaf->ptr.leaf.next;
-        iter->index = 0;
-        if (!iter->current_leaf) {
-            return NULL;
+    if (ca.path) {
+        a->free_fn(ca.path);
+    }
+    if (cb.path) {
+        b->free_fn(cb.path);
+    }
+    if (result && status == BPTREE_OK && output.count > 0) {
+        int height;
+        sorted_source source = {output.items, NULL, NULL, 0};
+        bptree_node *root = build_from_sorted(result, &source, output.count, 100, &height);
+        if (root) {
+            // The initial root leaf lives inside the tree structure, so nothing is freed.
+            free_node(result, result->root);
+            result->root = root;
+            result->height = height;
+            result->count = output.count;
+        } else {
+            status = BPTREE_ALLOCATION_ERROR;
+        }
+    }
+    if (result) {
+        a->free_fn(output.items);
+        if (status == BPTREE_OK) {
+            *out = result;
+        } else {
+            bptree_free(result);
         }
-        return iter->current_leaf->ptr.leaf.items[iter->index++];
     }
+    return status;
 }
 
-void bptree_iterator_free(bptree_iterator *iter, bptree_free_t free_fn) {
-    if (iter && free_fn) {
-        free_fn(iter);
-    }
+inline bptree_status bptree_intersect(const bptree *a, const bptree *b,
+                                      const bptree_visitor_t visit, void *user_data,
+                                      bptree **out) {
+    return set_operation(a, b, BPTREE_SET_BOTH, visit, user_data, out);
+}
+
+inline bptree_status bptree_union(const bptree *a, const bptree *b, const bptree_visitor_t visit,
+                                  void *user_data, bptree **out) {
+    return set_operation(a, b, BPTREE_SET_ONLY_A | BPTREE_SET_ONLY_B | BPTREE_SET_BOTH, visit,
+                         user_data, out);
+}
+
+inline bptree_status bptree_difference(const bptree *a, const bptree *b,
+                                       const bptree_visitor_t visit, void *user_data,
+                                       bptree **out) {
+    return set_operation(a, b, BPTREE_SET_ONLY_A, visit, user_data, out);
 }
 
 /**
@@ -1087,18 +6500,26 @@ void bptree_iterator_free(bptree_iterator *iter, bptree_free_t free_fn) {
  *
  * @param tree Pointer to the B+Tree.
  * @param node Pointer to the current node.
- * @return Total count of nodes in the subtree.
+ * @param stats Node counters to increment for the subtree.
  */
-static int count_nodes(const bptree *tree, bptree_node *node) {
-    if (!node) return 0;
+static void count_nodes(const bptree *tree, const bptree_node *node, bptree_stats *stats) {
+    if (!node) return;
+    stats->node_count++;
+    if (node != &tree->root_leaf) {
+        stats->node_bytes += node->slab ? node->slab->slot_size
+                                        : sizeof(bptree_node) +
+                                              arrays_size(tree, node->is_leaf,
+                                                          node_capacity(tree, node));
+    }
     if (node->is_leaf) {
-        return 1;
+        stats->leaf_count++;
+        stats->dense_leaf_count += node->ptr.leaf.dense != 0;
+        stats->compressed_leaf_count += node->ptr.leaf.delta_width != 0;
+        return;
     }
-    int total = 1;
     for (int i = 0; i <= node->num_keys; i++) {
-        total += count_nodes(tree, node->ptr.internal.children[i]);
+        count_nodes(tree, child_at(tree, node, i), stats);
     }
-    return total;
 }
 
 bptree_stats bptree_get_stats(const bptree *tree) {
@@ -1107,11 +6528,36 @@ bptree_stats bptree_get_stats(const bptree *tree) {
         stats.count = 0;
         stats.height = 0;
         stats.node_count = 0;
+        stats.leaf_count = 0;
+        stats.dense_leaf_count = 0;
+        stats.compressed_leaf_count = 0;
+        stats.reserved_nodes = 0;
+        stats.node_bytes = 0;
+        stats.arena_bytes = 0;
+        stats.arena_hugetlb_bytes = 0;
         return stats;
     }
     stats.count = tree->count;
     stats.height = tree->height;
-    stats.node_count = count_nodes(tree, tree->root);
+    stats.node_count = 0;
+    stats.leaf_count = 0;
+    stats.dense_leaf_count = 0;
+    stats.compressed_leaf_count = 0;
+    stats.reserved_nodes = slab_room(tree->reserve[0]) + slab_room(tree->reserve[1]);
+    stats.node_bytes = 0;
+    stats.arena_bytes = 0;
+    stats.arena_hugetlb_bytes = 0;
+#ifdef BPTREE_HUGE_PAGES
+    for (const bptree_slab *slab = tree->slabs; slab; slab = slab->next) {
+        if (slab->mapped) {
+            stats.arena_bytes += BPTREE_HUGE_PAGE_SIZE;
+        }
+        if (slab->mapped == BPTREE_ARENA_HUGETLB) {
+            stats.arena_hugetlb_bytes += BPTREE_HUGE_PAGE_SIZE;
+        }
+    }
+#endif
+    count_nodes(tree, tree->root, &stats);
     return stats;
 }
 
@@ -9,6 +9,8 @@
 
 #define BPTREE_IMPLEMENTATION
 #include <assert.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,6 +40,45 @@ int compare_ints(const void *a, const void *b, const void *udata) {
     return (ia > ib) - (ia < ib);
 }
 
+/**
+ * @brief Comparison function for strings.
+ *
+ * @param a Pointer to the first string.
+ * @param b Pointer to the second string.
+ * @param udata Unused user data.
+ * @return Negative if a sorts before b, zero if equal, positive otherwise.
+ */
+int compare_strings(const void *a, const void *b, const void *udata) {
+    (void)udata;
+    return strcmp(a, b);
+}
+
+/**
+ * @brief Key bytes function for string items.
+ *
+ * @param item Pointer to a string.
+ * @param length Receives the length of the string.
+ * @param udata Unused user data.
+ * @return Pointer to the bytes of the string.
+ */
+const void *string_key_bytes(const void *item, size_t *length, const void *udata) {
+    (void)udata;
+    *length = strlen(item);
+    return item;
+}
+
+/**
+ * @brief Integer key function for dense leaves.
+ *
+ * @param item Pointer to an integer.
+ * @param udata Unused user data.
+ * @return The integer pointed to by @p item.
+ */
+long long int_key(const void *item, const void *udata) {
+    (void)udata;
+    return *(const int *)item;
+}
+
 /**
  * @brief Comparison function for qsort using integer pointers.
  *
@@ -53,6 +94,66 @@ int compare_ints_qsort(const void *a, const void *b) {
     return (*ia > *ib) - (*ia < *ib);
 }
 
+/**
+ * @brief Comparison function for qsort over 64-bit integers.
+ *
+ * @param a Pointer to the first integer.
+ * @param b Pointer to the second integer.
+ * @return Negative if *a < *b, zero if equal, positive if *a > *b.
+ */
+int compare_long_longs_qsort(const void *a, const void *b) {
+    const long long la = *(const long long *)a;
+    const long long lb = *(const long long *)b;
+    return (la > lb) - (la < lb);
+}
+
+/**
+ * @brief Number of bytes currently allocated through counting_malloc.
+ */
+size_t counted_bytes = 0;
+
+/**
+ * @brief Allocation function that keeps count of the bytes in use.
+ *
+ * @param size Number of bytes to allocate.
+ * @return Pointer to the allocated memory, or NULL on failure.
+ */
+void *counting_malloc(size_t size) {
+    unsigned char *block = malloc(sizeof(max_align_t) + size);
+    if (!block) {
+        return NULL;
+    }
+    memcpy(block, &size, sizeof(size));
+    counted_bytes += size;
+    return block + sizeof(max_align_t);
+}
+
+/**
+ * @brief Frees memory allocated by counting_malloc.
+ *
+ * @param ptr Pointer returned by counting_malloc, or NULL.
+ */
+void counting_free(void *ptr) {
+    if (ptr) {
+        unsigned char *block = (unsigned char *)ptr - sizeof(max_align_t);
+        size_t size;
+        memcpy(&size, block, sizeof(size));
+        counted_bytes -= size;
+        free(block);
+    }
+}
+
+/**
+ * @brief Returns the current wall-clock time in nanoseconds.
+ *
+ * @return Nanoseconds since the epoch.
+ */
+long long now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 /**
  * @brief Benchmarking macro.
  *
@@ -75,6 +176,61 @@ int compare_ints_qsort(const void *a, const void *b) {
                elapsed / (count));                                                                \
     } while (0)
 
+/**
+ * @brief Counts the items visited by bptree_get_ranges.
+ *
+ * @param item Pointer to the item (unused).
+ * @param range Range the item was found in (unused).
+ * @param user_data Pointer to the counter.
+ * @return Always true.
+ */
+bool count_visited(void *item, const bptree_range *range, void *user_data) {
+    (void)item;
+    (void)range;
+    ++*(long long *)user_data;
+    return true;
+}
+
+/**
+ * @brief Counts the items visited by bptree_scan_prefix or a set operation.
+ *
+ * @param item Pointer to the item (unused).
+ * @param user_data Pointer to the counter.
+ * @return Always true.
+ */
+bool count_item(void *item, void *user_data) {
+    (void)item;
+    ++*(long long *)user_data;
+    return true;
+}
+
+/**
+ * @brief Hashes an integer item for node hashes.
+ *
+ * @param item Pointer to the integer.
+ * @param user_data Unused user data.
+ * @return Hash of the integer.
+ */
+unsigned long long hash_int(const void *item, const void *user_data) {
+    (void)user_data;
+    return (unsigned long long)*(const int *)item * 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * @brief Counts the keys reported by bptree_diff.
+ *
+ * @param a_item Item of the first tree, or NULL (unused).
+ * @param b_item Item of the second tree, or NULL (unused).
+ * @param user_data Pointer to the counter.
+ * @return Always true.
+ */
+bool count_difference(void *a_item, void *b_item, void *user_data) {
+    (void)a_item;
+    (void)b_item;
+    ++*(long long *)user_data;
+    return true;
+}
+
 /**
  * @brief Shuffles an array in-place.
  *
@@ -99,11 +255,23 @@ void shuffle(void **array, const int n) {
  * This function reads environment variables for seed, maximum items per node,
  * and number of elements (N) to test with. It then performs various benchmarks:
  * - Bulk load benchmark
- * - Insertion benchmarks (random and sequential)
+ * - Insertion benchmarks (random and sequential, and random with leaf redistribution)
  * - Search benchmarks (random and sequential)
  * - Iterator benchmark
  * - Deletion benchmarks (random and sequential)
  * - Range search benchmark
+ * - Churn benchmark (alternating removal and reinsertion) for several min fill policies
+ * - Scan before and after compacting a churned tree
+ * - Fanout sweep over leaf and internal node capacities (search and scan)
+ * - Scan of a randomly built tree with and without leaf clustering
+ * - Insertion, scan and deletion with large leaves, packed and gapped
+ * - Insertion and search over a dense integer range, with and without dense leaves
+ * - Insertion and search over spread-out integers, with and without compressed leaves
+ * - Creating, filling and freeing many trees that hold only a few items each
+ * - Insertion, search and deletion with fixed and variable node capacities, with
+ *   the node memory before and after trimming the thinned-out tree to fit
+ * - Insertion and search of random string keys with item-pointer and truncated separators
+ * - Insertion latency percentiles with and without nodes reserved ahead of time
  *
  * @return Exit status.
  */
@@ -154,6 +322,26 @@ int main(void) {
             const bptree_status stat = bptree_put(tree, pointers[bench_i]);
             assert(stat == BPTREE_OK);
         });
+        const bptree_stats stats = bptree_get_stats(tree);
+        printf("Leaves after insertion (rand): %d (%.1f%% full), nodes: %d\n", stats.leaf_count,
+               100.0 * stats.count / ((double)stats.leaf_count * max_keys), stats.node_count);
+        bptree_free(tree);
+    }
+    {
+        bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+        if (!tree ||
+            bptree_set_overflow_policy(tree, BPTREE_OVERFLOW_REDISTRIBUTE) != BPTREE_OK) {
+            fprintf(stderr, "Failed to create tree\n");
+            exit(1);
+        }
+        BENCH("Insertion (rand, redistribute)", N, {
+            const bptree_status stat = bptree_put(tree, pointers[bench_i]);
+            assert(stat == BPTREE_OK);
+        });
+        const bptree_stats stats = bptree_get_stats(tree);
+        printf("Leaves after insertion (rand, redistribute): %d (%.1f%% full), nodes: %d\n",
+               stats.leaf_count, 100.0 * stats.count / ((double)stats.leaf_count * max_keys),
+               stats.node_count);
         bptree_free(tree);
     }
     qsort(pointers, N, sizeof(void *), compare_ints_qsort);
@@ -315,6 +503,1045 @@ int main(void) {
         bptree_free(tree);
     }
 
+    /* --- Churn Benchmarks --- */
+    {
+        const int fills[] = {50, 25, 0};
+        for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+            qsort(pointers, N, sizeof(void *), compare_ints_qsort);
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree || bptree_set_min_fill(tree, fills[f]) != BPTREE_OK) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            // Sequential insertion leaves every leaf at the minimum fill, so under the
+            // classic policy each removal merges and each reinsertion splits again.
+            for (int i = 0; i < N; i++) {
+                const bptree_status stat = bptree_put(tree, pointers[i]);
+                assert(stat == BPTREE_OK);
+            }
+            shuffle(pointers, N);
+            char label[64];
+            snprintf(label, sizeof(label), "Churn (min fill %d%%)", fills[f]);
+            BENCH(label, N, {
+                bptree_status stat = bptree_remove(tree, pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+                stat = bptree_put(tree, pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+            });
+            printf("Node count after churn (min fill %d%%): %d\n", fills[f],
+                   bptree_get_stats(tree).node_count);
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Compaction Benchmark --- */
+    {
+        shuffle(pointers, N);
+        bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+        if (!tree) {
+            fprintf(stderr, "Failed to create tree\n");
+            exit(1);
+        }
+        for (int i = 0; i < N; i++) {
+            const bptree_status stat = bptree_put(tree, pointers[i]);
+            assert(stat == BPTREE_OK);
+        }
+        // Remove every other item to leave half-empty leaves behind.
+        for (int i = 0; i < N; i += 2) {
+            const bptree_status stat = bptree_remove(tree, pointers[i]);
+            assert(stat == BPTREE_OK);
+        }
+        for (int pass = 0; pass < 2; pass++) {
+            const bptree_stats stats = bptree_get_stats(tree);
+            printf("%s compaction: leaves=%d, nodes=%d\n", pass ? "After" : "Before",
+                   stats.leaf_count, stats.node_count);
+            BENCH(pass ? "Scan (compacted)" : "Scan (churned)", 10, {
+                bptree_iterator *iter = bptree_iterator_new(tree);
+                while (bptree_iterator_next(iter) != NULL) {
+                }
+                bptree_iterator_free(iter, tree->free_fn);
+            });
+            if (!pass) {
+                BENCH("Compaction", 1, {
+                    const bptree_status stat = bptree_compact(tree, 100);
+                    assert(stat == BPTREE_OK);
+                });
+            }
+        }
+        bptree_free(tree);
+    }
+
+    /* --- Fanout Sweep Benchmarks --- */
+    {
+        // Large leaves favor scans, small internal nodes favor descents.
+        const int leaf_sizes[] = {16, 64, 256};
+        const int internal_sizes[] = {8, 32, 128};
+        for (size_t l = 0; l < sizeof(leaf_sizes) / sizeof(leaf_sizes[0]); l++) {
+            for (size_t n = 0; n < sizeof(internal_sizes) / sizeof(internal_sizes[0]); n++) {
+                qsort(pointers, N, sizeof(void *), compare_ints_qsort);
+                bptree *tree = bptree_bulk_load_with_fanout(leaf_sizes[l], internal_sizes[n],
+                                                            compare_ints, NULL, NULL, NULL,
+                                                            debug_enabled, pointers, N);
+                if (!tree) {
+                    fprintf(stderr, "Bulk load failed\n");
+                    exit(1);
+                }
+                const bptree_stats stats = bptree_get_stats(tree);
+                printf("Fanout leaf=%d internal=%d: height=%d, nodes=%d\n", leaf_sizes[l],
+                       internal_sizes[n], stats.height, stats.node_count);
+                shuffle(pointers, N);
+                char label[64];
+                snprintf(label, sizeof(label), "Search (rand, leaf=%d internal=%d)", leaf_sizes[l],
+                         internal_sizes[n]);
+                BENCH(label, N, {
+                    void *res = bptree_get(tree, pointers[bench_i]);
+                    assert(res != NULL);
+                });
+                snprintf(label, sizeof(label), "Scan (leaf=%d internal=%d)", leaf_sizes[l],
+                         internal_sizes[n]);
+                BENCH(label, 10, {
+                    bptree_iterator *iter = bptree_iterator_new(tree);
+                    while (bptree_iterator_next(iter) != NULL) {
+                    }
+                    bptree_iterator_free(iter, tree->free_fn);
+                });
+                bptree_free(tree);
+            }
+        }
+    }
+
+    /* --- Leaf Clustering Benchmarks --- */
+    {
+        // Random insertion order scatters leaves unless splits allocate near their neighbor.
+        const int chunks[] = {0, 64};
+        for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+            shuffle(pointers, N);
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            bptree_status stat = bptree_set_leaf_clustering(tree, chunks[c]);
+            assert(stat == BPTREE_OK);
+            for (int i = 0; i < N; i++) {
+                stat = bptree_put(tree, pointers[i]);
+                assert(stat == BPTREE_OK);
+            }
+            char label[64];
+            snprintf(label, sizeof(label), "Scan (leaf chunk=%d)", chunks[c]);
+            BENCH(label, 10, {
+                bptree_iterator *iter = bptree_iterator_new(tree);
+                while (bptree_iterator_next(iter) != NULL) {
+                }
+                bptree_iterator_free(iter, tree->free_fn);
+            });
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Gapped Leaf Benchmarks --- */
+    {
+        // Large leaves make the per-insert shift expensive unless gaps absorb it.
+        const int leaf_size = 256;
+        for (int gapped = 0; gapped < 2; gapped++) {
+            shuffle(pointers, N);
+            bptree *tree = bptree_new(leaf_size, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            bptree_status stat = bptree_set_gapped_leaves(tree, gapped);
+            assert(stat == BPTREE_OK);
+            const char *layout = gapped ? "gapped" : "packed";
+            char label[64];
+            snprintf(label, sizeof(label), "Insertion (rand, leaf=%d, %s)", leaf_size, layout);
+            BENCH(label, N, {
+                stat = bptree_put(tree, pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+            });
+            snprintf(label, sizeof(label), "Scan (leaf=%d, %s)", leaf_size, layout);
+            BENCH(label, 10, {
+                bptree_iterator *iter = bptree_iterator_new(tree);
+                while (bptree_iterator_next(iter) != NULL) {
+                }
+                bptree_iterator_free(iter, tree->free_fn);
+            });
+            shuffle(pointers, N);
+            snprintf(label, sizeof(label), "Deletion (rand, leaf=%d, %s)", leaf_size, layout);
+            BENCH(label, N, {
+                stat = bptree_remove(tree, pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+            });
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Dense Leaf Benchmarks --- */
+    {
+        // The values are the dense range [0, N), so every leaf can use a bitmap index.
+        for (int dense = 0; dense < 2; dense++) {
+            shuffle(pointers, N);
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            bptree_status stat = bptree_set_int_keys(tree, dense ? int_key : NULL);
+            assert(stat == BPTREE_OK);
+            const char *layout = dense ? "dense leaves" : "sorted leaves";
+            char label[64];
+            snprintf(label, sizeof(label), "Insertion (rand, %s)", layout);
+            BENCH(label, N, {
+                stat = bptree_put(tree, pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+            });
+            const bptree_stats stats = bptree_get_stats(tree);
+            printf("Dense leaves: %d of %d\n", stats.dense_leaf_count, stats.leaf_count);
+            shuffle(pointers, N);
+            snprintf(label, sizeof(label), "Search (rand, %s)", layout);
+            BENCH(label, N, {
+                void *res = bptree_get(tree, pointers[bench_i]);
+                assert(res != NULL);
+            });
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Compressed Leaf Benchmarks --- */
+    {
+        // Values a thousand apart are too sparse for bitmaps but fit 2-byte offsets.
+        int *spread = malloc(N * sizeof(int));
+        void **spread_pointers = malloc(N * sizeof(void *));
+        if (!spread || !spread_pointers) {
+            fprintf(stderr, "Allocation failed\n");
+            exit(1);
+        }
+        for (int i = 0; i < N; i++) {
+            spread[i] = (int)((long long)i * 1000 % INT_MAX);
+            spread_pointers[i] = &spread[i];
+        }
+        for (int compressed = 0; compressed < 2; compressed++) {
+            shuffle(spread_pointers, N);
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            bptree_status stat = bptree_set_int_keys(tree, int_key);
+            assert(stat == BPTREE_OK);
+            stat = bptree_set_compressed_leaves(tree, compressed);
+            assert(stat == BPTREE_OK);
+            const char *layout = compressed ? "compressed leaves" : "sorted leaves";
+            char label[64];
+            snprintf(label, sizeof(label), "Insertion (rand spread, %s)", layout);
+            BENCH(label, N, {
+                stat = bptree_put(tree, spread_pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+            });
+            const bptree_stats stats = bptree_get_stats(tree);
+            printf("Compressed leaves: %d of %d\n", stats.compressed_leaf_count, stats.leaf_count);
+            shuffle(spread_pointers, N);
+            snprintf(label, sizeof(label), "Search (rand spread, %s)", layout);
+            BENCH(label, N, {
+                void *res = bptree_get(tree, spread_pointers[bench_i]);
+                assert(res != NULL);
+            });
+            bptree_free(tree);
+        }
+        free(spread_pointers);
+        free(spread);
+    }
+
+    /* --- Tiny Tree Benchmarks --- */
+    {
+        // One small tree per tenant: most trees hold a handful of items.
+        const int items_per_tree = 8;
+        const int n_trees = N / items_per_tree;
+        bptree **trees = malloc(n_trees * sizeof(bptree *));
+        if (!trees) {
+            fprintf(stderr, "Allocation failed\n");
+            exit(1);
+        }
+        BENCH("Tiny trees (create and fill 8 items)", n_trees, {
+            trees[bench_i] = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            assert(trees[bench_i] != NULL);
+            for (int j = 0; j < items_per_tree; j++) {
+                const bptree_status stat =
+                    bptree_put(trees[bench_i], pointers[bench_i * items_per_tree + j]);
+                assert(stat == BPTREE_OK);
+            }
+        });
+        BENCH("Tiny trees (search)", n_trees, {
+            void *res = bptree_get(trees[bench_i], pointers[bench_i * items_per_tree]);
+            assert(res != NULL);
+        });
+        BENCH("Tiny trees (free)", n_trees, { bptree_free(trees[bench_i]); });
+        free(trees);
+        // Memory of one tree: its structure with the inline root leaf, plus any nodes allocated
+        // once the items outgrow it.
+        printf("sizeof(bptree): %zu bytes\n", sizeof(bptree));
+        const int sizes[] = {0, 1, 4, 8, 9, 10, 11, 16};
+        for (int s = 0; s < 8; s++) {
+            counted_bytes = 0;
+            bptree *tree =
+                bptree_new(max_keys, compare_ints, NULL, counting_malloc, counting_free,
+                           debug_enabled);
+            assert(tree != NULL);
+            for (int j = 0; j < sizes[s]; j++) {
+                const bptree_status stat = bptree_put(tree, pointers[j]);
+                assert(stat == BPTREE_OK);
+            }
+            printf("Tiny tree footprint (%d items): %zu bytes\n", sizes[s], counted_bytes);
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Variable Capacity Benchmarks --- */
+    {
+        for (int variable = 0; variable < 2; variable++) {
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            bptree_status stat = bptree_set_variable_capacity(tree, variable);
+            if (stat != BPTREE_OK) {
+                printf("Variable node capacities are not available in this build\n");
+                bptree_free(tree);
+                break;
+            }
+            stat = bptree_set_min_fill(tree, 0);
+            assert(stat == BPTREE_OK);
+            const char *sizing = variable ? "variable capacity" : "fixed capacity";
+            char label[64];
+            qsort(pointers, N, sizeof(void *), compare_ints_qsort);
+            snprintf(label, sizeof(label), "Insertion (seq, %s)", sizing);
+            BENCH(label, N, {
+                stat = bptree_put(tree, pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+            });
+            printf("Node memory (seq, %s): %.1f MB\n", sizing,
+                   bptree_get_stats(tree).node_bytes / 1048576.0);
+            shuffle(pointers, N);
+            snprintf(label, sizeof(label), "Search (rand, %s)", sizing);
+            BENCH(label, N, {
+                void *res = bptree_get(tree, pointers[bench_i]);
+                assert(res != NULL);
+            });
+            // Remove three quarters of the items, leaving sparse nodes behind.
+            snprintf(label, sizeof(label), "Deletion (rand, %s)", sizing);
+            BENCH(label, N - N / 4, {
+                stat = bptree_remove(tree, pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+            });
+            printf("Node memory (25%% left, %s): %.1f MB\n", sizing,
+                   bptree_get_stats(tree).node_bytes / 1048576.0);
+            snprintf(label, sizeof(label), "Shrink to fit (%s)", sizing);
+            BENCH(label, 1, {
+                stat = bptree_shrink_to_fit(tree);
+                assert(stat == BPTREE_OK);
+            });
+            printf("Node memory (trimmed, %s): %.1f MB\n", sizing,
+                   bptree_get_stats(tree).node_bytes / 1048576.0);
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Truncated Separator Benchmarks --- */
+    {
+        char(*strings)[24] = malloc(N * sizeof(*strings));
+        void **string_pointers = malloc(N * sizeof(void *));
+        if (!strings || !string_pointers) {
+            fprintf(stderr, "Allocation failed\n");
+            exit(1);
+        }
+        for (int i = 0; i < N; i++) {
+            snprintf(strings[i], sizeof(strings[i]), "user:%010u", (unsigned)i * 2654435761u);
+            string_pointers[i] = strings[i];
+        }
+        for (int truncated = 0; truncated < 2; truncated++) {
+            bptree *tree = bptree_new(max_keys, compare_strings, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            bptree_status stat = bptree_set_key_bytes(tree, truncated ? string_key_bytes : NULL);
+            assert(stat == BPTREE_OK);
+            const char *separators = truncated ? "truncated separators" : "item separators";
+            char label[64];
+            shuffle(string_pointers, N);
+            snprintf(label, sizeof(label), "Insertion (rand strings, %s)", separators);
+            BENCH(label, N, {
+                stat = bptree_put(tree, string_pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+            });
+            shuffle(string_pointers, N);
+            snprintf(label, sizeof(label), "Search (rand strings, %s)", separators);
+            BENCH(label, N, {
+                void *res = bptree_get(tree, string_pointers[bench_i]);
+                assert(res != NULL);
+            });
+            bptree_free(tree);
+        }
+        free(string_pointers);
+        free(strings);
+    }
+
+    /* --- Prefix Scan Benchmarks --- */
+    // Each prefix matches 100 keys; the range version searches up to the prefix's successor.
+    {
+        char(*strings)[16] = malloc(N * sizeof(*strings));
+        bptree *tree = bptree_new(max_keys, compare_strings, NULL, NULL, NULL, debug_enabled);
+        if (!strings || !tree || bptree_set_key_bytes(tree, string_key_bytes) != BPTREE_OK) {
+            fprintf(stderr, "Failed to create tree\n");
+            exit(1);
+        }
+        for (int i = 0; i < N; i++) {
+            snprintf(strings[i], sizeof(strings[i]), "item:%08d", i);
+            const bptree_status stat = bptree_put(tree, strings[i]);
+            assert(stat == BPTREE_OK);
+        }
+        const int scans = N / 100 < 10000 ? N / 100 : 10000;
+        long long visited[2] = {0, 0};
+        for (int prefixed = 0; prefixed < 2; prefixed++) {
+            const char *label = prefixed ? "Prefix scan (bptree_scan_prefix)"
+                                         : "Prefix scan (bptree_get_range to successor)";
+            BENCH(label, scans, {
+                char prefix[16];
+                const int length = snprintf(prefix, sizeof(prefix), "item:%06d",
+                                            (int)((long long)bench_i * (N / 100) / scans));
+                if (prefixed) {
+                    const bptree_status stat =
+                        bptree_scan_prefix(tree, prefix, length, count_item, &visited[1]);
+                    assert(stat == BPTREE_OK);
+                } else {
+                    char successor[16];
+                    memcpy(successor, prefix, length + 1);
+                    successor[length - 1]++;
+                    int count = 0;
+                    void **res = bptree_get_range(tree, prefix, successor, &count);
+                    visited[0] += count;
+                    tree->free_fn(res);
+                }
+            });
+        }
+        assert(visited[0] == visited[1]);
+        bptree_free(tree);
+        free(strings);
+    }
+
+    /* --- Reserve Benchmarks --- */
+    {
+        long long *latencies = malloc(N * sizeof(long long));
+        if (!latencies) {
+            fprintf(stderr, "Allocation failed\n");
+            exit(1);
+        }
+        for (int reserve = 0; reserve < 2; reserve++) {
+            shuffle(pointers, N);
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            bptree_status stat = BPTREE_OK;
+            if (reserve) {
+                BENCH("Reserve (N items)", 1, {
+                    stat = bptree_reserve(tree, N);
+                    assert(stat == BPTREE_OK);
+                });
+            }
+            const char *allocation = reserve ? "reserved" : "on demand";
+            for (int i = 0; i < N; i++) {
+                const long long start = now_ns();
+                stat = bptree_put(tree, pointers[i]);
+                latencies[i] = now_ns() - start;
+                assert(stat == BPTREE_OK);
+            }
+            qsort(latencies, N, sizeof(long long), compare_long_longs_qsort);
+            printf("Insertion latency (rand, %s): p50 %lld ns, p99 %lld ns, p99.9 %lld ns, "
+                   "max %lld ns\n",
+                   allocation, latencies[N / 2], latencies[(int)(N * 0.99)],
+                   latencies[(int)(N * 0.999)], latencies[N - 1]);
+            printf("Reserved nodes left: %d\n", bptree_get_stats(tree).reserved_nodes);
+            bptree_free(tree);
+        }
+        free(latencies);
+    }
+
+    /* --- Huge Page Benchmarks --- */
+    // Run under `perf stat -e dTLB-loads,dTLB-load-misses` to see the TLB misses saved.
+    {
+        const char *placements[] = {"small pages", "huge internal nodes", "huge nodes"};
+        for (int kinds = 0; kinds < 3; kinds++) {
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            bptree_status stat = bptree_set_huge_pages(tree, kinds > 0, kinds > 1);
+            if (stat != BPTREE_OK) {
+                printf("Huge pages are not available in this build\n");
+                bptree_free(tree);
+                break;
+            }
+            char label[64];
+            shuffle(pointers, N);
+            snprintf(label, sizeof(label), "Insertion (rand, %s)", placements[kinds]);
+            BENCH(label, N, {
+                stat = bptree_put(tree, pointers[bench_i]);
+                assert(stat == BPTREE_OK);
+            });
+            shuffle(pointers, N);
+            snprintf(label, sizeof(label), "Search (rand, %s)", placements[kinds]);
+            BENCH(label, N, {
+                void *res = bptree_get(tree, pointers[bench_i]);
+                assert(res != NULL);
+            });
+            const bptree_stats stats = bptree_get_stats(tree);
+            printf("Arena (%s): %.1f MB, %.1f MB from reserved huge pages\n", placements[kinds],
+                   stats.arena_bytes / 1048576.0, stats.arena_hugetlb_bytes / 1048576.0);
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Hinted Operation Benchmarks --- */
+    // Keys in ascending order make consecutive operations land in the same leaf.
+    {
+        qsort(pointers, N, sizeof(void *), compare_ints_qsort);
+        for (int hinted = 0; hinted < 2; hinted++) {
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            bptree_hint hint = {0};
+            const char *access = hinted ? "hinted" : "from root";
+            char label[64];
+            snprintf(label, sizeof(label), "Insertion (seq, %s)", access);
+            BENCH(label, N, {
+                void *item = pointers[bench_i];
+                const bptree_status stat =
+                    hinted ? bptree_put_hinted(tree, item, &hint) : bptree_put(tree, item);
+                assert(stat == BPTREE_OK);
+            });
+            snprintf(label, sizeof(label), "Search (seq, %s)", access);
+            BENCH(label, N, {
+                void *res = hinted ? bptree_get_hinted(tree, pointers[bench_i], &hint)
+                                   : bptree_get(tree, pointers[bench_i]);
+                assert(res != NULL);
+            });
+            snprintf(label, sizeof(label), "Deletion (seq, %s)", access);
+            BENCH(label, N, {
+                const void *key = pointers[bench_i];
+                const bptree_status stat =
+                    hinted ? bptree_remove_hinted(tree, key, &hint) : bptree_remove(tree, key);
+                assert(stat == BPTREE_OK);
+            });
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Cursor Benchmarks --- */
+    // A filtering pass that walks the whole tree and removes every other item.
+    {
+        for (int with_cursor = 0; with_cursor < 2; with_cursor++) {
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            for (int i = 0; i < N; i++) {
+                const bptree_status stat = bptree_put(tree, pointers[i]);
+                assert(stat == BPTREE_OK);
+            }
+            bptree_cursor *cursor = bptree_cursor_new(tree, NULL);
+            bptree_iterator *iter = bptree_iterator_new(tree);
+            void **doomed = malloc(((N + 1) / 2) * sizeof(void *));
+            if (!cursor || !iter || !doomed) {
+                fprintf(stderr, "Failed to create cursor\n");
+                exit(1);
+            }
+            const char *label = with_cursor ? "Filter pass (bptree_cursor_remove)"
+                                             : "Filter pass (iterate, then bptree_remove)";
+            BENCH(label, N, {
+                if (!with_cursor) {
+                    void *item = bptree_iterator_next(iter);
+                    if (bench_i % 2 == 0) {
+                        doomed[bench_i / 2] = item;
+                    }
+                    if (bench_i == N - 1) {
+                        for (int i = 0; i < (N + 1) / 2; i++) {
+                            const bptree_status stat = bptree_remove(tree, doomed[i]);
+                            assert(stat == BPTREE_OK);
+                        }
+                    }
+                } else if (bench_i % 2 == 0) {
+                    const bptree_status stat = bptree_cursor_remove(cursor);
+                    assert(stat == BPTREE_OK);
+                } else {
+                    bptree_cursor_next(cursor);
+                }
+            });
+            assert(tree->count == N / 2);
+            free(doomed);
+            bptree_iterator_free(iter, tree->free_fn);
+            bptree_cursor_free(cursor);
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Pagination Benchmarks --- */
+    // Pages of 100 items through windows of 20,000 keys, as an API listing rows would read them.
+    {
+        qsort(pointers, N, sizeof(void *), compare_ints_qsort);
+        bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+        void **page = malloc(100 * sizeof(void *));
+        if (!tree || !page) {
+            fprintf(stderr, "Failed to create tree\n");
+            exit(1);
+        }
+        for (int i = 0; i < N; i++) {
+            const bptree_status stat = bptree_put(tree, pointers[i]);
+            assert(stat == BPTREE_OK);
+        }
+        const int window = N < 20000 ? N : 20000;
+        const int pages = window / 100;
+        const int windows = 10;
+        BENCH("Pagination (bptree_get_range per page)", windows * pages, {
+            const int first = bench_i / pages * (N - window) / windows;
+            const void *start = pointers[first + bench_i % pages * 100];
+            int count = 0;
+            void **res = bptree_get_range(tree, start, pointers[first + window - 1], &count);
+            assert(count >= 100);
+            memcpy(page, res, 100 * sizeof(void *));
+            tree->free_fn(res);
+        });
+        bptree_range_token token = {0};
+        BENCH("Pagination (bptree_get_range_limit)", windows * pages, {
+            const int first = bench_i / pages * (N - window) / windows;
+            if (bench_i % pages == 0) {
+                token = (bptree_range_token){0};
+            }
+            const void *end = pointers[first + window - 1];
+            const int count = bptree_get_range_limit(tree, pointers[first], end, 100, page, &token);
+            assert(count == 100);
+        });
+        free(page);
+        bptree_free(tree);
+    }
+
+    /* --- Multi-Range Benchmarks --- */
+    // Queries of 1,000 ranges of 10 keys within 100,000 keys, as a Z-order decomposition of a
+    // region yields them, in random order.
+    {
+        qsort(pointers, N, sizeof(void *), compare_ints_qsort);
+        bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+        const int n_ranges = 1000;
+        const int queries = 100;
+        bptree_range *ranges = malloc(n_ranges * sizeof(bptree_range));
+        int *starts = malloc(queries * n_ranges * sizeof(int));
+        if (!tree || !ranges || !starts) {
+            fprintf(stderr, "Failed to create tree\n");
+            exit(1);
+        }
+        for (int i = 0; i < N; i++) {
+            const bptree_status stat = bptree_put(tree, pointers[i]);
+            assert(stat == BPTREE_OK);
+        }
+        const int region = N < 100000 ? N - 10 : 100000;
+        for (int i = 0; i < queries * n_ranges; i++) {
+            starts[i] = i / n_ranges * ((N - 10 - region) / queries) + rand() % region;
+        }
+        long long visited = 0;
+        for (int batched = 0; batched < 2; batched++) {
+            const char *label = batched ? "Multi-range query (bptree_get_ranges)"
+                                        : "Multi-range query (bptree_get_range per range)";
+            BENCH(label, queries, {
+                for (int r = 0; r < n_ranges; r++) {
+                    const int start = starts[bench_i * n_ranges + r];
+                    ranges[r].start_key = pointers[start];
+                    ranges[r].end_key = pointers[start + 9];
+                }
+                if (batched) {
+                    const bptree_status stat =
+                        bptree_get_ranges(tree, ranges, n_ranges, count_visited, &visited);
+                    assert(stat == BPTREE_OK);
+                } else {
+                    for (int r = 0; r < n_ranges; r++) {
+                        int count = 0;
+                        void **res = bptree_get_range(tree, ranges[r].start_key,
+                                                      ranges[r].end_key, &count);
+                        visited += count;
+                        tree->free_fn(res);
+                    }
+                }
+            });
+        }
+        assert(visited > 0);
+        free(starts);
+        free(ranges);
+        bptree_free(tree);
+    }
+
+    /* --- Priority Queue Benchmarks --- */
+    // Draining a tree from its smallest item, as a work queue would.
+    {
+        for (int pop = 0; pop < 2; pop++) {
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            shuffle(pointers, N);
+            for (int i = 0; i < N; i++) {
+                const bptree_status stat = bptree_put(tree, pointers[i]);
+                assert(stat == BPTREE_OK);
+            }
+            const char *label =
+                pop ? "Pop min (bptree_pop_min)" : "Pop min (iterator, then bptree_remove)";
+            BENCH(label, N, {
+                void *item;
+                bptree_status stat;
+                if (pop) {
+                    stat = bptree_pop_min(tree, &item);
+                } else {
+                    bptree_iterator *iter = bptree_iterator_new(tree);
+                    item = bptree_iterator_next(iter);
+                    bptree_iterator_free(iter, tree->free_fn);
+                    stat = bptree_remove(tree, item);
+                }
+                assert(stat == BPTREE_OK);
+            });
+            assert(tree->count == 0);
+            bptree_free(tree);
+        }
+    }
+
+    /* --- Clone Benchmarks --- */
+    {
+        bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+        if (!tree) {
+            fprintf(stderr, "Failed to create tree\n");
+            exit(1);
+        }
+        shuffle(pointers, N);
+        for (int i = 0; i < N; i++) {
+            const bptree_status stat = bptree_put(tree, pointers[i]);
+            assert(stat == BPTREE_OK);
+        }
+        bptree *copy = NULL;
+        BENCH("Clone (iterate and re-insert)", 1, {
+            copy = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            bptree_iterator *iter = bptree_iterator_new(tree);
+            void *item;
+            while ((item = bptree_iterator_next(iter)) != NULL) {
+                const bptree_status stat = bptree_put(copy, item);
+                assert(stat == BPTREE_OK);
+            }
+            bptree_iterator_free(iter, tree->free_fn);
+        });
+        bptree_free(copy);
+        BENCH("Clone (bptree_clone)", 1, { copy = bptree_clone(tree); });
+        assert(copy && copy->count == N);
+        bptree_free(copy);
+        BENCH("Clone (bptree_clone_parallel, 4 threads)", 1,
+              { copy = bptree_clone_parallel(tree, 4); });
+        assert(copy && copy->count == N);
+        bptree_free(copy);
+        // The floor a structural copy approaches: copying as many bytes as the nodes take.
+        const size_t node_bytes = bptree_get_stats(tree).node_bytes;
+        char *from = malloc(node_bytes);
+        char *to = malloc(node_bytes);
+        if (!from || !to) {
+            fprintf(stderr, "Allocation failed\n");
+            exit(1);
+        }
+        memset(from, 1, node_bytes);
+        BENCH("Clone (memcpy of the node memory)", 1, { memcpy(to, from, node_bytes); });
+        long touched = 0;
+        for (size_t i = 0; i < node_bytes; i += 4096) {
+            touched += to[i];
+        }
+        printf("Node memory copied: %.1f MB in %ld pages\n", node_bytes / 1048576.0, touched);
+        free(to);
+        free(from);
+        bptree_free(tree);
+    }
+
+    /* --- Merged Scan Benchmarks --- */
+    // The items spread over k trees, as with data sharded by time, scanned in one key order.
+    // The keys either interleave across the trees or come in blocks of 1000 per tree.
+    for (int k = 8; k <= 64; k *= 8) {
+        for (int blocks = 0; blocks < 2; blocks++) {
+            bptree **trees = malloc(k * sizeof(bptree *));
+            bptree_iterator **iters = malloc(k * sizeof(bptree_iterator *));
+            void **heads = malloc(k * sizeof(void *));
+            if (!trees || !iters || !heads) {
+                fprintf(stderr, "Allocation failed\n");
+                exit(1);
+            }
+            for (int t = 0; t < k; t++) {
+                trees[t] = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+                if (!trees[t]) {
+                    fprintf(stderr, "Failed to create tree\n");
+                    exit(1);
+                }
+            }
+            shuffle(pointers, N);
+            for (int i = 0; i < N; i++) {
+                const int t = blocks ? *(int *)pointers[i] / 1000 % k : i % k;
+                const bptree_status stat = bptree_put(trees[t], pointers[i]);
+                assert(stat == BPTREE_OK);
+            }
+            const char *layout = blocks ? ", blocks" : "";
+            char label[64];
+            long long scanned = 0;
+            snprintf(label, sizeof(label), "Scan (%d separate iterators%s, unmerged)", k, layout);
+            BENCH(label, 1, {
+                for (int t = 0; t < k; t++) {
+                    bptree_iterator *iter = bptree_iterator_new(trees[t]);
+                    while (bptree_iterator_next(iter)) {
+                        scanned++;
+                    }
+                    bptree_iterator_free(iter, trees[t]->free_fn);
+                }
+            });
+            assert(scanned == N);
+            scanned = 0;
+            snprintf(label, sizeof(label), "Merged scan (minimum of %d iterators%s)", k, layout);
+            BENCH(label, 1, {
+                for (int t = 0; t < k; t++) {
+                    iters[t] = bptree_iterator_new(trees[t]);
+                    heads[t] = bptree_iterator_next(iters[t]);
+                }
+                for (;;) {
+                    int min = -1;
+                    for (int t = 0; t < k; t++) {
+                        if (heads[t] &&
+                            (min < 0 || compare_ints(heads[t], heads[min], NULL) < 0)) {
+                            min = t;
+                        }
+                    }
+                    if (min < 0) {
+                        break;
+                    }
+                    scanned++;
+                    heads[min] = bptree_iterator_next(iters[min]);
+                }
+                for (int t = 0; t < k; t++) {
+                    bptree_iterator_free(iters[t], trees[t]->free_fn);
+                }
+            });
+            assert(scanned == N);
+            scanned = 0;
+            snprintf(label, sizeof(label), "Merged scan (bptree_merge_iterator, %d trees%s)", k,
+                     layout);
+            BENCH(label, 1, {
+                bptree_merge_iterator *iter =
+                    bptree_merge_iterator_new((const bptree *const *)trees, k, NULL, false);
+                while (bptree_merge_iterator_next(iter, NULL)) {
+                    scanned++;
+                }
+                bptree_merge_iterator_free(iter);
+            });
+            assert(scanned == N);
+            for (int t = 0; t < k; t++) {
+                bptree_free(trees[t]);
+            }
+            free(heads);
+            free(iters);
+            free(trees);
+        }
+    }
+
+    /* --- Set Operation Benchmarks --- */
+    // A full tree against a tree of every other key and against a sparse tree.
+    {
+        const int sparse_step = N < 2000 ? 2 : 1000;
+        bptree *full = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+        bptree *half = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+        bptree *sparse = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+        if (!full || !half || !sparse) {
+            fprintf(stderr, "Failed to create tree\n");
+            exit(1);
+        }
+        shuffle(pointers, N);
+        for (int i = 0; i < N; i++) {
+            const int v = *(int *)pointers[i];
+            bptree_status stat = bptree_put(full, pointers[i]);
+            assert(stat == BPTREE_OK);
+            if (v % 2 == 0) {
+                stat = bptree_put(half, pointers[i]);
+                assert(stat == BPTREE_OK);
+            }
+            if (v % sparse_step == 0) {
+                stat = bptree_put(sparse, pointers[i]);
+                assert(stat == BPTREE_OK);
+            }
+        }
+        const bptree *others[2] = {half, sparse};
+        const char *labels[2][2] = {
+            {"Intersect with half (merge of two iterators)",
+             "Intersect with half (bptree_intersect)"},
+            {"Intersect with sparse (merge of two iterators)",
+             "Intersect with sparse (bptree_intersect)"}};
+        for (int o = 0; o < 2; o++) {
+            const bptree *other = others[o];
+            long long common = 0;
+            BENCH(labels[o][0], 1, {
+                bptree_iterator *ia = bptree_iterator_new(full);
+                bptree_iterator *ib = bptree_iterator_new(other);
+                const int *a = bptree_iterator_next(ia);
+                const int *b = bptree_iterator_next(ib);
+                while (a && b) {
+                    const int cmp = compare_ints(a, b, NULL);
+                    common += cmp == 0;
+                    if (cmp <= 0) {
+                        a = bptree_iterator_next(ia);
+                    }
+                    if (cmp >= 0) {
+                        b = bptree_iterator_next(ib);
+                    }
+                }
+                bptree_iterator_free(ia, full->free_fn);
+                bptree_iterator_free(ib, other->free_fn);
+            });
+            printf("Common keys: %lld\n", common);
+            common = 0;
+            bptree_status stat = BPTREE_OK;
+            BENCH(labels[o][1], 1,
+                  { stat = bptree_intersect(full, other, count_item, &common, NULL); });
+            assert(stat == BPTREE_OK);
+            printf("Common keys: %lld\n", common);
+        }
+        bptree *out = NULL;
+        bptree_status stat = BPTREE_OK;
+        BENCH("Difference with sparse into a new tree (bptree_difference)", 1,
+              { stat = bptree_difference(full, sparse, NULL, NULL, &out); });
+        assert(stat == BPTREE_OK);
+        printf("Keys kept: %d\n", out->count);
+        bptree_free(out);
+        BENCH("Union of half and sparse into a new tree (bptree_union)", 1,
+              { stat = bptree_union(half, sparse, NULL, NULL, &out); });
+        assert(stat == BPTREE_OK);
+        printf("Keys kept: %d\n", out->count);
+        bptree_free(out);
+        bptree_free(full);
+        bptree_free(half);
+        bptree_free(sparse);
+    }
+
+    /* --- Diff Benchmarks --- */
+    // A tree and a clone of it with a few hundred keys removed and added.
+    {
+        const int n_changes = N < 200 ? N / 2 : 100;
+        int *extra = malloc(n_changes * sizeof(int));
+        bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+        if (!tree || !extra) {
+            fprintf(stderr, "Failed to create tree\n");
+            exit(1);
+        }
+        shuffle(pointers, N);
+        for (int i = 0; i < N; i++) {
+            const bptree_status stat = bptree_put(tree, pointers[i]);
+            assert(stat == BPTREE_OK);
+        }
+        bptree_status stat;
+#ifdef BPTREE_NODE_HASHES
+        stat = bptree_set_hash(tree, hash_int);
+        assert(stat == BPTREE_OK);
+#endif
+        bptree *copy = bptree_clone(tree);
+        assert(copy);
+        for (int i = 0; i < n_changes; i++) {
+            extra[i] = N + i;
+            stat = bptree_remove(copy, pointers[i]);
+            assert(stat == BPTREE_OK);
+            stat = bptree_put(copy, &extra[i]);
+            assert(stat == BPTREE_OK);
+        }
+        long long differences = 0;
+        BENCH("Diff (merge of two iterators)", 1, {
+            bptree_iterator *ia = bptree_iterator_new(tree);
+            bptree_iterator *ib = bptree_iterator_new(copy);
+            const int *a = bptree_iterator_next(ia);
+            const int *b = bptree_iterator_next(ib);
+            while (a || b) {
+                const int cmp = !b ? -1 : !a ? 1 : compare_ints(a, b, NULL);
+                differences += cmp != 0;
+                if (cmp <= 0) {
+                    a = bptree_iterator_next(ia);
+                }
+                if (cmp >= 0) {
+                    b = bptree_iterator_next(ib);
+                }
+            }
+            bptree_iterator_free(ia, tree->free_fn);
+            bptree_iterator_free(ib, copy->free_fn);
+        });
+        printf("Differences found: %lld\n", differences);
+#ifdef BPTREE_NODE_HASHES
+        differences = 0;
+        BENCH("Diff (bptree_diff, computing every hash)", 1,
+              { stat = bptree_diff(tree, copy, count_difference, &differences); });
+        assert(stat == BPTREE_OK);
+        printf("Differences found: %lld\n", differences);
+        differences = 0;
+        BENCH("Diff (bptree_diff, hashes up to date)", 1,
+              { stat = bptree_diff(tree, copy, count_difference, &differences); });
+        assert(stat == BPTREE_OK);
+        printf("Differences found: %lld\n", differences);
+        for (int i = 0; i < n_changes; i++) {
+            stat = bptree_remove(copy, pointers[n_changes + i]);
+            assert(stat == BPTREE_OK);
+        }
+        differences = 0;
+        BENCH("Diff (bptree_diff after more removals)", 1,
+              { stat = bptree_diff(tree, copy, count_difference, &differences); });
+        assert(stat == BPTREE_OK);
+        printf("Differences found: %lld\n", differences);
+#endif
+        bptree_free(copy);
+        bptree_free(tree);
+        free(extra);
+    }
+
+    /* --- Teardown Benchmarks --- */
+    // Wall time spent on the calling thread; the background free of the last run overlaps exit.
+    {
+        const char *teardowns[] = {"bptree_free", "bptree_free_parallel, 4 threads",
+                                   "bptree_free_async"};
+        for (int mode = 0; mode < 3; mode++) {
+            bptree *tree = bptree_new(max_keys, compare_ints, NULL, NULL, NULL, debug_enabled);
+            if (!tree) {
+                fprintf(stderr, "Failed to create tree\n");
+                exit(1);
+            }
+            shuffle(pointers, N);
+            for (int i = 0; i < N; i++) {
+                const bptree_status stat = bptree_put(tree, pointers[i]);
+                assert(stat == BPTREE_OK);
+            }
+            const long long start = now_ns();
+            bptree_status stat = BPTREE_OK;
+            if (mode == 0) {
+                bptree_free(tree);
+            } else if (mode == 1) {
+                stat = bptree_free_parallel(tree, 4);
+            } else {
+                stat = bptree_free_async(tree);
+            }
+            const long long elapsed = now_ns() - start;
+            if (stat != BPTREE_OK) {
+                printf("Background teardown is not available in this build\n");
+                bptree_free(tree);
+                break;
+            }
+            printf("Teardown (%s): %.3f ms\n", teardowns[mode], elapsed / 1e6);
+        }
+    }
+
     free(vals);
     free(pointers);
     return 0;
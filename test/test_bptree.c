@@ -15,6 +15,10 @@
 
 #include "bptree.h"
 
+#ifdef BPTREE_THREADS
+#include <stdatomic.h>
+#endif
+
 /**
  * @brief Global flag for enabling/disabling debug logging.
  */
@@ -35,6 +39,240 @@ int str_compare(const void *a, const void *b, const void *udata) {
     return strcmp(a, b);
 }
 
+/**
+ * @brief Comparison function for integers.
+ *
+ * @param a Pointer to the first integer.
+ * @param b Pointer to the second integer.
+ * @param udata Unused user data.
+ * @return Negative value if a < b, zero if a equals b, positive value if a > b.
+ */
+int int_compare(const void *a, const void *b, const void *udata) {
+    (void)udata;
+    const int ia = *(const int *)a;
+    const int ib = *(const int *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+/**
+ * @brief Compares an item with a separator stored in an internal node.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param item Item to compare.
+ * @param slot Separator slot of an internal node.
+ * @return Negative, zero, or positive as the item sorts before, at, or after the separator.
+ */
+int compare_to_separator(const bptree *tree, const void *item, const unsigned char *slot) {
+    if (!tree->key_bytes) {
+        const void *key;
+        memcpy(&key, slot, sizeof(key));
+        return tree->compare(item, key, tree->udata);
+    }
+    size_t length, separator_length;
+    const unsigned char *bytes = tree->key_bytes(item, &length, tree->udata);
+    const unsigned char *separator = separator_bytes(tree, slot, &separator_length);
+    return compare_bytes(bytes, length, separator, separator_length);
+}
+
+/**
+ * @brief Compares two separators stored in internal nodes.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param a First separator slot.
+ * @param b Second separator slot.
+ * @return Negative, zero, or positive as a sorts before, at, or after b.
+ */
+int compare_separators(const bptree *tree, const unsigned char *a, const unsigned char *b) {
+    if (!tree->key_bytes) {
+        const void *key;
+        memcpy(&key, a, sizeof(key));
+        return compare_to_separator(tree, key, b);
+    }
+    size_t a_length, b_length;
+    const unsigned char *a_bytes = separator_bytes(tree, a, &a_length);
+    const unsigned char *b_bytes = separator_bytes(tree, b, &b_length);
+    return compare_bytes(a_bytes, a_length, b_bytes, b_length);
+}
+
+/**
+ * @brief Recursively checks the structural invariants of a subtree.
+ *
+ * Verifies key order, that every key lies within the bounds given by the
+ * parent separators, that all leaves are at the same depth, and that non-root
+ * nodes respect the tree's minimum occupancy. Gaps in leaves must carry the
+ * key of the next item and may not trail the last item, and the index of a
+ * dense or compressed leaf must locate every item.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Root of the subtree to check.
+ * @param low Separator slot holding the inclusive lower bound of the subtree, or NULL.
+ * @param high Separator slot holding the exclusive upper bound of the subtree, or NULL.
+ * @param depth Depth of the node (1 for the root).
+ * @return Number of items stored in the subtree.
+ */
+int check_node(const bptree *tree, const bptree_node *node, const unsigned char *low,
+               const unsigned char *high, int depth) {
+    const int live = live_keys(node);
+    if (node != tree->root) {
+        assert(live >= (node->is_leaf ? tree->leaf_min_keys : tree->internal_min_keys));
+    }
+    if (node->is_leaf) {
+        // Only a full-size dense or compressed leaf may hold more items than a sorted one.
+        assert(node->num_keys <= leaf_room(tree, node));
+        assert(leaf_overfull(node) ? leaf_capacity(node) == tree->leaf_max_keys
+                                   : node->num_keys <= tree->leaf_max_keys);
+    } else {
+        assert(node->num_keys <= tree->internal_max_keys);
+        assert(node->num_keys <= node_capacity(tree, node));
+    }
+    if (!node->is_leaf) {
+        for (int i = 0; i < node->num_keys; i++) {
+            const unsigned char *key = key_slot(tree, node, i);
+            assert(low == NULL || compare_separators(tree, key, low) >= 0);
+            assert(high == NULL || compare_separators(tree, key, high) < 0);
+            assert(i == 0 || compare_separators(tree, key_slot(tree, node, i - 1), key) < 0);
+        }
+        int total = 0;
+        for (int i = 0; i <= node->num_keys; i++) {
+            const unsigned char *child_low = i == 0 ? low : key_slot(tree, node, i - 1);
+            const unsigned char *child_high = i == node->num_keys ? high : key_slot(tree, node, i);
+            total += check_node(tree, child_at(tree, node, i), child_low, child_high, depth + 1);
+        }
+        return total;
+    }
+    int gaps = 0;
+    const void *prev = NULL;
+    for (int i = 0; i < node->num_keys; i++) {
+        // Dense leaves keep an index instead of keys, so leaf items serve as keys.
+        const void *key = node->ptr.leaf.items[i] ? node->ptr.leaf.items[i] : node->keys[i];
+        assert(low == NULL || compare_to_separator(tree, key, low) >= 0);
+        assert(high == NULL || compare_to_separator(tree, key, high) < 0);
+        if (node->ptr.leaf.items[i] == NULL) {
+            assert(tree->gapped_leaves && i + 1 < node->num_keys);
+            assert(node->keys[i] == node->keys[i + 1]);
+            gaps++;
+            continue;
+        }
+        if (node->ptr.leaf.dense) {
+            int slot = -1;
+            assert(dense_find(tree, node, key, &slot) == 1 && slot == i);
+        } else if (node->ptr.leaf.delta_width) {
+            int slot = -1;
+            assert(delta_find(tree, node, key, &slot) == 1 && slot == i);
+        } else {
+            assert(node->keys[i] == key);
+        }
+        assert(prev == NULL || tree->compare(prev, key, tree->udata) < 0);
+        prev = key;
+    }
+    assert(gaps == node->ptr.leaf.gaps);
+    assert(depth == tree->height);
+    return live;
+}
+
+/**
+ * @brief Checks that the tree is well formed and holds exactly the expected items.
+ *
+ * @param tree Pointer to the B+Tree of integers.
+ * @param present Flags telling which values in [0, n) are expected in the tree.
+ * @param n Number of flags.
+ */
+void check_tree(const bptree *tree, const bool *present, int n) {
+    int expected = 0;
+    for (int i = 0; i < n; i++) {
+        expected += present[i];
+    }
+    assert(tree->count == expected);
+    assert(check_node(tree, tree->root, NULL, NULL, 1) == expected);
+    bptree_iterator *iter = bptree_iterator_new(tree);
+    int prev = -1, seen = 0;
+    const int *item;
+    while ((item = bptree_iterator_next(iter)) != NULL) {
+        assert(*item > prev && *item < n && present[*item]);
+        prev = *item;
+        seen++;
+    }
+    assert(seen == expected);
+    bptree_iterator_free(iter, tree->free_fn);
+}
+
+/**
+ * @brief Applies a random mix of insertions and removals and checks the tree along the way.
+ *
+ * @param tree Pointer to an empty B+Tree of integers.
+ * @param vals Array of n distinct values, vals[i] == i.
+ * @param n Number of values.
+ * @param ops Number of operations to apply.
+ */
+void random_workload(bptree *tree, int *vals, int n, int ops) {
+    bool *present = calloc(n, sizeof(bool));
+    assert(present != NULL);
+    for (int op = 0; op < ops; op++) {
+        const int v = rand() % n;
+        if (rand() % 3 != 0) {
+            assert(bptree_put(tree, &vals[v]) == (present[v] ? BPTREE_DUPLICATE : BPTREE_OK));
+            present[v] = true;
+        } else {
+            assert(bptree_remove(tree, &vals[v]) == (present[v] ? BPTREE_OK : BPTREE_NOT_FOUND));
+            present[v] = false;
+        }
+        if (op % 1000 == 0) {
+            check_tree(tree, present, n);
+        }
+    }
+    check_tree(tree, present, n);
+    for (int v = 0; v < n; v++) {
+        if (present[v]) {
+            assert(bptree_get(tree, &vals[v]) == &vals[v]);
+            assert(bptree_remove(tree, &vals[v]) == BPTREE_OK);
+            present[v] = false;
+        } else {
+            assert(bptree_get(tree, &vals[v]) == NULL);
+        }
+    }
+    check_tree(tree, present, n);
+    assert(tree->height == 1);
+    free(present);
+}
+
+/**
+ * @brief Number of configurations new_config_tree knows.
+ */
+#define TREE_CONFIGS 5
+
+/**
+ * @brief Creates a small tree in one of the configurations that feature tests cycle through.
+ *
+ * Configuration 0 is the default tree, 1 uses gapped leaves and shares items
+ * on overflow, 2 uses compressed integer leaves, 3 uses dense integer leaves,
+ * and 4 lets nodes empty out and, without node handles, vary their capacity.
+ *
+ * @param config Configuration number, below TREE_CONFIGS.
+ * @param compare Comparison function to order keys.
+ * @param int_key Integer key function agreeing with compare.
+ * @return Pointer to the new, empty B+Tree.
+ */
+bptree *new_config_tree(int config,
+                        int (*compare)(const void *first, const void *second,
+                                       const void *user_data),
+                        bptree_int_key_t int_key) {
+    bptree *tree = bptree_new_with_fanout(8, 4, compare, NULL, NULL, NULL, debug_enabled);
+    assert(tree != NULL);
+    if (config == 1) {
+        assert(bptree_set_gapped_leaves(tree, true) == BPTREE_OK);
+        assert(bptree_set_overflow_policy(tree, BPTREE_OVERFLOW_REDISTRIBUTE) == BPTREE_OK);
+    } else if (config == 2 || config == 3) {
+        assert(bptree_set_int_keys(tree, int_key) == BPTREE_OK);
+        assert(bptree_set_compressed_leaves(tree, config == 2) == BPTREE_OK);
+    } else if (config == 4) {
+        assert(bptree_set_min_fill(tree, 0) == BPTREE_OK);
+#ifndef BPTREE_NODE_HANDLES
+        assert(bptree_set_variable_capacity(tree, true) == BPTREE_OK);
+#endif
+    }
+    return tree;
+}
+
 /**
  * @brief Tests insertion and search functionality.
  *
@@ -450,6 +688,2471 @@ void test_tree_stats() {
     printf("Tree stats passed.\n");
 }
 
+/**
+ * @brief Tests the configurable minimum fill used when rebalancing on removal.
+ *
+ * This test checks that out-of-range values are rejected and runs a random
+ * workload under the classic, relaxed and merge-when-empty policies.
+ */
+void test_min_fill_policies() {
+    printf("Test min fill policies...\n");
+    const int N = 2000;
+    int *vals = malloc(N * sizeof(int));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    const int fills[] = {50, 25, 0};
+    for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+        bptree *tree = bptree_new(7, int_compare, NULL, NULL, NULL, debug_enabled);
+        assert(tree != NULL);
+        assert(bptree_set_min_fill(tree, -1) == BPTREE_ERROR);
+        assert(bptree_set_min_fill(tree, 51) == BPTREE_ERROR);
+        assert(bptree_set_min_fill(tree, fills[f]) == BPTREE_OK);
+        assert(tree->leaf_min_keys >= 1 && tree->internal_min_keys >= 1);
+        random_workload(tree, vals, N, 20000);
+        bptree_free(tree);
+    }
+    free(vals);
+    printf("Min fill policies passed.\n");
+}
+
+/**
+ * @brief Tests trees whose leaf and internal nodes have different capacities.
+ *
+ * This test runs a random workload on a tree with large leaves and small internal
+ * nodes, checks the minimum occupancy setter, and bulk loads a tree with separate
+ * capacities.
+ */
+void test_separate_fanout() {
+    printf("Test separate leaf and internal fanout...\n");
+    const int N = 3000;
+    int *vals = malloc(N * sizeof(int));
+    void **items = malloc(N * sizeof(void *));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+        items[i] = &vals[i];
+    }
+    bptree *tree = bptree_new_with_fanout(32, 4, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(tree != NULL);
+    assert(tree->leaf_max_keys == 32 && tree->internal_max_keys == 4);
+    assert(tree->leaf_min_keys == 16 && tree->internal_min_keys == 2);
+    assert(bptree_set_min_keys(tree, 17, 2) == BPTREE_ERROR);
+    assert(bptree_set_min_keys(tree, 8, 3) == BPTREE_ERROR);
+    assert(bptree_set_min_keys(tree, 0, 1) == BPTREE_ERROR);
+    assert(bptree_set_min_keys(tree, 8, 1) == BPTREE_OK);
+    random_workload(tree, vals, N, 20000);
+    bptree_free(tree);
+
+    tree = bptree_bulk_load_with_fanout(64, 8, int_compare, NULL, NULL, NULL, debug_enabled,
+                                        items, N);
+    assert(tree != NULL);
+    assert(tree->root->num_keys <= 8);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_get(tree, &vals[i]) == &vals[i]);
+    }
+    bptree_free(tree);
+    free(items);
+    free(vals);
+    printf("Separate leaf and internal fanout passed.\n");
+}
+
+/**
+ * @brief Tests B*-style redistribution when inserting into a full leaf.
+ *
+ * This test inserts the same random sequence with both overflow policies and
+ * checks that redistribution yields a valid tree with fewer, fuller leaves.
+ */
+void test_overflow_redistribution() {
+    printf("Test overflow redistribution...\n");
+    const int N = 5000;
+    int *vals = malloc(N * sizeof(int));
+    int *order = malloc(N * sizeof(int));
+    bool *present = malloc(N * sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+        order[i] = i;
+        present[i] = true;
+    }
+    for (int i = N - 1; i > 0; i--) {
+        const int j = rand() % (i + 1);
+        const int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    bptree *split = bptree_new(16, int_compare, NULL, NULL, NULL, debug_enabled);
+    bptree *redist = bptree_new(16, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(split != NULL && redist != NULL);
+    assert(bptree_set_overflow_policy(redist, (bptree_overflow_policy)42) == BPTREE_ERROR);
+    assert(bptree_set_overflow_policy(redist, BPTREE_OVERFLOW_REDISTRIBUTE) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(split, &vals[order[i]]) == BPTREE_OK);
+        assert(bptree_put(redist, &vals[order[i]]) == BPTREE_OK);
+    }
+    assert(bptree_put(redist, &vals[order[0]]) == BPTREE_DUPLICATE);
+    check_tree(split, present, N);
+    check_tree(redist, present, N);
+    const bptree_stats split_stats = bptree_get_stats(split);
+    const bptree_stats redist_stats = bptree_get_stats(redist);
+    assert(redist_stats.leaf_count < split_stats.leaf_count);
+    assert(N >= redist_stats.leaf_count * 16 * 8 / 10);
+    bptree_free(split);
+    bptree_free(redist);
+
+    bptree *tree = bptree_new(5, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_overflow_policy(tree, BPTREE_OVERFLOW_REDISTRIBUTE) == BPTREE_OK);
+    random_workload(tree, vals, N, 20000);
+    bptree_free(tree);
+    free(present);
+    free(order);
+    free(vals);
+    printf("Overflow redistribution passed.\n");
+}
+
+/**
+ * @brief Tests rebuilding a churned tree into packed, contiguous nodes.
+ *
+ * This test fragments a tree with random insertions and removals, compacts it,
+ * and checks that the result is valid, uses the minimum number of leaves, and
+ * lays the leaves out contiguously in key order. The compacted tree must keep
+ * working under further updates.
+ */
+void test_compact() {
+    printf("Test compaction...\n");
+    const int N = 4000;
+    int *vals = malloc(N * sizeof(int));
+    bool *present = calloc(N, sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    bptree *tree = bptree_new(8, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(tree != NULL);
+    assert(bptree_compact(tree, 100) == BPTREE_OK);
+    assert(bptree_compact(tree, 0) == BPTREE_ERROR);
+    assert(bptree_compact(tree, 101) == BPTREE_ERROR);
+    for (int i = 0; i < 3 * N; i++) {
+        const int v = rand() % N;
+        if (i % 4 == 3) {
+            bptree_remove(tree, &vals[v]);
+            present[v] = false;
+        } else {
+            bptree_put(tree, &vals[v]);
+            present[v] = true;
+        }
+    }
+    check_tree(tree, present, N);
+    const int fills[] = {100, 60};
+    for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+        assert(bptree_compact(tree, fills[f]) == BPTREE_OK);
+        check_tree(tree, present, N);
+        const bptree_stats stats = bptree_get_stats(tree);
+        const int per_leaf = (8 * fills[f] + 99) / 100;
+        assert(stats.leaf_count == (stats.count + per_leaf - 1) / per_leaf);
+        const bptree_node *leaf = tree->root;
+        while (!leaf->is_leaf) {
+            leaf = child_at(tree, leaf, 0);
+        }
+        for (; next_leaf(tree, leaf); leaf = next_leaf(tree, leaf)) {
+            const ptrdiff_t gap = (const char *)next_leaf(tree, leaf) - (const char *)leaf;
+            assert(gap == (ptrdiff_t)(sizeof(bptree_node) + 16 * sizeof(void *)));
+        }
+    }
+    for (int i = 0; i < N; i++) {
+        if (present[i]) {
+            assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+            present[i] = false;
+        } else {
+            assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+            present[i] = true;
+        }
+    }
+    check_tree(tree, present, N);
+    bptree_free(tree);
+    free(present);
+    free(vals);
+    printf("Compaction passed.\n");
+}
+
+/**
+ * @brief Tests that split leaves are placed in their left neighbor's chunk.
+ *
+ * This test inserts sequentially with leaf clustering enabled and checks that
+ * consecutive leaves share chunks, so the leaves span only as many chunks as
+ * needed. A random workload then exercises chunk reuse after merges.
+ */
+void test_leaf_clustering() {
+    printf("Test leaf clustering...\n");
+    const int N = 2000;
+    const int chunk = 8;
+    int *vals = malloc(N * sizeof(int));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    bptree *tree = bptree_new(4, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(tree != NULL);
+    assert(bptree_set_leaf_clustering(tree, -1) == BPTREE_ERROR);
+    assert(bptree_set_leaf_clustering(tree, chunk) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+    }
+    const bptree_node *leaf = tree->root;
+    while (!leaf->is_leaf) {
+        leaf = child_at(tree, leaf, 0);
+    }
+    int leaves = 0;
+    int chunk_changes = 0;
+    for (; leaf; leaf = next_leaf(tree, leaf)) {
+        leaves++;
+        const bptree_node *next = next_leaf(tree, leaf);
+        if (next && next->slab != leaf->slab) {
+            chunk_changes++;
+        }
+    }
+    assert(leaves == bptree_get_stats(tree).leaf_count);
+    // The first leaf is the initial root, which is allocated on its own.
+    assert(chunk_changes <= (leaves - 1 + chunk - 1) / chunk);
+    bptree_free(tree);
+
+    tree = bptree_new(4, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_leaf_clustering(tree, chunk) == BPTREE_OK);
+    random_workload(tree, vals, N, 20000);
+    bptree_free(tree);
+    free(vals);
+    printf("Leaf clustering passed.\n");
+}
+
+/**
+ * @brief Tests leaves that keep gaps between their items.
+ *
+ * This test runs random workloads on gapped trees of several leaf sizes, with
+ * both overflow policies, checks that splits leave gaps for later inserts, and
+ * checks that range queries skip the gaps. Turning the mode off on a populated
+ * tree must pack every leaf.
+ */
+void test_gapped_leaves() {
+    printf("Test gapped leaves...\n");
+    const int N = 1500;
+    int *vals = malloc(N * sizeof(int));
+    bool *present = calloc(N, sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    const int sizes[] = {3, 4, 7, 64};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (int policy = 0; policy < 2; policy++) {
+            bptree *tree = bptree_new(sizes[s], int_compare, NULL, NULL, NULL, debug_enabled);
+            assert(bptree_set_gapped_leaves(tree, true) == BPTREE_OK);
+            assert(bptree_set_overflow_policy(tree, policy ? BPTREE_OVERFLOW_REDISTRIBUTE
+                                                           : BPTREE_OVERFLOW_SPLIT) == BPTREE_OK);
+            random_workload(tree, vals, N, 15000);
+            bptree_free(tree);
+        }
+    }
+
+    bptree *tree = bptree_new(16, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_gapped_leaves(tree, true) == BPTREE_OK);
+    for (int i = N - 1; i >= 0; i -= 2) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+        present[i] = true;
+    }
+    check_tree(tree, present, N);
+    const bptree_node *leaf = tree->root;
+    while (!leaf->is_leaf) {
+        leaf = child_at(tree, leaf, 0);
+    }
+    int gaps = 0;
+    for (; leaf; leaf = next_leaf(tree, leaf)) {
+        gaps += leaf->ptr.leaf.gaps;
+    }
+    assert(gaps > 0);
+    int count = 0;
+    void **range = bptree_get_range(tree, &vals[100], &vals[200], &count);
+    assert(count == 50);
+    for (int i = 0; i < count; i++) {
+        assert(*(int *)range[i] == 101 + 2 * i);
+    }
+    tree->free_fn(range);
+    for (int i = 0; i < N; i += 2) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+        present[i] = true;
+    }
+    for (int i = 0; i < N; i += 3) {
+        assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+        present[i] = false;
+    }
+    check_tree(tree, present, N);
+    assert(bptree_set_gapped_leaves(tree, false) == BPTREE_OK);
+    leaf = tree->root;
+    while (!leaf->is_leaf) {
+        leaf = child_at(tree, leaf, 0);
+    }
+    for (; leaf; leaf = next_leaf(tree, leaf)) {
+        assert(leaf->ptr.leaf.gaps == 0);
+    }
+    check_tree(tree, present, N);
+    assert(bptree_compact(tree, 100) == BPTREE_OK);
+    check_tree(tree, present, N);
+    bptree_free(tree);
+    assert(bptree_set_gapped_leaves(NULL, true) == BPTREE_ERROR);
+    free(present);
+    free(vals);
+    printf("Gapped leaves passed.\n");
+}
+
+/**
+ * @brief Returns the integer key of an item of an integer tree.
+ *
+ * @param item Pointer to an integer.
+ * @param user_data Unused.
+ * @return The integer.
+ */
+long long int_key(const void *item, const void *user_data) {
+    (void)user_data;
+    return *(const int *)item;
+}
+
+/**
+ * @brief Tests dense bitmap leaves for integer keys.
+ *
+ * This test checks that leaves over dense key ranges switch to the bitmap
+ * layout while leaves over sparse ranges keep their key arrays, runs random
+ * workloads with both overflow policies, and checks that keys outside a dense
+ * leaf's range and disabling the mode convert leaves back.
+ */
+void test_dense_leaves() {
+    printf("Test dense leaves...\n");
+    const int N = 3000;
+    int *vals = malloc(N * sizeof(int));
+    bool *present = calloc(N, sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    for (int policy = 0; policy < 2; policy++) {
+        bptree *tree = bptree_new(6, int_compare, NULL, NULL, NULL, debug_enabled);
+        assert(bptree_set_int_keys(tree, int_key) == BPTREE_OK);
+        assert(bptree_set_gapped_leaves(tree, true) == BPTREE_ERROR);
+        assert(bptree_set_overflow_policy(tree, policy ? BPTREE_OVERFLOW_REDISTRIBUTE
+                                                       : BPTREE_OVERFLOW_SPLIT) == BPTREE_OK);
+        random_workload(tree, vals, N, 20000);
+        bptree_free(tree);
+    }
+
+    bptree *tree = bptree_new(32, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_int_keys(tree, int_key) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+        present[i] = true;
+    }
+    check_tree(tree, present, N);
+    bptree_stats stats = bptree_get_stats(tree);
+    // Only the initial root leaf was never split or rebalanced.
+    assert(stats.dense_leaf_count >= stats.leaf_count - 1);
+    // Dense leaves move their items next to the bitmap and hold more than leaf_max_keys.
+    bptree *sorted = bptree_new(32, int_compare, NULL, NULL, NULL, debug_enabled);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(sorted, &vals[i]) == BPTREE_OK);
+    }
+    const bptree_stats sorted_stats = bptree_get_stats(sorted);
+    assert(stats.leaf_count * 3 < sorted_stats.leaf_count * 2);
+    assert(stats.node_bytes * 3 < sorted_stats.node_bytes * 2);
+    bptree_free(sorted);
+    const bptree_node *leaf = tree->root;
+    while (!leaf->is_leaf) {
+        leaf = child_at(tree, leaf, 0);
+    }
+    int largest = 0;
+    for (; leaf; leaf = next_leaf(tree, leaf)) {
+        largest = leaf->num_keys > largest ? leaf->num_keys : largest;
+    }
+    assert(largest > tree->leaf_max_keys);
+    // Leaves past leaf_max_keys have no sorted layout, so this rebuilds the tree.
+    assert(bptree_set_int_keys(tree, NULL) == BPTREE_OK);
+    assert(bptree_get_stats(tree).dense_leaf_count == 0);
+    check_tree(tree, present, N);
+    assert(bptree_set_int_keys(tree, int_key) == BPTREE_OK);
+    check_tree(tree, present, N);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_get(tree, &vals[i]) == &vals[i]);
+    }
+    for (int i = 0; i < N; i += 3) {
+        assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+        assert(bptree_get(tree, &vals[i]) == NULL);
+        present[i] = false;
+    }
+    check_tree(tree, present, N);
+    int count = 0;
+    void **range = bptree_get_range(tree, &vals[10], &vals[20], &count);
+    assert(count == 8);
+    tree->free_fn(range);
+    assert(bptree_set_int_keys(tree, NULL) == BPTREE_OK);
+    assert(bptree_get_stats(tree).dense_leaf_count == 0);
+    check_tree(tree, present, N);
+    assert(bptree_set_int_keys(tree, int_key) == BPTREE_OK);
+    assert(bptree_get_stats(tree).dense_leaf_count == bptree_get_stats(tree).leaf_count);
+    check_tree(tree, present, N);
+    bptree_free(tree);
+
+    // Keys a hundred thousand apart never fit a leaf's bitmap.
+    int *far = malloc(N * sizeof(int));
+    for (int i = 0; i < N; i++) {
+        far[i] = i * 100000;
+    }
+    tree = bptree_new(32, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_int_keys(tree, int_key) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(tree, &far[i]) == BPTREE_OK);
+    }
+    stats = bptree_get_stats(tree);
+    assert(stats.dense_leaf_count == 0);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_get(tree, &far[i]) == &far[i]);
+    }
+    bptree_free(tree);
+
+    // A key far outside a dense leaf's range turns it back into a sorted array.
+    tree = bptree_new(32, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_int_keys(tree, int_key) == BPTREE_OK);
+    for (int i = 0; i < 40; i++) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+    }
+    const int before = bptree_get_stats(tree).dense_leaf_count;
+    assert(before > 0);
+    assert(bptree_put(tree, &far[N - 1]) == BPTREE_OK);
+    assert(bptree_get_stats(tree).dense_leaf_count == before - 1);
+    assert(bptree_get(tree, &far[N - 1]) == &far[N - 1]);
+    assert(bptree_get(tree, &vals[39]) == &vals[39]);
+    bptree_free(tree);
+    free(far);
+    free(present);
+    free(vals);
+    printf("Dense leaves passed.\n");
+}
+
+/**
+ * @brief Integer key function that spreads the values of the items apart.
+ *
+ * @param item Pointer to an integer.
+ * @param user_data Pointer to the factor to scale the integer by.
+ * @return The integer times the factor.
+ */
+long long scaled_int_key(const void *item, const void *user_data) {
+    return *(const int *)item * *(const long long *)user_data;
+}
+
+/**
+ * @brief Tests compressed leaves.
+ *
+ * This test checks that trees with compressed leaves stay well formed under
+ * random workloads whose keys are spread far enough apart to need 1, 2, or
+ * 4-byte offsets, or too far apart to compress at all, that a key outside a
+ * leaf's range re-encodes it with wider offsets, and that disabling
+ * compressed leaves or the integer key function converts every leaf back.
+ */
+void test_compressed_leaves() {
+    printf("Test compressed leaves...\n");
+    const int N = 3000;
+    int *vals = malloc(N * sizeof(int));
+    bool *present = calloc(N, sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    long long scales[] = {60, 1000, 1 << 20, 1LL << 40};
+    for (int s = 0; s < 4; s++) {
+        for (int policy = 0; policy < 2; policy++) {
+            bptree *tree =
+                bptree_new_with_fanout(4 + 28 * policy, 8, int_compare, &scales[s], NULL, NULL,
+                                       debug_enabled);
+            assert(bptree_set_int_keys(tree, scaled_int_key) == BPTREE_OK);
+            assert(bptree_set_compressed_leaves(tree, true) == BPTREE_OK);
+            if (policy == 1) {
+                assert(bptree_set_overflow_policy(tree, BPTREE_OVERFLOW_REDISTRIBUTE) ==
+                       BPTREE_OK);
+#ifndef BPTREE_NODE_HANDLES
+                assert(bptree_set_variable_capacity(tree, true) == BPTREE_OK);
+#endif
+            }
+            random_workload(tree, vals, N, 20000);
+            bptree_free(tree);
+        }
+    }
+
+    long long scale = 1000;
+    bptree *tree = bptree_new(32, int_compare, &scale, NULL, NULL, debug_enabled);
+    assert(bptree_set_compressed_leaves(NULL, true) == BPTREE_ERROR);
+    assert(bptree_set_int_keys(tree, scaled_int_key) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+        present[i] = true;
+    }
+    assert(bptree_get_stats(tree).compressed_leaf_count == 0);
+    assert(bptree_set_compressed_leaves(tree, true) == BPTREE_OK);
+    bptree_stats stats = bptree_get_stats(tree);
+    assert(stats.compressed_leaf_count == stats.leaf_count && stats.dense_leaf_count == 0);
+    check_tree(tree, present, N);
+    for (int i = 0; i < N; i += 3) {
+        assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+        assert(bptree_get(tree, &vals[i]) == NULL);
+        present[i] = false;
+    }
+    check_tree(tree, present, N);
+    int count = 0;
+    void **range = bptree_get_range(tree, &vals[10], &vals[20], &count);
+    assert(count == 8);
+    tree->free_fn(range);
+
+    // A key below the base of the first leaf and one far above the last re-encode both leaves.
+    // Re-encoding puts the first leaf's base at its smallest key, vals[1], above vals[0].
+    assert(bptree_set_compressed_leaves(tree, false) == BPTREE_OK);
+    assert(bptree_set_compressed_leaves(tree, true) == BPTREE_OK);
+    const bptree_node *first = tree->root;
+    while (!first->is_leaf) {
+        first = child_at(tree, first, 0);
+    }
+    assert(first->ptr.leaf.delta_width == 2);
+    assert(*delta_base(first) == scaled_int_key(&vals[1], &scale));
+    const int width = first->ptr.leaf.delta_width;
+    assert(bptree_put(tree, &vals[0]) == BPTREE_OK);
+    present[0] = true;
+    assert(first->ptr.leaf.delta_width == width);
+    assert(*delta_base(first) == scaled_int_key(&vals[0], &scale));
+    assert(first->ptr.leaf.items[0] == &vals[0]);
+    int wide = 1 << 20;
+    assert(bptree_put(tree, &wide) == BPTREE_OK);
+    assert(bptree_get(tree, &wide) == &wide);
+    assert(bptree_get_stats(tree).compressed_leaf_count == bptree_get_stats(tree).leaf_count);
+    assert(first->ptr.leaf.delta_width == width);
+    assert(bptree_remove(tree, &wide) == BPTREE_OK);
+    check_tree(tree, present, N);
+
+    assert(bptree_set_compressed_leaves(tree, false) == BPTREE_OK);
+    assert(bptree_get_stats(tree).compressed_leaf_count == 0);
+    check_tree(tree, present, N);
+    assert(bptree_set_compressed_leaves(tree, true) == BPTREE_OK);
+    assert(bptree_set_int_keys(tree, NULL) == BPTREE_OK);
+    assert(bptree_get_stats(tree).compressed_leaf_count == 0);
+    check_tree(tree, present, N);
+    bptree_free(tree);
+
+    // Two-byte offsets leave room for more items than leaf_max_keys, so fewer leaves are needed.
+    bptree *sorted = bptree_new(32, int_compare, &scale, NULL, NULL, debug_enabled);
+    tree = bptree_new(32, int_compare, &scale, NULL, NULL, debug_enabled);
+    assert(bptree_set_int_keys(sorted, scaled_int_key) == BPTREE_OK);
+    assert(bptree_set_int_keys(tree, scaled_int_key) == BPTREE_OK);
+    assert(bptree_set_compressed_leaves(tree, true) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(sorted, &vals[i]) == BPTREE_OK);
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+        present[i] = true;
+    }
+    check_tree(tree, present, N);
+    stats = bptree_get_stats(tree);
+    const bptree_stats sorted_stats = bptree_get_stats(sorted);
+    assert(sorted_stats.compressed_leaf_count == 0);
+    assert(stats.leaf_count * 4 < sorted_stats.leaf_count * 3);
+    assert(stats.node_bytes * 4 < sorted_stats.node_bytes * 3);
+    bptree_free(sorted);
+    const bptree_node *leaf = tree->root;
+    while (!leaf->is_leaf) {
+        leaf = child_at(tree, leaf, 0);
+    }
+    int largest = 0;
+    for (; leaf; leaf = next_leaf(tree, leaf)) {
+        largest = leaf->num_keys > largest ? leaf->num_keys : largest;
+    }
+    assert(largest > tree->leaf_max_keys);
+    // Leaves past leaf_max_keys have no sorted layout, so this rebuilds the tree.
+    assert(bptree_set_compressed_leaves(tree, false) == BPTREE_OK);
+    assert(bptree_get_stats(tree).compressed_leaf_count == 0);
+    check_tree(tree, present, N);
+    bptree_free(tree);
+    free(present);
+    free(vals);
+    printf("Compressed leaves passed.\n");
+}
+
+/**
+ * @brief Tests the root leaf stored inside the tree and its geometric growth.
+ *
+ * This test checks that a new tree keeps its first items in the root leaf
+ * inside the tree structure, that the root leaf then doubles in capacity
+ * until it reaches the maximum, and that the tree splits normally after that.
+ * Removing everything and inserting again must keep working.
+ */
+void test_small_trees() {
+    printf("Test small trees...\n");
+    const int N = 200;
+    int *vals = malloc(N * sizeof(int));
+    bool *present = calloc(N, sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    bptree *tree = bptree_new(32, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(tree != NULL);
+    assert(tree->root == &tree->root_leaf);
+    assert(leaf_capacity(tree->root) == BPTREE_INLINE_ROOT_KEYS);
+    int expected_capacity = BPTREE_INLINE_ROOT_KEYS;
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+        present[i] = true;
+        if (i < BPTREE_INLINE_ROOT_KEYS) {
+            assert(tree->root == &tree->root_leaf);
+        } else if (tree->height == 1) {
+            assert(tree->root != &tree->root_leaf);
+            if (i == expected_capacity) {
+                expected_capacity = expected_capacity * 2 < 32 ? expected_capacity * 2 : 32;
+            }
+#ifndef BPTREE_NODE_HANDLES
+            assert(leaf_capacity(tree->root) == expected_capacity);
+#endif
+        }
+        assert(bptree_put(tree, &vals[i]) == BPTREE_DUPLICATE);
+        check_tree(tree, present, N);
+    }
+    assert(tree->height > 1);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+        present[i] = false;
+    }
+    check_tree(tree, present, N);
+    for (int i = N - 1; i >= 0; i--) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+        present[i] = true;
+    }
+    check_tree(tree, present, N);
+    bptree_free(tree);
+
+    // Leaves smaller than the inline root leaf cap it.
+    tree = bptree_new(3, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(leaf_capacity(tree->root) == 3);
+    random_workload(tree, vals, 50, 2000);
+    bptree_free(tree);
+
+    // Many tiny trees, each holding fewer than ten items inside the tree structure.
+    bptree *trees[64];
+    for (int t = 0; t < 64; t++) {
+        trees[t] = bptree_new(32, int_compare, NULL, NULL, NULL, debug_enabled);
+        assert(trees[t] != NULL);
+        for (int i = 0; i < t % 10; i++) {
+            assert(bptree_put(trees[t], &vals[i]) == BPTREE_OK);
+        }
+    }
+    for (int t = 0; t < 64; t++) {
+        assert(bptree_get_stats(trees[t]).count == t % 10);
+        assert(trees[t]->root == &trees[t]->root_leaf);
+        for (int i = 0; i < t % 10; i++) {
+            assert(bptree_get(trees[t], &vals[i]) == &vals[i]);
+        }
+        bptree_free(trees[t]);
+    }
+    free(present);
+    free(vals);
+    printf("Small trees passed.\n");
+}
+
+/**
+ * @brief Checks that every node of a subtree has the smallest capacity class holding its keys.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Root of the subtree to check.
+ */
+void check_fit(const bptree *tree, const bptree_node *node) {
+    if (node != &tree->root_leaf) {
+        assert(node_capacity(tree, node) ==
+               capacity_class(node_max_keys(tree, node), live_keys(node)));
+    }
+    if (!node->is_leaf) {
+        for (int i = 0; i <= node->num_keys; i++) {
+            check_fit(tree, child_at(tree, node, i));
+        }
+    }
+}
+
+/**
+ * @brief Tests variable node capacities and trimming a tree to fit.
+ *
+ * This test checks that a tree with variable capacities stays well formed
+ * under random workloads in every leaf layout, that sequential insertion then
+ * takes much less memory than with full-size nodes, and that
+ * bptree_shrink_to_fit trims every node of a sparse tree, including
+ * bulk-loaded ones, after which the tree keeps growing normally.
+ */
+void test_variable_capacity() {
+    printf("Test variable capacity...\n");
+    const int N = 20000;
+    int *vals = malloc(N * sizeof(int));
+    void **ptrs = malloc(N * sizeof(void *));
+    bool *present = calloc(N, sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+        ptrs[i] = &vals[i];
+    }
+    bptree *tree = bptree_new(64, int_compare, NULL, NULL, NULL, debug_enabled);
+#ifdef BPTREE_NODE_HANDLES
+    assert(bptree_set_variable_capacity(tree, true) == BPTREE_ERROR);
+    assert(bptree_set_variable_capacity(tree, false) == BPTREE_OK);
+    assert(bptree_shrink_to_fit(tree) == BPTREE_OK);
+    bptree_free(tree);
+#else
+    bptree *fixed = bptree_new(64, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_variable_capacity(NULL, true) == BPTREE_ERROR);
+    assert(bptree_set_variable_capacity(tree, true) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+        assert(bptree_put(fixed, &vals[i]) == BPTREE_OK);
+        present[i] = true;
+    }
+    check_tree(tree, present, N);
+    // Leaves left behind by sequential splits stay half full, which fixed nodes pay for.
+    const size_t full = bptree_get_stats(tree).node_bytes;
+    assert(full * 4 < bptree_get_stats(fixed).node_bytes * 3);
+    bptree_free(fixed);
+
+    // Nodes move into smaller classes as the tree thins out, and trimming finishes the job.
+    assert(bptree_set_min_fill(tree, 0) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        if (i % 16 != 0) {
+            assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+            present[i] = false;
+        }
+    }
+    check_tree(tree, present, N);
+    const size_t thinned = bptree_get_stats(tree).node_bytes;
+    assert(thinned * 2 < full);
+    assert(bptree_shrink_to_fit(tree) == BPTREE_OK);
+    assert(bptree_get_stats(tree).node_bytes <= thinned);
+    check_tree(tree, present, N);
+    check_fit(tree, tree->root);
+    for (int i = 0; i < N; i++) {
+        if (!present[i]) {
+            assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+            present[i] = true;
+        }
+    }
+    check_tree(tree, present, N);
+    bptree_free(tree);
+
+    // Random workloads in every leaf layout.
+    for (int layout = 0; layout < 4; layout++) {
+        tree = bptree_new_with_fanout(32, 16, int_compare, NULL, NULL, NULL, debug_enabled);
+        assert(bptree_set_variable_capacity(tree, true) == BPTREE_OK);
+        if (layout == 1) {
+            assert(bptree_set_gapped_leaves(tree, true) == BPTREE_OK);
+        } else if (layout == 2) {
+            assert(bptree_set_int_keys(tree, int_key) == BPTREE_OK);
+        } else if (layout == 3) {
+            assert(bptree_set_overflow_policy(tree, BPTREE_OVERFLOW_REDISTRIBUTE) == BPTREE_OK);
+            assert(bptree_set_min_fill(tree, 0) == BPTREE_OK);
+        }
+        random_workload(tree, vals, 2000, 20000);
+        bptree_free(tree);
+    }
+
+    // Trimming a bulk-loaded tree moves its sparse leaves out of their slab.
+    tree = bptree_bulk_load(64, int_compare, NULL, NULL, NULL, debug_enabled, ptrs, N);
+    assert(tree != NULL);
+    assert(bptree_set_min_fill(tree, 0) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        present[i] = i % 8 == 0;
+        if (!present[i]) {
+            assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+        }
+    }
+    const size_t loaded = bptree_get_stats(tree).node_bytes;
+    assert(bptree_shrink_to_fit(tree) == BPTREE_OK);
+    assert(bptree_get_stats(tree).node_bytes * 2 < loaded);
+    check_tree(tree, present, N);
+    check_fit(tree, tree->root);
+    for (int i = N - 1; i >= 0; i--) {
+        if (!present[i]) {
+            assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+            present[i] = true;
+        }
+    }
+    check_tree(tree, present, N);
+    bptree_free(tree);
+#endif
+    free(present);
+    free(ptrs);
+    free(vals);
+    printf("Variable capacity passed.\n");
+}
+
+/**
+ * @brief Key bytes function for string items.
+ *
+ * @param item String item.
+ * @param length Receives the length of the string.
+ * @param udata Unused user data.
+ * @return Pointer to the bytes of the string.
+ */
+const void *str_key_bytes(const void *item, size_t *length, const void *udata) {
+    (void)udata;
+    *length = strlen(item);
+    return item;
+}
+
+/**
+ * @brief Counts the separators of a subtree stored inline and as item pointers.
+ *
+ * @param tree Pointer to the B+Tree.
+ * @param node Root of the subtree.
+ * @param inline_count Incremented for each inline separator.
+ * @param item_count Incremented for each separator kept as an item pointer.
+ * @param longest Raised to the length of the longest inline separator.
+ */
+void count_separators(const bptree *tree, const bptree_node *node, int *inline_count,
+                      int *item_count, int *longest) {
+    if (node->is_leaf) {
+        return;
+    }
+    for (int i = 0; i < node->num_keys; i++) {
+        const unsigned char *slot = key_slot(tree, node, i);
+        if (slot[0] == BPTREE_SEPARATOR_ITEM) {
+            (*item_count)++;
+        } else {
+            (*inline_count)++;
+            *longest = slot[0] > *longest ? slot[0] : *longest;
+        }
+    }
+    for (int i = 0; i <= node->num_keys; i++) {
+        count_separators(tree, child_at(tree, node, i), inline_count, item_count, longest);
+    }
+}
+
+/**
+ * @brief Tests truncated separator keys.
+ *
+ * This test checks that with a key bytes function internal nodes store short
+ * inline prefixes for string keys, including keys that are prefixes of other
+ * keys, that separators too long to store inline fall back to item pointers,
+ * and that the tree stays well formed and searchable under random workloads,
+ * redistribution, and compaction. The key bytes function can only be set
+ * while the tree has no internal nodes.
+ */
+void test_truncated_separators() {
+    printf("Test truncated separators...\n");
+    const int N = 3000;
+    const char *prefixes[] = {"", "a/shared/prefix/of/length/32/"};
+    char(*keys)[64] = malloc(N * sizeof(*keys));
+    bool *present = calloc(N, sizeof(bool));
+    for (int p = 0; p < 2; p++) {
+        // Unpadded numbers make some keys prefixes of others.
+        for (int i = 0; i < N; i++) {
+            snprintf(keys[i], sizeof(keys[i]), "%skey-%d", prefixes[p], i * 7 % N);
+        }
+        for (int policy = 0; policy < 2; policy++) {
+            bptree *tree =
+                bptree_new_with_fanout(8, 4, str_compare, NULL, NULL, NULL, debug_enabled);
+            assert(bptree_set_key_bytes(NULL, str_key_bytes) == BPTREE_ERROR);
+            assert(bptree_set_key_bytes(tree, str_key_bytes) == BPTREE_OK);
+            if (policy == 1) {
+                assert(bptree_set_overflow_policy(tree, BPTREE_OVERFLOW_REDISTRIBUTE) ==
+                       BPTREE_OK);
+                assert(bptree_set_min_fill(tree, 0) == BPTREE_OK);
+#ifndef BPTREE_NODE_HANDLES
+                assert(bptree_set_variable_capacity(tree, true) == BPTREE_OK);
+#endif
+            }
+            int expected = 0;
+            for (int i = 0; i < N; i++) {
+                assert(bptree_put(tree, keys[i]) == BPTREE_OK);
+                present[i] = true;
+                expected++;
+            }
+            assert(bptree_set_key_bytes(tree, NULL) == BPTREE_ERROR);
+            assert(check_node(tree, tree->root, NULL, NULL, 1) == expected);
+            int inline_count = 0, item_count = 0, longest = 0;
+            count_separators(tree, tree->root, &inline_count, &item_count, &longest);
+            if (p == 0) {
+                assert(item_count == 0 && inline_count > 0 && longest <= 9);
+            } else {
+                assert(inline_count == 0 && item_count > 0);
+            }
+
+            for (int op = 0; op < 20000; op++) {
+                const int k = rand() % N;
+                if (rand() % 3 == 0) {
+                    assert(bptree_put(tree, keys[k]) ==
+                           (present[k] ? BPTREE_DUPLICATE : BPTREE_OK));
+                    expected += !present[k];
+                    present[k] = true;
+                } else {
+                    assert(bptree_remove(tree, keys[k]) ==
+                           (present[k] ? BPTREE_OK : BPTREE_NOT_FOUND));
+                    expected -= present[k];
+                    present[k] = false;
+                }
+                if (op % 1000 == 0) {
+                    assert(check_node(tree, tree->root, NULL, NULL, 1) == expected);
+                }
+            }
+            assert(bptree_compact(tree, 70) == BPTREE_OK);
+            assert(check_node(tree, tree->root, NULL, NULL, 1) == expected);
+            for (int i = 0; i < N; i++) {
+                assert(bptree_get(tree, keys[i]) == (present[i] ? keys[i] : NULL));
+                if (!present[i]) {
+                    assert(bptree_put(tree, keys[i]) == BPTREE_OK);
+                }
+            }
+            assert(check_node(tree, tree->root, NULL, NULL, 1) == N);
+            int count = 0;
+            void **range = bptree_get_range(tree, keys[0], keys[N - 1], &count);
+            assert(range != NULL && count > 0);
+            for (int i = 1; i < count; i++) {
+                assert(strcmp(range[i - 1], range[i]) < 0);
+            }
+            tree->free_fn(range);
+            bptree_free(tree);
+        }
+    }
+    free(present);
+    free(keys);
+    printf("Truncated separators passed.\n");
+}
+
+/**
+ * @brief Number of calls to counting_malloc so far.
+ */
+int allocation_count = 0;
+
+/**
+ * @brief Allocation function that counts its calls.
+ *
+ * @param size Number of bytes to allocate.
+ * @return Pointer to the allocated memory, or NULL on failure.
+ */
+void *counting_malloc(size_t size) {
+    allocation_count++;
+    return malloc(size);
+}
+
+/**
+ * @brief Tests reserving nodes ahead of insertions.
+ *
+ * This test checks that after bptree_reserve, inserting the announced number
+ * of items in random or sequential order, with splits or redistribution,
+ * never calls the allocation function, that the reserve shrinks as nodes are
+ * taken and grows back as removals free them, and that invalid arguments and
+ * variable capacities are rejected.
+ */
+void test_reserve() {
+    printf("Test reserve...\n");
+    const int N = 20000;
+    int *vals = malloc(N * sizeof(int));
+    bool *present = calloc(N, sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    for (int order = 0; order < 3; order++) {
+        bptree *tree = bptree_new_with_fanout(16, 8, int_compare, NULL, counting_malloc, NULL,
+                                              debug_enabled);
+        assert(bptree_reserve(NULL, N) == BPTREE_ERROR);
+        assert(bptree_reserve(tree, -1) == BPTREE_ERROR);
+        if (order == 2) {
+            assert(bptree_set_overflow_policy(tree, BPTREE_OVERFLOW_REDISTRIBUTE) == BPTREE_OK);
+        }
+        assert(bptree_reserve(tree, N) == BPTREE_OK);
+        const int reserved = bptree_get_stats(tree).reserved_nodes;
+        assert(reserved > 0);
+        const int allocations = allocation_count;
+        for (int i = 0; i < N; i++) {
+            // Sequential insertion leaves every node half full, the worst case.
+            const int v = order == 1 ? i : (int)((long long)i * 7919 % N);
+            assert(bptree_put(tree, &vals[v]) == BPTREE_OK);
+            present[v] = true;
+        }
+        assert(allocation_count == allocations);
+        const bptree_stats stats = bptree_get_stats(tree);
+        assert(stats.reserved_nodes == reserved - stats.node_count);
+        check_tree(tree, present, N);
+        for (int i = 0; i < N; i++) {
+            assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+            present[i] = false;
+        }
+        assert(bptree_get_stats(tree).reserved_nodes == reserved - tree->height);
+        check_tree(tree, present, N);
+        bptree_free(tree);
+    }
+#ifndef BPTREE_NODE_HANDLES
+    bptree *tree = bptree_new(16, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_variable_capacity(tree, true) == BPTREE_OK);
+    assert(bptree_reserve(tree, N) == BPTREE_ERROR);
+    bptree_free(tree);
+#endif
+    free(present);
+    free(vals);
+    printf("Reserve passed.\n");
+}
+
+/**
+ * @brief Tests placing nodes in huge page arenas.
+ *
+ * Without BPTREE_HUGE_PAGES, this test checks that huge pages are refused.
+ * With it, this test checks that nodes are taken from the arena for each
+ * choice of node kinds, that the arena is reported in the statistics, and
+ * that the tree stays valid through a random workload.
+ */
+void test_huge_pages() {
+    printf("Test huge pages...\n");
+    assert(bptree_set_huge_pages(NULL, true, true) == BPTREE_ERROR);
+    bptree *tree = bptree_new(16, int_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_huge_pages(tree, false, false) == BPTREE_OK);
+#ifndef BPTREE_HUGE_PAGES
+    assert(bptree_set_huge_pages(tree, true, false) == BPTREE_ERROR);
+    assert(bptree_set_huge_pages(tree, false, true) == BPTREE_ERROR);
+    bptree_free(tree);
+#else
+    bptree_free(tree);
+    const int N = 20000;
+    int *vals = malloc(N * sizeof(int));
+    bool *present = calloc(N, sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    for (int kinds = 1; kinds < 4; kinds++) {
+        tree = bptree_new(16, int_compare, NULL, NULL, NULL, debug_enabled);
+        assert(bptree_set_huge_pages(tree, kinds & 1, kinds & 2) == BPTREE_OK);
+        for (int i = 0; i < N; i++) {
+            const int v = (int)((long long)i * 7919 % N);
+            assert(bptree_put(tree, &vals[v]) == BPTREE_OK);
+            present[v] = true;
+        }
+        check_tree(tree, present, N);
+        const bptree_stats stats = bptree_get_stats(tree);
+        assert(stats.arena_bytes > 0 && stats.arena_hugetlb_bytes <= stats.arena_bytes);
+        // Internal nodes of a tree this size fit in a single page.
+        assert(kinds != 1 || stats.arena_bytes == BPTREE_HUGE_PAGE_SIZE);
+        for (int i = 0; i < N; i++) {
+            assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+            present[i] = false;
+        }
+        random_workload(tree, vals, N, 20000);
+        bptree_free(tree);
+    }
+    free(present);
+    free(vals);
+#endif
+    printf("Huge pages passed.\n");
+}
+
+/**
+ * @brief Applies a workload of hinted operations on keys near each other.
+ *
+ * Each operation moves to a key a few places away from the previous one and
+ * gets, inserts, or removes it through one of two hints, with an occasional
+ * plain operation in between to make the hints stale. Results are checked
+ * against the expected contents.
+ *
+ * @param tree Pointer to an empty B+Tree.
+ * @param items Array of n distinct items.
+ * @param present Flags telling which items are expected in the tree, all false.
+ * @param n Number of items.
+ */
+void hinted_workload(bptree *tree, void **items, bool *present, int n) {
+    bptree_hint hints[2];
+    memset(hints, 0, sizeof(hints));
+    int v = 0;
+    for (int op = 0; op < 40000; op++) {
+        v = (v + rand() % 7 - 2 + n) % n;
+        bptree_hint *hint = &hints[op / 64 % 2];
+        const int kind = rand() % 10;
+        if (kind < 3) {
+            assert(bptree_get_hinted(tree, items[v], hint) == (present[v] ? items[v] : NULL));
+        } else if (kind < 7) {
+            assert(bptree_put_hinted(tree, items[v], hint) ==
+                   (present[v] ? BPTREE_DUPLICATE : BPTREE_OK));
+            present[v] = true;
+        } else if (kind < 9) {
+            assert(bptree_remove_hinted(tree, items[v], hint) ==
+                   (present[v] ? BPTREE_OK : BPTREE_NOT_FOUND));
+            present[v] = false;
+        } else {
+            const int w = rand() % n;
+            assert(bptree_put(tree, items[w]) == (present[w] ? BPTREE_DUPLICATE : BPTREE_OK));
+            present[w] = true;
+        }
+        assert(hint->leaf == NULL || hint->tree == tree);
+    }
+    int expected = 0;
+    for (int i = 0; i < n; i++) {
+        expected += present[i];
+        assert(bptree_get(tree, items[i]) == (present[i] ? items[i] : NULL));
+    }
+    assert(tree->count == expected);
+    assert(check_node(tree, tree->root, NULL, NULL, 1) == expected);
+}
+
+/**
+ * @brief Tests the hinted get, put, and remove operations.
+ *
+ * This test runs a workload of nearby hinted operations on trees with plain,
+ * gapped, compressed, and variable capacity leaves, with both overflow
+ * policies, and on a tree with truncated string separators, and checks that
+ * NULL hints and hints from another tree fall back to regular operations.
+ */
+void test_hinted_operations() {
+    printf("Test hinted operations...\n");
+    const int N = 2000;
+    int *vals = malloc(N * sizeof(int));
+    void **items = malloc(N * sizeof(void *));
+    bool *present = calloc(N, sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+        items[i] = &vals[i];
+    }
+    for (int config = 0; config < TREE_CONFIGS; config++) {
+        bptree *tree = new_config_tree(config, int_compare, int_key);
+        hinted_workload(tree, items, present, N);
+        check_tree(tree, present, N);
+        bptree_free(tree);
+        memset(present, 0, N * sizeof(bool));
+    }
+
+    // A hint from one tree must not be trusted by another.
+    bptree *first = bptree_new(8, int_compare, NULL, NULL, NULL, debug_enabled);
+    bptree *second = bptree_new(8, int_compare, NULL, NULL, NULL, debug_enabled);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(i % 2 ? second : first, items[i]) == BPTREE_OK);
+    }
+    bptree_hint hint = {0};
+    assert(bptree_get_hinted(first, items[10], &hint) == items[10]);
+    assert(bptree_get_hinted(second, items[10], &hint) == NULL);
+    assert(bptree_get_hinted(second, items[11], &hint) == items[11]);
+    assert(bptree_get_hinted(first, items[11], NULL) == NULL);
+    assert(bptree_put_hinted(NULL, items[0], &hint) == BPTREE_ERROR);
+    assert(bptree_remove_hinted(NULL, items[0], &hint) == BPTREE_ERROR);
+    assert(bptree_get_hinted(NULL, items[0], &hint) == NULL);
+    bptree_free(first);
+    bptree_free(second);
+
+    char(*keys)[32] = malloc(N * sizeof(*keys));
+    void **strings = malloc(N * sizeof(void *));
+    for (int i = 0; i < N; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "key-%05d", i);
+        strings[i] = keys[i];
+    }
+    bptree *tree = bptree_new_with_fanout(8, 4, str_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_key_bytes(tree, str_key_bytes) == BPTREE_OK);
+    hinted_workload(tree, strings, present, N);
+    bptree_free(tree);
+    free(strings);
+    free(keys);
+    free(present);
+    free(items);
+    free(vals);
+    printf("Hinted operations passed.\n");
+}
+
+/**
+ * @brief Tests reading ranges one page at a time with continuation tokens.
+ *
+ * Pages of several sizes are read from trees with plain, gapped, compressed,
+ * and dense leaves, both from an unchanged tree and while the item recorded in
+ * the token is removed and new items are inserted after it between pages.
+ */
+void test_range_limit() {
+    printf("Test range limit...\n");
+    const int N = 3000;
+    const int lo = 101;
+    const int hi = N - 101;
+    int *vals = malloc(N * sizeof(int));
+    bool *ever = calloc(N, sizeof(bool));
+    void **page = malloc(100 * sizeof(void *));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    const int limits[] = {1, 7, 100};
+    for (int config = 0; config < TREE_CONFIGS; config++) {
+        for (int l = 0; l < 3; l++) {
+            for (int mutate = 0; mutate < 2; mutate++) {
+                bptree *tree = new_config_tree(config, int_compare, int_key);
+                for (int i = 0; i < N; i++) {
+                    ever[i] = i % 2 == 0;
+                    if (ever[i]) {
+                        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+                    }
+                }
+                bptree_range_token token = {0};
+                int last = lo - 1;
+                int pages = 0;
+                int n;
+                while ((n = bptree_get_range_limit(tree, &vals[lo], &vals[hi], limits[l], page,
+                                                   &token)) > 0) {
+                    assert(n <= limits[l]);
+                    assert(n == limits[l] || token.done);
+                    for (int k = 0; k < n; k++) {
+                        const int v = *(int *)page[k];
+                        assert(v > last && v <= hi);
+                        for (int skipped = last + 1; skipped < v; skipped++) {
+                            assert(!ever[skipped]);
+                        }
+                        last = v;
+                    }
+                    pages++;
+                    if (mutate) {
+                        // Drop the item held by the token and add a few items after it.
+                        assert(bptree_remove(tree, &vals[last]) == BPTREE_OK);
+                        for (int v = last + 1; v < last + 2 * limits[l] + 2 && v < N; v += 2) {
+                            if (!ever[v]) {
+                                ever[v] = true;
+                                assert(bptree_put(tree, &vals[v]) == BPTREE_OK);
+                            }
+                        }
+                    }
+                }
+                assert(token.done);
+                for (int skipped = last + 1; skipped <= hi; skipped++) {
+                    assert(!ever[skipped]);
+                }
+                assert(pages > 0);
+                assert(bptree_get_range_limit(tree, &vals[lo], &vals[hi], limits[l], page,
+                                              &token) == 0);
+                bptree_free(tree);
+            }
+        }
+    }
+
+    // Empty ranges and invalid arguments.
+    bptree *tree = bptree_new_with_fanout(8, 4, int_compare, NULL, NULL, NULL, debug_enabled);
+    bptree_range_token token = {0};
+    assert(bptree_get_range_limit(tree, &vals[0], &vals[N - 1], 10, page, &token) == 0);
+    assert(token.done);
+    for (int i = 0; i < N; i += 2) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+    }
+    token = (bptree_range_token){0};
+    assert(bptree_get_range_limit(tree, &vals[11], &vals[11], 10, page, &token) == 0);
+    assert(token.done);
+    token = (bptree_range_token){0};
+    assert(bptree_get_range_limit(tree, &vals[10], &vals[12], 0, page, &token) == 0);
+    assert(bptree_get_range_limit(NULL, &vals[10], &vals[12], 10, page, &token) == 0);
+    assert(bptree_get_range_limit(tree, &vals[10], &vals[12], 10, NULL, &token) == 0);
+    assert(bptree_get_range_limit(tree, &vals[10], &vals[12], 10, page, NULL) == 0);
+    assert(bptree_get_range_limit(tree, &vals[10], &vals[12], 1, page, &token) == 1);
+    assert(page[0] == &vals[10] && !token.done);
+    // The token is done as soon as the next item is past the end of the range.
+    assert(bptree_get_range_limit(tree, &vals[10], &vals[12], 1, page, &token) == 1);
+    assert(page[0] == &vals[12] && token.done);
+    assert(bptree_get_range_limit(tree, &vals[10], &vals[12], 1, page, &token) == 0);
+    bptree_free(tree);
+    free(page);
+    free(ever);
+    free(vals);
+    printf("Range limit passed.\n");
+}
+
+/**
+ * @brief Items collected by collect_range_item.
+ */
+typedef struct range_visit {
+    const bptree *tree; /**< Tree being queried. */
+    void **items;       /**< Items visited so far. */
+    int count;          /**< Number of items visited. */
+    int stop_after;     /**< Number of items after which the query stops, or 0. */
+} range_visit;
+
+/**
+ * @brief Records an item visited by bptree_get_ranges and checks it lies in its range.
+ *
+ * @param item Pointer to the item.
+ * @param range Range the item was found in.
+ * @param user_data Pointer to a range_visit.
+ * @return false once stop_after items were visited.
+ */
+bool collect_range_item(void *item, const bptree_range *range, void *user_data) {
+    range_visit *visit = user_data;
+    const bptree *tree = visit->tree;
+    assert(tree->compare(item, range->start_key, tree->udata) >= 0);
+    assert(tree->compare(item, range->end_key, tree->udata) <= 0);
+    visit->items[visit->count++] = item;
+    return visit->count != visit->stop_after;
+}
+
+/**
+ * @brief Tests visiting many ranges in one pass.
+ *
+ * Random ranges, including overlapping, empty, and reversed ones, are queried
+ * on trees with plain, gapped, and compressed leaves and on a tree of strings
+ * with byte separators, and the visited items are compared with a scan.
+ */
+void test_get_ranges() {
+    printf("Test get ranges...\n");
+    const int N = 5000;
+    const int R = 300;
+    int *vals = malloc(N * sizeof(int));
+    bool *covered = malloc(N * sizeof(bool));
+    void **items = malloc(N * sizeof(void *));
+    bptree_range *ranges = malloc(R * sizeof(bptree_range));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    for (int config = 0; config < TREE_CONFIGS; config++) {
+        bptree *tree = new_config_tree(config, int_compare, int_key);
+        for (int i = 0; i < N; i++) {
+            if (i % 3 != 0) {
+                assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+            }
+        }
+        for (int round = 0; round < 20; round++) {
+            const int n = round == 0 ? 1 : rand() % R + 1;
+            memset(covered, 0, N * sizeof(bool));
+            for (int r = 0; r < n; r++) {
+                // Mostly short ranges, some long ones, and a few reversed ones.
+                const int start = rand() % N;
+                int end = start + (rand() % 10 == 0 ? rand() % 500 : rand() % 20) - 2;
+                end = end < N ? end : N - 1;
+                end = end >= 0 ? end : 0;
+                ranges[r] = (bptree_range){&vals[start], &vals[end]};
+                for (int v = start; v <= end; v++) {
+                    covered[v] = true;
+                }
+            }
+            range_visit visit = {tree, items, 0, 0};
+            assert(bptree_get_ranges(tree, ranges, n, collect_range_item, &visit) == BPTREE_OK);
+            for (int r = 1; r < n; r++) {
+                assert(int_compare(ranges[r - 1].start_key, ranges[r].start_key, NULL) <= 0);
+            }
+            int expected = 0;
+            for (int v = 0; v < N; v++) {
+                if (covered[v] && v % 3 != 0) {
+                    assert(expected < visit.count && visit.items[expected] == &vals[v]);
+                    expected++;
+                }
+            }
+            assert(visit.count == expected);
+            if (expected > 1) {
+                visit = (range_visit){tree, items, 0, expected - 1};
+                assert(bptree_get_ranges(tree, ranges, n, collect_range_item, &visit) ==
+                       BPTREE_OK);
+                assert(visit.count == expected - 1);
+            }
+        }
+        bptree_free(tree);
+    }
+
+    // Separators holding key bytes are compared with the range starts when climbing.
+    char(*keys)[80] = malloc(N * sizeof(*keys));
+    bptree *tree = bptree_new_with_fanout(8, 4, str_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_key_bytes(tree, str_key_bytes) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "keys/%05d", i);
+        assert(bptree_put(tree, keys[i]) == BPTREE_OK);
+    }
+    for (int r = 0; r < 50; r++) {
+        ranges[r] = (bptree_range){keys[(49 - r) * 100], keys[(49 - r) * 100 + 9]};
+    }
+    range_visit visit = {tree, items, 0, 0};
+    assert(bptree_get_ranges(tree, ranges, 50, collect_range_item, &visit) == BPTREE_OK);
+    assert(visit.count == 500);
+    for (int k = 0; k < 500; k++) {
+        assert(visit.items[k] == keys[k / 10 * 100 + k % 10]);
+    }
+    assert(bptree_get_ranges(NULL, ranges, 50, collect_range_item, &visit) == BPTREE_ERROR);
+    assert(bptree_get_ranges(tree, NULL, 50, collect_range_item, &visit) == BPTREE_ERROR);
+    assert(bptree_get_ranges(tree, ranges, -1, collect_range_item, &visit) == BPTREE_ERROR);
+    assert(bptree_get_ranges(tree, ranges, 50, NULL, &visit) == BPTREE_ERROR);
+    assert(bptree_get_ranges(tree, NULL, 0, collect_range_item, &visit) == BPTREE_OK);
+    bptree_free(tree);
+    free(keys);
+    free(ranges);
+    free(items);
+    free(covered);
+    free(vals);
+    printf("Get ranges passed.\n");
+}
+
+/**
+ * @brief Records an item visited by bptree_scan_prefix.
+ *
+ * @param item Pointer to the item.
+ * @param user_data Pointer to a range_visit.
+ * @return false once stop_after items were visited.
+ */
+bool collect_item(void *item, void *user_data) {
+    range_visit *visit = user_data;
+    visit->items[visit->count++] = item;
+    return visit->count != visit->stop_after;
+}
+
+/**
+ * @brief Tests visiting the items whose keys start with a prefix.
+ *
+ * The tree mixes short keys, whose separators are stored inline, with keys
+ * sharing a long prefix, whose separators refer to items, and uses plain and
+ * gapped leaves. Each scan is compared with a filter over the sorted keys.
+ */
+void test_scan_prefix() {
+    printf("Test scan prefix...\n");
+    const int N = 2000;
+    char(*keys)[48] = malloc(2 * N * sizeof(*keys));
+    void **items = malloc(2 * N * sizeof(void *));
+    for (int i = 0; i < N; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "a/long/shared/prefix/of/the/keys/%05d", i);
+        snprintf(keys[N + i], sizeof(keys[N + i]), "k%05d", i);
+    }
+    const char *prefixes[] = {"",
+                              "a",
+                              "a/long/shared/prefix/of/the/keys/001",
+                              "a/long/shared/prefix/of/the/keys/01999",
+                              "a/long/shared/prefix/of/the/keys/9",
+                              "j",
+                              "k",
+                              "k0",
+                              "k012",
+                              "k01234",
+                              "k012345",
+                              "k1999",
+                              "l"};
+    const int n_prefixes = sizeof(prefixes) / sizeof(prefixes[0]);
+    for (int gapped = 0; gapped < 2; gapped++) {
+        bptree *tree = bptree_new_with_fanout(8, 4, str_compare, NULL, NULL, NULL, debug_enabled);
+        assert(bptree_set_key_bytes(tree, str_key_bytes) == BPTREE_OK);
+        assert(bptree_set_gapped_leaves(tree, gapped) == BPTREE_OK);
+        for (int i = 0; i < 2 * N; i++) {
+            assert(bptree_put(tree, keys[(long long)i * 7919 % (2 * N)]) == BPTREE_OK);
+        }
+        for (int p = 0; p < n_prefixes; p++) {
+            const size_t length = strlen(prefixes[p]);
+            range_visit visit = {tree, items, 0, 0};
+            assert(bptree_scan_prefix(tree, prefixes[p], length, collect_item, &visit) ==
+                   BPTREE_OK);
+            int expected = 0;
+            for (int i = 0; i < 2 * N; i++) {
+                if (strncmp(keys[i], prefixes[p], length) == 0) {
+                    assert(expected < visit.count && visit.items[expected] == keys[i]);
+                    expected++;
+                }
+            }
+            assert(visit.count == expected);
+            if (expected > 1) {
+                void *first = items[0];
+                visit = (range_visit){tree, items, 0, 1};
+                assert(bptree_scan_prefix(tree, prefixes[p], length, collect_item, &visit) ==
+                       BPTREE_OK);
+                assert(visit.count == 1 && items[0] == first);
+            }
+        }
+        range_visit visit = {tree, items, 0, 0};
+        assert(bptree_scan_prefix(tree, NULL, 0, collect_item, &visit) == BPTREE_OK);
+        assert(visit.count == 2 * N);
+        for (int i = 0; i < 2 * N; i++) {
+            assert(items[i] == keys[i]);
+        }
+        assert(bptree_scan_prefix(tree, NULL, 1, collect_item, &visit) == BPTREE_ERROR);
+        assert(bptree_scan_prefix(tree, "k", 1, NULL, &visit) == BPTREE_ERROR);
+        assert(bptree_scan_prefix(NULL, "k", 1, collect_item, &visit) == BPTREE_ERROR);
+        bptree_free(tree);
+    }
+    bptree *tree = bptree_new_with_fanout(8, 4, str_compare, NULL, NULL, NULL, debug_enabled);
+    range_visit visit = {tree, items, 0, 0};
+    assert(bptree_scan_prefix(tree, "k", 1, collect_item, &visit) == BPTREE_ERROR);
+    assert(bptree_set_key_bytes(tree, str_key_bytes) == BPTREE_OK);
+    assert(bptree_scan_prefix(tree, NULL, 0, collect_item, &visit) == BPTREE_OK);
+    assert(visit.count == 0);
+    assert(bptree_put(tree, keys[N]) == BPTREE_OK);
+    assert(bptree_scan_prefix(tree, NULL, 0, collect_item, &visit) == BPTREE_OK);
+    assert(visit.count == 1 && items[0] == keys[N]);
+    bptree_free(tree);
+    free(items);
+    free(keys);
+    printf("Scan prefix passed.\n");
+}
+
+/**
+ * @brief Tests the smallest and largest items and popping them as from a priority queue.
+ *
+ * Trees with plain, gapped, compressed, and variable capacity leaves are used
+ * as work queues: items are popped from both ends while new ones are pushed
+ * in between, and the results are compared with a model. The cached edge
+ * leaves are also checked after bulk loading and compaction replace all nodes.
+ */
+void test_min_max() {
+    printf("Test min and max...\n");
+    const int N = 3000;
+    int *vals = malloc(2 * N * sizeof(int));
+    bool *present = malloc(2 * N * sizeof(bool));
+    for (int i = 0; i < 2 * N; i++) {
+        vals[i] = i;
+    }
+    for (int config = 0; config < TREE_CONFIGS; config++) {
+        bptree *tree = new_config_tree(config, int_compare, int_key);
+        void *item = NULL;
+        assert(bptree_min(tree) == NULL && bptree_max(tree) == NULL);
+        assert(bptree_pop_min(tree, &item) == BPTREE_NOT_FOUND);
+        assert(bptree_pop_max(tree, &item) == BPTREE_NOT_FOUND);
+        memset(present, 0, 2 * N * sizeof(bool));
+        for (int i = 0; i < N; i++) {
+            const int v = (int)((long long)i * 7919 % N);
+            present[v] = true;
+            assert(bptree_put(tree, &vals[v]) == BPTREE_OK);
+        }
+        int low = 0, high = N - 1, next = N;
+        for (int step = 0; step < 3 * N && low <= high; step++) {
+            assert(bptree_min(tree) == &vals[low] && bptree_max(tree) == &vals[high]);
+            if (step % 3 == 2 && next < 2 * N) {
+                // Pushing the next value makes it the largest item.
+                present[next] = true;
+                assert(bptree_put(tree, &vals[next]) == BPTREE_OK);
+                high = next++;
+            } else if (step % 2 == 0) {
+                assert(bptree_pop_min(tree, &item) == BPTREE_OK && item == &vals[low]);
+                present[low] = false;
+                while (low <= high && !present[low]) {
+                    low++;
+                }
+            } else {
+                assert(bptree_pop_max(tree, &item) == BPTREE_OK && item == &vals[high]);
+                present[high] = false;
+                while (high >= low && !present[high]) {
+                    high--;
+                }
+            }
+            if (step % 256 == 0) {
+                assert(check_node(tree, tree->root, NULL, NULL, 1) == tree->count);
+            }
+        }
+        int count = 0;
+        for (int v = 0; v < 2 * N; v++) {
+            count += present[v];
+            assert((bptree_get(tree, &vals[v]) != NULL) == present[v]);
+        }
+        assert(tree->count == count);
+        while (bptree_pop_min(tree, &item) == BPTREE_OK) {
+            count--;
+        }
+        assert(count == 0 && tree->count == 0 && bptree_max(tree) == NULL);
+        bptree_free(tree);
+    }
+
+    void **items = malloc(N * sizeof(void *));
+    for (int i = 0; i < N; i++) {
+        items[i] = &vals[i];
+    }
+    bptree *tree = bptree_bulk_load(8, int_compare, NULL, NULL, NULL, debug_enabled, items, N);
+    assert(bptree_min(tree) == &vals[0] && bptree_max(tree) == &vals[N - 1]);
+    for (int i = 0; i < N / 2; i++) {
+        void *item;
+        assert(bptree_pop_max(tree, &item) == BPTREE_OK && item == &vals[N - 1 - i]);
+    }
+    assert(bptree_compact(tree, 100) == BPTREE_OK);
+    const bptree *view = tree;
+    assert(bptree_min(view) == &vals[0] && bptree_max(view) == &vals[N - N / 2 - 1]);
+    assert(bptree_min(NULL) == NULL && bptree_max(NULL) == NULL);
+    assert(bptree_pop_min(tree, NULL) == BPTREE_ERROR);
+    assert(bptree_pop_max(NULL, items) == BPTREE_ERROR);
+    bptree_free(tree);
+    free(items);
+    free(present);
+    free(vals);
+    printf("Min and max passed.\n");
+}
+
+/**
+ * @brief Tests copying trees with bptree_clone and bptree_clone_parallel.
+ *
+ * Trees with plain, gapped, dense, compressed, and variable capacity leaves,
+ * and a tree of strings with byte separators, are cloned. Each clone must
+ * hold the same items in a valid structure, keep working under a random
+ * workload, and share no nodes with its source.
+ */
+void test_clone() {
+    printf("Test clone...\n");
+    const int N = 20000;
+    int *vals = malloc(N * sizeof(int));
+    bool *present = malloc(N * sizeof(bool));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+        present[i] = i % 3 != 0;
+    }
+    for (int config = 0; config < TREE_CONFIGS; config++) {
+        for (int threads = 1; threads <= 4; threads += 3) {
+            bptree *tree = new_config_tree(config, int_compare, int_key);
+            for (int i = 0; i < N; i++) {
+                const int v = (int)((long long)i * 7919 % N);
+                if (present[v]) {
+                    assert(bptree_put(tree, &vals[v]) == BPTREE_OK);
+                }
+            }
+            bptree *clone = bptree_clone_parallel(tree, threads);
+            assert(clone != NULL && clone->root != tree->root);
+            check_tree(clone, present, N);
+            const bptree_stats stats = bptree_get_stats(tree);
+            const bptree_stats clone_stats = bptree_get_stats(clone);
+            assert(clone_stats.height == stats.height);
+            assert(clone_stats.leaf_count == stats.leaf_count);
+            assert(clone_stats.dense_leaf_count == stats.dense_leaf_count);
+            assert(clone_stats.compressed_leaf_count == stats.compressed_leaf_count);
+            // Emptying and reusing the clone leaves the source untouched.
+            for (int v = 0; v < N; v++) {
+                if (present[v]) {
+                    assert(bptree_remove(clone, &vals[v]) == BPTREE_OK);
+                }
+            }
+            random_workload(clone, vals, N, 20000);
+            check_tree(tree, present, N);
+            bptree_free(tree);
+            bptree_free(clone);
+        }
+    }
+
+    // Strings with byte separators, a small tree with its root inline, and an empty tree.
+    char(*keys)[48] = malloc(N * sizeof(*keys));
+    bptree *tree = bptree_new_with_fanout(8, 4, str_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_key_bytes(tree, str_key_bytes) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        snprintf(keys[i], sizeof(keys[i]), i % 2 ? "k%05d" : "a/long/shared/prefix/%05d", i);
+        assert(bptree_put(tree, keys[i]) == BPTREE_OK);
+    }
+    bptree *clone = bptree_clone(tree);
+    bptree_free(tree);
+    assert(clone->count == N && check_node(clone, clone->root, NULL, NULL, 1) == N);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_get(clone, keys[i]) == keys[i]);
+    }
+    bptree_free(clone);
+    free(keys);
+    tree = bptree_new_with_fanout(8, 4, int_compare, NULL, NULL, NULL, debug_enabled);
+    clone = bptree_clone(tree);
+    assert(clone != NULL && clone->count == 0 && bptree_min(clone) == NULL);
+    bptree_free(clone);
+    for (int i = 0; i < 3; i++) {
+        assert(bptree_put(tree, &vals[i]) == BPTREE_OK);
+    }
+    clone = bptree_clone(tree);
+    assert(clone->count == 3 && clone->root == &clone->root_leaf);
+    assert(bptree_put(clone, &vals[3]) == BPTREE_OK && tree->count == 3);
+    assert(bptree_get(clone, &vals[2]) == &vals[2] && bptree_get(tree, &vals[3]) == NULL);
+    assert(bptree_clone(NULL) == NULL && bptree_clone_parallel(tree, 0) == NULL);
+    bptree_free(clone);
+    bptree_free(tree);
+    free(present);
+    free(vals);
+    printf("Clone passed.\n");
+}
+
+/* Item with a string key and a value, for diffs that tell changed items apart */
+typedef struct pair {
+    char key[12]; /**< Key, first so that the item is also its key string. */
+    int number;   /**< Key as an integer. */
+    int value;    /**< Value. */
+} pair;
+
+/**
+ * @brief Returns the integer key of a pair.
+ *
+ * @param item Pointer to the pair.
+ * @param user_data Unused user data.
+ * @return Key of the pair as an integer.
+ */
+long long pair_int_key(const void *item, const void *user_data) {
+    (void)user_data;
+    return ((const pair *)item)->number;
+}
+
+/**
+ * @brief Hashes the key and value of a pair.
+ *
+ * @param item Pointer to the pair.
+ * @param user_data Unused user data.
+ * @return Hash of the pair.
+ */
+unsigned long long pair_hash(const void *item, const void *user_data) {
+    (void)user_data;
+    const pair *p = item;
+    return (unsigned long long)p->number * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)p->value;
+}
+
+/**
+ * @brief Hashes only the key of a pair.
+ *
+ * @param item Pointer to the pair.
+ * @param user_data Unused user data.
+ * @return Hash of the key of the pair.
+ */
+unsigned long long pair_key_hash(const void *item, const void *user_data) {
+    (void)user_data;
+    return (unsigned long long)((const pair *)item)->number;
+}
+
+#ifdef BPTREE_NODE_HASHES
+/**
+ * @brief Recomputes the hashes of a subtree and checks the ones marked up to date.
+ *
+ * @param tree Pointer to a B+Tree with a hash function.
+ * @param node Root of the subtree.
+ * @return Hash of the subtree.
+ */
+unsigned long long check_hashes(const bptree *tree, const bptree_node *node) {
+    unsigned long long hash = 0;
+    for (int i = 0; i < node->num_keys + !node->is_leaf; i++) {
+        if (!node->is_leaf) {
+            hash += check_hashes(tree, child_at(tree, node, i));
+        } else if (node->ptr.leaf.items[i]) {
+            hash += item_hash(tree, node->ptr.leaf.items[i]);
+        }
+    }
+    assert(!node->hashed || node->hash == hash);
+    return hash;
+}
+#endif
+
+/* Differences reported by bptree_diff */
+typedef struct diff_log {
+    const pair **a_items; /**< First tree's item per reported key, by report. */
+    const pair **b_items; /**< Second tree's item per reported key, by report. */
+    int count;            /**< Number of reports. */
+    int limit;            /**< Number of reports to stop after, or 0 for no limit. */
+} diff_log;
+
+/**
+ * @brief Records a difference reported by bptree_diff.
+ *
+ * @param a_item Item of the first tree, or NULL.
+ * @param b_item Item of the second tree, or NULL.
+ * @param user_data Pointer to the diff_log.
+ * @return false once the log's limit is reached.
+ */
+bool log_difference(void *a_item, void *b_item, void *user_data) {
+    diff_log *log = user_data;
+    assert(a_item || b_item);
+    log->a_items[log->count] = a_item;
+    log->b_items[log->count] = b_item;
+    log->count++;
+    return log->count != log->limit;
+}
+
+#ifdef BPTREE_NODE_HASHES
+/**
+ * @brief Diffs two trees of pairs and compares the result with their contents.
+ *
+ * @param a First tree.
+ * @param b Second tree.
+ * @param in_a Item of the first tree per key, or NULL.
+ * @param in_b Item of the second tree per key, or NULL.
+ * @param n Number of keys.
+ * @param log Log with room for n reports.
+ */
+void check_diff(bptree *a, bptree *b, pair **in_a, pair **in_b, const int n, diff_log *log) {
+    log->count = 0;
+    log->limit = 0;
+    assert(bptree_diff(a, b, log_difference, log) == BPTREE_OK);
+    int reported = 0;
+    for (int k = 0; k < n; k++) {
+        if (in_a[k] == in_b[k] ||
+            (in_a[k] && in_b[k] && in_a[k]->value == in_b[k]->value)) {
+            continue;
+        }
+        assert(reported < log->count);
+        assert(log->a_items[reported] == in_a[k] && log->b_items[reported] == in_b[k]);
+        reported++;
+    }
+    assert(reported == log->count);
+    // Bring every hash up to date, so later diffs rely on modifications marking them stale.
+    assert(node_hash(a, a->root) == check_hashes(a, a->root));
+    assert(node_hash(b, b->root) == check_hashes(b, b->root));
+}
+#endif
+
+/**
+ * @brief Tests node hashes and diffs between trees.
+ *
+ * A tree of pairs with plain, gapped, compressed, variable capacity leaves,
+ * or byte separators is cloned, and both trees are changed through every kind
+ * of modification: removals, insertions, replaced values, hinted operations,
+ * pops, and cursors. Diffs taken in between bring the hashes up to date, so
+ * the later ones depend on every modification marking its path stale. Each
+ * diff is compared with the contents of the trees, as is a diff with a tree of
+ * the same items built in another order with another fanout. Without
+ * BPTREE_NODE_HASHES, this test checks that hashes and diffs are refused.
+ */
+void test_merkle_diff() {
+    printf("Test Merkle diff...\n");
+#ifndef BPTREE_NODE_HASHES
+    bptree *tree = bptree_new(8, str_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_hash(tree, pair_hash) == BPTREE_ERROR);
+    assert(bptree_set_hash(tree, NULL) == BPTREE_OK);
+    assert(bptree_set_hash(NULL, NULL) == BPTREE_ERROR);
+    diff_log log = {NULL, NULL, 0, 0};
+    assert(bptree_diff(tree, tree, log_difference, &log) == BPTREE_ERROR);
+    bptree_free(tree);
+#else
+    const int N = 6000;
+    pair *pairs = malloc(2 * N * sizeof(pair));
+    pair **in_a = malloc(N * sizeof(pair *));
+    pair **in_b = malloc(N * sizeof(pair *));
+    diff_log log = {malloc(N * sizeof(pair *)), malloc(N * sizeof(pair *)), 0, 0};
+    for (int i = 0; i < 2 * N; i++) {
+        snprintf(pairs[i].key, sizeof(pairs[i].key), "k%06d", i % N);
+        pairs[i].number = i % N;
+        pairs[i].value = i / N;
+    }
+    for (int config = 0; config <= TREE_CONFIGS; config++) {
+        // The last configuration stores key prefixes in the internal nodes.
+        bptree *a = new_config_tree(config < TREE_CONFIGS ? config : 0, str_compare, pair_int_key);
+        if (config == TREE_CONFIGS) {
+            assert(bptree_set_key_bytes(a, str_key_bytes) == BPTREE_OK);
+        }
+        for (int i = 0; i < N; i++) {
+            const int k = (int)((long long)i * 7919 % N);
+            in_a[k] = k % 5 ? &pairs[k] : NULL;
+            in_b[k] = in_a[k];
+            if (in_a[k]) {
+                assert(bptree_put(a, in_a[k]) == BPTREE_OK);
+            }
+        }
+        assert(bptree_diff(a, a, log_difference, &log) == BPTREE_ERROR);
+        assert(bptree_set_hash(a, pair_hash) == BPTREE_OK);
+        bptree *b = bptree_clone(a);
+        check_diff(a, b, in_a, in_b, N, &log);
+        assert(log.count == 0 && a->root->hashed && b->root->hashed);
+
+        // Replace values and remove keys through the plain operations.
+        for (int k = 1; k < N; k += 97) {
+            if (in_b[k]) {
+                assert(bptree_remove(b, in_b[k]) == BPTREE_OK);
+            }
+            in_b[k] = k % 2 ? &pairs[N + k] : NULL;
+            if (in_b[k]) {
+                assert(bptree_put(b, in_b[k]) == BPTREE_OK);
+            }
+        }
+        check_diff(a, b, in_a, in_b, N, &log);
+        // Removals thinning out a run of keys, which borrow from both siblings and merge.
+        for (int k = 500; k < 1500; k++) {
+            if (in_b[k] && (k % 7 == 0 || k % 3 == 0 || k > 1200)) {
+                assert(bptree_remove(b, in_b[k]) == BPTREE_OK);
+                in_b[k] = NULL;
+            }
+        }
+        check_diff(a, b, in_a, in_b, N, &log);
+        // Insertions and removals into leaves with room, which hints would do in place.
+        bptree_hint hint;
+        memset(&hint, 0, sizeof(hint));
+        for (int k = 2000; k < 2200; k += 5) {
+            assert(bptree_put_hinted(b, &pairs[N + k], &hint) ==
+                   (in_b[k] ? BPTREE_DUPLICATE : BPTREE_OK));
+            in_b[k] = in_b[k] ? in_b[k] : &pairs[N + k];
+        }
+        check_diff(a, b, in_a, in_b, N, &log);
+        for (int k = 2001; k < 2200; k += 10) {
+            assert(bptree_remove_hinted(b, &pairs[k], &hint) ==
+                   (in_b[k] ? BPTREE_OK : BPTREE_NOT_FOUND));
+            in_b[k] = NULL;
+        }
+        check_diff(a, b, in_a, in_b, N, &log);
+        // Pops from both edges, some from leaves filled up to pop without rebalancing.
+        for (int k = 0; k < 40; k += 5) {
+            assert(bptree_put(b, &pairs[N + k]) == BPTREE_OK);
+            in_b[k] = &pairs[N + k];
+            assert(bptree_put(b, &pairs[2 * N - 5 - k]) == BPTREE_OK);
+            in_b[N - 5 - k] = &pairs[2 * N - 5 - k];
+        }
+        check_diff(a, b, in_a, in_b, N, &log);
+        void *item;
+        for (int i = 0; i < 20; i++) {
+            if (i == 1) {
+                check_diff(a, b, in_a, in_b, N, &log);
+            }
+            assert(bptree_pop_min(b, &item) == BPTREE_OK);
+            in_b[((pair *)item)->number] = NULL;
+            assert(bptree_pop_max(b, &item) == BPTREE_OK);
+            in_b[((pair *)item)->number] = NULL;
+        }
+        check_diff(a, b, in_a, in_b, N, &log);
+        // Removals from the first tree.
+        for (int k = 3001; k < 3400; k += 3) {
+            if (in_a[k]) {
+                assert(bptree_remove(a, in_a[k]) == BPTREE_OK);
+                in_a[k] = NULL;
+            }
+        }
+        check_diff(a, b, in_a, in_b, N, &log);
+        // Cursor replacements, insertions, and removals.
+        bptree_cursor *cursor = bptree_cursor_new(b, &pairs[4000]);
+        for (int i = 0; i < 300 && (item = bptree_cursor_get(cursor)) != NULL; i++) {
+            const int k = ((pair *)item)->number;
+            if (i % 30 < 3) {
+                check_diff(a, b, in_a, in_b, N, &log);
+            }
+            if (i % 3 == 0) {
+                assert(bptree_cursor_replace(cursor, &pairs[N + k]) == BPTREE_OK);
+                in_b[k] = &pairs[N + k];
+                bptree_cursor_next(cursor);
+            } else if (i % 3 == 1) {
+                assert(bptree_cursor_remove(cursor) == BPTREE_OK);
+                in_b[k] = NULL;
+            } else {
+                if (!in_b[k - 1]) {
+                    assert(bptree_cursor_insert_before(cursor, &pairs[k - 1]) == BPTREE_OK);
+                    in_b[k - 1] = &pairs[k - 1];
+                }
+                bptree_cursor_next(cursor);
+            }
+        }
+        bptree_cursor_free(cursor);
+        check_diff(a, b, in_a, in_b, N, &log);
+        assert(log.count > 0);
+
+        // The same items in a tree of another shape.
+        bptree *c = bptree_new_with_fanout(6, 7, str_compare, NULL, NULL, NULL, debug_enabled);
+        if (config == TREE_CONFIGS) {
+            assert(bptree_set_key_bytes(c, str_key_bytes) == BPTREE_OK);
+        }
+        assert(bptree_set_hash(c, pair_hash) == BPTREE_OK);
+        for (int k = N - 1; k >= 0; k--) {
+            if (in_b[k]) {
+                assert(bptree_put(c, in_b[k]) == BPTREE_OK);
+            }
+        }
+        check_diff(a, c, in_a, in_b, N, &log);
+        check_diff(c, b, in_b, in_b, N, &log);
+        assert(log.count == 0);
+        log.count = 0;
+        log.limit = 1;
+        assert(bptree_diff(a, c, log_difference, &log) == BPTREE_OK && log.count == 1);
+        assert(bptree_set_hash(c, pair_key_hash) == BPTREE_OK);
+        assert(bptree_diff(a, c, log_difference, &log) == BPTREE_ERROR);
+        assert(bptree_diff(a, NULL, log_difference, &log) == BPTREE_ERROR);
+        assert(bptree_diff(a, b, NULL, &log) == BPTREE_ERROR);
+        assert(bptree_set_hash(NULL, pair_hash) == BPTREE_ERROR);
+        bptree_free(a);
+        bptree_free(b);
+        bptree_free(c);
+    }
+    free(log.a_items);
+    free(log.b_items);
+    free(in_b);
+    free(in_a);
+    free(pairs);
+#endif
+    printf("Merkle diff passed.\n");
+}
+
+/**
+ * @brief Tests merging several trees with a merged iterator.
+ *
+ * Five trees, one in each configuration of new_config_tree and one of them
+ * empty, hold overlapping sets of pairs, with the value telling the trees
+ * apart. Merged scans from several start keys, with and without
+ * de-duplication, are compared with the sets, as is the merge of a single
+ * tree. Trees holding blocks of consecutive keys then check the runs of a
+ * single source.
+ */
+void test_merge_iterator() {
+    printf("Test merge iterator...\n");
+    const int N = 3000, K = TREE_CONFIGS;
+    pair *pairs = malloc(K * N * sizeof(pair));
+    bptree *trees[TREE_CONFIGS];
+    for (int t = 0; t < K; t++) {
+        trees[t] = new_config_tree(t, str_compare, pair_int_key);
+        for (int i = 0; i < N; i++) {
+            pair *p = &pairs[t * N + i];
+            snprintf(p->key, sizeof(p->key), "k%06d", i);
+            p->number = i;
+            p->value = t;
+            // Tree t holds the keys divisible by t + 1, except tree 3, which is empty.
+            if (t != 3 && i % (t + 1) == 0) {
+                assert(bptree_put(trees[t], p) == BPTREE_OK);
+            }
+        }
+    }
+    const int starts[] = {-1, 0, 1, 1234, N - 1, N};
+    for (int s = 0; s < 6; s++) {
+        char start_key[12];
+        snprintf(start_key, sizeof(start_key), "k%06d", starts[s]);
+        const int first = starts[s] < 0 ? 0 : starts[s];
+        for (int dedup = 0; dedup < 2; dedup++) {
+            bptree_merge_iterator *iter = bptree_merge_iterator_new(
+                (const bptree *const *)trees, K, starts[s] < 0 ? NULL : start_key, dedup);
+            assert(iter != NULL);
+            for (int i = first; i < N; i++) {
+                // Equal keys come from the newest tree first.
+                for (int t = K - 1; t >= 0; t--) {
+                    if (t == 3 || i % (t + 1) != 0) {
+                        continue;
+                    }
+                    int source = -1;
+                    assert(bptree_merge_iterator_next(iter, &source) == &pairs[t * N + i]);
+                    assert(source == t);
+                    if (dedup) {
+                        break;
+                    }
+                }
+            }
+            assert(bptree_merge_iterator_next(iter, NULL) == NULL);
+            assert(bptree_merge_iterator_next(iter, NULL) == NULL);
+            bptree_merge_iterator_free(iter);
+        }
+    }
+    bptree_merge_iterator *iter =
+        bptree_merge_iterator_new((const bptree *const *)&trees[1], 1, NULL, true);
+    for (int i = 0; i < N; i += 2) {
+        assert(bptree_merge_iterator_next(iter, NULL) == &pairs[N + i]);
+    }
+    assert(bptree_merge_iterator_next(iter, NULL) == NULL);
+    bptree_merge_iterator_free(iter);
+    const bptree *with_null[2] = {trees[0], NULL};
+    assert(bptree_merge_iterator_new(with_null, 2, NULL, false) == NULL);
+    assert(bptree_merge_iterator_new((const bptree *const *)trees, 0, NULL, false) == NULL);
+    assert(bptree_merge_iterator_new(NULL, 1, NULL, false) == NULL);
+    assert(bptree_merge_iterator_next(NULL, NULL) == NULL);
+    bptree_merge_iterator_free(NULL);
+    for (int t = 0; t < K; t++) {
+        bptree_free(trees[t]);
+    }
+
+    // Trees holding blocks of keys, sharing the first key of each block with the tree before.
+    const int blocks[] = {3, 37, 500};
+    for (int b = 0; b < 3; b++) {
+        const int size = blocks[b];
+        for (int t = 0; t < K; t++) {
+            trees[t] = new_config_tree(t, str_compare, pair_int_key);
+        }
+        for (int i = 0; i < N; i++) {
+            const int t = i / size % K;
+            assert(bptree_put(trees[t], &pairs[t * N + i]) == BPTREE_OK);
+            if (i > 0 && i % size == 0) {
+                const int before = (i - 1) / size % K;
+                assert(bptree_put(trees[before], &pairs[before * N + i]) == BPTREE_OK);
+            }
+        }
+        for (int dedup = 0; dedup < 2; dedup++) {
+            bptree_merge_iterator *iter =
+                bptree_merge_iterator_new((const bptree *const *)trees, K, NULL, dedup);
+            for (int i = 0; i < N; i++) {
+                const int t = i / size % K;
+                const int before = i > 0 && i % size == 0 ? (i - 1) / size % K : t;
+                const int newest = t > before ? t : before;
+                int source = -1;
+                assert(bptree_merge_iterator_next(iter, &source) == &pairs[newest * N + i]);
+                assert(source == newest);
+                if (!dedup && before != t) {
+                    const int oldest = t + before - newest;
+                    assert(bptree_merge_iterator_next(iter, &source) == &pairs[oldest * N + i]);
+                    assert(source == oldest);
+                }
+            }
+            assert(bptree_merge_iterator_next(iter, NULL) == NULL);
+            bptree_merge_iterator_free(iter);
+        }
+        for (int t = 0; t < K; t++) {
+            bptree_free(trees[t]);
+        }
+    }
+    free(pairs);
+    printf("Merge iterator passed.\n");
+}
+
+/* Items visited by a set operation */
+typedef struct set_log {
+    const pair **items; /**< Items in the order visited. */
+    int count;          /**< Number of items visited. */
+    int limit;          /**< Number of items to stop after, or 0 for no limit. */
+} set_log;
+
+/**
+ * @brief Records an item visited by a set operation.
+ *
+ * @param item Item kept by the operation.
+ * @param user_data Pointer to the set_log.
+ * @return false once the log's limit is reached.
+ */
+bool log_set_item(void *item, void *user_data) {
+    set_log *log = user_data;
+    log->items[log->count++] = item;
+    return log->count != log->limit;
+}
+
+/**
+ * @brief Runs a set operation and compares its items and tree with the expected items.
+ *
+ * @param op bptree_intersect, bptree_union, or bptree_difference.
+ * @param a First tree.
+ * @param b Second tree.
+ * @param expected Expected item per key, or NULL.
+ * @param n Number of keys.
+ * @param log Log with room for n items.
+ */
+void check_set_operation(bptree_status (*op)(const bptree *, const bptree *, bptree_visitor_t,
+                                             void *, bptree **),
+                         bptree *a, bptree *b, pair **expected, const int n, set_log *log) {
+    log->count = 0;
+    log->limit = 0;
+    bptree *out = NULL;
+    assert(op(a, b, log_set_item, log, &out) == BPTREE_OK && out != NULL);
+    int count = 0;
+    for (int k = 0; k < n; k++) {
+        if (expected[k]) {
+            assert(count < log->count && log->items[count] == expected[k]);
+            assert(bptree_get(out, expected[k]) == expected[k]);
+            count++;
+        }
+    }
+    assert(log->count == count && out->count == count);
+    assert(check_node(out, out->root, NULL, NULL, 1) == count);
+    assert(out->leaf_max_keys == a->leaf_max_keys && out->int_key == a->int_key);
+    assert(out->key_bytes == a->key_bytes);
+    bptree_free(out);
+    // Stopping early leaves the new tree with the items visited so far.
+    if (count > 2) {
+        log->count = 0;
+        log->limit = count / 2;
+        assert(op(a, b, log_set_item, log, &out) == BPTREE_OK);
+        assert(log->count == count / 2 && out->count == count / 2);
+        assert(check_node(out, out->root, NULL, NULL, 1) == count / 2);
+        bptree_free(out);
+    }
+    log->count = 0;
+    log->limit = 0;
+    assert(op(a, b, log_set_item, log, NULL) == BPTREE_OK && log->count == count);
+}
+
+/**
+ * @brief Tests intersections, unions, and differences of two trees.
+ *
+ * Trees of pairs with plain, gapped, compressed leaves, or byte separators
+ * are combined with a tree of another fanout that shares part of their keys,
+ * and with a sparse tree whose long gaps make the merge skip through
+ * separators. The visited items and the new trees are compared with the
+ * expected items, in both orders of the trees.
+ */
+void test_set_operations() {
+    printf("Test set operations...\n");
+    const int N = 6000;
+    pair *pairs = malloc(2 * N * sizeof(pair));
+    pair **in_a = malloc(N * sizeof(pair *));
+    pair **in_b = malloc(N * sizeof(pair *));
+    pair **expected = malloc(N * sizeof(pair *));
+    set_log log = {malloc(2 * N * sizeof(pair *)), 0, 0};
+    for (int i = 0; i < 2 * N; i++) {
+        snprintf(pairs[i].key, sizeof(pairs[i].key), "k%06d", i % N);
+        pairs[i].number = i % N;
+        pairs[i].value = i / N;
+    }
+    for (int config = 0; config < TREE_CONFIGS + 2; config++) {
+        // The last two configurations store key prefixes in the internal nodes of both
+        // trees, and pair a dense tree with a sparse one.
+        bptree *a = new_config_tree(config < TREE_CONFIGS ? config : 0, str_compare, pair_int_key);
+        bptree *b = bptree_new_with_fanout(16, 6, str_compare, NULL, NULL, NULL, debug_enabled);
+        if (config == TREE_CONFIGS) {
+            assert(bptree_set_key_bytes(a, str_key_bytes) == BPTREE_OK);
+            assert(bptree_set_key_bytes(b, str_key_bytes) == BPTREE_OK);
+        }
+        const bool sparse = config == TREE_CONFIGS + 1;
+        for (int i = 0; i < N; i++) {
+            const int k = (int)((long long)i * 7919 % N);
+            const bool a_has = sparse || k % 2 == 0 || k % 7 == 0;
+            const bool b_has = sparse ? k % 97 == 5 || (k > 2000 && k < 2040) : k % 3 == 0;
+            in_a[k] = a_has ? &pairs[k] : NULL;
+            in_b[k] = b_has ? &pairs[N + k] : NULL;
+            if (a_has) {
+                assert(bptree_put(a, &pairs[k]) == BPTREE_OK);
+            }
+            if (b_has) {
+                assert(bptree_put(b, &pairs[N + k]) == BPTREE_OK);
+            }
+        }
+        for (int order = 0; order < 2; order++) {
+            bptree *first = order ? b : a, *second = order ? a : b;
+            pair **in_first = order ? in_b : in_a, **in_second = order ? in_a : in_b;
+            for (int k = 0; k < N; k++) {
+                expected[k] = in_second[k] ? in_first[k] : NULL;
+            }
+            check_set_operation(bptree_intersect, first, second, expected, N, &log);
+            for (int k = 0; k < N; k++) {
+                expected[k] = in_first[k] ? in_first[k] : in_second[k];
+            }
+            check_set_operation(bptree_union, first, second, expected, N, &log);
+            for (int k = 0; k < N; k++) {
+                expected[k] = in_second[k] ? NULL : in_first[k];
+            }
+            check_set_operation(bptree_difference, first, second, expected, N, &log);
+        }
+        bptree_free(a);
+        bptree_free(b);
+    }
+
+    // Empty trees, a tree with itself, and invalid arguments.
+    bptree *a = bptree_new_with_fanout(8, 4, str_compare, NULL, NULL, NULL, debug_enabled);
+    bptree *empty = bptree_new_with_fanout(8, 4, str_compare, NULL, NULL, NULL, debug_enabled);
+    for (int k = 0; k < N; k++) {
+        in_a[k] = k % 5 == 0 ? &pairs[k] : NULL;
+        in_b[k] = NULL;
+        if (in_a[k]) {
+            assert(bptree_put(a, &pairs[k]) == BPTREE_OK);
+        }
+    }
+    check_set_operation(bptree_intersect, a, empty, in_b, N, &log);
+    check_set_operation(bptree_intersect, empty, a, in_b, N, &log);
+    check_set_operation(bptree_union, a, empty, in_a, N, &log);
+    check_set_operation(bptree_union, empty, a, in_a, N, &log);
+    check_set_operation(bptree_difference, a, empty, in_a, N, &log);
+    check_set_operation(bptree_difference, empty, a, in_b, N, &log);
+    check_set_operation(bptree_union, empty, empty, in_b, N, &log);
+    check_set_operation(bptree_intersect, a, a, in_a, N, &log);
+    check_set_operation(bptree_difference, a, a, in_b, N, &log);
+    bptree *out = a;
+    assert(bptree_intersect(NULL, a, log_set_item, &log, &out) == BPTREE_ERROR);
+    assert(bptree_union(a, NULL, log_set_item, &log, &out) == BPTREE_ERROR);
+    assert(bptree_difference(a, empty, NULL, NULL, NULL) == BPTREE_ERROR);
+    assert(out == a);
+    bptree_free(a);
+    bptree_free(empty);
+    free(log.items);
+    free(expected);
+    free(in_b);
+    free(in_a);
+    free(pairs);
+    printf("Set operations passed.\n");
+}
+
+/**
+ * @brief Walks a tree of the odd values in [0, n) with a cursor and modifies it on the way.
+ *
+ * At each odd value v the cursor inserts v - 1 before itself, removes v, or
+ * replaces v with the equal item in alt, depending on v % 6. The replaced
+ * originals are then overwritten, so any reference the tree kept to them
+ * would break the final checks.
+ *
+ * @param tree Pointer to a B+Tree of integers holding the odd values of vals.
+ * @param vals Array of n items, vals[i] == i.
+ * @param alt Array of n items equal to vals.
+ * @param n Number of items.
+ */
+void cursor_walk(bptree *tree, int *vals, int *alt, int n) {
+    bptree_cursor *cursor = bptree_cursor_new(tree, NULL);
+    assert(cursor != NULL);
+    int *item;
+    int expected = 1;
+    while ((item = bptree_cursor_get(cursor)) != NULL) {
+        const int v = *item;
+        assert(v == expected && item == &vals[v]);
+        assert(bptree_cursor_insert_before(cursor, &vals[v]) == BPTREE_DUPLICATE);
+        assert(v + 1 >= n || bptree_cursor_insert_before(cursor, &vals[v + 1]) == BPTREE_ERROR);
+        if (v % 6 == 1) {
+            assert(bptree_cursor_insert_before(cursor, &vals[v - 1]) == BPTREE_OK);
+            assert(bptree_cursor_get(cursor) == &vals[v]);
+            assert(bptree_cursor_next(cursor) == (v + 2 < n ? &vals[v + 2] : NULL));
+        } else if (v % 6 == 3) {
+            assert(bptree_cursor_remove(cursor) == BPTREE_OK);
+            assert(bptree_cursor_get(cursor) == (v + 2 < n ? &vals[v + 2] : NULL));
+        } else {
+            assert(bptree_cursor_replace(cursor, &vals[v - 1]) == BPTREE_ERROR);
+            assert(bptree_cursor_replace(cursor, &alt[v]) == BPTREE_OK);
+            assert(bptree_cursor_get(cursor) == &alt[v]);
+            assert(bptree_cursor_next(cursor) == (v + 2 < n ? &vals[v + 2] : NULL));
+        }
+        expected = v + 2;
+    }
+    assert(expected >= n);
+    assert(bptree_cursor_remove(cursor) == BPTREE_ERROR);
+    assert(bptree_cursor_replace(cursor, &alt[0]) == BPTREE_ERROR);
+    bptree_cursor_free(cursor);
+    for (int v = 5; v < n; v += 6) {
+        vals[v] = -1;
+    }
+    int count = 0;
+    for (int v = 0; v < n; v++) {
+        const int *found = bptree_get(tree, &alt[v]);
+        if (v % 6 == 5) {
+            assert(found == &alt[v]);
+        } else if (v % 6 == 0 || v % 6 == 1) {
+            assert(found == &vals[v]);
+        } else {
+            assert(found == NULL);
+        }
+        count += found != NULL;
+    }
+    assert(tree->count == count);
+    assert(check_node(tree, tree->root, NULL, NULL, 1) == count);
+    for (int v = 5; v < n; v += 6) {
+        vals[v] = v;
+    }
+}
+
+/**
+ * @brief Tests modifying the tree through cursors.
+ *
+ * This test walks trees with plain, gapped, compressed, and variable capacity
+ * leaves with a cursor that inserts, removes, and replaces items as it goes,
+ * checks that a cursor follows its item through other modifications of the
+ * tree, and replaces items that serve as truncated string separators.
+ */
+void test_cursors() {
+    printf("Test cursors...\n");
+    const int N = 3000;
+    int *vals = malloc(N * sizeof(int));
+    int *alt = malloc(N * sizeof(int));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+        alt[i] = i;
+    }
+    for (int config = 0; config < TREE_CONFIGS; config++) {
+        bptree *tree = new_config_tree(config, int_compare, int_key);
+        for (int i = 1; i < N; i += 2) {
+            assert(bptree_put(tree, &vals[(long long)i * 7919 % N | 1]) == BPTREE_OK);
+        }
+        cursor_walk(tree, vals, alt, N);
+        bptree_free(tree);
+    }
+
+    // A cursor finds its item again after other operations reshape the tree.
+    assert(bptree_cursor_new(NULL, NULL) == NULL);
+    bptree *tree = bptree_new_with_fanout(8, 4, int_compare, NULL, NULL, NULL, debug_enabled);
+    bptree_cursor *cursor = bptree_cursor_new(tree, NULL);
+    assert(bptree_cursor_get(cursor) == NULL);
+    assert(bptree_cursor_insert_before(cursor, &vals[N / 2]) == BPTREE_OK);
+    assert(bptree_cursor_get(cursor) == NULL);
+    bptree_cursor_free(cursor);
+    cursor = bptree_cursor_new(tree, &vals[N / 2]);
+    assert(bptree_cursor_get(cursor) == &vals[N / 2]);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_put(tree, &vals[i]) == (i == N / 2 ? BPTREE_DUPLICATE : BPTREE_OK));
+    }
+    assert(bptree_cursor_get(cursor) == &vals[N / 2]);
+    for (int i = 0; i < N; i += 2) {
+        assert(bptree_remove(tree, &vals[i]) == BPTREE_OK);
+    }
+    assert(bptree_cursor_get(cursor) == &vals[N / 2 + 1]);
+    assert(bptree_cursor_next(cursor) == &vals[N / 2 + 3]);
+    bptree_cursor_free(cursor);
+    const int past_end = N;
+    cursor = bptree_cursor_new(tree, &past_end);
+    assert(cursor != NULL && bptree_cursor_get(cursor) == NULL);
+    assert(bptree_cursor_insert_before(cursor, &vals[N - 2]) == BPTREE_OK);
+    assert(bptree_get(tree, &vals[N - 2]) == &vals[N - 2]);
+    bptree_cursor_free(cursor);
+    bptree_free(tree);
+
+    // Long shared prefixes make separators refer to items instead of storing their bytes.
+    char(*keys)[80] = malloc(2 * N * sizeof(*keys));
+    tree = bptree_new_with_fanout(8, 4, str_compare, NULL, NULL, NULL, debug_enabled);
+    assert(bptree_set_key_bytes(tree, str_key_bytes) == BPTREE_OK);
+    for (int i = 0; i < N; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "a/long/shared/prefix/of/the/keys/%05d", i);
+        strcpy(keys[N + i], keys[i]);
+        assert(bptree_put(tree, keys[i]) == BPTREE_OK);
+    }
+    cursor = bptree_cursor_new(tree, NULL);
+    for (int i = 0; i < N; i++) {
+        assert(bptree_cursor_get(cursor) == keys[i]);
+        assert(bptree_cursor_replace(cursor, keys[N + i]) == BPTREE_OK);
+        bptree_cursor_next(cursor);
+    }
+    bptree_cursor_free(cursor);
+    memset(keys, 0, N * sizeof(*keys));
+    for (int i = 0; i < N; i++) {
+        assert(bptree_get(tree, keys[N + i]) == keys[N + i]);
+    }
+    bptree_free(tree);
+    free(keys);
+    free(alt);
+    free(vals);
+    printf("Cursors passed.\n");
+}
+
+/**
+ * @brief Values of the items in the trees of test_teardown.
+ */
+int teardown_vals[50000];
+
+/**
+ * @brief Builds a tree of the given shape for test_teardown.
+ *
+ * @param shape 0 for a tree of separately allocated nodes with the smallest
+ *        fanout, 1 for a bulk loaded tree, 2 for a tree small enough to be a
+ *        single leaf.
+ * @param free_fn Free function for the tree, or NULL for the default.
+ * @return Pointer to the new tree.
+ */
+bptree *teardown_tree(const int shape, bptree_free_t free_fn) {
+    const int N = sizeof(teardown_vals) / sizeof(teardown_vals[0]);
+    if (shape == 1) {
+        void **items = malloc(N * sizeof(void *));
+        for (int i = 0; i < N; i++) {
+            items[i] = &teardown_vals[i];
+        }
+        bptree *tree =
+            bptree_bulk_load(8, int_compare, NULL, NULL, free_fn, debug_enabled, items, N);
+        free(items);
+        return tree;
+    }
+    bptree *tree = bptree_new_with_fanout(3, 3, int_compare, NULL, NULL, free_fn, debug_enabled);
+    for (int i = 0; i < (shape == 0 ? N : 3); i++) {
+        assert(bptree_put(tree, &teardown_vals[(long long)i * 7919 % N]) == BPTREE_OK);
+    }
+    return tree;
+}
+
+#ifdef BPTREE_THREADS
+/**
+ * @brief Tree whose release watching_free watches for.
+ */
+const void *watched_tree = NULL;
+
+/**
+ * @brief Set once watched_tree has been freed.
+ */
+atomic_bool watched_tree_freed;
+
+/**
+ * @brief Free function that reports when watched_tree is freed.
+ *
+ * @param ptr Pointer to the memory to free.
+ */
+void watching_free(void *ptr) {
+    if (ptr != NULL && ptr == watched_tree) {
+        atomic_store(&watched_tree_freed, true);
+    }
+    free(ptr);
+}
+#endif
+
+/**
+ * @brief Tests freeing trees on the calling thread, in the background, and in parallel.
+ *
+ * This test frees trees of separately allocated nodes, bulk loaded trees, and
+ * single leaf trees with each teardown function, which must leave nothing
+ * behind for the sanitizers to report. Without BPTREE_THREADS, this test
+ * checks that background freeing is refused and that the parallel variant
+ * falls back to the calling thread.
+ */
+void test_teardown() {
+    printf("Test teardown...\n");
+    const int N = sizeof(teardown_vals) / sizeof(teardown_vals[0]);
+    for (int i = 0; i < N; i++) {
+        teardown_vals[i] = i;
+    }
+    assert(bptree_free_async(NULL) == BPTREE_ERROR);
+    assert(bptree_free_parallel(NULL, 0) == BPTREE_ERROR);
+    assert(bptree_free_parallel(NULL, 2) == BPTREE_OK);
+    for (int shape = 0; shape < 3; shape++) {
+        bptree_free(teardown_tree(shape, NULL));
+        bptree *tree = teardown_tree(shape, NULL);
+        assert(bptree_free_parallel(tree, 0) == BPTREE_ERROR);
+        assert(check_node(tree, tree->root, NULL, NULL, 1) == tree->count);
+        assert(bptree_free_parallel(tree, 1) == BPTREE_OK);
+        for (int threads = 2; threads <= 8; threads *= 2) {
+            assert(bptree_free_parallel(teardown_tree(shape, NULL), threads) == BPTREE_OK);
+        }
+#ifdef BPTREE_THREADS
+        tree = teardown_tree(shape, watching_free);
+        watched_tree = tree;
+        atomic_store(&watched_tree_freed, false);
+        assert(bptree_free_async(tree) == BPTREE_OK);
+        while (!atomic_load(&watched_tree_freed)) {
+            thrd_yield();
+        }
+        watched_tree = NULL;
+#else
+        tree = teardown_tree(shape, NULL);
+        assert(bptree_free_async(tree) == BPTREE_ERROR);
+        assert(check_node(tree, tree->root, NULL, NULL, 1) == tree->count);
+        bptree_free(tree);
+#endif
+    }
+    printf("Teardown passed.\n");
+}
+
 /**
  * @brief Main function to run all B+Tree tests.
  *
@@ -478,6 +3181,30 @@ int main(void) {
     test_bulk_load_empty();
     test_iterator();
     test_tree_stats();
+    test_min_fill_policies();
+    test_separate_fanout();
+    test_overflow_redistribution();
+    test_compact();
+    test_leaf_clustering();
+    test_gapped_leaves();
+    test_dense_leaves();
+    test_compressed_leaves();
+    test_small_trees();
+    test_variable_capacity();
+    test_truncated_separators();
+    test_reserve();
+    test_huge_pages();
+    test_teardown();
+    test_hinted_operations();
+    test_cursors();
+    test_range_limit();
+    test_get_ranges();
+    test_scan_prefix();
+    test_min_max();
+    test_clone();
+    test_merkle_diff();
+    test_merge_iterator();
+    test_set_operations();
     printf("All tests passed.\n");
     return 0;
 }